@@ -1306,6 +1306,7 @@ int do_action(struct action* a, struct sip_msg* msg)
 				break;
 			}
 			str aux = {0, 0};
+			cdb_borrowed_t cdb_ref;
 			/* parse the name argument */
 			pve = (pv_elem_t *)a->elem[1].u.data;
 			if ( pv_printf_s(msg, pve, &name_s)!=0 ||
@@ -1315,7 +1316,8 @@ int do_action(struct action* a, struct sip_msg* msg)
 				break;
 			}
 
-			ret = cachedb_fetch( &a->elem[0].u.s, &name_s, &aux);
+			/* the value is copied only once, straight into the variable */
+			ret = cachedb_borrow( &a->elem[0].u.s, &name_s, &aux, &cdb_ref);
 			if(ret > 0)
 			{
 				val.rs = aux;
@@ -1325,10 +1327,10 @@ int do_action(struct action* a, struct sip_msg* msg)
 				spec = (pv_spec_t*)a->elem[2].u.data;
 				if (pv_set_value(msg, spec, 0, &val) < 0) {
 					LM_ERR("cannot set the variable value\n");
-					pkg_free(aux.s);
+					cdb_release(&cdb_ref, &aux);
 					return -1;
 				}
-				pkg_free(aux.s);
+				cdb_release(&cdb_ref, &aux);
 			}
 
 			break;
@@ -399,19 +399,13 @@ int cachedb_store(str* cachedb_name, str* attr, str* val,int expires)
 	return ret;
 }
 
-int cachedb_fetch(str* cachedb_name, str* attr, str* val)
+/* resolves the "engine[:group]" name used from script to the engine
+ * and its connection */
+static cachedb_con *cachedb_script_con(str *cachedb_name, cachedb_engine **cde)
 {
-	cachedb_engine* cde;
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
-	int ret;
-
-	if(cachedb_name == NULL || attr == NULL || val == NULL)
-	{
-		LM_ERR("null arguments\n");
-		return -1;
-	}
 
 	p = memchr(cachedb_name->s,':',cachedb_name->len);
 	if (p == NULL) {
@@ -429,22 +423,41 @@ int cachedb_fetch(str* cachedb_name, str* attr, str* val)
 
 	}
 
-	cde = lookup_cachedb(&cde_engine);
-	if(cde == NULL)
+	*cde = lookup_cachedb(&cde_engine);
+	if(*cde == NULL)
 	{
 		LM_ERR("Wrong argument <%.*s> - no cachedb system with"
 				" this name registered\n",
 				cde_engine.len,cde_engine.s);
-		return -1;
+		return NULL;
 	}
 
-	con = cachedb_get_connection(cde,&grp_name);
+	con = cachedb_get_connection(*cde,&grp_name);
 	if (con == NULL) {
 		LM_ERR("failed to get connection for grp name [%.*s] : check db_url\n",
 				grp_name.len,grp_name.s);
+		return NULL;
+	}
+
+	return con;
+}
+
+int cachedb_fetch(str* cachedb_name, str* attr, str* val)
+{
+	cachedb_engine* cde;
+	cachedb_con *con;
+	int ret;
+
+	if(cachedb_name == NULL || attr == NULL || val == NULL)
+	{
+		LM_ERR("null arguments\n");
 		return -1;
 	}
 
+	con = cachedb_script_con(cachedb_name,&cde);
+	if (con == NULL)
+		return -1;
+
 	ret = cde->cdb_func.get(con,attr,val);
 	if (ret == 0)
 		ret++;
@@ -452,6 +465,29 @@ int cachedb_fetch(str* cachedb_name, str* attr, str* val)
 	return ret;
 }
 
+int cachedb_borrow(str* cachedb_name, str* attr, str* val, cdb_borrowed_t *b)
+{
+	cachedb_engine* cde;
+	cachedb_con *con;
+	int ret;
+
+	if(cachedb_name == NULL || attr == NULL || val == NULL || b == NULL)
+	{
+		LM_ERR("null arguments\n");
+		return -1;
+	}
+
+	con = cachedb_script_con(cachedb_name,&cde);
+	if (con == NULL)
+		return -1;
+
+	ret = cdb_borrow(&cde->cdb_func,con,attr,val,b);
+	if (ret == 0)
+		ret++;
+
+	return ret;
+}
+
 int cachedb_counter_fetch(str* cachedb_name, str* attr, int* val)
 {
 	cachedb_engine* cde;
@@ -754,6 +790,59 @@ int cachedb_raw_query(str* cachedb_name, str* attr, cdb_raw_entry*** reply,int e
 	return ret;
 }
 
+int cdb_pipeline(cachedb_funcs *funcs, cachedb_con *con,
+									cdb_pipe_op *ops, int no)
+{
+	int i, failed = 0;
+
+	if (funcs->pipeline) {
+		if (funcs->pipeline(con, ops, no) < 0)
+			LM_ERR("failed to run a pipeline of %d operations\n", no);
+	} else {
+		/* no pipelining support - one round-trip per operation */
+		for (i = 0; i < no; i++) {
+			ops[i].rc = -1;
+			switch (ops[i].type) {
+			case CDB_PIPE_GET:
+				if (funcs->get)
+					ops[i].rc = funcs->get(con, &ops[i].key, &ops[i].val);
+				break;
+			case CDB_PIPE_GET_COUNTER:
+				if (funcs->get_counter)
+					ops[i].rc = funcs->get_counter(con, &ops[i].key,
+						&ops[i].n);
+				break;
+			case CDB_PIPE_SET:
+				if (funcs->set)
+					ops[i].rc = funcs->set(con, &ops[i].key, &ops[i].val,
+						ops[i].expires);
+				break;
+			case CDB_PIPE_REMOVE:
+				if (funcs->remove)
+					ops[i].rc = funcs->remove(con, &ops[i].key);
+				break;
+			case CDB_PIPE_ADD:
+				if (funcs->add)
+					ops[i].rc = funcs->add(con, &ops[i].key, ops[i].n,
+						ops[i].expires, &ops[i].n);
+				break;
+			case CDB_PIPE_SUB:
+				if (funcs->sub)
+					ops[i].rc = funcs->sub(con, &ops[i].key, ops[i].n,
+						ops[i].expires, &ops[i].n);
+				break;
+			}
+		}
+	}
+
+	/* a missing key is not a failure */
+	for (i = 0; i < no; i++)
+		if (ops[i].rc < 0 && ops[i].rc != -2)
+			failed++;
+
+	return failed;
+}
+
 void free_raw_fetch(cdb_raw_entry **reply, int no_val, int no_key)
 {
 	int i,j;
@@ -28,6 +28,7 @@
 #define _CACHEDB_H
 
 #include "../str.h"
+#include "../mem/mem.h"
 #include "../db/db_query.h"
 #include "cachedb_con.h"
 #include "cachedb_pool.h"
@@ -53,6 +54,26 @@ typedef struct {
 	} val;
 } cdb_raw_entry;
 
+/* operations which may be grouped in a pipeline - see cdb_pipeline() */
+typedef enum {
+	CDB_PIPE_GET,
+	CDB_PIPE_GET_COUNTER,
+	CDB_PIPE_SET,
+	CDB_PIPE_REMOVE,
+	CDB_PIPE_ADD,
+	CDB_PIPE_SUB,
+} cdb_pipe_op_type_t;
+
+typedef struct cdb_pipe_op {
+	cdb_pipe_op_type_t type;
+	str key;
+	str val;        /* SET: value to store; GET: fetched value (PKG memory,
+	                   to be freed by the caller) */
+	int n;          /* ADD/SUB: the amount; ADD/SUB/GET_COUNTER: the result */
+	int expires;    /* SET/ADD/SUB */
+	int rc;         /* same return code as the respective single operation */
+} cdb_pipe_op;
+
 int cachedb_store_url(struct cachedb_url **list,char *val);
 void cachedb_free_url(struct cachedb_url *list);
 
@@ -70,6 +91,14 @@ typedef int (cachedb_set_f)(cachedb_con *con,str *attr,str *val,int expires);
 typedef int (cachedb_remove_f)(cachedb_con *con,str *attr);
 typedef int (cachedb_add_f)(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 typedef int (cachedb_sub_f)(cachedb_con *con,str *attr,int val,int expires,int *new_val);
+/* NOTE: "val->s" points to an immutable value owned by the engine, which
+ * stays valid (even if the key is changed or removed in the meantime)
+ * until "ref" is handed back to the release function */
+typedef int (cachedb_borrow_f)(cachedb_con *con,str *attr,str *val,void **ref);
+typedef void (cachedb_release_f)(cachedb_con *con,void *ref);
+/* runs all the "ops" in as few round-trips to the backend as possible;
+ * the outcome of each operation is returned in its "rc" field */
+typedef int (cachedb_pipeline_f)(cachedb_con *con,cdb_pipe_op *ops,int no);
 /* bi-dimensional array will be returned */
 typedef int (cachedb_raw_f)(cachedb_con *con,str *query,cdb_raw_entry ***reply,int expected_key_no,int *reply_no);
 
@@ -88,6 +117,9 @@ typedef struct cachedb_funcs_t {
 	cachedb_remove_f		*remove;
 	cachedb_add_f			*add;
 	cachedb_sub_f			*sub;
+	cachedb_borrow_f		*borrow;
+	cachedb_release_f		*release;
+	cachedb_pipeline_f		*pipeline;
 	cachedb_raw_f			*raw_query;
 	cachedb_query_trans_f	*db_query_trans;
 	cachedb_free_trans_f	*db_free_trans;
@@ -107,10 +139,51 @@ typedef struct cachedb_engines {
 
 int register_cachedb(cachedb_engine* cde_entry);
 
+/* a value obtained with cdb_borrow() / cachedb_borrow() */
+typedef struct cdb_borrowed {
+	cachedb_funcs *funcs;
+	cachedb_con *con;
+	void *ref;		/* NULL if the value is a PKG copy */
+} cdb_borrowed_t;
+
+/* fetches the value of @attr without copying it, if the engine supports
+ * it, or as a PKG copy otherwise; either way, it must be handed back
+ * with cdb_release() */
+static inline int cdb_borrow(cachedb_funcs *funcs, cachedb_con *con,
+									str *attr, str *val, cdb_borrowed_t *b)
+{
+	b->funcs = funcs;
+	b->con = con;
+	b->ref = NULL;
+
+	if (funcs->borrow)
+		return funcs->borrow(con, attr, val, &b->ref);
+
+	return funcs->get(con, attr, val);
+}
+
+static inline void cdb_release(cdb_borrowed_t *b, str *val)
+{
+	if (b->ref) {
+		b->funcs->release(b->con, b->ref);
+		b->ref = NULL;
+	} else if (val->s) {
+		pkg_free(val->s);
+	}
+	val->s = NULL;
+	val->len = 0;
+}
+
+/* runs a batch of operations, pipelined if the engine supports it or
+ * one by one otherwise; returns the number of failed operations */
+int cdb_pipeline(cachedb_funcs *funcs, cachedb_con *con,
+									cdb_pipe_op *ops, int no);
+
 /* functions to be used from script */
 int cachedb_store(str* cachedb_engine, str* attr, str* val,int expires);
 int cachedb_remove(str* cachedb_engine, str* attr);
 int cachedb_fetch(str* cachedb_engine, str* attr, str* val);
+int cachedb_borrow(str* cachedb_engine, str* attr, str* val, cdb_borrowed_t *b);
 int cachedb_counter_fetch(str* cachedb_engine, str* attr, int* val);
 int cachedb_add(str* cachedb_engine, str* attr, int val,int expires,int *new_val);
 int cachedb_sub(str* cachedb_engine, str* attr, int val,int expires,int *new_val);
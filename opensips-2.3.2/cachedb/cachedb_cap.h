@@ -38,7 +38,9 @@ typedef enum {
 	CACHEDB_CAP_ADD = 1<<3,
 	CACHEDB_CAP_SUB = 1<<4,
 	CACHEDB_CAP_BINARY_VALUE = 1<<5,
-	CACHEDB_CAP_RAW = 1<<6
+	CACHEDB_CAP_RAW = 1<<6,
+	CACHEDB_CAP_BORROW = 1<<7,
+	CACHEDB_CAP_PIPELINE = 1<<8
 } cachedb_cap;
 
 #define CACHEDB_CAPABILITY(cdbf,cpv) (((cdbf)->capability & (cpv)) == (cpv))
@@ -72,6 +74,16 @@ static inline int check_cachedb_api(cachedb_engine *cde)
 		cde->cdb_func.capability |= CACHEDB_CAP_SUB;
 	if (cde->cdb_func.raw_query)
 		cde->cdb_func.capability |= CACHEDB_CAP_RAW;
+	if (cde->cdb_func.pipeline)
+		cde->cdb_func.capability |= CACHEDB_CAP_PIPELINE;
+
+	if ((cde->cdb_func.borrow == 0) != (cde->cdb_func.release == 0)) {
+		LM_ERR("module %.*s must export both borrow and release funcs\n",
+				cde->name.len,cde->name.s);
+		return -1;
+	}
+	if (cde->cdb_func.borrow)
+		cde->cdb_func.capability |= CACHEDB_CAP_BORROW;
 
 	return 0;
 }
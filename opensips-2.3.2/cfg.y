@@ -318,6 +318,11 @@ static struct multi_str *tmp_mod;
 %token LOGSTDERROR
 %token LOGFACILITY
 %token LOGNAME
+%token LOGASYNC
+%token LOGASYNCBUFFER
+%token LOGFILE
+%token LOGFILESIZE
+%token LOGRATELIMIT
 %token AVP_ALIASES
 %token LISTEN
 %token MEMGROUP
@@ -348,6 +353,7 @@ static struct multi_str *tmp_mod;
 %token EVENT_PKG_THRESHOLD
 %token QUERYBUFFERSIZE
 %token QUERYFLUSHTIME
+%token QUERYBUFFERWRITERS
 %token SIP_WARNING
 %token SOCK_MODE
 %token SOCK_USER
@@ -673,6 +679,16 @@ assign_stm: DEBUG EQUAL snumber
 		| LOGFACILITY EQUAL error { yyerror("ID expected"); }
 		| LOGNAME EQUAL STRING { log_name=$3; }
 		| LOGNAME EQUAL error { yyerror("string value expected"); }
+		| LOGASYNC EQUAL NUMBER { log_async=$3; }
+		| LOGASYNC EQUAL error { yyerror("boolean value expected"); }
+		| LOGASYNCBUFFER EQUAL NUMBER { log_async_buffer=$3; }
+		| LOGASYNCBUFFER EQUAL error { yyerror("int value expected"); }
+		| LOGFILE EQUAL STRING { log_file=$3; }
+		| LOGFILE EQUAL error { yyerror("string value expected"); }
+		| LOGFILESIZE EQUAL NUMBER { log_file_size=$3; }
+		| LOGFILESIZE EQUAL error { yyerror("int value expected"); }
+		| LOGRATELIMIT EQUAL NUMBER { log_rate_limit=$3; }
+		| LOGRATELIMIT EQUAL error { yyerror("int value expected"); }
 		| DNS EQUAL NUMBER   { received_dns|= ($3)?DO_DNS:0; }
 		| DNS EQUAL error { yyerror("boolean value expected"); }
 		| REV_DNS EQUAL NUMBER { received_dns|= ($3)?DO_REV_DNS:0; }
@@ -823,6 +839,8 @@ assign_stm: DEBUG EQUAL snumber
 		| QUERYBUFFERSIZE EQUAL error { yyerror("int value expected"); }
 		| QUERYFLUSHTIME EQUAL NUMBER { query_flush_time=$3; }
 		| QUERYFLUSHTIME EQUAL error { yyerror("int value expected"); }
+		| QUERYBUFFERWRITERS EQUAL NUMBER { query_buffer_writers=$3; }
+		| QUERYBUFFERWRITERS EQUAL error { yyerror("int value expected"); }
 		| SIP_WARNING EQUAL NUMBER { sip_warning=$3; }
 		| SIP_WARNING EQUAL error { yyerror("boolean value expected"); }
 		| CHROOT EQUAL STRING     { chroot_dir=$3; }
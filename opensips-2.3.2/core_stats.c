@@ -59,9 +59,9 @@ stat_var* bad_msg_hdr;
 
 
 stat_export_t core_stats[] = {
-	{"rcv_requests" ,         0,  &rcv_reqs              },
+	{"rcv_requests" ,   STAT_PER_PROC,  &rcv_reqs              },
 	{"rcv_replies" ,          0,  &rcv_rpls              },
-	{"fwd_requests" ,         0,  &fwd_reqs              },
+	{"fwd_requests" ,   STAT_PER_PROC,  &fwd_reqs              },
 	{"fwd_replies" ,          0,  &fwd_rpls              },
 	{"drop_requests" ,        0,  &drp_reqs              },
 	{"drop_replies" ,         0,  &drp_rpls              },
@@ -153,6 +153,15 @@ int db_check_api(db_func_t* dbf, char *mname)
 		dbf->cap |= DB_CAP_ASYNC_RAW_QUERY;
 	}
 
+	if (dbf->async_query) {
+		if (!(dbf->cap & DB_CAP_ASYNC_RAW_QUERY)) {
+			LM_BUG("async query with NULL async raw_query | resume | free_result in %s", mname);
+			return -1;
+		}
+
+		dbf->cap |= DB_CAP_ASYNC_QUERY;
+	}
+
 	return 0;
 error:
 	return -1;
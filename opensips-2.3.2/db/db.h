@@ -329,6 +329,32 @@ typedef int (*db_async_resume_f) (db_con_t *_h, int fd, db_res_t **_r,
  */
 typedef int (*db_async_free_result_f) (db_con_t *_h, db_res_t *_r, void *_priv);
 
+/**
+ * \brief Asynchronous query on a separate DB connection, with the values
+ *		  bound and escaped by the engine, the same way "query" does it.
+ *		  Returns immediately.
+ *
+ * The progress and the results are handled by the "async_resume" and
+ * "async_free_result" functions, just like for "async_raw_query".
+ *
+ * \param _h structure representing the database handle
+ * \param _k array of column names that will be compared and their values
+ * \param _op array of operators to be used with key-value pairs
+ * \param _v array of values, columns specified in _k parameter must match these values
+ * \param _c array of column names that will be returned
+ * \param _n number of key-value pairs to match in _k and _v parameters
+ * \param _nc number of columns to be returned
+ * \param _o order by the specified column
+ * \param _priv data that shall be populated by the engine
+ *			!!! must be preserved by the upper layer while the query is run
+ * \return
+ *		success: Unix FD for polling
+ *		failure: negative error code
+ */
+typedef int (*db_async_query_f) (db_con_t *_h, const db_key_t *_k,
+		const db_op_t *_op, const db_val_t *_v, const db_key_t *_c,
+		const int _n, const int _nc, const db_key_t _o, void **_priv);
+
 /**
  * \brief Database module callbacks
  *
@@ -354,6 +380,7 @@ typedef struct db_func {
 	db_async_raw_query_f   async_raw_query;   /* Starts an asynchronous raw query */
 	db_async_resume_f      async_resume;      /* Called on progress or completed query */
 	db_async_free_result_f async_free_result; /* Clean up after an async query */
+	db_async_query_f       async_query;       /* Starts an asynchronous query */
 } db_func_t;
 
 
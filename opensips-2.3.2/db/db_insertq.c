@@ -23,17 +23,113 @@
  *  2011-06-07  created (vlad)
  */
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
 #include "db_insertq.h"
 #include "db_cap.h"
 #include "../timer.h"
 #include "../pt.h"
+#include "../daemonize.h"
+#include "../statistics.h"
 
 int query_buffer_size = 0;
 int query_flush_time = 0;
+int query_buffer_writers = 0;
 query_list_t **query_list = NULL;
 query_list_t **last_query = NULL;
 gen_lock_t *ql_lock;
 
+/* set in the writer processes - the rows of a batch are only freed
+ * once written (or given up on), so they can be retried */
+int ql_keep_rows = 0;
+
+/* batches handed over by the producers to the writer processes */
+struct ql_writer_queue {
+	gen_lock_t *lock;
+	ql_batch_t *first;
+	ql_batch_t *last;
+	int no_batches;
+	unsigned long queued_rows;		/* rows not written yet */
+	unsigned long flush_latency;	/* ms from handover to DB, averaged */
+};
+
+static struct ql_writer_queue *wq = NULL;
+/* one byte written for each batch wakes up a writer */
+static int wq_pipe[2] = {-1, -1};
+/* batch to be returned by the next detach done in this writer */
+static ql_batch_t *ql_injected = NULL;
+
+static void ql_batch_done(ql_batch_t *b, int ret);
+
+#ifdef STATISTICS
+static stat_var *ql_flushed_rows;
+static stat_var *ql_dropped_rows;
+static stat_var *ql_sync_flushes;
+
+static unsigned long ql_get_queued_rows(void *foo)
+{
+	return wq->queued_rows;
+}
+
+static unsigned long ql_get_flush_latency(void *foo)
+{
+	return wq->flush_latency;
+}
+#endif
+
+static int init_writer_queue(void)
+{
+	int flags;
+
+	wq = shm_malloc(sizeof *wq);
+	if (!wq) {
+		LM_ERR("no more shm\n");
+		return -1;
+	}
+	memset(wq, 0, sizeof *wq);
+
+	wq->lock = lock_alloc();
+	if (!wq->lock || !lock_init(wq->lock)) {
+		LM_ERR("failed to init writers lock\n");
+		goto error;
+	}
+
+	if (pipe(wq_pipe) < 0) {
+		LM_ERR("failed to create writers pipe: %s\n", strerror(errno));
+		goto error;
+	}
+	/* the producers must never block on waking up the writers */
+	flags = fcntl(wq_pipe[1], F_GETFL);
+	if (flags < 0 || fcntl(wq_pipe[1], F_SETFL, flags | O_NONBLOCK) < 0) {
+		LM_ERR("failed to set writers pipe non-blocking: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+#ifdef STATISTICS
+	if (register_stat2("querydb", "queued_rows",
+	(stat_var **)ql_get_queued_rows, STAT_IS_FUNC, NULL, 0) != 0 ||
+	register_stat2("querydb", "flush_latency",
+	(stat_var **)ql_get_flush_latency, STAT_IS_FUNC, NULL, 0) != 0 ||
+	register_stat("querydb", "flushed_rows", &ql_flushed_rows, 0) != 0 ||
+	register_stat("querydb", "dropped_rows", &ql_dropped_rows, 0) != 0 ||
+	register_stat("querydb", "sync_flushes", &ql_sync_flushes, 0) != 0) {
+		LM_ERR("failed to register querydb statistics\n");
+		goto error;
+	}
+#endif
+
+	return 0;
+error:
+	if (wq->lock)
+		lock_dealloc(wq->lock);
+	shm_free(wq);
+	wq = NULL;
+	return -1;
+}
+
 /* inits all the global variables needed for the insert query lists */
 int init_query_list(void)
 {
@@ -92,6 +188,11 @@ int init_ql_support(void)
 			LM_ERR("failed initializing ins list support\n");
 			return -1;
 		}
+
+		if (query_buffer_writers > 0 && init_writer_queue() != 0) {
+			LM_ERR("failed to init the writers, inserting from workers\n");
+			query_buffer_writers = 0;
+		}
 	}
 
 	return 0;
@@ -101,13 +202,14 @@ int init_ql_support(void)
 void flush_query_list(void)
 {
 	query_list_t *it;
+	ql_batch_t *b;
 	static db_ps_t my_ps = NULL;
 	int i;
 
 	/* no locks, only attendent is left at this point */
 	for (it=*query_list;it;it=it->next)
 	{
-		if (it->no_rows > 0)
+		if (it->no_rows > 0 || it->pending_batches > 0)
 		{
 			memset(&it->dbf,0,sizeof(db_func_t));
 			if (db_bind_mod(&it->url,&it->dbf) < 0)
@@ -142,10 +244,45 @@ void flush_query_list(void)
 				shm_free(it->rows[i]);
 			}
 
+			/* and the ones not picked up by the writers yet */
+			for (b = wq ? wq->first : NULL; b; b = b->next)
+			{
+				if (b->entry != it)
+					continue;
+
+				for (i=0;i<b->no_rows;i++)
+				{
+					if (it->dbf.insert(it->conn[process_no],it->cols,
+								b->rows[i],it->col_no) < 0)
+						LM_ERR("failed to insert into DB\n");
+
+					shm_free(b->rows[i]);
+				}
+			}
+
 			/* no longer need this connection */
 			if (it->conn[process_no] && it->dbf.close)
 				it->dbf.close(it->conn[process_no]);
 		}
+
+		/* the writers are gone - the batches they had picked up are lost,
+		 * do not let anybody wait for them */
+		it->pending_batches = 0;
+	}
+
+	if (wq)
+	{
+		while ((b = wq->first) != NULL)
+		{
+			wq->first = b->next;
+			shm_free(b);
+		}
+		wq->last = NULL;
+		wq->no_batches = 0;
+		wq->queued_rows = 0;
+
+		/* modules flushing at destroy time insert the rows themselves */
+		wq = NULL;
 	}
 }
 
@@ -199,6 +336,15 @@ int ql_detach_rows_unsafe(query_list_t *entry,db_val_t ***ins_rows)
 	static db_val_t **detached_rows = NULL;
 	int no_rows;
 
+	if (ql_injected)
+	{
+		/* a writer flushing one of its batches */
+		*ins_rows = ql_injected->rows;
+		no_rows = ql_injected->no_rows;
+		ql_injected = NULL;
+		return no_rows;
+	}
+
 	if (detached_rows == NULL)
 	{
 		/* one time allocate buffer to pkg */
@@ -227,6 +373,62 @@ int ql_detach_rows_unsafe(query_list_t *entry,db_val_t ***ins_rows)
 	return no_rows;
 }
 
+/* hands the rows of a full (or old) query list over to the writers
+ * assumes the lock of the entry is acquired
+ *
+ * returns -1 if the rows are to be flushed by the caller instead */
+static int ql_handoff_unsafe(query_list_t *entry)
+{
+	ql_batch_t *b;
+	char c = 0;
+
+	/* back-pressure: if the writers are lagging behind, let the
+	 * producers do the inserts themselves */
+	if (wq->no_batches >= QL_MAX_WRITER_BATCHES * query_buffer_writers)
+	{
+		LM_DBG("writers are busy, flushing synchronously\n");
+		update_stat(ql_sync_flushes, 1);
+		return -1;
+	}
+
+	b = shm_malloc(sizeof(ql_batch_t) + query_buffer_size*sizeof(db_val_t *));
+	if (b == NULL)
+	{
+		LM_ERR("no more shm\n");
+		return -1;
+	}
+
+	b->entry = entry;
+	b->no_rows = entry->no_rows;
+	b->rows = (db_val_t **)(b + 1);
+	b->next = NULL;
+	gettimeofday(&b->stamp, NULL);
+
+	memcpy(b->rows,entry->rows,query_buffer_size * sizeof(db_val_t *));
+	memset(entry->rows,0,query_buffer_size * sizeof(db_val_t *));
+	entry->no_rows = 0;
+	entry->oldest_query = 0;
+	entry->pending_batches++;
+
+	lock_get(wq->lock);
+	if (wq->last)
+		wq->last->next = b;
+	else
+		wq->first = b;
+	wq->last = b;
+	wq->no_batches++;
+	wq->queued_rows += b->no_rows;
+	lock_release(wq->lock);
+
+	LM_DBG("handed %d rows over to the writers\n",b->no_rows);
+
+	/* if the pipe is full, the writers have plenty of work anyway */
+	if (write(wq_pipe[1], &c, 1) < 0 && errno != EAGAIN && errno != EINTR)
+		LM_ERR("failed to wake up the writers: %s\n", strerror(errno));
+
+	return 0;
+}
+
 /* safely adds a new row to the insert list
  * also checks if the queue is full and returns all the rows that need to
  * be flushed to DB to the caller
@@ -313,6 +515,12 @@ int ql_row_add(query_list_t *entry,const db_val_t *row,db_val_t ***ins_rows)
 	/* is it time to flush to DB ? */
 	if (entry->no_rows == query_buffer_size)
 	{
+		if (wq && ql_handoff_unsafe(entry) == 0)
+		{
+			lock_release(entry->lock);
+			return 0;
+		}
+
 		if ((no_rows = ql_detach_rows_unsafe(entry,ins_rows)) < 0)
 		{
 			LM_ERR("failed to detach rows for insertion\n");
@@ -538,6 +746,10 @@ void cleanup_rows(db_val_t **rows)
 {
 	int i;
 
+	/* rows handed over to the writers are freed once written */
+	if (ql_keep_rows)
+		return;
+
 	if (rows != NULL)
 		for (i=0;i<query_buffer_size;i++)
 			if (rows[i] != NULL)
@@ -565,6 +777,12 @@ void ql_timer_routine(unsigned int ticks,void *param)
 		{
 			LM_DBG("insert timer kicking in for query %p [%d]\n",it, it->no_rows);
 
+			if (wq && ql_handoff_unsafe(it) == 0)
+			{
+				lock_release(it->lock);
+				continue;
+			}
+
 			if (it->dbf.init == NULL)
 			{
 				/* first time timer kicked in for this query */
@@ -611,11 +829,75 @@ void ql_timer_routine(unsigned int ticks,void *param)
 	}
 }
 
+/* inserts, through the caller's connection, the batches of this query
+ * list that no writer picked up yet - the ones being written already
+ * reach the DB on their own, without the caller having to wait for them */
+static void ql_flush_batches(db_func_t *dbf,db_con_t *conn,query_list_t *entry)
+{
+	ql_batch_t *b, **prev, *first = NULL, *last = NULL;
+	int keep_rows, ret;
+
+	if (!wq || entry->pending_batches == 0)
+		return;
+
+	lock_get(wq->lock);
+	wq->last = NULL;
+	for (prev = &wq->first; (b = *prev) != NULL; )
+	{
+		if (b->entry != entry)
+		{
+			wq->last = b;
+			prev = &b->next;
+			continue;
+		}
+
+		*prev = b->next;
+		wq->no_batches--;
+		b->next = NULL;
+		if (last)
+			last->next = b;
+		else
+			first = b;
+		last = b;
+	}
+	lock_release(wq->lock);
+
+	keep_rows = ql_keep_rows;
+	ql_keep_rows = 1;
+
+	while ((b = first) != NULL)
+	{
+		first = b->next;
+
+		conn->ins_list = entry;
+		CON_FLUSH_SAFE(conn);
+		ql_injected = b;
+
+		ret = dbf->insert(conn,entry->cols,(db_val_t *)-1,entry->col_no);
+		if (ql_injected)
+		{
+			ql_injected = NULL;
+			CON_FLUSH_RESET(conn,entry);
+		}
+
+		if (ret != 0)
+			LM_ERR("failed to insert %d handed over rows into [%.*s]\n",
+				b->no_rows, entry->table.len, entry->table.s);
+
+		ql_batch_done(b, ret);
+	}
+
+	ql_keep_rows = keep_rows;
+}
+
 int ql_flush_rows(db_func_t *dbf,db_con_t *conn,query_list_t *entry)
 {
 	if (query_buffer_size <= 1 || !entry)
 		return 0;
 
+	/* rows handed over earlier must reach the DB first */
+	ql_flush_batches(dbf,conn,entry);
+
 	/* simulate the finding of the right query list */
 	conn->ins_list = entry;
 	/* tell the core that we need to flush right away */
@@ -630,3 +912,167 @@ int ql_flush_rows(db_func_t *dbf,db_con_t *conn,query_list_t *entry)
 
 	return 0;
 }
+
+
+static ql_batch_t *ql_dequeue(void)
+{
+	ql_batch_t *b;
+
+	lock_get(wq->lock);
+	b = wq->first;
+	if (b)
+	{
+		wq->first = b->next;
+		if (wq->first == NULL)
+			wq->last = NULL;
+		wq->no_batches--;
+	}
+	lock_release(wq->lock);
+
+	return b;
+}
+
+/* accounts a batch taken out of the writers queue and frees it */
+static void ql_batch_done(ql_batch_t *b, int ret)
+{
+	query_list_t *entry = b->entry;
+	struct timeval now;
+	unsigned long latency;
+	int i;
+
+	gettimeofday(&now, NULL);
+	latency = (now.tv_sec - b->stamp.tv_sec) * 1000 +
+		(now.tv_usec - b->stamp.tv_usec) / 1000;
+
+	lock_get(wq->lock);
+	wq->queued_rows -= b->no_rows;
+	wq->flush_latency = (wq->flush_latency * 7 + latency) / 8;
+	lock_release(wq->lock);
+
+	update_stat(ret == 0 ? ql_flushed_rows : ql_dropped_rows, b->no_rows);
+
+	for (i=0;i<b->no_rows;i++)
+		shm_free(b->rows[i]);
+
+	lock_get(entry->lock);
+	entry->pending_batches--;
+	lock_release(entry->lock);
+
+	shm_free(b);
+}
+
+static void ql_write_batch(ql_batch_t *b)
+{
+	query_list_t *entry = b->entry;
+	db_con_t *con;
+	int try, ret = -1;
+
+	for (try = 0; try < QL_WRITER_RETRIES; try++)
+	{
+		if (try)
+		{
+			LM_WARN("retrying the insert of %d rows into [%.*s]\n",
+				b->no_rows, entry->table.len, entry->table.s);
+			sleep(1);
+		}
+
+		if (entry->dbf.init == NULL && db_bind_mod(&entry->url,&entry->dbf) < 0)
+		{
+			LM_ERR("writer failed to bind to db\n");
+			continue;
+		}
+
+		if (entry->conn[process_no] == NULL)
+		{
+			entry->conn[process_no] = entry->dbf.init(&entry->url);
+			if (entry->conn[process_no] == NULL)
+			{
+				LM_ERR("unable to connect to DB\n");
+				continue;
+			}
+		}
+		con = entry->conn[process_no];
+
+		entry->dbf.use_table(con,&entry->table);
+
+		lock_get(entry->lock);
+		ql_injected = b;
+		con->ins_list = entry;
+		CON_FLUSH_UNSAFE(con);
+
+		ret = entry->dbf.insert(con,entry->cols,(db_val_t *)-1,entry->col_no);
+		if (ql_injected)
+		{
+			/* failed before even getting to the rows */
+			ql_injected = NULL;
+			CON_FLUSH_RESET(con,entry);
+		}
+
+		if (ret == 0)
+			break;
+
+		/* start over with a fresh connection */
+		entry->dbf.close(con);
+		entry->conn[process_no] = NULL;
+	}
+
+	if (ret != 0)
+		LM_ERR("dropping %d rows for [%.*s] after %d failed inserts\n",
+			b->no_rows, entry->table.len, entry->table.s, QL_WRITER_RETRIES);
+
+	ql_batch_done(b, ret);
+}
+
+static void ql_writer_loop(void)
+{
+	ql_batch_t *b;
+	char c;
+
+	ql_keep_rows = 1;
+
+	for (;;)
+	{
+		if (read(wq_pipe[0], &c, 1) < 0)
+		{
+			if (errno != EINTR)
+			{
+				LM_ERR("failed to read from writers pipe: %s\n",
+					strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		while ((b = ql_dequeue()) != NULL)
+			ql_write_batch(b);
+	}
+}
+
+int ql_writers_count(void)
+{
+	return (query_buffer_size > 1 && wq) ? query_buffer_writers : 0;
+}
+
+/* forks the dedicated insert processes
+ * to be called by the main process only */
+int start_ql_writers(void)
+{
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < ql_writers_count(); i++)
+	{
+		if ( (pid=internal_fork("SQL insert writer"))<0 ) {
+			LM_CRIT("cannot fork SQL insert writer process\n");
+			return -1;
+		} else if (pid==0) {
+			/* new process */
+			clean_write_pipeend();
+
+			ql_writer_loop();
+			exit(-1);
+		}
+	}
+
+	return 0;
+}
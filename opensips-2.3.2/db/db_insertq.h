@@ -26,6 +26,8 @@
 #ifndef _DB_INSERTQ_H
 #define _DB_INSERTQ_H
 
+#include <sys/time.h>
+
 #include "db_ut.h"
 #include "db_query.h"
 #include "../locking.h"
@@ -38,9 +40,16 @@ extern int query_flush_time; /* if the query contains inserts older
 								that query_flush_time seconds, the timer
 								will kick in and flush to DB,
 								to maintain "real time" sync with DB */
+extern int query_buffer_writers; /* number of dedicated processes doing the
+								 bulk inserts - if 0, the inserts are done
+								 by the processes filling the queues */
 
 #define CON_HAS_INSLIST(cn)	((cn)->ins_list)
 #define DEF_FLUSH_TIME		10 /* seconds */
+/* max batches waiting for each writer before the producers
+ * start flushing the rows by themselves */
+#define QL_MAX_WRITER_BATCHES	64
+#define QL_WRITER_RETRIES	3
 
 typedef struct query_list {
 	str url;			/* url for the connection - needed by timer */
@@ -53,12 +62,23 @@ typedef struct query_list {
 	gen_lock_t* lock;	/* lock for adding rows */
 	int no_rows;		/* number of rows in queue */
 	time_t oldest_query;	/* timestamp of oldest query in queue */
+	volatile int pending_batches;	/* batches handed to the writers, not written */
 	struct query_list *next;
 	struct query_list *prev;
 } query_list_t;
 
+/* rows detached from a query list and handed over to a writer process */
+typedef struct ql_batch {
+	query_list_t *entry;
+	int no_rows;
+	struct timeval stamp;	/* time of the handover */
+	db_val_t **rows;		/* query_buffer_size slots, unused ones are NULL */
+	struct ql_batch *next;
+} ql_batch_t;
+
 extern query_list_t **query_list;
 extern gen_lock_t *ql_lock;
+extern int ql_keep_rows;
 
 int init_ql_support(void);
 int ql_row_add(query_list_t *entry,const db_val_t *row,db_val_t ***ins_rows);
@@ -95,4 +115,7 @@ int ql_flush_rows(db_func_t *dbf, db_con_t *conn,query_list_t *entry);
 void cleanup_rows(db_val_t **rows);
 void handle_ql_shutdown(void);
 
+int ql_writers_count(void);
+int start_ql_writers(void);
+
 #endif
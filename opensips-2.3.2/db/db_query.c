@@ -149,6 +149,32 @@ int db_do_raw_query(const db_con_t* _h, const str* _s, db_res_t** _r,
 }
 
 
+/* the query is only printed into sql_str, it is started asynchronously */
+static int db_hold_query(const db_con_t* _h, const str* _s)
+{
+	return 0;
+}
+
+
+int db_do_async_query(db_con_t* _h, const db_key_t* _k, const db_op_t* _op,
+	const db_val_t* _v, const db_key_t* _c, const int _n, const int _nc,
+	const db_key_t _o, void** _priv, int (*val2str) (const db_con_t*,
+	const db_val_t*, char*, int*), int (*async_raw_query)(db_con_t* _h,
+	const str* _s, void** _priv))
+{
+	if (!async_raw_query) {
+		LM_ERR("invalid parameter value\n");
+		return -1;
+	}
+
+	if (db_do_query(_h, _k, _op, _v, _c, _n, _nc, _o, NULL, val2str,
+	db_hold_query, NULL) != 0)
+		return -1;
+
+	return async_raw_query(_h, &sql_str, _priv);
+}
+
+
 int db_do_insert(const db_con_t* _h, const db_key_t* _k, const db_val_t* _v,
 	const int _n, int (*val2str) (const db_con_t*, const db_val_t*, char*, int*),
 	int (*submit_query)(const db_con_t* _h, const str* _c))
@@ -247,7 +273,7 @@ build_query:
 
 				/* if we have a PS, leave the function handling prep stmts
 				   in the module to free the rows once it's done */
-				if (!CON_HAS_PS(_h)) {
+				if (!CON_HAS_PS(_h) && !ql_keep_rows) {
 					shm_free(buffered_rows[i]);
 					buffered_rows[i] = NULL;
 				}
@@ -292,7 +318,8 @@ submit:
 	return 0;
 
 error:
-	cleanup_rows(buffered_rows);
+	if (!ql_keep_rows)
+		cleanup_rows(buffered_rows);
 error0:
 	LM_ERR("error while preparing insert operation\n");
 	return -1;
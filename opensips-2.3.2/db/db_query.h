@@ -90,6 +90,33 @@ int db_do_raw_query(const db_con_t* _h, const str* _s, db_res_t** _r,
 	int (*store_result)(const db_con_t* _h, db_res_t** _r));
 
 
+/**
+ * \brief Helper function for asynchronous db queries
+ *
+ * This method prints the query just like db_do_query does, with the values
+ * converted (and escaped) by the db specific val2str function, and starts
+ * it through the asynchronous raw query function of the db module.
+ *
+ * \param _h structure representing database connection
+ * \param _k key names, if not present the whole table will be returned
+ * \param _op operators
+ * \param _v values of the keys that must match
+ * \param _c column names that should be returned
+ * \param _n number of key/value pairs that are compared, if zero then no comparison is done
+ * \param _nc number of colums that should be returned
+ * \param _o order by the specificied column, optional
+ * \param _priv engine data, to be passed to the resume function
+ * \param (*val2str) function pointer to the db specific val conversion function
+ * \param (*async_raw_query) function pointer to the db specific async raw query function
+ * \return the fd to poll on success, negative on errors
+ */
+int db_do_async_query(db_con_t* _h, const db_key_t* _k, const db_op_t* _op,
+	const db_val_t* _v, const db_key_t* _c, const int _n, const int _nc,
+	const db_key_t _o, void** _priv, int (*val2str) (const db_con_t*,
+	const db_val_t*, char*, int*), int (*async_raw_query)(db_con_t* _h,
+	const str* _s, void** _priv));
+
+
 /**
  * \brief Helper function for db insert operations
  *
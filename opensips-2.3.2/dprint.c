@@ -29,10 +29,20 @@
 #include "dprint.h"
 #include "globals.h"
 #include "pt.h"
+#include "daemonize.h"
+#include "statistics.h"
+#include "mem/shm_mem.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <strings.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 static int log_level_holder = L_NOTICE;
 
@@ -63,6 +73,62 @@ static int int_fac[]={LOG_AUTH ,  LOG_CRON , LOG_DAEMON ,
 
 char ctime_buf[256];
 
+/* asynchronous logging: the processes only format the log lines into
+ * their own shm ring, a dedicated logger process does the writing */
+int log_async = 0;
+int log_async_buffer = 128;    /* lines per process */
+char *log_file = NULL;         /* write to a file instead of syslog/stderr */
+int log_file_size = 0;         /* rotate the file when reaching it (bytes) */
+int log_rate_limit = 0;        /* max lines/second for a log statement */
+
+/* max size of a log line, the longer ones are truncated */
+#define DP_LINE_MAX 1024
+/* rotated files kept, as log_file.1 ... log_file.N */
+#define DP_FILE_ROTATIONS 5
+/* idle time of the logger, when all rings are empty (us) */
+#define DP_IDLE_SLEEP 2000
+/* lines gathered in a single write */
+#define DP_BATCH 64
+
+/* a formatted log line */
+struct dp_rec {
+	int prio;            /* syslog priority, -1 if printed with dprint() */
+	pid_t pid;
+	time_t ts;
+	unsigned int len;
+	char text[DP_LINE_MAX];
+};
+
+/* single producer (the owner process), single consumer (the logger) */
+struct dp_proc_ring {
+	volatile unsigned int head;
+	char pad1[60];
+	volatile unsigned int tail;
+	char pad2[60];
+};
+
+struct dp_async {
+	volatile int logger_up;
+	unsigned long dropped;     /* lost, as the ring was full */
+	unsigned long suppressed;  /* over the log_rate_limit */
+	unsigned int size;         /* slots per process, power of 2 */
+	struct dp_proc_ring *rings;
+	struct dp_rec *recs;
+};
+
+static struct dp_async *dp_async = NULL;
+static int dp_is_logger = 0;
+
+/* per process state of the rate limited log statements */
+#define DP_RATE_SITES 256
+struct dp_site {
+	const char *file;
+	int line;
+	time_t ts;
+	int count;
+};
+static struct dp_site dp_sites[DP_RATE_SITES];
+
 
 int str2facility(char *s)
 {
@@ -82,10 +148,58 @@ int dp_my_pid(void)
 }
 
 
+/* formats a line into the ring of this process
+ * returns 0 if queued (or dropped), -1 if it must be written directly */
+static int dp_async_vprint(int prio, char *format, va_list ap)
+{
+	struct dp_proc_ring *ring;
+	struct dp_rec *rec;
+	unsigned int head;
+	int len;
+
+	if (!dp_async || !dp_async->logger_up || dp_is_logger || process_no == 0
+	|| process_no >= counted_processes)
+		return -1;
+
+	ring = &dp_async->rings[process_no];
+	head = ring->head;
+	if (head - ring->tail >= dp_async->size) {
+		__sync_fetch_and_add(&dp_async->dropped, 1);
+		return 0;
+	}
+
+	rec = &dp_async->recs[process_no * dp_async->size +
+		(head & (dp_async->size - 1))];
+	len = vsnprintf(rec->text, DP_LINE_MAX, format, ap);
+	if (len < 0)
+		return 0;
+	if (len >= DP_LINE_MAX) {
+		/* truncated, keep the line ending */
+		len = DP_LINE_MAX - 1;
+		rec->text[len - 1] = '\n';
+	}
+	rec->len = len;
+	rec->prio = prio;
+	rec->pid = my_pid();
+	rec->ts = time(NULL);
+
+	__sync_synchronize();
+	ring->head = head + 1;
+
+	return 0;
+}
+
 void dprint(char * format, ...)
 {
 	va_list ap;
 
+	va_start(ap, format);
+	if (log_async && dp_async_vprint(-1, format, ap) == 0) {
+		va_end(ap);
+		return;
+	}
+	va_end(ap);
+
 	//fprintf(stderr, "%2d(%d) ", process_no, my_pid());
 	va_start(ap, format);
 	vfprintf(stderr,format,ap);
@@ -93,6 +207,277 @@ void dprint(char * format, ...)
 	va_end(ap);
 }
 
+void dp_syslog(int prio, char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	if (log_async && dp_async_vprint(prio, format, ap) == 0) {
+		va_end(ap);
+		return;
+	}
+	va_end(ap);
+
+	va_start(ap, format);
+	vsyslog(prio, format, ap);
+	va_end(ap);
+}
+
+/* per log statement rate limiting; statements are identified by their
+ * file and line, sharing a slot on hash collisions */
+int dp_rate_ok(const char *file, int line)
+{
+	struct dp_site *site;
+	time_t now;
+
+	site = &dp_sites[((unsigned long)file ^ (line * 31)) % DP_RATE_SITES];
+	now = time(NULL);
+
+	if (site->file != file || site->line != line || site->ts != now) {
+		site->file = file;
+		site->line = line;
+		site->ts = now;
+		site->count = 0;
+	}
+
+	if (++site->count <= log_rate_limit)
+		return 1;
+
+	if (dp_async)
+		__sync_fetch_and_add(&dp_async->suppressed, 1);
+	return 0;
+}
+
+#ifdef STATISTICS
+static unsigned long dp_get_dropped(void *foo)
+{
+	return dp_async->dropped;
+}
+
+static unsigned long dp_get_suppressed(void *foo)
+{
+	return dp_async->suppressed;
+}
+#endif
+
+/* must be called after init_multi_proc_support() */
+int init_log_async(void)
+{
+	unsigned int size;
+
+	if (!log_async && !log_rate_limit)
+		return 0;
+
+	if (log_async_buffer <= 0) {
+		LM_ERR("invalid log_async_buffer %d\n", log_async_buffer);
+		return -1;
+	}
+	for (size = 1; size < log_async_buffer; size <<= 1);
+
+	dp_async = shm_malloc(sizeof *dp_async);
+	if (!dp_async) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(dp_async, 0, sizeof *dp_async);
+	dp_async->size = size;
+
+	if (log_async) {
+		dp_async->rings = shm_malloc(counted_processes *
+			sizeof *dp_async->rings);
+		dp_async->recs = shm_malloc(counted_processes * size *
+			sizeof *dp_async->recs);
+		if (!dp_async->rings || !dp_async->recs) {
+			LM_ERR("no more shm memory for %d x %u log lines\n",
+				counted_processes, size);
+			goto error;
+		}
+		memset(dp_async->rings, 0, counted_processes *
+			sizeof *dp_async->rings);
+	}
+
+#ifdef STATISTICS
+	if (register_stat2("core", "log_dropped_lines",
+	(stat_var **)dp_get_dropped, STAT_IS_FUNC, NULL, 0) != 0 ||
+	register_stat2("core", "log_suppressed_lines",
+	(stat_var **)dp_get_suppressed, STAT_IS_FUNC, NULL, 0) != 0) {
+		LM_ERR("failed to register logging statistics\n");
+		goto error;
+	}
+#endif
+
+	return 0;
+error:
+	if (dp_async->rings)
+		shm_free(dp_async->rings);
+	if (dp_async->recs)
+		shm_free(dp_async->recs);
+	shm_free(dp_async);
+	dp_async = NULL;
+	return -1;
+}
+
+int log_writers_count(void)
+{
+	return log_async ? 1 : 0;
+}
+
+static int dp_file_fd = -1;
+static long dp_file_len;
+
+static int dp_file_open(void)
+{
+	dp_file_fd = open(log_file, O_WRONLY|O_CREAT|O_APPEND, 0640);
+	if (dp_file_fd < 0) {
+		LM_ERR("failed to open log file %s: %s\n", log_file, strerror(errno));
+		return -1;
+	}
+
+	dp_file_len = lseek(dp_file_fd, 0, SEEK_END);
+	if (dp_file_len < 0)
+		dp_file_len = 0;
+
+	return 0;
+}
+
+static void dp_file_rotate(void)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	int i;
+
+	close(dp_file_fd);
+	dp_file_fd = -1;
+
+	for (i = DP_FILE_ROTATIONS - 1; i >= 0; i--) {
+		if (i)
+			snprintf(from, sizeof from, "%s.%d", log_file, i);
+		else
+			snprintf(from, sizeof from, "%s", log_file);
+		snprintf(to, sizeof to, "%s.%d", log_file, i + 1);
+		rename(from, to);
+	}
+
+	dp_file_open();
+}
+
+/* writes a batch of lines to the log file or to stderr */
+static void dp_write_batch(struct iovec *iov, int iov_no, int len)
+{
+	int fd;
+
+	if (log_file) {
+		if (dp_file_fd < 0 && dp_file_open() < 0)
+			return;
+		fd = dp_file_fd;
+	} else {
+		fd = STDERR_FILENO;
+	}
+
+	if (writev(fd, iov, iov_no) < 0)
+		return;
+
+	if (log_file) {
+		dp_file_len += len;
+		if (log_file_size > 0 && dp_file_len >= log_file_size)
+			dp_file_rotate();
+	}
+}
+
+/* the lines logged with syslog() have no prefix, add one when they
+ * end up in the file */
+#define DP_STAMP_LEN 32
+
+static int dp_drain_ring(int proc)
+{
+	static char stamps[DP_BATCH][DP_STAMP_LEN];
+	struct iovec iov[2 * DP_BATCH];
+	struct dp_proc_ring *ring = &dp_async->rings[proc];
+	struct dp_rec *rec;
+	unsigned int tail, head;
+	int n, iov_no, len;
+	struct tm t;
+
+	head = ring->head;
+	__sync_synchronize();
+
+	for (tail = ring->tail, n = 0; tail != head && n < DP_BATCH; tail++) {
+		rec = &dp_async->recs[proc * dp_async->size +
+			(tail & (dp_async->size - 1))];
+
+		if (rec->prio != -1 && !log_file) {
+			syslog(rec->prio, "%.*s", rec->len, rec->text);
+			continue;
+		}
+
+		if (rec->prio != -1) {
+			localtime_r(&rec->ts, &t);
+			len = strftime(stamps[n], DP_STAMP_LEN, "%b %d %H:%M:%S", &t);
+			len += snprintf(stamps[n] + len, DP_STAMP_LEN - len, " [%d] ",
+				rec->pid);
+			iov[2 * n].iov_base = stamps[n];
+			iov[2 * n].iov_len = len;
+		} else {
+			iov[2 * n].iov_base = NULL;
+			iov[2 * n].iov_len = 0;
+		}
+		iov[2 * n + 1].iov_base = rec->text;
+		iov[2 * n + 1].iov_len = rec->len;
+		n++;
+	}
+
+	if (n) {
+		for (iov_no = 0, len = 0; iov_no < 2 * n; iov_no++)
+			len += iov[iov_no].iov_len;
+		dp_write_batch(iov, 2 * n, len);
+	}
+
+	if (tail == ring->tail)
+		return 0;
+
+	__sync_synchronize();
+	ring->tail = tail;
+	return 1;
+}
+
+static void dp_logger_loop(void)
+{
+	int i, busy;
+
+	dp_is_logger = 1;
+	dp_async->logger_up = 1;
+
+	for (;;) {
+		for (i = 1, busy = 0; i < counted_processes; i++)
+			busy |= dp_drain_ring(i);
+
+		if (!busy)
+			usleep(DP_IDLE_SLEEP);
+	}
+}
+
+/* forks the logger process
+ * to be called by the main process only */
+int start_log_writer(void)
+{
+	pid_t pid;
+
+	if (!log_writers_count() || !dp_async)
+		return 0;
+
+	if ( (pid=internal_fork("logger"))<0 ) {
+		LM_CRIT("cannot fork logger process\n");
+		return -1;
+	} else if (pid==0) {
+		/* new process */
+		clean_write_pipeend();
+
+		dp_logger_loop();
+		exit(-1);
+	}
+
+	return 0;
+}
+
 int init_log_level(void)
 {
 	log_level = &pt[process_no].log_level;
@@ -102,6 +102,11 @@ extern int log_stderr;
 extern int log_facility;
 extern char* log_name;
 extern char ctime_buf[];
+extern int log_async;
+extern int log_async_buffer;
+extern char *log_file;
+extern int log_file_size;
+extern int log_rate_limit;
 
 /*
  * must be called after init_multi_proc_support()
@@ -116,6 +121,19 @@ int dp_my_pid(void);
 
 void dprint (char* format, ...);
 
+void dp_syslog(int prio, char *format, ...)
+#ifdef __GNUC__
+	__attribute__ ((format (printf, 2, 3)))
+#endif
+	;
+
+int dp_rate_ok(const char *file, int line);
+
+/* asynchronous logging, see the log_async core parameter */
+int init_log_async(void);
+int log_writers_count(void);
+int start_log_writer(void);
+
 int str2facility(char *s);
 
 /*
@@ -167,6 +185,10 @@ static inline char* dp_time(void)
 
 #define is_printable(_level)  (((int)(*log_level)) >= ((int)(_level)))
 
+/* printable and not over the log_rate_limit of this log statement */
+#define is_loggable(_level) \
+	(is_printable(_level) && (!log_rate_limit || dp_rate_ok(__FILE__, __LINE__)))
+
 #if defined __GNUC__
 	#define __DP_FUNC  __FUNCTION__
 #elif defined __STDC_VERSION__ && __STDC_VERSION__ >= 199901L
@@ -211,7 +233,7 @@ static inline char* dp_time(void)
 				dprint( LOG_PREFIX __VA_ARGS__ ) \
 
 		#define MY_SYSLOG( _log_level, ...) \
-				syslog( (_log_level)|log_facility, \
+				dp_syslog( (_log_level)|log_facility, \
 							LOG_PREFIX __VA_ARGS__);\
 
 		#define LM_GEN1(_lev, ...) \
@@ -219,36 +241,36 @@ static inline char* dp_time(void)
 
 		#define LM_GEN2( _facility, _lev, ...) \
 			do { \
-				if (is_printable(_lev)){ \
+				if (is_loggable(_lev)){ \
 					if (log_stderr) \
 						dprint( DP_PREFIX fmt, dp_time(), \
 							dp_my_pid(), __VA_ARGS__ ); \
 					else { \
 						switch(_lev){ \
 							case L_CRIT: \
-								syslog(LOG_CRIT|_facility, __VA_ARGS__); \
+								dp_syslog(LOG_CRIT|_facility, __VA_ARGS__); \
 								break; \
 							case L_ALERT: \
-								syslog(LOG_ALERT|_facility, __VA_ARGS__); \
+								dp_syslog(LOG_ALERT|_facility, __VA_ARGS__); \
 								break; \
 							case L_ERR: \
-								syslog(LOG_ERR|_facility, __VA_ARGS__); \
+								dp_syslog(LOG_ERR|_facility, __VA_ARGS__); \
 								break; \
 							case L_WARN: \
-								syslog(LOG_WARNING|_facility, __VA_ARGS__);\
+								dp_syslog(LOG_WARNING|_facility, __VA_ARGS__);\
 								break; \
 							case L_NOTICE: \
-								syslog(LOG_NOTICE|_facility, __VA_ARGS__); \
+								dp_syslog(LOG_NOTICE|_facility, __VA_ARGS__); \
 								break; \
 							case L_INFO: \
-								syslog(LOG_INFO|_facility, __VA_ARGS__); \
+								dp_syslog(LOG_INFO|_facility, __VA_ARGS__); \
 								break; \
 							case L_DBG: \
-								syslog(LOG_DEBUG|_facility, __VA_ARGS__); \
+								dp_syslog(LOG_DEBUG|_facility, __VA_ARGS__); \
 								break; \
 							default: \
 								if (_lev > L_DBG) \
-									syslog(LOG_DEBUG|_facility, __VA_ARGS__); \
+									dp_syslog(LOG_DEBUG|_facility, __VA_ARGS__); \
 								break; \
 						} \
 					} \
@@ -257,7 +279,7 @@ static inline char* dp_time(void)
 
 		#define LM_ALERT( ...) \
 			do { \
-				if (is_printable(L_ALERT)){ \
+				if (is_loggable(L_ALERT)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_ALERT_PREFIX __VA_ARGS__);\
 					else \
@@ -267,7 +289,7 @@ static inline char* dp_time(void)
 
 		#define LM_CRIT( ...) \
 			do { \
-				if (is_printable(L_CRIT)){ \
+				if (is_loggable(L_CRIT)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_CRIT_PREFIX __VA_ARGS__);\
 					else \
@@ -277,7 +299,7 @@ static inline char* dp_time(void)
 
 		#define LM_ERR( ...) \
 			do { \
-				if (is_printable(L_ERR)){ \
+				if (is_loggable(L_ERR)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_ERR_PREFIX __VA_ARGS__);\
 					else \
@@ -287,7 +309,7 @@ static inline char* dp_time(void)
 
 		#define LM_WARN( ...) \
 			do { \
-				if (is_printable(L_WARN)){ \
+				if (is_loggable(L_WARN)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_WARN_PREFIX __VA_ARGS__);\
 					else \
@@ -297,7 +319,7 @@ static inline char* dp_time(void)
 
 		#define LM_NOTICE( ...) \
 			do { \
-				if (is_printable(L_NOTICE)){ \
+				if (is_loggable(L_NOTICE)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_NOTICE_PREFIX __VA_ARGS__);\
 					else \
@@ -307,7 +329,7 @@ static inline char* dp_time(void)
 
 		#define LM_INFO( ...) \
 			do { \
-				if (is_printable(L_INFO)){ \
+				if (is_loggable(L_INFO)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_INFO_PREFIX __VA_ARGS__);\
 					else \
@@ -320,7 +342,7 @@ static inline char* dp_time(void)
 		#else
 			#define LM_DBG( ...) \
 				do { \
-					if (is_printable(L_DBG)){ \
+					if (is_loggable(L_DBG)){ \
 						if (log_stderr)\
 							MY_DPRINT( DP_DBG_PREFIX __VA_ARGS__);\
 						else \
@@ -340,7 +362,7 @@ static inline char* dp_time(void)
 					dp_my_pid(), __DP_FUNC, ## args) \
 
 		#define MY_SYSLOG( _log_level, _prefix, _fmt, args...) \
-				syslog( (_log_level)|log_facility, \
+				dp_syslog( (_log_level)|log_facility, \
 							_prefix LOG_PREFIX _fmt, __DP_FUNC, ##args);\
 
 		#define LM_GEN1(_lev, args...) \
@@ -348,36 +370,36 @@ static inline char* dp_time(void)
 
 		#define LM_GEN2( _facility, _lev, fmt, args...) \
 			do { \
-				if (is_printable(_lev)){ \
+				if (is_loggable(_lev)){ \
 					if (log_stderr) \
 						dprint( DP_PREFIX fmt, dp_time(), \
 							dp_my_pid(), ## args); \
 					else { \
 						switch(_lev){ \
 							case L_CRIT: \
-								syslog(LOG_CRIT|_facility, fmt, ##args); \
+								dp_syslog(LOG_CRIT|_facility, fmt, ##args); \
 								break; \
 							case L_ALERT: \
-								syslog(LOG_ALERT|_facility, fmt, ##args); \
+								dp_syslog(LOG_ALERT|_facility, fmt, ##args); \
 								break; \
 							case L_ERR: \
-								syslog(LOG_ERR|_facility, fmt, ##args); \
+								dp_syslog(LOG_ERR|_facility, fmt, ##args); \
 								break; \
 							case L_WARN: \
-								syslog(LOG_WARNING|_facility, fmt, ##args);\
+								dp_syslog(LOG_WARNING|_facility, fmt, ##args);\
 								break; \
 							case L_NOTICE: \
-								syslog(LOG_NOTICE|_facility, fmt, ##args); \
+								dp_syslog(LOG_NOTICE|_facility, fmt, ##args); \
 								break; \
 							case L_INFO: \
-								syslog(LOG_INFO|_facility, fmt, ##args); \
+								dp_syslog(LOG_INFO|_facility, fmt, ##args); \
 								break; \
 							case L_DBG: \
-								syslog(LOG_DEBUG|_facility, fmt, ##args); \
+								dp_syslog(LOG_DEBUG|_facility, fmt, ##args); \
 								break; \
 							default: \
 								if (_lev > L_DBG) \
-									syslog(LOG_DEBUG|_facility, fmt, ##args); \
+									dp_syslog(LOG_DEBUG|_facility, fmt, ##args); \
 								break; \
 						} \
 					} \
@@ -386,7 +408,7 @@ static inline char* dp_time(void)
 
 		#define LM_ALERT( fmt, args...) \
 			do { \
-				if (is_printable(L_ALERT)){ \
+				if (is_loggable(L_ALERT)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_ALERT_PREFIX, fmt, ##args);\
 					else \
@@ -396,7 +418,7 @@ static inline char* dp_time(void)
 
 		#define LM_CRIT( fmt, args...) \
 			do { \
-				if (is_printable(L_CRIT)){ \
+				if (is_loggable(L_CRIT)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_CRIT_PREFIX, fmt, ##args);\
 					else \
@@ -406,7 +428,7 @@ static inline char* dp_time(void)
 
 		#define LM_ERR( fmt, args...) \
 			do { \
-				if (is_printable(L_ERR)){ \
+				if (is_loggable(L_ERR)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_ERR_PREFIX, fmt, ##args);\
 					else \
@@ -416,7 +438,7 @@ static inline char* dp_time(void)
 
 		#define LM_WARN( fmt, args...) \
 			do { \
-				if (is_printable(L_WARN)){ \
+				if (is_loggable(L_WARN)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_WARN_PREFIX, fmt, ##args);\
 					else \
@@ -426,7 +448,7 @@ static inline char* dp_time(void)
 
 		#define LM_NOTICE( fmt, args...) \
 			do { \
-				if (is_printable(L_NOTICE)){ \
+				if (is_loggable(L_NOTICE)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_NOTICE_PREFIX, fmt, ##args);\
 					else \
@@ -436,7 +458,7 @@ static inline char* dp_time(void)
 
 		#define LM_INFO( fmt, args...) \
 			do { \
-				if (is_printable(L_INFO)){ \
+				if (is_loggable(L_INFO)){ \
 					if (log_stderr)\
 						MY_DPRINT( DP_INFO_PREFIX, fmt, ##args);\
 					else \
@@ -449,7 +471,7 @@ static inline char* dp_time(void)
 		#else
 			#define LM_DBG( fmt, args...) \
 				do { \
-					if (is_printable(L_DBG)){ \
+					if (is_loggable(L_DBG)){ \
 						if (log_stderr)\
 							MY_DPRINT( DP_DBG_PREFIX, fmt, ##args);\
 						else \
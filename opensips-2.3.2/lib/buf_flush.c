@@ -0,0 +1,180 @@
+/*
+ * Time bounded flushing of per process write buffers
+ *
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../dprint.h"
+#include "../mem/shm_mem.h"
+#include "../ipc.h"
+#include "../pt.h"
+#include "buf_flush.h"
+
+/* the flushers the current process holds data for */
+static struct buf_flusher *proc_flushers;
+static int ipc_flush_type = -1;
+
+/* runs in the process holding the data, on request from the timer */
+static void buf_flusher_ipc(int sender, void *param)
+{
+	struct buf_flusher *f = (struct buf_flusher *)param;
+
+	if (f->me)
+		f->me->job_sent = 0;
+	f->flush();
+}
+
+/* the timer only signals processes holding data older than the interval;
+ * at most one job is outstanding per process, so a process that does not
+ * read its IPC pipe can never get it filled - it flushes on its next write */
+static void buf_flusher_timer(utime_t ticks, void *param)
+{
+	struct buf_flusher *f = (struct buf_flusher *)param;
+	struct buf_holder *h;
+	utime_t oldest;
+
+	for (h = *f->holders; h; h = h->next) {
+		oldest = h->oldest;
+		if (!oldest || h->job_sent ||
+		ticks - oldest < (utime_t)f->interval * 1000)
+			continue;
+
+		if (h == f->me) {
+			f->flush();
+			continue;
+		}
+
+		h->job_sent = 1;
+		/* the flusher is module data, at the same address everywhere */
+		if (ipc_send_job(h->proc_no, ipc_flush_type, f) < 0) {
+			LM_ERR("failed to send %s flush job to process %d\n",
+				f->name, h->proc_no);
+			h->job_sent = 0;
+		}
+	}
+}
+
+static void buf_flusher_exit(void)
+{
+	struct buf_flusher *f;
+
+	for (f = proc_flushers; f; f = f->next)
+		f->flush();
+}
+
+int buf_flusher_init(struct buf_flusher *f, char *name, int interval,
+		buf_flush_f *flush)
+{
+	memset(f, 0, sizeof *f);
+	f->name = name;
+	f->interval = interval > 0 ? interval : 1000;
+	f->flush = flush;
+
+	f->holders = shm_malloc(sizeof *f->holders);
+	f->lock = lock_alloc();
+	if (!f->holders || !f->lock || !lock_init(f->lock)) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	*f->holders = NULL;
+
+	if (ipc_flush_type < 0) {
+		ipc_flush_type = ipc_register_handler(buf_flusher_ipc,
+			"buffer flush");
+		if (ipc_flush_type < 0) {
+			LM_ERR("failed to register the IPC flush handler\n");
+			return -1;
+		}
+	}
+
+	if (register_utimer(name, buf_flusher_timer, f,
+	(f->interval>1?f->interval/2:1)*1000, TIMER_FLAG_SKIP_ON_DELAY) < 0) {
+		LM_ERR("failed to register the %s flush timer\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+int buf_flusher_register_proc(struct buf_flusher *f)
+{
+	if (f->me)
+		return 0;
+
+	f->me = shm_malloc(sizeof *f->me);
+	if (!f->me) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(f->me, 0, sizeof *f->me);
+	f->me->proc_no = process_no;
+
+	/* nothing buffered may be lost on shutdown */
+	if (!proc_flushers && atexit(buf_flusher_exit) < 0)
+		LM_WARN("cannot register the exit flush handler\n");
+	f->next = proc_flushers;
+	proc_flushers = f;
+
+	lock_get(f->lock);
+	f->me->next = *f->holders;
+	*f->holders = f->me;
+	lock_release(f->lock);
+
+	return 0;
+}
+
+int buf_flusher_touch(struct buf_flusher *f)
+{
+	utime_t now;
+
+	if (!f->me && buf_flusher_register_proc(f) < 0)
+		return -1;
+
+	now = get_uticks();
+	if (!f->me->oldest) {
+		f->me->oldest = now;
+		return 0;
+	}
+
+	return now - f->me->oldest >= (utime_t)f->interval * 1000;
+}
+
+int buf_write_all(int fd, char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
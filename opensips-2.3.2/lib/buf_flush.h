@@ -0,0 +1,99 @@
+/*
+ * Time bounded flushing of per process write buffers
+ *
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ */
+
+/*
+ * Modules writing to files may collect the data in a pkg buffer of each
+ * process and write it in bulk. A buf_flusher makes sure nothing stays
+ * buffered for longer than its interval, even in processes which stop
+ * writing: every process holding data publishes itself in shm and a timer
+ * asks the ones holding data for too long to flush it, over IPC. The data
+ * is also flushed when the process exits.
+ *
+ * The flusher is a static variable of the module, set up in mod_init:
+ *
+ *   static struct buf_flusher my_flusher;
+ *   ...
+ *   buf_flusher_init(&my_flusher, "my_module", interval, my_flush_all);
+ *
+ * then, in the writing process, after each buffered record:
+ *
+ *   if (buf_flusher_touch(&my_flusher))
+ *       my_flush_all();
+ *
+ * with my_flush_all() calling buf_flusher_flushed() once done.
+ */
+
+#ifndef _LIB_BUF_FLUSH_H
+#define _LIB_BUF_FLUSH_H
+
+#include "../locking.h"
+#include "../timer.h"
+
+/* flushes all the data buffered by the current process */
+typedef void (buf_flush_f)(void);
+
+/* shm record of a process holding buffered data */
+struct buf_holder {
+	int proc_no;
+	volatile utime_t oldest;
+	volatile int job_sent;
+	struct buf_holder *next;
+};
+
+struct buf_flusher {
+	char *name;
+	int interval;
+	buf_flush_f *flush;
+	int ipc_type;
+	gen_lock_t *lock;
+	struct buf_holder **holders;
+	/* per process: the record of this process, once it buffered data */
+	struct buf_holder *me;
+	struct buf_flusher *next;
+};
+
+/* to be called from mod_init; @interval is in milliseconds */
+int buf_flusher_init(struct buf_flusher *f, char *name, int interval,
+		buf_flush_f *flush);
+
+/* publishes the current process as a holder of buffered data */
+int buf_flusher_register_proc(struct buf_flusher *f);
+
+/* notes that data was just buffered; returns 1 if the buffered data is
+ * older than the interval and must be flushed by the caller, 0 if not and
+ * -1 if the process cannot buffer data at all */
+int buf_flusher_touch(struct buf_flusher *f);
+
+/* to be called by the flush function once all the data is written; the
+ * pending IPC job, if any, is only cleared once the job is run, so a
+ * process that does not read IPC never has more than one job queued */
+static inline void buf_flusher_flushed(struct buf_flusher *f)
+{
+	if (f->me)
+		f->me->oldest = 0;
+}
+
+/* write a whole buffer, coping with interrupted and short writes */
+int buf_write_all(int fd, char *buf, int len);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Shared memory hash table of expiring entries
+ *
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ */
+
+#include <string.h>
+
+#include "../dprint.h"
+#include "ttl_hash.h"
+
+#define TTL_HASH_MIN_SIZE	16
+#define TTL_HASH_MAX_SIZE	(1<<20)
+
+struct ttl_hash *ttl_hash_new(unsigned int max_entries, unsigned int locks_no)
+{
+	struct ttl_hash *t;
+	unsigned int size;
+
+	t = shm_malloc(sizeof *t);
+	if (!t) {
+		LM_ERR("no more shm memory\n");
+		return NULL;
+	}
+	memset(t, 0, sizeof *t);
+
+	for (size = TTL_HASH_MIN_SIZE;
+	size < max_entries / 4 && size < TTL_HASH_MAX_SIZE; size <<= 1);
+	t->size = size;
+
+	t->buckets = shm_malloc(size * sizeof *t->buckets);
+	if (!t->buckets) {
+		LM_ERR("no more shm memory\n");
+		goto error;
+	}
+	memset(t->buckets, 0, size * sizeof *t->buckets);
+
+	t->locks_no = locks_no;
+	t->locks = lock_set_alloc(locks_no);
+	if (!t->locks) {
+		LM_ERR("failed to alloc the hash locks\n");
+		goto error;
+	}
+	if (!lock_set_init(t->locks)) {
+		LM_ERR("failed to init the hash locks\n");
+		lock_set_dealloc(t->locks);
+		t->locks = NULL;
+		goto error;
+	}
+
+	return t;
+error:
+	ttl_hash_free(t);
+	return NULL;
+}
+
+void ttl_hash_free(struct ttl_hash *t)
+{
+	struct ttl_hash_entry *e, *next;
+	unsigned int b;
+
+	if (!t)
+		return;
+
+	if (t->buckets) {
+		for (b = 0; b < t->size; b++)
+			for (e = t->buckets[b]; e; e = next) {
+				next = e->next;
+				shm_free(e);
+			}
+		shm_free(t->buckets);
+	}
+	if (t->locks) {
+		lock_set_destroy(t->locks);
+		lock_set_dealloc(t->locks);
+	}
+	shm_free(t);
+}
+
+void ttl_hash_purge(struct ttl_hash *t, unsigned int now)
+{
+	struct ttl_hash_entry **prev;
+	unsigned int b;
+
+	for (b = 0; b < t->size; b++) {
+		if (t->buckets[b] == NULL)
+			continue;
+
+		ttl_hash_lock(t, b);
+		for (prev = &t->buckets[b]; *prev; ) {
+			if ((*prev)->expires <= now)
+				ttl_hash_unlink(t, prev);
+			else
+				prev = &(*prev)->next;
+		}
+		ttl_hash_unlock(t, b);
+	}
+}
@@ -0,0 +1,87 @@
+/*
+ * Shared memory hash table of expiring entries
+ *
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ */
+
+/*
+ * The bucket and lock handling, entry accounting and expiry purging of a
+ * shm cache with a bounded number of entries. The users embed a
+ * struct ttl_hash_entry as the first member of their own entries, pick
+ * the bucket out of their own hash and do the lookups themselves, under
+ * the bucket lock.
+ */
+
+#ifndef _LIB_TTL_HASH_H
+#define _LIB_TTL_HASH_H
+
+#include "../mem/shm_mem.h"
+#include "../locking.h"
+
+struct ttl_hash_entry {
+	unsigned int expires;
+	struct ttl_hash_entry *next;
+};
+
+struct ttl_hash {
+	unsigned int size;
+	unsigned int entries;
+	unsigned int locks_no;
+	gen_lock_set_t *locks;
+	struct ttl_hash_entry **buckets;
+};
+
+#define ttl_hash_bucket(_t, _hash) ((_hash) & ((_t)->size - 1))
+
+#define ttl_hash_lock(_t, _b) \
+	lock_set_get((_t)->locks, (_b) % (_t)->locks_no)
+#define ttl_hash_unlock(_t, _b) \
+	lock_set_release((_t)->locks, (_b) % (_t)->locks_no)
+
+/* sizes the table for about @max_entries entries (4 per bucket) */
+struct ttl_hash *ttl_hash_new(unsigned int max_entries, unsigned int locks_no);
+
+/* frees the table and all the entries still in it */
+void ttl_hash_free(struct ttl_hash *t);
+
+/* the following must be called under the lock of the bucket */
+
+static inline void ttl_hash_link(struct ttl_hash *t, unsigned int b,
+		struct ttl_hash_entry *e)
+{
+	e->next = t->buckets[b];
+	t->buckets[b] = e;
+	__sync_fetch_and_add(&t->entries, 1);
+}
+
+static inline void ttl_hash_unlink(struct ttl_hash *t,
+		struct ttl_hash_entry **prev)
+{
+	struct ttl_hash_entry *e = *prev;
+
+	*prev = e->next;
+	shm_free(e);
+	__sync_fetch_and_sub(&t->entries, 1);
+}
+
+/* drops all the entries expired at @now, bucket by bucket */
+void ttl_hash_purge(struct ttl_hash *t, unsigned int now);
+
+#endif
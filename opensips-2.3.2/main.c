@@ -653,6 +653,12 @@ static int main_loop(void)
 
 	chd_rank=0;
 
+	/* fork the logger first, so it is up before the other processes */
+	if (start_log_writer()!=0) {
+		LM_CRIT("cannot start logger process\n");
+		goto error;
+	}
+
 	if (start_module_procs()!=0) {
 		LM_ERR("failed to fork module processes\n");
 		goto error;
@@ -673,6 +679,12 @@ static int main_loop(void)
 		goto error;
 	}
 
+	/* fork the SQL insert writers, if any */
+	if (start_ql_writers()!=0) {
+		LM_CRIT("cannot start SQL insert writer process(es)\n");
+		goto error;
+	}
+
 	/* fork all processes required by UDP network layer */
 	if (udp_start_processes( &chd_rank, startup_done)<0) {
 		LM_CRIT("cannot start UDP processes\n");
@@ -1245,6 +1257,18 @@ try_again:
 		goto error;
 	}
 
+	/* init the asynchronous logging (rings for all processes) */
+	if (init_log_async()!=0) {
+		LM_ERR("failed to init asynchronous logging\n");
+		goto error;
+	}
+
+	/* init the per process statistics */
+	if (init_stats_proc_slots(counted_processes)!=0) {
+		LM_ERR("failed to init per process statistics\n");
+		goto error;
+	}
+
 	#ifdef PKG_MALLOC
 	/* init stats support for pkg mem */
 	if (init_pkg_stats(counted_processes)!=0) {
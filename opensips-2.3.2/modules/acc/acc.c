@@ -55,6 +55,7 @@
 #include "acc_extra.h"
 #include "acc_logic.h"
 #include "acc_vars.h"
+#include "acc_file.h"
 
 #define TABLE_VERSION 7
 
@@ -231,6 +232,123 @@ void acc_log_init(void)
 	SET_LOG_ATTR(n,CREATED);
 }
 
+/* the record type for files, out of the leading syslog text */
+static inline void acc_file_set_type(str *type)
+{
+	*type = acc_env.text;
+	if (type->len > ACC_LEN && memcmp(type->s, ACC, ACC_LEN) == 0) {
+		type->s += ACC_LEN;
+		type->len -= ACC_LEN;
+	}
+	if (type->len >= 2 && type->s[type->len - 2] == ':')
+		type->len -= 2;
+}
+
+/* writes one record per leg, or a single one if there are no legs;
+ * to be called under the context lock */
+static int acc_file_write_legs(str *vals, acc_ctx_t *ctx)
+{
+	struct acc_extra *extra;
+	int i, j, ret = 1;
+
+	if (!ctx || !ctx->leg_values)
+		return acc_file_write(vals) < 0 ? -1 : 1;
+
+	for (j = 0; j < ctx->legs_no; j++) {
+		for (extra=log_leg_tags, i=acc_file_cols.leg_col; extra;
+		extra=extra->next, i++)
+			vals[i] = LEG_VALUE(j, extra, ctx);
+		if (acc_file_write(vals) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int acc_file_cdrs(struct dlg_cell *dlg, acc_ctx_t *ctx)
+{
+	static str vals[ACC_FILE_MAX_COLS];
+	char time_buf[INT2STR_MAX_LEN], dur_buf[INT2STR_MAX_LEN],
+		ms_dur_buf[INT2STR_MAX_LEN], setup_buf[INT2STR_MAX_LEN],
+		created_buf[INT2STR_MAX_LEN];
+	str *cdr = vals + acc_file_cols.cdr_col;
+	struct acc_extra *extra;
+	struct timeval start_time;
+	str core_s;
+	int i, ret;
+
+	if (prebuild_core_arr(dlg, &core_s, &start_time) < 0) {
+		LM_ERR("cannot copy core arguments\n");
+		return -1;
+	}
+
+	memset(vals, 0, acc_file_cols.cols * sizeof(str));
+	acc_file_set_type(&vals[ACC_FILE_TYPE_COL]);
+	memcpy(vals + ACC_FILE_CORE_COL, val_arr, ACC_CORE_LEN * sizeof(str));
+
+	vals[ACC_FILE_TIME_COL].s = int2bstr(start_time.tv_sec, time_buf,
+		&vals[ACC_FILE_TIME_COL].len);
+	cdr[ACC_FILE_DURATION].s = int2bstr(
+		ctx->bye_time.tv_sec - start_time.tv_sec, dur_buf,
+		&cdr[ACC_FILE_DURATION].len);
+	cdr[ACC_FILE_MS_DURATION].s = int2bstr(
+		(ctx->bye_time.tv_sec - start_time.tv_sec) * 1000 +
+		(ctx->bye_time.tv_usec - start_time.tv_usec) / 1000, ms_dur_buf,
+		&cdr[ACC_FILE_MS_DURATION].len);
+	cdr[ACC_FILE_SETUPTIME].s = int2bstr(start_time.tv_sec - ctx->created,
+		setup_buf, &cdr[ACC_FILE_SETUPTIME].len);
+	cdr[ACC_FILE_CREATED].s = int2bstr(ctx->created, created_buf,
+		&cdr[ACC_FILE_CREATED].len);
+
+	/* prevent acces for setting variable */
+	accX_lock(&ctx->lock);
+	for (extra=log_extra_tags, i=acc_file_cols.extra_col; extra;
+	extra=extra->next, i++)
+		vals[i] = ctx->extra_values[extra->tag_idx].value;
+	ret = acc_file_write_legs(vals, ctx);
+	accX_unlock(&ctx->lock);
+
+	pkg_free(core_s.s);
+	return ret;
+}
+
+static int acc_file_request(struct sip_msg *rq, int cdr_flag)
+{
+	static str vals[ACC_FILE_MAX_COLS];
+	char time_buf[INT2STR_MAX_LEN], setup_buf[INT2STR_MAX_LEN],
+		created_buf[INT2STR_MAX_LEN];
+	str *cdr = vals + acc_file_cols.cdr_col;
+	struct acc_extra *extra;
+	acc_ctx_t* ctx = try_fetch_ctx();
+	int i, ret;
+
+	memset(vals, 0, acc_file_cols.cols * sizeof(str));
+	acc_file_set_type(&vals[ACC_FILE_TYPE_COL]);
+	core2strar(rq, vals + ACC_FILE_CORE_COL);
+	vals[ACC_FILE_TIME_COL].s = int2bstr(acc_env.ts.tv_sec, time_buf,
+		&vals[ACC_FILE_TIME_COL].len);
+
+	if (!ctx)
+		return acc_file_write(vals) < 0 ? -1 : 1;
+
+	if (cdr_flag) {
+		cdr[ACC_FILE_SETUPTIME].s = int2bstr(time(NULL) - ctx->created,
+			setup_buf, &cdr[ACC_FILE_SETUPTIME].len);
+		cdr[ACC_FILE_CREATED].s = int2bstr(ctx->created, created_buf,
+			&cdr[ACC_FILE_CREATED].len);
+	}
+
+	/* prevent acces for setting variable */
+	accX_lock(&ctx->lock);
+	for (extra=log_extra_tags, i=acc_file_cols.extra_col; extra;
+	extra=extra->next, i++)
+		vals[i] = ctx->extra_values[extra->tag_idx].value;
+	ret = acc_file_write_legs(vals, ctx);
+	accX_unlock(&ctx->lock);
+
+	return ret;
+}
+
 int acc_log_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx)
 {
 	static char log_msg[MAX_SYSLOG_SIZE];
@@ -242,6 +360,9 @@ int acc_log_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx)
 
 	struct acc_extra* extra;
 
+	if (acc_file_path)
+		return acc_file_cdrs(dlg, ctx);
+
 	core_s.s = extra_s.s = leg_s.s = 0;
 
 	ret = prebuild_core_arr(dlg, &core_s, &start_time);
@@ -330,8 +451,12 @@ int acc_log_request( struct sip_msg *rq, struct sip_msg *rpl, int cdr_flag)
 	unsigned int _setup_time=0;
 
 	struct acc_extra* extra;
-	acc_ctx_t* ctx = try_fetch_ctx();
+	acc_ctx_t* ctx;
+
+	if (acc_file_path)
+		return acc_file_request(rq, cdr_flag);
 
+	ctx = try_fetch_ctx();
 	if (ctx && cdr_flag) {
 		/* get created value from context */
 		_created = ctx->created;
@@ -38,6 +38,7 @@
 
 /* leading text for a request accounted from a script */
 #define ACC "ACC: "
+#define ACC_LEN (sizeof(ACC)-1)
 #define ACC_REQUEST ACC"request accounted: "
 #define ACC_REQUEST_LEN (sizeof(ACC_REQUEST)-1)
 #define ACC_MISSED ACC"call missed: "
@@ -0,0 +1,432 @@
+/**
+ *
+ * Copyright (C) 2017 OpenSIPS Foundation
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Batched file output for the "log" accounting - instead of one syslog
+ * line per record, the records are appended in a fixed column layout
+ * (CSV or length prefixed binary) to a per process buffer, which is
+ * written to the current file in a single write() when full or when
+ * older than log_flush_interval. Files may be rotated by time.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../../dprint.h"
+#include "../../mem/mem.h"
+#include "../../ut.h"
+#include "../../lib/buf_flush.h"
+
+#include "acc.h"
+#include "acc_extra.h"
+#include "acc_file.h"
+
+#define ACC_FILE_NAME_MAX 1024
+
+extern struct acc_extra *log_extra_tags;
+extern struct acc_extra *log_leg_tags;
+
+char *acc_file_path = NULL;
+char *acc_file_format_str = NULL;
+int acc_file_rotate = 0;
+int acc_file_buffer_size = 65536;
+int acc_file_flush_interval = 1000;
+
+struct acc_file_layout acc_file_cols;
+
+static int acc_file_format = ACC_FILE_CSV;
+
+/* per process state */
+static char *acc_buf;
+static int acc_buf_len;
+static int acc_fd = -1;
+static time_t acc_fd_period = -1;
+
+static struct buf_flusher acc_flusher;
+
+static void acc_file_flush(void);
+
+
+#define set_col_name(_n, _s) \
+	do { \
+		acc_file_cols.names[_n].s = _s; \
+		acc_file_cols.names[_n].len = sizeof(_s) - 1; \
+	} while (0)
+
+/* CSV: only values holding separators, quotes or line ends get quoted */
+static inline char *csv_put(char *p, str *v)
+{
+	char *s, *end = v->s + v->len;
+
+	for (s = v->s; s < end; s++)
+		if (*s == ',' || *s == '"' || *s == '\n' || *s == '\r')
+			break;
+
+	if (s == end) {
+		memcpy(p, v->s, v->len);
+		return p + v->len;
+	}
+
+	*p++ = '"';
+	memcpy(p, v->s, s - v->s);
+	p += s - v->s;
+	for (; s < end; s++) {
+		if (*s == '"')
+			*p++ = '"';
+		*p++ = *s;
+	}
+	*p++ = '"';
+
+	return p;
+}
+
+static inline char *bin_put(char *p, str *v)
+{
+	unsigned short len = v->len > 0xffff ? 0xffff : v->len;
+	unsigned short nlen = htons(len);
+
+	memcpy(p, &nlen, sizeof nlen);
+	p += sizeof nlen;
+	memcpy(p, v->s, len);
+	return p + len;
+}
+
+/* worst case length of a formatted record */
+static inline int record_max_len(str *vals)
+{
+	int i, len = 0;
+
+	for (i = 0; i < acc_file_cols.cols; i++)
+		len += vals[i].len;
+
+	if (acc_file_format == ACC_FILE_CSV)
+		return 2 * len + 3 * acc_file_cols.cols + 1;
+
+	return sizeof(unsigned int) + len +
+		acc_file_cols.cols * sizeof(unsigned short);
+}
+
+/* formats a record into p; returns its end */
+static char *record_print(char *p, str *vals)
+{
+	unsigned int nlen;
+	char *start = p;
+	int i;
+
+	if (acc_file_format == ACC_FILE_CSV) {
+		for (i = 0; i < acc_file_cols.cols; i++) {
+			if (i)
+				*p++ = ',';
+			p = csv_put(p, &vals[i]);
+		}
+		*p++ = '\n';
+		return p;
+	}
+
+	/* the record length goes in front, once known */
+	p += sizeof nlen;
+	for (i = 0; i < acc_file_cols.cols; i++)
+		p = bin_put(p, &vals[i]);
+	nlen = htonl(p - start - sizeof nlen);
+	memcpy(start, &nlen, sizeof nlen);
+
+	return p;
+}
+
+static int build_header(void)
+{
+	char *p;
+	int i, len;
+	unsigned short n;
+
+	len = record_max_len(acc_file_cols.names) + ACC_FILE_MAGIC_LEN +
+		sizeof(unsigned short);
+	acc_file_cols.header.s = pkg_malloc(len);
+	if (!acc_file_cols.header.s) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+
+	p = acc_file_cols.header.s;
+	if (acc_file_format == ACC_FILE_CSV) {
+		p = record_print(p, acc_file_cols.names);
+	} else {
+		memcpy(p, ACC_FILE_MAGIC, ACC_FILE_MAGIC_LEN);
+		p += ACC_FILE_MAGIC_LEN;
+		n = htons(acc_file_cols.cols);
+		memcpy(p, &n, sizeof n);
+		p += sizeof n;
+		for (i = 0; i < acc_file_cols.cols; i++)
+			p = bin_put(p, &acc_file_cols.names[i]);
+	}
+	acc_file_cols.header.len = p - acc_file_cols.header.s;
+
+	return 0;
+}
+
+int acc_file_init(void)
+{
+	struct acc_extra *extra;
+	int n = 0;
+
+	if (acc_file_format_str) {
+		if (strcasecmp(acc_file_format_str, "csv") == 0) {
+			acc_file_format = ACC_FILE_CSV;
+		} else if (strcasecmp(acc_file_format_str, "binary") == 0) {
+			acc_file_format = ACC_FILE_BINARY;
+		} else {
+			LM_ERR("unknown log_file_format <%s>\n", acc_file_format_str);
+			return -1;
+		}
+	}
+
+	if (acc_file_rotate < 0) {
+		LM_ERR("invalid log_file_rotate %d\n", acc_file_rotate);
+		return -1;
+	}
+	if (acc_file_buffer_size < 0)
+		acc_file_buffer_size = 0;
+	if (acc_file_flush_interval <= 0)
+		acc_file_flush_interval = 1000;
+
+	/* the column layout */
+	set_col_name(n++, "type");
+	set_col_name(n++, "time");
+	set_col_name(n++, A_METHOD);
+	set_col_name(n++, A_FROMTAG);
+	set_col_name(n++, A_TOTAG);
+	set_col_name(n++, A_CALLID);
+	set_col_name(n++, A_CODE);
+	set_col_name(n++, A_STATUS);
+
+	acc_file_cols.extra_col = n;
+	for (extra = log_extra_tags; extra; extra = extra->next)
+		acc_file_cols.names[n++] = extra->name;
+
+	acc_file_cols.leg_col = n;
+	for (extra = log_leg_tags; extra; extra = extra->next)
+		acc_file_cols.names[n++] = extra->name;
+
+	acc_file_cols.cdr_col = n;
+	set_col_name(n++, A_DURATION);
+	set_col_name(n++, "ms_duration");
+	set_col_name(n++, A_SETUPTIME);
+	set_col_name(n++, A_CREATED);
+	acc_file_cols.cols = n;
+
+	if (build_header() < 0)
+		return -1;
+
+	if (acc_file_buffer_size && buf_flusher_init(&acc_flusher,
+	"acc-file-flush", acc_file_flush_interval, acc_file_flush) < 0) {
+		LM_ERR("failed to set up the buffer flushing\n");
+		return -1;
+	}
+
+	LM_DBG("%d columns, buffering up to %d bytes, flushed every %d ms\n",
+		acc_file_cols.cols, acc_file_buffer_size, acc_file_flush_interval);
+
+	return 0;
+}
+
+
+/* creates a new file along with its header: the header is written into a
+ * temporary file which is then linked under the final name, so no other
+ * process can ever append records in front of it */
+static int acc_file_create(char *name)
+{
+	char tmp[ACC_FILE_NAME_MAX + 32];
+	int fd;
+
+	snprintf(tmp, sizeof tmp, "%s.%d.tmp", name, (int)getpid());
+
+	fd = open(tmp, O_WRONLY|O_APPEND|O_CREAT|O_EXCL, 0640);
+	if (fd < 0) {
+		LM_ERR("cannot create <%s>: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	if (buf_write_all(fd, acc_file_cols.header.s,
+	acc_file_cols.header.len) < 0) {
+		LM_ERR("cannot write header to <%s>: %s\n", tmp, strerror(errno));
+		goto error;
+	}
+
+	if (link(tmp, name) < 0) {
+		if (errno != EEXIST) {
+			LM_ERR("cannot link <%s>: %s\n", name, strerror(errno));
+			goto error;
+		}
+		/* somebody else was faster */
+		close(fd);
+		unlink(tmp);
+		return open(name, O_WRONLY|O_APPEND);
+	}
+
+	unlink(tmp);
+	return fd;
+error:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/* returns the descriptor of the file records should go to right now */
+static int acc_file_open(void)
+{
+	char name[ACC_FILE_NAME_MAX];
+	time_t now, period;
+	struct tm tm;
+
+	if (acc_file_rotate) {
+		now = time(NULL);
+		period = now - now % acc_file_rotate;
+	} else {
+		period = 0;
+	}
+
+	if (acc_fd >= 0 && period == acc_fd_period)
+		return acc_fd;
+
+	if (acc_fd >= 0) {
+		close(acc_fd);
+		acc_fd = -1;
+	}
+
+	if (!acc_file_rotate) {
+		strncpy(name, acc_file_path, sizeof name - 1);
+		name[sizeof name - 1] = 0;
+	} else if (strchr(acc_file_path, '%')) {
+		localtime_r(&period, &tm);
+		if (strftime(name, sizeof name, acc_file_path, &tm) == 0) {
+			LM_ERR("bad log_file pattern <%s>\n", acc_file_path);
+			return -1;
+		}
+	} else {
+		snprintf(name, sizeof name, "%s.%lu", acc_file_path,
+			(unsigned long)period);
+	}
+
+	acc_fd = open(name, O_WRONLY|O_APPEND);
+	if (acc_fd < 0 && errno == ENOENT)
+		acc_fd = acc_file_create(name);
+	if (acc_fd < 0) {
+		LM_ERR("cannot open <%s>: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	acc_fd_period = period;
+	return acc_fd;
+}
+
+static void acc_file_flush(void)
+{
+	int fd, len = acc_buf_len;
+
+	if (!len)
+		return;
+
+	acc_buf_len = 0;
+	buf_flusher_flushed(&acc_flusher);
+
+	if ((fd = acc_file_open()) < 0)
+		return;
+
+	if (buf_write_all(fd, acc_buf, len) < 0)
+		LM_ERR("failed to write %d bytes of records: %s\n", len,
+			strerror(errno));
+}
+
+static int acc_file_alloc_buf(void)
+{
+	acc_buf = pkg_malloc(acc_file_buffer_size);
+	if (!acc_buf) {
+		LM_ERR("no more pkg memory for the write buffer\n");
+		return -1;
+	}
+
+	if (buf_flusher_register_proc(&acc_flusher) < 0) {
+		pkg_free(acc_buf);
+		acc_buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* unbuffered write of a single record */
+static int acc_file_write_direct(str *vals, int max_len)
+{
+	char *rec, *end;
+	int fd, ret = 0;
+
+	rec = pkg_malloc(max_len);
+	if (!rec) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	end = record_print(rec, vals);
+
+	if ((fd = acc_file_open()) < 0 || buf_write_all(fd, rec, end - rec) < 0) {
+		LM_ERR("failed to write the record\n");
+		ret = -1;
+	}
+
+	pkg_free(rec);
+	return ret;
+}
+
+int acc_file_write(str *vals)
+{
+	int max_len = record_max_len(vals);
+
+	if (max_len > acc_file_buffer_size ||
+	(!acc_buf && acc_file_alloc_buf() < 0)) {
+		/* keep the order of the records */
+		acc_file_flush();
+		return acc_file_write_direct(vals, max_len);
+	}
+
+	if (acc_buf_len + max_len > acc_file_buffer_size)
+		acc_file_flush();
+
+	acc_buf_len = record_print(acc_buf + acc_buf_len, vals) - acc_buf;
+
+	if (buf_flusher_touch(&acc_flusher) > 0)
+		acc_file_flush();
+
+	return 0;
+}
+
+void acc_file_destroy(void)
+{
+	acc_file_flush();
+	if (acc_fd >= 0) {
+		close(acc_fd);
+		acc_fd = -1;
+	}
+}
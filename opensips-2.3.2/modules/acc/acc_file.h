@@ -0,0 +1,76 @@
+/**
+ *
+ * Copyright (C) 2017 OpenSIPS Foundation
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef _ACC_FILE_H_
+#define _ACC_FILE_H_
+
+#include "../../str.h"
+#include "acc.h"
+
+#define ACC_FILE_CSV     0
+#define ACC_FILE_BINARY  1
+
+/* magic at the start of binary files, followed by the column names */
+#define ACC_FILE_MAGIC     "OSACC\x01"
+#define ACC_FILE_MAGIC_LEN (sizeof(ACC_FILE_MAGIC)-1)
+
+/* fixed columns, in front of the core ones */
+#define ACC_FILE_TYPE_COL  0
+#define ACC_FILE_TIME_COL  1
+#define ACC_FILE_CORE_COL  2
+
+/* cdr columns, at the end of each record */
+#define ACC_FILE_DURATION     0
+#define ACC_FILE_MS_DURATION  1
+#define ACC_FILE_SETUPTIME    2
+#define ACC_FILE_CREATED      3
+#define ACC_FILE_CDR_LEN      4
+
+#define ACC_FILE_MAX_COLS \
+	(ACC_FILE_CORE_COL+ACC_CORE_LEN+MAX_ACC_EXTRA+MAX_ACC_LEG+ACC_FILE_CDR_LEN)
+
+/* the column layout of all the records of the file, built once at startup
+ * out of the log extra and leg definitions */
+struct acc_file_layout {
+	int cols;
+	int extra_col;
+	int leg_col;
+	int cdr_col;
+	str names[ACC_FILE_MAX_COLS];
+	str header;
+};
+
+extern char *acc_file_path;
+extern char *acc_file_format_str;
+extern int acc_file_rotate;
+extern int acc_file_buffer_size;
+extern int acc_file_flush_interval;
+
+extern struct acc_file_layout acc_file_cols;
+
+int acc_file_init(void);
+void acc_file_destroy(void);
+
+/* appends one record, with acc_file_cols.cols values, to the buffer of the
+ * current process */
+int acc_file_write(str *vals);
+
+#endif
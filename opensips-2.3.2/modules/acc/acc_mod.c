@@ -59,6 +59,7 @@
 #include "acc_extra.h"
 #include "acc_logic.h"
 #include "acc_vars.h"
+#include "acc_file.h"
 
 struct dlg_binds dlg_api;
 struct tm_binds tmb;
@@ -225,6 +226,11 @@ static param_export_t params[] = {
 	/* syslog specific */
 	{"log_level",            INT_PARAM, &acc_log_level        },
 	{"log_facility",         STR_PARAM, &log_facility_str     },
+	{"log_file",             STR_PARAM, &acc_file_path        },
+	{"log_file_format",      STR_PARAM, &acc_file_format_str  },
+	{"log_file_rotate",      INT_PARAM, &acc_file_rotate      },
+	{"log_buffer_size",      INT_PARAM, &acc_file_buffer_size },
+	{"log_flush_interval",   INT_PARAM, &acc_file_flush_interval},
 	/* aaa specific */
 	{"aaa_url",   		     STR_PARAM, &aaa_proto_url        },
 	{"service_type",         INT_PARAM, &service_type         },
@@ -408,6 +414,12 @@ static int mod_init( void )
 
 	/* ----------- SYSLOG INIT SECTION ----------- */
 	acc_log_init();
+	if (acc_file_path && !acc_file_path[0])
+		acc_file_path = NULL;
+	if (acc_file_path && acc_file_init() < 0) {
+		LM_ERR("failed to init the log file output\n");
+		return -1;
+	}
 
 	/* ----------- DATABASE INIT SECTION ----------- */
 	if (db_url.s) {
@@ -464,6 +476,8 @@ static int child_init(int rank)
 
 static void destroy(void)
 {
+	if (acc_file_path)
+		acc_file_destroy();
 	if (log_extra_tags)
 		destroy_extras( log_extra_tags);
 	if (log_leg_tags)
@@ -95,6 +95,7 @@ static int mod_init(void)
 
 	LM_NOTICE("initializing module cachedb_couchbase ...\n");
 
+	memset(&cde, 0, sizeof(cachedb_engine));
 	cde.name = cache_mod_name;
 
 	cde.cdb_func.init = couchbase_init;
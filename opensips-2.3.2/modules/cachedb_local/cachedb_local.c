@@ -54,6 +54,7 @@ int local_exec_threshold = 0;
 
 lcache_col_t* lcache_collection = NULL;
 url_lst_t* url_list=NULL;
+static url_lst_t* limit_list=NULL;
 
 
 static int w_remove_chunk_1(struct sip_msg* msg, char* glob);
@@ -63,12 +64,15 @@ struct mi_root * mi_cache_remove_chunk(struct mi_root *cmd_tree,void *param);
 void localcache_clean(unsigned int ticks,void *param);
 static int parse_collections(unsigned int type, void *val);
 static int store_urls(unsigned int type, void *val);
+static int store_limits(unsigned int type, void *val);
+static int set_collection_limits(void);
 
 static param_export_t params[]={
 	{ "cache_clean_period", INT_PARAM, &cache_clean_period },
 	{ "exec_threshold",     INT_PARAM, &local_exec_threshold },
 	{ "cache_collections",  STR_PARAM|USE_FUNC_PARAM, (void *)parse_collections },
 	{ "cachedb_url",        STR_PARAM|USE_FUNC_PARAM, (void *)store_urls },
+	{ "collection_limit",   STR_PARAM|USE_FUNC_PARAM, (void *)store_limits },
 	{0,0,0}
 };
 
@@ -197,11 +201,11 @@ static int remove_chunk_f(struct sip_msg* msg, char* collection, char* glob)
 
 				if(me2) {
 					me2->next = me1->next;
-					shm_free(me1);
+					lcache_free_entry(col, me1);
 					me1 = me2->next;
 				} else{
 					cache_htable[i].entries = me1->next;
-					shm_free(me1);
+					lcache_free_entry(col, me1);
 					me1 = cache_htable[i].entries;
 				}
 			} else {
@@ -327,6 +331,7 @@ static int mod_init(void)
 	lcache_col_t *default_col, *col_it;
 
 	/* register the cache system */
+	memset(&cde, 0, sizeof(cachedb_engine));
 	cde.name = cache_mod_name;
 
 	cde.cdb_func.init = lcache_init;
@@ -337,6 +342,8 @@ static int mod_init(void)
 	cde.cdb_func.remove = lcache_htable_remove;
 	cde.cdb_func.add = lcache_htable_add;
 	cde.cdb_func.sub = lcache_htable_sub;
+	cde.cdb_func.borrow = lcache_htable_borrow;
+	cde.cdb_func.release = lcache_htable_release;
 
 	cde.cdb_func.capability = CACHEDB_CAP_BINARY_VALUE;
 
@@ -423,8 +430,17 @@ static int mod_init(void)
 			LM_WARN("collection <%.*s> is not assigned to any url!\n",
 					col_it->col_name.len, col_it->col_name.s);
 		}
+
+		if (lcache_col_init(col_it) < 0) {
+			LM_ERR("failed to initialize collection <%.*s>!\n",
+					col_it->col_name.len, col_it->col_name.s);
+			return -1;
+		}
 	}
 
+	if (set_collection_limits() < 0)
+		return -1;
+
 	/* register timer to delete the expired entries */
 	register_timer("localcache-expire",localcache_clean, 0,
 		cache_clean_period, TIMER_FLAG_DELAY_ON_DELAY);
@@ -449,56 +465,16 @@ static void destroy(void)
 
 	for ( it=lcache_collection; it; it=it->next) {
 		lcache_htable_destroy(&it->col_htable, it->size);
+		lcache_col_destroy(it);
 	}
 }
 
 void localcache_clean(unsigned int ticks,void *param)
 {
-	int i;
-	lcache_entry_t* me1, *me2;
 	lcache_col_t* it;
-	lcache_t* cache_htable;
-
-	for ( it=lcache_collection; it; it=it->next ) {
-		LM_DBG("start\n");
-		cache_htable = it->col_htable;
-
-		for(i = 0; i< it->size; i++)
-		{
-			lock_get(&cache_htable[i].lock);
-			me1 = cache_htable[i].entries;
-			me2 = NULL;
-
-			while(me1)
-			{
-				if((me1->expires > 0) && (me1->expires < get_ticks()))
-				{
-					LM_DBG("deleted entry attr= [%.*s]\n",
-							me1->attr.len, me1->attr.s);
-
-					if(me2)
-					{
-						me2->next = me1->next;
-						shm_free(me1);
-						me1 = me2->next;
-					}
-					else
-					{
-						cache_htable[i].entries = me1->next;
-						shm_free(me1);
-						me1 = cache_htable[i].entries;
-					}
-				}
-				else
-				{
-					me2 = me1;
-					me1 = me1->next;
-				}
-			}
 
-			lock_release(&cache_htable[i].lock);
-		}
-	}
+	for ( it=lcache_collection; it; it=it->next )
+		lcache_expire_wheel(it, ticks);
 }
 
 /* !!!WARNNG!!! unsafe function
@@ -660,3 +636,90 @@ static int store_urls(unsigned int type, void *val)
 	return 0;
 }
 
+
+/**
+ * store the collection limits until mod init, when all the
+ * collections (including the default one) are known
+ */
+static int store_limits(unsigned int type, void *val)
+{
+	url_lst_t* new_limit;
+
+	new_limit = pkg_malloc(sizeof(url_lst_t));
+	if ( !new_limit ) {
+		LM_ERR("no more pkg mem!\n");
+		return -1;
+	}
+
+	new_limit->url.s = (char *)val;
+	new_limit->url.len = strlen(new_limit->url.s);
+	new_limit->next = limit_list;
+	limit_list = new_limit;
+
+	return 0;
+}
+
+/* "collection=size", where size is in bytes or has a K/M/G suffix */
+static int set_collection_limits(void)
+{
+	url_lst_t *it, *foo;
+	lcache_col_t *col;
+	str name, size_s;
+	unsigned int size;
+	unsigned long mult;
+	char *p;
+
+	it = limit_list;
+	while ( it ) {
+		p = q_memchr(it->url.s, '=', it->url.len);
+		if ( !p ) {
+			LM_ERR("no '=' in collection limit <%.*s>!\n",
+					it->url.len, it->url.s);
+			return -1;
+		}
+
+		name.s = it->url.s;
+		name.len = p - name.s;
+		size_s.s = p + 1;
+		size_s.len = it->url.len - name.len - 1;
+		str_trim_spaces_lr(name);
+		str_trim_spaces_lr(size_s);
+
+		mult = 1;
+		if ( size_s.len > 0 ) {
+			switch ( size_s.s[size_s.len - 1] ) {
+				case 'k': case 'K': mult = 1024; break;
+				case 'm': case 'M': mult = 1024 * 1024; break;
+				case 'g': case 'G': mult = 1024 * 1024 * 1024; break;
+			}
+			if ( mult != 1 )
+				size_s.len--;
+		}
+
+		if ( str2int(&size_s, &size) < 0 ) {
+			LM_ERR("invalid size in collection limit <%.*s>!\n",
+					it->url.len, it->url.s);
+			return -1;
+		}
+
+		for ( col=lcache_collection; col; col=col->next )
+			if ( !str_strcmp(&col->col_name, &name) )
+				break;
+
+		if ( !col ) {
+			LM_ERR("collection <%.*s> not defined!\n", name.len, name.s);
+			return -1;
+		}
+
+		col->mem_limit = size * mult;
+		LM_DBG("collection <%.*s> limited to %lu bytes\n",
+				name.len, name.s, col->mem_limit);
+
+		foo = it;
+		it = it->next;
+		pkg_free(foo);
+	}
+	limit_list = NULL;
+
+	return 0;
+}
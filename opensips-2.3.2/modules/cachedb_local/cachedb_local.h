@@ -29,6 +29,7 @@
 
 #include "../../cachedb/cachedb.h"
 #include "../../cachedb/cachedb_cap.h"
+#include "../../statistics.h"
 #include "hash.h"
 
 #define HASH_SIZE_DEFAULT 9 /* power of two */
@@ -56,6 +57,22 @@ typedef struct lcache_col {
 	 * if not used we'll need to throw an error */
 	int is_used;
 
+	/* memory accounting and CLOCK eviction; no limit if mem_limit is 0 */
+	unsigned long mem_limit;
+	volatile long mem_used;
+	unsigned int clock_hand;
+	gen_lock_t *evict_lock;
+
+	/* expiry wheel - for each slot, a bitmap of the buckets holding
+	 * entries which expire in that slot */
+	unsigned long *wheel;
+	unsigned int wheel_words;
+	unsigned int wheel_tick;
+
+	stat_var *hits;
+	stat_var *misses;
+	stat_var *evictions;
+
 	struct lcache_col* next;
 } lcache_col_t;
 
@@ -30,12 +30,15 @@
 #include "../../dprint.h"
 #include "../../ut.h"
 #include "../../timer.h"
+#include "../../locking.h"
 #include "../../mem/mem.h"
 #include "../../mem/shm_mem.h"
 #include "cachedb_local.h"
 #include "hash.h"
 
-void lcache_htable_remove_safe(str attr, lcache_entry_t** it);
+#define WHEEL_BITS (8 * sizeof(unsigned long))
+
+void lcache_htable_remove_safe(lcache_col_t *col, str attr, lcache_entry_t** it);
 
 int lcache_htable_init(lcache_t** cache_htable_p, int size)
 {
@@ -78,6 +81,205 @@ error:
 	return -1;
 }
 
+int lcache_col_init(lcache_col_t *col)
+{
+#ifdef STATISTICS
+	static str hits_s = str_init("hits");
+	static str misses_s = str_init("misses");
+	static str evictions_s = str_init("evictions");
+	char *name, *col_name;
+#endif
+
+	col->wheel_words = (col->size + WHEEL_BITS - 1) / WHEEL_BITS;
+	col->wheel = shm_malloc(LCACHE_WHEEL_SIZE * col->wheel_words *
+		sizeof(unsigned long));
+	if (col->wheel == NULL) {
+		LM_ERR("no more shared memory\n");
+		return -1;
+	}
+	memset(col->wheel, 0,
+		LCACHE_WHEEL_SIZE * col->wheel_words * sizeof(unsigned long));
+	col->wheel_tick = get_ticks();
+
+	col->evict_lock = lock_alloc();
+	if (col->evict_lock == NULL || lock_init(col->evict_lock) == 0) {
+		LM_ERR("failed to init eviction lock\n");
+		return -1;
+	}
+
+#ifdef STATISTICS
+	col_name = pkg_malloc(col->col_name.len + 1);
+	if (col_name == NULL) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memcpy(col_name, col->col_name.s, col->col_name.len);
+	col_name[col->col_name.len] = 0;
+
+	if ((name = build_stat_name(&hits_s, col_name)) == 0 ||
+	register_stat("cachedb_local", name, &col->hits, STAT_SHM_NAME) != 0 ||
+	(name = build_stat_name(&misses_s, col_name)) == 0 ||
+	register_stat("cachedb_local", name, &col->misses, STAT_SHM_NAME) != 0 ||
+	(name = build_stat_name(&evictions_s, col_name)) == 0 ||
+	register_stat("cachedb_local", name, &col->evictions, STAT_SHM_NAME) != 0) {
+		LM_ERR("failed to add stat variables for collection <%s>\n", col_name);
+		pkg_free(col_name);
+		return -1;
+	}
+	pkg_free(col_name);
+#endif
+
+	return 0;
+}
+
+void lcache_col_destroy(lcache_col_t *col)
+{
+	if (col->evict_lock) {
+		lock_destroy(col->evict_lock);
+		lock_dealloc(col->evict_lock);
+		col->evict_lock = NULL;
+	}
+	if (col->wheel) {
+		shm_free(col->wheel);
+		col->wheel = NULL;
+	}
+}
+
+static inline void lcache_entry_unref(lcache_entry_t *e)
+{
+	if (__sync_sub_and_fetch(&e->refcnt, 1) == 0)
+		shm_free(e);
+}
+
+/* unlinked entries stop counting against the limit right away, even if
+ * still borrowed by someone */
+void lcache_free_entry(lcache_col_t *col, lcache_entry_t *e)
+{
+	__sync_fetch_and_sub(&col->mem_used, (long)lcache_entry_size(e));
+	lcache_entry_unref(e);
+}
+
+/* flags the bucket to be checked by the wheel once the entry expired;
+ * an entry is expired starting with the tick following its "expires" */
+static inline void lcache_wheel_mark(lcache_col_t *col, unsigned int bucket,
+														unsigned int expires)
+{
+	unsigned int slot = (expires + 1) % LCACHE_WHEEL_SIZE;
+
+	__sync_fetch_and_or(&col->wheel[slot * col->wheel_words +
+		bucket / WHEEL_BITS], 1UL << (bucket % WHEEL_BITS));
+}
+
+static void lcache_purge_bucket(lcache_col_t *col, unsigned int bucket,
+														unsigned int now)
+{
+	lcache_entry_t *it, *prev = NULL, *next;
+	lcache_t *b = &col->col_htable[bucket];
+
+	lock_get(&b->lock);
+	for (it = b->entries; it; it = next) {
+		next = it->next;
+		if (it->expires == 0) {
+			prev = it;
+			continue;
+		}
+
+		if (it->expires < now) {
+			LM_DBG("deleted entry attr= [%.*s]\n", it->attr.len, it->attr.s);
+			if (prev)
+				prev->next = next;
+			else
+				b->entries = next;
+			lcache_free_entry(col, it);
+		} else {
+			/* due in a later slot or in a later turn of the wheel */
+			lcache_wheel_mark(col, bucket, it->expires);
+			prev = it;
+		}
+	}
+	lock_release(&b->lock);
+}
+
+/* checks only the buckets flagged in the wheel slots elapsed since
+ * the last run, instead of sweeping the whole collection */
+void lcache_expire_wheel(lcache_col_t *col, unsigned int ticks)
+{
+	unsigned int t, n, w, bit;
+	unsigned long bits, *slot;
+
+	n = ticks - col->wheel_tick;
+	if (n > LCACHE_WHEEL_SIZE)
+		n = LCACHE_WHEEL_SIZE;
+
+	for (t = ticks - n + 1; n; t++, n--) {
+		slot = col->wheel + (t % LCACHE_WHEEL_SIZE) * col->wheel_words;
+		for (w = 0; w < col->wheel_words; w++) {
+			if (slot[w] == 0)
+				continue;
+			bits = __sync_fetch_and_and(&slot[w], 0UL);
+			for (bit = 0; bits; bit++, bits >>= 1)
+				if (bits & 1)
+					lcache_purge_bucket(col, w * WHEEL_BITS + bit, ticks);
+		}
+	}
+	col->wheel_tick = ticks;
+}
+
+/*
+ * CLOCK eviction: the hand walks the buckets of the collection; a
+ * referenced entry gets a second chance (its bit is cleared), while an
+ * unreferenced (or expired) one is dropped, until @needed bytes fit under
+ * the memory limit. Must be called without holding any bucket lock.
+ */
+static int lcache_evict(lcache_col_t *col, unsigned long needed)
+{
+	lcache_entry_t *it, *prev, *next;
+	unsigned int i, bucket, now;
+	lcache_t *b;
+	int evicted = 0, ret;
+
+#define over_limit() \
+	((unsigned long)col->mem_used + needed > col->mem_limit)
+
+	lock_get(col->evict_lock);
+	now = get_ticks();
+
+	/* two turns at most: the first one may only clear reference bits */
+	for (i = 0; i < 2 * (unsigned int)col->size && over_limit(); i++) {
+		bucket = col->clock_hand;
+		col->clock_hand = (bucket + 1) % col->size;
+
+		b = &col->col_htable[bucket];
+		lock_get(&b->lock);
+		for (prev = NULL, it = b->entries; it && over_limit(); it = next) {
+			next = it->next;
+			if (it->ref && !(it->expires != 0 && it->expires < now)) {
+				it->ref = 0;
+				prev = it;
+				continue;
+			}
+
+			if (prev)
+				prev->next = next;
+			else
+				b->entries = next;
+			if (it->expires == 0 || it->expires >= now)
+				evicted++;
+			lcache_free_entry(col, it);
+		}
+		lock_release(&b->lock);
+	}
+
+	ret = over_limit() ? -1 : 0;
+	lock_release(col->evict_lock);
+
+	if (evicted)
+		update_stat(col->evictions, evicted);
+
+#undef over_limit
+	return ret;
+}
+
 void lcache_htable_destroy(lcache_t** cache_htable_p, int size)
 {
 	int i;
@@ -123,6 +325,20 @@ int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
 
 	size= sizeof(lcache_entry_t) + attr->len + value->len;
 
+	if (cache_col->mem_limit) {
+		if (size > cache_col->mem_limit) {
+			LM_ERR("%d bytes do not fit in collection <%.*s>\n", size,
+				cache_col->col_name.len, cache_col->col_name.s);
+			return -1;
+		}
+		if ((unsigned long)cache_col->mem_used + size > cache_col->mem_limit &&
+		lcache_evict(cache_col, size) < 0) {
+			LM_ERR("collection <%.*s> is full\n",
+				cache_col->col_name.len, cache_col->col_name.s);
+			return -1;
+		}
+	}
+
 	me = (lcache_entry_t*)shm_malloc(size);
 	if(me == NULL)
 	{
@@ -140,20 +356,27 @@ int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
 	me->value.s = (char*)me + (sizeof(lcache_entry_t)) + attr->len;
 	memcpy(me->value.s, value->s, value->len);
 	me->value.len = value->len;
+	me->ref = 1;
+	me->refcnt = 1;
 	if( expires != 0)
 		me->expires = get_ticks() + expires;
 
+	__sync_fetch_and_add(&cache_col->mem_used, (long)size);
+
 	hash_code= core_hash( attr, 0, cache_col->size);
 	lock_get(&cache_htable[hash_code].lock);
 
 	it = cache_htable[hash_code].entries;
 
 	/* if a previous record for the same attr delete it */
-	lcache_htable_remove_safe( *attr, &it);
+	lcache_htable_remove_safe( cache_col, *attr, &it);
 
 	me->next = it;
 	cache_htable[hash_code].entries = me;
 
+	if (me->expires)
+		lcache_wheel_mark(cache_col, hash_code, me->expires);
+
 	lock_release(&cache_htable[hash_code].lock);
 
 	stop_expire_timer(start,local_exec_threshold,
@@ -161,7 +384,8 @@ int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
 	return 1;
 }
 
-void lcache_htable_remove_safe(str attr, lcache_entry_t** it_p)
+void lcache_htable_remove_safe(lcache_col_t *col, str attr,
+													lcache_entry_t** it_p)
 {
 	lcache_entry_t* me = NULL, *it= *it_p;
 
@@ -176,7 +400,7 @@ void lcache_htable_remove_safe(str attr, lcache_entry_t** it_p)
 			else
 				*it_p = it->next;
 
-			shm_free(it);
+			lcache_free_entry(col, it);
 
 			return;
 		}
@@ -209,7 +433,8 @@ int lcache_htable_remove(cachedb_con *con,str* attr)
 	hash_code= core_hash( attr, 0, cache_col->size);
 	lock_get(&cache_htable[hash_code].lock);
 
-	lcache_htable_remove_safe( *attr, &cache_htable[hash_code].entries);
+	lcache_htable_remove_safe( cache_col, *attr,
+		&cache_htable[hash_code].entries);
 
 	lock_release(&cache_htable[hash_code].lock);
 
@@ -222,10 +447,10 @@ int lcache_htable_remove(cachedb_con *con,str* attr)
 int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_val)
 {
 	int hash_code;
-	lcache_entry_t *it=NULL,*it_prev=NULL;
+	lcache_entry_t *it=NULL,*it_prev=NULL,*me;
 	int old_value;
 	char *new_value;
-	int new_len;
+	int new_len, old_size;
 	str ins_val;
 	struct timeval start;
 
@@ -257,7 +482,7 @@ int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_va
 				else
 					cache_htable[hash_code].entries = it->next;
 
-				shm_free(it);
+				lcache_free_entry(cache_col, it);
 				lock_release(&cache_htable[hash_code].lock);
 
 				ins_val.s = sint2str(val,&ins_val.len);
@@ -287,14 +512,32 @@ int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_va
 
 			old_value+=val;
 			expires = it->expires;
+			old_size = lcache_entry_size(it);
 			new_value = sint2str(old_value,&new_len);
-			it = shm_realloc(it,sizeof(lcache_entry_t) + attr->len +new_len);
-			if (it == NULL) {
-				LM_ERR("failed to realloc struct\n");
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local add",attr->s,attr->len,0);
-				return -1;
+			if (it->refcnt > 1) {
+				/* borrowed value - replace the entry instead of changing it */
+				me = shm_malloc(sizeof(lcache_entry_t) + attr->len + new_len);
+				if (me == NULL) {
+					LM_ERR("no more shared memory\n");
+					lock_release(&cache_htable[hash_code].lock);
+					stop_expire_timer(start,local_exec_threshold,
+					"cachedb_local add",attr->s,attr->len,0);
+					return -1;
+				}
+				*me = *it;
+				me->refcnt = 1;
+				memcpy(me + 1, it->attr.s, attr->len);
+				lcache_entry_unref(it);
+				it = me;
+			} else {
+				it = shm_realloc(it,sizeof(lcache_entry_t) + attr->len +new_len);
+				if (it == NULL) {
+					LM_ERR("failed to realloc struct\n");
+					lock_release(&cache_htable[hash_code].lock);
+					stop_expire_timer(start,local_exec_threshold,
+					"cachedb_local add",attr->s,attr->len,0);
+					return -1;
+				}
 			}
 
 			if (it_prev)
@@ -305,9 +548,12 @@ int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_va
 			it->attr.s = (char*)(it + 1);
 			it->value.s =(char *)(it + 1) + attr->len;
 			it->expires = expires;
+			it->ref = 1;
 
 			memcpy(it->value.s,new_value,new_len);
 			it->value.len = new_len;
+			__sync_fetch_and_add(&cache_col->mem_used,
+				(long)lcache_entry_size(it) - old_size);
 			lock_release(&cache_htable[hash_code].lock);
 			if (new_val)
 				*new_val = old_value;
@@ -349,11 +595,10 @@ int lcache_htable_sub(cachedb_con *con,str *attr,int val,int expires,int *new_va
  *		-2 - if not found
  *		-1 - if error
  * */
-int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
+int lcache_htable_borrow(cachedb_con *con,str* attr, str* res, void **ref)
 {
 	int hash_code;
 	lcache_entry_t* it = NULL, *it_aux = NULL;
-	char* value;
 	struct timeval start;
 
 	lcache_t* cache_htable;
@@ -389,26 +634,21 @@ int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
 				else
 					cache_htable[hash_code].entries = it->next;
 
-				shm_free(it);
+				lcache_free_entry(cache_col, it);
 
 				lock_release(&cache_htable[hash_code].lock);
+				update_stat(cache_col->misses, 1);
 				stop_expire_timer(start,local_exec_threshold,
 				"cachedb_local fetch",attr->s,attr->len,0);
 				return -2;
 			}
-			value = (char*)pkg_malloc(it->value.len);
-			if(value == NULL)
-			{
-				LM_ERR("no more memory\n");
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch",attr->s,attr->len,0);
-				return -1;
-			}
-			memcpy(value, it->value.s, it->value.len);
+			__sync_fetch_and_add(&it->refcnt, 1);
+			it->ref = 1;
 			res->len = it->value.len;
-			res->s = value;
+			res->s = it->value.s;
+			*ref = it;
 			lock_release(&cache_htable[hash_code].lock);
+			update_stat(cache_col->hits, 1);
 			stop_expire_timer(start,local_exec_threshold,
 			"cachedb_local fetch",attr->s,attr->len,0);
 			return 1;
@@ -419,11 +659,41 @@ int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
 	}
 
 	lock_release(&cache_htable[hash_code].lock);
+	update_stat(cache_col->misses, 1);
 	stop_expire_timer(start,local_exec_threshold,
 	"cachedb_local fetch",attr->s,attr->len,0);
 	return -2;
 }
 
+void lcache_htable_release(cachedb_con *con, void *ref)
+{
+	lcache_entry_unref((lcache_entry_t *)ref);
+}
+
+/* same as lcache_htable_borrow(), but returns a PKG copy of the value */
+int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
+{
+	str val;
+	void *ref;
+	int ret;
+
+	ret = lcache_htable_borrow(con, attr, &val, &ref);
+	if (ret < 0)
+		return ret;
+
+	res->s = (char*)pkg_malloc(val.len);
+	if (res->s == NULL) {
+		LM_ERR("no more memory\n");
+		lcache_htable_release(con, ref);
+		return -1;
+	}
+	memcpy(res->s, val.s, val.len);
+	res->len = val.len;
+	lcache_htable_release(con, ref);
+
+	return 1;
+}
+
 int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 {
 	int hash_code;
@@ -463,9 +733,10 @@ int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 				else
 					cache_htable[hash_code].entries = it->next;
 
-				shm_free(it);
+				lcache_free_entry(cache_col, it);
 
 				lock_release(&cache_htable[hash_code].lock);
+				update_stat(cache_col->misses, 1);
 				stop_expire_timer(start,local_exec_threshold,
 				"cachedb_local fetch_counter",attr->s,attr->len,0);
 				return -2;
@@ -479,7 +750,9 @@ int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 			}
 			if (val)
 				*val = ret;
+			it->ref = 1;
 			lock_release(&cache_htable[hash_code].lock);
+			update_stat(cache_col->hits, 1);
 			stop_expire_timer(start,local_exec_threshold,
 			"cachedb_local fetch_counter",attr->s,attr->len,0);
 			return 1;
@@ -490,6 +763,7 @@ int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 	}
 
 	lock_release(&cache_htable[hash_code].lock);
+	update_stat(cache_col->misses, 1);
 	stop_expire_timer(start,local_exec_threshold,
 	"cachedb_local fetch_counter",attr->s,attr->len,0);
 	return -2;
@@ -37,9 +37,20 @@ typedef struct lcache_entry
 	str attr;
 	str value;
 	unsigned int expires;
+	/* CLOCK reference bit - set on every access, cleared by the eviction */
+	unsigned int ref;
+	/* one reference is held by the hash table, one by each borrower; the
+	 * entry is never changed while borrowed and freed by the last unref */
+	volatile int refcnt;
 	struct lcache_entry* next;
 }lcache_entry_t;
 
+#define lcache_entry_size(_e) \
+	(sizeof(lcache_entry_t) + (_e)->attr.len + (_e)->value.len)
+
+/* number of slots in the expiry wheel of a collection */
+#define LCACHE_WHEEL_SIZE 64
+
 
 typedef struct lcache
 {
@@ -48,11 +59,19 @@ typedef struct lcache
 }lcache_t;
 
 
+struct lcache_col;
+
 int lcache_htable_init(lcache_t** cache_htable_p, int size);
+int lcache_col_init(struct lcache_col *col);
+void lcache_col_destroy(struct lcache_col *col);
+void lcache_free_entry(struct lcache_col *col, lcache_entry_t *e);
+void lcache_expire_wheel(struct lcache_col *col, unsigned int ticks);
 void lcache_htable_destroy();
 int lcache_htable_insert(cachedb_con *con,str* attr, str* value,int expires);
 int lcache_htable_remove(cachedb_con *con,str* attr);
 int lcache_htable_fetch(cachedb_con *con,str* attr, str* val);
+int lcache_htable_borrow(cachedb_con *con,str* attr, str* val, void **ref);
+void lcache_htable_release(cachedb_con *con, void *ref);
 int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int lcache_htable_sub(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val);
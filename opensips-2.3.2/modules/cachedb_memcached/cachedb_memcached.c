@@ -446,6 +446,7 @@ static int mod_init(void)
 
 	LM_NOTICE("initializing module cachedb_memcached\n");
 
+	memset(&cde, 0, sizeof(cachedb_engine));
 	cde.name = cache_mod_name;
 
 	cde.cdb_func.init = memcached_init;
@@ -36,9 +36,12 @@
 #include "../../dprint.h"
 #include "../../error.h"
 #include "../../pt.h"
+#include "../../mod_fix.h"
+#include "../../async.h"
 #include "../../cachedb/cachedb.h"
 
 #include "cachedb_redis_dbase.h"
+#include "cachedb_redis_utils.h"
 
 static int mod_init(void);
 static int child_init(int);
@@ -47,6 +50,27 @@ static void destroy(void);
 static str cache_mod_name = str_init("redis");
 struct cachedb_url *redis_script_urls = NULL;
 
+/* the script connections of this process, for the async functions */
+struct redis_script_con {
+	cachedb_con *con;
+	str grp;
+	struct redis_script_con *next;
+};
+static struct redis_script_con *redis_script_cons = NULL;
+
+struct redis_async_param {
+	redis_con *con;
+	cluster_node *node;
+	redis_async_con *ac;
+	pv_spec_t *dst;
+};
+
+static int fixup_redis_async(void **param, int param_no);
+static int w_async_redis_fetch(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *key, char *dst);
+static int w_async_redis_raw_query(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *query, char *dst);
+
 int set_connection(unsigned int type, void *val)
 {
 	return cachedb_store_url(&redis_script_urls,(char *)val);
@@ -56,9 +80,18 @@ static param_export_t params[]={
 	{ "connect_timeout",             INT_PARAM,                &redis_connnection_tout},
 	{ "query_timeout",               INT_PARAM,                &redis_query_tout      },
 	{ "cachedb_url",                 STR_PARAM|USE_FUNC_PARAM, (void *)&set_connection},
+	{ "max_async_connections",       INT_PARAM,                &redis_max_async_cons  },
 	{0,0,0}
 };
 
+static acmd_export_t acmds[] = {
+	{"redis_fetch",     (acmd_function)w_async_redis_fetch,     3,
+		fixup_redis_async },
+	{"redis_raw_query", (acmd_function)w_async_redis_raw_query, 3,
+		fixup_redis_async },
+	{0,0,0,0}
+};
+
 
 /** module exports */
 struct module_exports exports= {
@@ -68,7 +101,7 @@ struct module_exports exports= {
 	DEFAULT_DLFLAGS,			/* dlopen flags */
 	NULL,            /* OpenSIPS module dependencies */
 	0,						/* exported functions */
-	0,						/* exported async functions */
+	acmds,					/* exported async functions */
 	params,						/* exported parameters */
 	0,							/* exported statistics */
 	0,							/* exported MI functions */
@@ -102,6 +135,7 @@ static int mod_init(void)
 	cde.cdb_func.add = redis_add;
 	cde.cdb_func.sub = redis_sub;
 	cde.cdb_func.raw_query = redis_raw_query;
+	cde.cdb_func.pipeline = redis_pipeline;
 
 	cde.cdb_func.capability = 0;
 
@@ -117,6 +151,7 @@ static int child_init(int rank)
 {
 	struct cachedb_url *it;
 	cachedb_con *con;
+	struct redis_script_con *sc;
 
 	if(rank == PROC_MAIN || rank == PROC_TCP_MAIN) {
 		return 0;
@@ -133,6 +168,17 @@ static int child_init(int rank)
 			LM_ERR("failed to insert connection\n");
 			return -1;
 		}
+
+		sc = pkg_malloc(sizeof *sc);
+		if (sc == NULL) {
+			LM_ERR("no more pkg\n");
+			return -1;
+		}
+		sc->con = con;
+		sc->grp.s = ((cachedb_pool_con *)con->data)->id->group_name;
+		sc->grp.len = sc->grp.s ? strlen(sc->grp.s) : 0;
+		sc->next = redis_script_cons;
+		redis_script_cons = sc;
 	}
 
 	cachedb_free_url(redis_script_urls);
@@ -148,3 +194,278 @@ static void destroy(void)
 	cachedb_end_connections(&cache_mod_name);
 	return;
 }
+
+static int fixup_redis_async(void **param, int param_no)
+{
+	if (param_no < 3)
+		return fixup_spve(param);
+
+	if (fixup_pvar(param) < 0)
+		return -1;
+
+	if (((pv_spec_t *)*param)->setf == NULL) {
+		LM_ERR("output variable must be writable\n");
+		return E_SCRIPT;
+	}
+
+	return 0;
+}
+
+/* looks up a script connection by its "redis[:group]" identifier */
+static cachedb_con *get_script_con(str *id)
+{
+	struct redis_script_con *it;
+	str grp = {NULL, 0};
+
+	if (id->len < cache_mod_name.len ||
+			memcmp(id->s, cache_mod_name.s, cache_mod_name.len) != 0 ||
+			(id->len > cache_mod_name.len &&
+				id->s[cache_mod_name.len] != ':')) {
+		LM_ERR("bad redis connection id <%.*s>\n", id->len, id->s);
+		return NULL;
+	}
+
+	if (id->len > cache_mod_name.len) {
+		grp.s = id->s + cache_mod_name.len + 1;
+		grp.len = id->len - cache_mod_name.len - 1;
+	}
+
+	for (it = redis_script_cons; it; it = it->next)
+		if (it->grp.len == grp.len &&
+				(grp.len == 0 || memcmp(it->grp.s, grp.s, grp.len) == 0))
+			return it->con;
+
+	LM_ERR("no redis connection for <%.*s> - check cachedb_url\n",
+		id->len, id->s);
+	return NULL;
+}
+
+static int set_reply_value(struct sip_msg *msg, pv_spec_t *dst,
+		redisReply *reply)
+{
+	pv_value_t val;
+
+	memset(&val, 0, sizeof val);
+
+	switch (reply->type) {
+		case REDIS_REPLY_STRING:
+		case REDIS_REPLY_STATUS:
+			val.rs.s = reply->str;
+			val.rs.len = reply->len;
+			val.flags = PV_VAL_STR;
+			break;
+		case REDIS_REPLY_INTEGER:
+			val.ri = (int)reply->integer;
+			val.flags = PV_VAL_INT|PV_TYPE_INT;
+			break;
+		case REDIS_REPLY_NIL:
+			val.flags = PV_VAL_NULL;
+			break;
+		default:
+			LM_DBG("skipping reply of type %d\n", reply->type);
+			return 0;
+	}
+
+	if (pv_set_value(msg, dst, 0, &val) < 0) {
+		LM_ERR("cannot set the variable value\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* stores the reply into the output variable and frees it; the elements
+ * of an array are set starting with the last one, so that the first one
+ * ends up on top of an AVP stack */
+static int set_reply(struct sip_msg *msg, pv_spec_t *dst, redisReply *reply)
+{
+	int i, rc = 1;
+
+	switch (reply->type) {
+		case REDIS_REPLY_ERROR:
+			LM_ERR("Redis operation failure - %.*s\n", reply->len, reply->str);
+			rc = -1;
+			break;
+		case REDIS_REPLY_NIL:
+			LM_DBG("no such key\n");
+			rc = -2;
+			break;
+		case REDIS_REPLY_ARRAY:
+			for (i = reply->elements - 1; i >= 0; i--)
+				if (set_reply_value(msg, dst, reply->element[i]) < 0) {
+					rc = -1;
+					break;
+				}
+			break;
+		default:
+			if (set_reply_value(msg, dst, reply) < 0)
+				rc = -1;
+	}
+
+	freeReplyObject(reply);
+	return rc;
+}
+
+/* fallback, when no more async connections may be opened */
+static int redis_sync_op(struct sip_msg *msg, cachedb_con *con, str *query,
+		pv_spec_t *dst, int raw)
+{
+	redisReply *reply;
+	pv_value_t val;
+	int rc;
+
+	if (raw) {
+		if (redis_raw_query_send(con, &reply, NULL, 0, NULL, query) < 0) {
+			LM_ERR("Failed to send query to server \n");
+			return -1;
+		}
+		return set_reply(msg, dst, reply);
+	}
+
+	memset(&val, 0, sizeof val);
+	rc = redis_get(con, query, &val.rs);
+	if (rc < 0)
+		return rc == -2 ? -2 : -1;
+
+	val.flags = PV_VAL_STR;
+	rc = pv_set_value(msg, dst, 0, &val) < 0 ? -1 : 1;
+	pkg_free(val.rs.s);
+	return rc;
+}
+
+static int resume_async_redis(int fd, struct sip_msg *msg, void *_param)
+{
+	struct redis_async_param *param = (struct redis_async_param *)_param;
+	redisContext *ctx = param->ac->context;
+	redisReply *reply = NULL;
+	int rc = -1;
+
+	if (redisBufferRead(ctx) != REDIS_OK) {
+		LM_ERR("failed to read from redis - %s\n", ctx->errstr);
+		goto out;
+	}
+
+	if (redisReaderGetReply(ctx->reader, (void **)&reply) != REDIS_OK) {
+		LM_ERR("failed to parse redis reply - %s\n", ctx->reader->errstr);
+		ctx->err = REDIS_ERR_PROTOCOL;
+		goto out;
+	}
+
+	if (reply == NULL) {
+		/* more data to come */
+		async_status = ASYNC_CONTINUE;
+		return 1;
+	}
+
+	rc = set_reply(msg, param->dst, reply);
+
+out:
+	redis_release_async_con(param->node, param->ac);
+	pkg_free(param);
+	return rc;
+}
+
+static int redis_async_start(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *query, char *dst, int raw)
+{
+	struct redis_async_param *param;
+	cachedb_con *cdb_con;
+	redis_con *con;
+	cluster_node *node;
+	redis_async_con *ac;
+	str id_s, query_s, key;
+	char *q;
+	int rc, done;
+
+	if (fixup_get_svalue(msg, (gparam_p)id, &id_s) != 0 ||
+			fixup_get_svalue(msg, (gparam_p)query, &query_s) != 0) {
+		LM_ERR("failed to get the function parameters\n");
+		return -1;
+	}
+
+	cdb_con = get_script_con(&id_s);
+	if (cdb_con == NULL)
+		return -1;
+	con = (redis_con *)cdb_con->data;
+
+	if (raw) {
+		if (redis_raw_query_extract_key(&query_s, &key) < 0) {
+			LM_ERR("Failed to extract Redis raw query key \n");
+			return -1;
+		}
+	} else {
+		key = query_s;
+	}
+
+	node = get_redis_connection(con, &key);
+	if (node == NULL) {
+		LM_ERR("Bad cluster configuration\n");
+		return -1;
+	}
+
+	ctx->resume_param = NULL;
+	ctx->resume_f = NULL;
+	async_status = ASYNC_NO_IO;
+
+	ac = redis_get_async_con(con, node);
+	if (ac == NULL) {
+		LM_DBG("no async connection available, running in sync mode\n");
+		return redis_sync_op(msg, cdb_con, &query_s, (pv_spec_t *)dst, raw);
+	}
+
+	param = pkg_malloc(sizeof *param + query_s.len + 1);
+	if (param == NULL) {
+		LM_ERR("no more pkg\n");
+		redis_release_async_con(node, ac);
+		return -1;
+	}
+	param->con = con;
+	param->node = node;
+	param->ac = ac;
+	param->dst = (pv_spec_t *)dst;
+
+	if (raw) {
+		/* the raw query is also the format of the command */
+		q = (char *)(param + 1);
+		memcpy(q, query_s.s, query_s.len);
+		q[query_s.len] = '\0';
+		rc = redisAppendCommand(ac->context, q);
+	} else {
+		rc = redisAppendCommand(ac->context, "GET %b", query_s.s, query_s.len);
+	}
+	if (rc != REDIS_OK) {
+		LM_ERR("failed to build the redis command\n");
+		goto error;
+	}
+
+	/* writes are blocking - only waiting for the reply is async */
+	do {
+		if (redisBufferWrite(ac->context, &done) != REDIS_OK) {
+			LM_ERR("failed to send the redis command - %s\n",
+				ac->context->errstr);
+			goto error;
+		}
+	} while (!done);
+
+	ctx->resume_param = param;
+	ctx->resume_f = resume_async_redis;
+	async_status = ac->context->fd;
+	return 1;
+
+error:
+	redis_release_async_con(node, ac);
+	pkg_free(param);
+	return -1;
+}
+
+static int w_async_redis_fetch(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *key, char *dst)
+{
+	return redis_async_start(msg, ctx, id, key, dst, 0);
+}
+
+static int w_async_redis_raw_query(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *query, char *dst)
+{
+	return redis_async_start(msg, ctx, id, query, dst, 1);
+}
@@ -35,6 +35,7 @@
 
 int redis_query_tout = CACHEDB_REDIS_DEFAULT_TIMEOUT;
 int redis_connnection_tout = CACHEDB_REDIS_DEFAULT_TIMEOUT;
+int redis_max_async_cons = 10;
 
 redisContext *redis_get_ctx(char *ip, int port)
 {
@@ -68,41 +69,53 @@ redisContext *redis_get_ctx(char *ip, int port)
 	return ctx;
 }
 
-int redis_connect_node(redis_con *con,cluster_node *node)
+/* opens a new connection to the node, authenticated and with the
+ * database selected */
+static redisContext *redis_node_ctx(redis_con *con,cluster_node *node)
 {
+	redisContext *ctx;
 	redisReply *rpl;
 
-	node->context = redis_get_ctx(node->ip,node->port);
-	if (!node->context)
-		return -1;
+	ctx = redis_get_ctx(node->ip,node->port);
+	if (!ctx)
+		return NULL;
 
 	if (con->id->password) {
-		rpl = redisCommand(node->context,"AUTH %s",con->id->password);
+		rpl = redisCommand(ctx,"AUTH %s",con->id->password);
 		if (rpl == NULL || rpl->type == REDIS_REPLY_ERROR) {
 			LM_ERR("failed to auth to redis - %.*s\n",
 				rpl?rpl->len:7,rpl?rpl->str:"FAILURE");
 			freeReplyObject(rpl);
-			redisFree(node->context);
-			return -1;
+			redisFree(ctx);
+			return NULL;
 		}
 		LM_DBG("AUTH [password] -  %.*s\n",rpl->len,rpl->str);
 		freeReplyObject(rpl);
 	}
 
 	if ((con->type & REDIS_SINGLE_INSTANCE) && con->id->database) {
-		rpl = redisCommand(node->context,"SELECT %s",con->id->database);
+		rpl = redisCommand(ctx,"SELECT %s",con->id->database);
 		if (rpl == NULL || rpl->type == REDIS_REPLY_ERROR) {
 			LM_ERR("failed to select database %s - %.*s\n",con->id->database,
 				rpl?rpl->len:7,rpl?rpl->str:"FAILURE");
 			freeReplyObject(rpl);
-			redisFree(node->context);
-			return -1;
+			redisFree(ctx);
+			return NULL;
 		}
 
 		LM_DBG("SELECT [%s] - %.*s\n",con->id->database,rpl->len,rpl->str);
 		freeReplyObject(rpl);
 	}
 
+	return ctx;
+}
+
+int redis_connect_node(redis_con *con,cluster_node *node)
+{
+	node->context = redis_node_ctx(con,node);
+	if (!node->context)
+		return -1;
+
 	return 0;
 }
 
@@ -111,8 +124,10 @@ int redis_reconnect_node(redis_con *con,cluster_node *node)
 	LM_DBG("reconnecting node %s:%d \n",node->ip,node->port);
 
 	/* close the old connection */
-	if(node->context)
+	if(node->context) {
 		redisFree(node->context);
+		node->context = NULL;
+	}
 
 	return redis_connect_node(con,node);
 }
@@ -163,6 +178,8 @@ int redis_connect(redis_con *con)
 		con->nodes->start_slot = 0;
 		con->nodes->end_slot = 4096;
 		con->nodes->context = NULL;
+		con->nodes->async_pool = NULL;
+		con->nodes->async_no = 0;
 		con->nodes->next = NULL;
 		LM_DBG("single instance mode\n");
 	} else {
@@ -711,3 +728,247 @@ int redis_raw_query(cachedb_con *connection,str *attr,cdb_raw_entry ***rpl,int e
 
 	return 1;
 }
+
+/* queues the command(s) of a pipelined operation; returns the number of
+ * replies to be read for it */
+static int redis_append_op(redisContext *ctx,cdb_pipe_op *op)
+{
+	int rc;
+
+	switch (op->type) {
+		case CDB_PIPE_GET:
+		case CDB_PIPE_GET_COUNTER:
+			rc = redisAppendCommand(ctx,"GET %b",op->key.s,op->key.len);
+			break;
+		case CDB_PIPE_SET:
+			rc = redisAppendCommand(ctx,"SET %b %b",op->key.s,op->key.len,
+				op->val.s,op->val.len);
+			break;
+		case CDB_PIPE_REMOVE:
+			rc = redisAppendCommand(ctx,"DEL %b",op->key.s,op->key.len);
+			break;
+		case CDB_PIPE_ADD:
+			rc = redisAppendCommand(ctx,"INCRBY %b %d",op->key.s,op->key.len,
+				op->n);
+			break;
+		case CDB_PIPE_SUB:
+			rc = redisAppendCommand(ctx,"DECRBY %b %d",op->key.s,op->key.len,
+				op->n);
+			break;
+		default:
+			LM_ERR("unknown pipelined operation %d\n",op->type);
+			return 0;
+	}
+
+	if (rc != REDIS_OK)
+		return 0;
+
+	if (op->expires && op->type != CDB_PIPE_GET &&
+			op->type != CDB_PIPE_GET_COUNTER && op->type != CDB_PIPE_REMOVE) {
+		if (redisAppendCommand(ctx,"EXPIRE %b %d",op->key.s,op->key.len,
+				op->expires) != REDIS_OK)
+			return 1;
+		return 2;
+	}
+
+	return 1;
+}
+
+/* translates the reply of an operation into the return code of the
+ * respective single operation (see redis_get(), redis_remove(), etc.) */
+static int redis_op_result(cdb_pipe_op *op,redisReply *reply)
+{
+	str response;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		LM_ERR("Redis operation failure on %.*s - %.*s\n",
+			op->key.len,op->key.s,reply->len,reply->str);
+		return -1;
+	}
+
+	switch (op->type) {
+		case CDB_PIPE_GET:
+			op->val.s = NULL;
+			op->val.len = 0;
+			if (reply->type == REDIS_REPLY_NIL || reply->str == NULL
+					|| reply->len == 0) {
+				LM_DBG("no such key - %.*s\n",op->key.len,op->key.s);
+				return -2;
+			}
+			op->val.s = pkg_malloc(reply->len);
+			if (op->val.s == NULL) {
+				LM_ERR("no more pkg\n");
+				return -1;
+			}
+			memcpy(op->val.s,reply->str,reply->len);
+			op->val.len = reply->len;
+			return 0;
+		case CDB_PIPE_GET_COUNTER:
+			if (reply->type == REDIS_REPLY_NIL || reply->str == NULL
+					|| reply->len == 0) {
+				LM_DBG("no such key - %.*s\n",op->key.len,op->key.s);
+				return -2;
+			}
+			response.s = reply->str;
+			response.len = reply->len;
+			if (str2sint(&response,&op->n) != 0) {
+				LM_ERR("Not a counter \n");
+				return -3;
+			}
+			return 0;
+		case CDB_PIPE_REMOVE:
+			return reply->integer == 0 ? 1 : 0;
+		case CDB_PIPE_ADD:
+		case CDB_PIPE_SUB:
+			op->n = reply->integer;
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * All the commands are first queued on the connections of their nodes and
+ * sent at once; the replies are then read in the same order, as Redis
+ * answers the commands of a connection in the order it received them.
+ * Connections which break meanwhile are re-opened upon their next use.
+ */
+int redis_pipeline(cachedb_con *connection,cdb_pipe_op *ops,int no)
+{
+	redis_con *con;
+	cluster_node **nodes, *node;
+	redisReply *reply;
+	int *replies;
+	int i, j;
+
+	if (!connection || !ops || no <= 0) {
+		LM_ERR("null parameter\n");
+		return -1;
+	}
+
+	con = (redis_con *)connection->data;
+
+	nodes = pkg_malloc(no * (sizeof *nodes + sizeof *replies));
+	if (nodes == NULL) {
+		LM_ERR("no more pkg\n");
+		return -1;
+	}
+	replies = (int *)(nodes + no);
+
+	for (i = 0; i < no; i++) {
+		ops[i].rc = -1;
+		nodes[i] = NULL;
+		replies[i] = 0;
+
+		node = get_redis_connection(con,&ops[i].key);
+		if (node == NULL) {
+			LM_ERR("Bad cluster configuration\n");
+			ops[i].rc = -10;
+			continue;
+		}
+
+		if (node->context == NULL && redis_reconnect_node(con,node) < 0)
+			continue;
+
+		replies[i] = redis_append_op(node->context,&ops[i]);
+		if (replies[i] > 0)
+			nodes[i] = node;
+	}
+
+	for (i = 0; i < no; i++) {
+		if (nodes[i] == NULL)
+			continue;
+
+		for (j = 0; j < replies[i]; j++) {
+			reply = NULL;
+			if (redisGetReply(nodes[i]->context,(void **)&reply) != REDIS_OK
+					|| reply == NULL) {
+				LM_ERR("failed to read reply for %.*s - %s\n",
+					ops[i].key.len,ops[i].key.s,nodes[i]->context->errstr);
+				ops[i].rc = -1;
+				break;
+			}
+
+			/* the reply of the optional EXPIRE only confirms it */
+			if (j == 0)
+				ops[i].rc = redis_op_result(&ops[i],reply);
+			freeReplyObject(reply);
+		}
+	}
+
+	for (i = 0; i < no; i++)
+		if (nodes[i] && nodes[i]->context &&
+				nodes[i]->context->err != REDIS_OK) {
+			LM_DBG("dropping broken connection to %s:%d\n",
+				nodes[i]->ip,nodes[i]->port);
+			redisFree(nodes[i]->context);
+			nodes[i]->context = NULL;
+		}
+
+	pkg_free(nodes);
+	return 0;
+}
+
+/* takes an idle async connection of the node or opens a new one, if the
+ * limit allows it; returns NULL if the operation has to run blocking */
+redis_async_con *redis_get_async_con(redis_con *con,cluster_node *node)
+{
+	redis_async_con *ac;
+
+	if (node->async_pool) {
+		ac = node->async_pool;
+		node->async_pool = ac->next;
+		ac->next = NULL;
+		return ac;
+	}
+
+	if (node->async_no >= redis_max_async_cons)
+		return NULL;
+
+	ac = pkg_malloc(sizeof *ac);
+	if (ac == NULL) {
+		LM_ERR("no more pkg\n");
+		return NULL;
+	}
+
+	ac->context = redis_node_ctx(con,node);
+	if (ac->context == NULL) {
+		pkg_free(ac);
+		return NULL;
+	}
+	ac->next = NULL;
+	node->async_no++;
+
+	LM_DBG("opened async connection %d/%d to %s:%d\n",node->async_no,
+		redis_max_async_cons,node->ip,node->port);
+	return ac;
+}
+
+/* hands back an async connection; broken ones are closed */
+void redis_release_async_con(cluster_node *node,redis_async_con *ac)
+{
+	if (ac->context->err != REDIS_OK) {
+		LM_DBG("closing broken async connection to %s:%d\n",
+			node->ip,node->port);
+		redisFree(ac->context);
+		pkg_free(ac);
+		node->async_no--;
+		return;
+	}
+
+	ac->next = node->async_pool;
+	node->async_pool = ac;
+}
+
+void redis_free_async_pool(cluster_node *node)
+{
+	redis_async_con *ac;
+
+	while (node->async_pool) {
+		ac = node->async_pool;
+		node->async_pool = ac->next;
+		redisFree(ac->context);
+		pkg_free(ac);
+	}
+	node->async_no = 0;
+}
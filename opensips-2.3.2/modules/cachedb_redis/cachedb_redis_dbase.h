@@ -29,6 +29,12 @@
 #include <hiredis/hiredis.h>
 #include "../../cachedb/cachedb.h"
 
+/* extra connection, used for running one async operation at a time */
+typedef struct redis_async_con {
+	redisContext *context;
+	struct redis_async_con *next;
+} redis_async_con;
+
 typedef struct cluster_nodes {
 	char *ip;							/* ip of this cluster node */
 	short port;						/* port of this cluster node */
@@ -36,6 +42,8 @@ typedef struct cluster_nodes {
 	unsigned short end_slot;		/* last slot for this server */
 
 	redisContext *context;			/* actual connection to this node */
+	redis_async_con *async_pool;	/* idle connections for async ops */
+	int async_no;					/* connections opened for async ops */
 	struct cluster_nodes *next;
 } cluster_node;
 
@@ -44,6 +52,7 @@ typedef struct cluster_nodes {
 
 extern int redis_query_tout;
 extern int redis_connnection_tout;
+extern int redis_max_async_cons;
 
 #define REDIS_SINGLE_INSTANCE	(1<<0)
 #define REDIS_CLUSTER_INSTANCE	(1<<1)
@@ -66,6 +75,14 @@ int redis_add(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int redis_sub(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int redis_get_counter(cachedb_con *connection,str *attr,int *val);
 int redis_raw_query(cachedb_con *connection,str *attr,cdb_raw_entry ***reply,int expected_kv_no,int *reply_no);
+int redis_pipeline(cachedb_con *connection,cdb_pipe_op *ops,int no);
+
+int redis_raw_query_extract_key(str *attr,str *query_key);
+int redis_raw_query_send(cachedb_con *connection,redisReply **reply,
+		cdb_raw_entry ***rpl,int expected_kv_no,int *reply_no,str *attr, ...);
+redis_async_con *redis_get_async_con(redis_con *con,cluster_node *node);
+void redis_release_async_con(cluster_node *node,redis_async_con *ac);
+void redis_free_async_pool(cluster_node *node);
 
 #endif /* CACHEDBREDIS_DBASE_H */
 
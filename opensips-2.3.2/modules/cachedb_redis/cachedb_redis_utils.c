@@ -109,6 +109,7 @@ void destroy_cluster_nodes(redis_con *con)
 	new = con->nodes;
 	while (new) {
 		foo = new->next;
+		redis_free_async_pool(new);
 		redisFree(new->context);
 		pkg_free(new);
 		new = foo;
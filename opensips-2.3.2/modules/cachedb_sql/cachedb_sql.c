@@ -522,6 +522,7 @@ static int mod_init(void)
 	expires_column.len = strlen(expires_column.s);
 
 	/* register the cache system */
+	memset(&cde, 0, sizeof(cachedb_engine));
 	cde.name = cache_mod_name;
 
 	cde.cdb_func.init = dbcache_init;
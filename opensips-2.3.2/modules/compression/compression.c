@@ -77,6 +77,9 @@
 #define DEFLATE_ALGO	"deflate"
 #define BASE64_ALGO		"base64"
 
+#define DICT_PARAM		";dict="
+#define DICT_PARAM_LEN	(sizeof(DICT_PARAM) - 1)
+
 #define DELIM		": "
 #define ATTR_DELIM	", "
 #define DELIM_LEN	(sizeof(DELIM) - 1)
@@ -92,7 +95,6 @@
 #define DWORD(p) (*(p+0) + (*(p+1) << 8) + (*(p+2) << 16) + (*(p+3) << 24))
 
 #define LOWER_CASE(p) (*(p) & 0x20)
-#define BUFLEN 4096
 
 #define COMPACT_FORMS	"cfiklmstvx"
 
@@ -129,7 +131,8 @@ static int mc_compress_fixup(void**, int);
 static int mc_compress(struct sip_msg*, char*, char*, char*);
 int mc_compress_cb(char** buf, void* param, int type, int* olen);
 static inline int mc_ndigits(int x);
-static inline void parse_algo_hdr(struct hdr_field* algo_hdr, int* algo, int* b64_required);
+static inline void parse_algo_hdr(struct hdr_field* algo_hdr, int* algo,
+		int* b64_required, int* dict);
 
 static int mc_decompress(struct sip_msg*);
 void wrap_tm_func(struct cell* t, int type, struct tmcb_params* p);
@@ -138,8 +141,6 @@ int wrap_msg_func(str*, struct sip_msg*, int type);
 
 
 
-static char body_buf[BUFLEN];
-static char hdr_buf[BUFLEN/2];
 struct cell* global_tran=NULL;
 
 static str body_in  = {NULL, 0},
@@ -380,6 +381,8 @@ static int mod_init(void)
 		mc_level = 6;
 	}
 
+	mc_dict_init();
+
 	compress_ctx_pos = context_register_ptr(CONTEXT_GLOBAL, NULL);
 	LM_DBG("received compress context position %d\n", compress_ctx_pos);
 
@@ -406,7 +409,7 @@ static int child_init(int rank)
  */
 static void mod_destroy(void)
 {
-	return;
+	mc_zstreams_destroy();
 }
 
 /*
@@ -1087,6 +1090,11 @@ flags:
 		return -1;
 	}
 
+	if ((flags&DICT_COMP_FLG) && algo != 0) {
+		LM_WARN("preset dictionary available only for deflate, ignoring\n");
+		flags &= ~DICT_COMP_FLG;
+	}
+
 	/* Simulate an whitelist which will contain only the Content-Length
 		header in case BODY_COMP_FLG is set */
 	if (!(flags&HDR_COMP_FLG)) {
@@ -1323,47 +1331,39 @@ only_body:
 	case 0: /* deflate */
 
 		if (buf2compress.s) {
-			bufcompressed.len = compressBound((unsigned long)buf2compress.len);
-			if (wrap_realloc(&body_out, bufcompressed.len))
-				goto free_mem_full;
-
-			bufcompressed.s = body_out.s;
-			temp = (unsigned long)bufcompressed.len;
-
-			rc = compress2((unsigned char*)bufcompressed.s,
-					&temp,
+			rc = zlib_compress(
 					(unsigned char*)buf2compress.s,
 					(unsigned long)buf2compress.len,
-					mc_level);
-
-			bufcompressed.len = (int)temp;
+					&body_out,
+					&temp,
+					mc_level,
+					flags&DICT_COMP_FLG);
 
 			if (check_zlib_rc(rc)) {
 				LM_ERR("Body compression failed\n");
 				goto free_mem_full;
 			}
+
+			bufcompressed.s = body_out.s;
+			bufcompressed.len = (int)temp;
 		}
 
 		if ((flags&HDR_COMP_FLG) && hdr_buf2compress.s) {
-			hdr_bufcompressed.len = compressBound((unsigned long)hdr_buf2compress.len);
-			if (wrap_realloc(&hdr_out, hdr_bufcompressed.len))
-				goto free_mem_full;
-
-			hdr_bufcompressed.s = hdr_out.s;
-			temp = (unsigned long)hdr_bufcompressed.len;
-
-			rc = compress2((unsigned char*)hdr_bufcompressed.s,
-					&temp,
+			rc = zlib_compress(
 					(unsigned char*)hdr_buf2compress.s,
 					(unsigned long)hdr_buf2compress.len,
-					mc_level);
-
-			hdr_bufcompressed.len = temp;
+					&hdr_out,
+					&temp,
+					mc_level,
+					flags&DICT_COMP_FLG);
 
 			if (check_zlib_rc(rc)) {
 				LM_ERR("Header compression failed\n");
 				goto free_mem_full;
 			}
+
+			hdr_bufcompressed.s = hdr_out.s;
+			hdr_bufcompressed.len = temp;
 		}
 
 		break;
@@ -1478,6 +1478,8 @@ only_body:
 				alloc_size += DEFLATE_CE_LEN;
 			if (hdr_bufencoded.s)
 				alloc_size += sizeof(DEFLATE_ALGO) - 1;
+			if (flags & DICT_COMP_FLG)
+				alloc_size += 2 * (DICT_PARAM_LEN + mc_dict_name.len);
 			break;
 		case 1: /* gzip */
 			if (bufencoded.s)
@@ -1545,6 +1547,12 @@ only_body:
 			}
 			wrap_copy_and_update(&buf2send.s, hdr_value.s,
 						hdr_value.len, &buf2send.len);
+			if (flags & DICT_COMP_FLG) {
+				wrap_copy_and_update(&buf2send.s, DICT_PARAM,
+						DICT_PARAM_LEN, &buf2send.len);
+				wrap_copy_and_update(&buf2send.s, mc_dict_name.s,
+						mc_dict_name.len, &buf2send.len);
+			}
 			wrap_copy_and_update(&buf2send.s, CRLF,
 							CRLF_LEN, &buf2send.len);
 
@@ -1562,6 +1570,12 @@ only_body:
 			}
 			wrap_copy_and_update(&buf2send.s, DEFLATE_ALGO,
 							sizeof(DEFLATE_ALGO)-1, &buf2send.len);
+			if (flags & DICT_COMP_FLG) {
+				wrap_copy_and_update(&buf2send.s, DICT_PARAM,
+						DICT_PARAM_LEN, &buf2send.len);
+				wrap_copy_and_update(&buf2send.s, mc_dict_name.s,
+						mc_dict_name.len, &buf2send.len);
+			}
 			wrap_copy_and_update(&buf2send.s, CRLF,
 							CRLF_LEN, &buf2send.len);
 		}
@@ -1570,14 +1584,14 @@ only_body:
 		if (hdr_bufencoded.s) {
 			str hdr_name = str_init(HDRS_ENCODING),
 				hdr_value = str_init(GZIP_ALGO);
+			wrap_copy_and_update(&buf2send.s, hdr_name.s,
+						hdr_name.len, &buf2send.len);
 			if (flags & B64_ENCODED_FLG) {
 				wrap_copy_and_update(&buf2send.s, BASE64_ALGO,
 						sizeof(BASE64_ALGO)-1, &buf2send.len);
 				wrap_copy_and_update(&buf2send.s, ATTR_DELIM,
 						ATTR_DELIM_LEN, &buf2send.len);
 			}
-			wrap_copy_and_update(&buf2send.s, hdr_name.s,
-						hdr_name.len, &buf2send.len);
 			wrap_copy_and_update(&buf2send.s, hdr_value.s,
 						hdr_value.len, &buf2send.len);
 			wrap_copy_and_update(&buf2send.s, CRLF,
@@ -1745,6 +1759,7 @@ static int mc_decompress(struct sip_msg* msg)
 	int algo=-1;
 	int hdrs_algo=-1;
 	int b64_required=-1;
+	int dict=0;
 
 	str msg_body;
 	str msg_final;
@@ -1822,7 +1837,7 @@ static int mc_decompress(struct sip_msg* msg)
 
 	if (hdr_vec[3]) {
 		hdr_vec[0] = msg->content_length;
-		parse_algo_hdr(hdr_vec[3], &algo, &b64_required);
+		parse_algo_hdr(hdr_vec[3], &algo, &b64_required, &dict);
 	}
 
 
@@ -1855,7 +1870,14 @@ static int mc_decompress(struct sip_msg* msg)
 
 	b64_required=0;
 	if (hdr_vec[2]) {
-		parse_algo_hdr(hdr_vec[3], &algo, &b64_required);
+		parse_algo_hdr(hdr_vec[2], &hdrs_algo, &b64_required, &dict);
+	}
+
+	/* the dictionary itself is identified by the zlib stream; the
+	 * param only tells us the sender used one we may not have */
+	if (dict < 0) {
+		LM_ERR("unsupported compression dictionary\n");
+		return -1;
 	}
 
 	if (b64_required > 0 &&  hdr_vec[1]) {
@@ -1876,20 +1898,19 @@ static int mc_decompress(struct sip_msg* msg)
 
 	switch (hdrs_algo) {
 		case 0: /* deflate */
-			temp = (unsigned long)BUFLEN;
-
-			rc = uncompress((unsigned char*)hdr_buf,
-					&temp,
+			rc = zlib_uncompress(
 					(unsigned char*)hdr_b64_decode.s,
-					(unsigned long)hdr_b64_decode.len);
-
-			uncomp_hdrs.s = hdr_buf;
-			uncomp_hdrs.len = temp;
+					(unsigned long)hdr_b64_decode.len,
+					&hdr_out,
+					&temp);
 
 			if (check_zlib_rc(rc)) {
 				LM_ERR("header decompression failed\n");
 				return -1;
 			}
+
+			uncomp_hdrs.s = hdr_out.s;
+			uncomp_hdrs.len = temp;
 			break;
 		case 1: /* gzip */
 			rc = gzip_uncompress(
@@ -1915,19 +1936,18 @@ static int mc_decompress(struct sip_msg* msg)
 
 	switch (algo) {
 		case 0: /* deflate */
-			temp = (unsigned long)BUFLEN;
-
-			rc = uncompress((unsigned char*)body_buf,
-					&temp,
+			rc = zlib_uncompress(
 					(unsigned char*)b64_decode.s,
-					(unsigned long)b64_decode.len);
+					(unsigned long)b64_decode.len,
+					&body_out,
+					&temp);
 
 			if (check_zlib_rc(rc)) {
 				LM_ERR("body decompression failed\n");
 				return -1;
 			}
 
-			uncomp_body.s = body_buf;
+			uncomp_body.s = body_out.s;
 			uncomp_body.len = temp;
 
 			break;
@@ -2092,7 +2112,44 @@ static int mc_decompress(struct sip_msg* msg)
 }
 
 
-static inline void parse_algo_hdr(struct hdr_field* algo_hdr, int* algo, int* b64_required)
+/*
+ * Parses the ";dict=name" param of an algo token; sets dict to 1 if it
+ * names our preset dictionary, to -1 if it names an unknown one
+ */
+static inline void parse_dict_param(str* tok, int* dict)
+{
+	char *p;
+	str name;
+
+	p = q_memchr(tok->s, DICT_PARAM[0], tok->len);
+	if (p == NULL)
+		return;
+
+	name.s = p + 1;
+	name.len = tok->s + tok->len - name.s;
+	tok->len = p - tok->s;
+	trim_spaces_lr(*tok);
+
+	trim_spaces_lr(name);
+	if (name.len < DICT_PARAM_LEN - 1 ||
+			strncasecmp(name.s, DICT_PARAM + 1, DICT_PARAM_LEN - 1)) {
+		LM_DBG("unknown param <%.*s>\n", name.len, name.s);
+		return;
+	}
+	name.s += DICT_PARAM_LEN - 1;
+	name.len -= DICT_PARAM_LEN - 1;
+
+	if (name.len == mc_dict_name.len &&
+			!strncasecmp(name.s, mc_dict_name.s, name.len)) {
+		*dict = 1;
+	} else {
+		LM_ERR("unknown dictionary <%.*s>\n", name.len, name.s);
+		*dict = -1;
+	}
+}
+
+static inline void parse_algo_hdr(struct hdr_field* algo_hdr, int* algo,
+		int* b64_required, int* dict)
 {
 	int rc;
 	char* delim=NULL;
@@ -2108,15 +2165,17 @@ static inline void parse_algo_hdr(struct hdr_field* algo_hdr, int* algo, int* b6
 
 		if (delim==NULL) {
 			trim_spaces_lr(s_tok);
+			parse_dict_param(&s_tok, dict);
 			rc = get_algo(&s_tok);
 		} else {
 			tok.s = s_tok.s;
 			tok.len = delim - s_tok.s;
 
 			s_tok.s = delim+1;
-			s_tok.len = (delim-tok.s+1);
+			s_tok.len -= (delim-tok.s+1);
 
 			trim_spaces_lr(tok);
+			parse_dict_param(&tok, dict);
 			rc = get_algo(&tok);
 		}
 
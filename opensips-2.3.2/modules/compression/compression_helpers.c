@@ -314,6 +314,10 @@ int fixup_compression_flags(void** param)
 				gp->type = GPARAM_TYPE_INT;
 				gp->v.ival |= SEPARATE_COMP_FLG;
 				break;
+			case 'd' :
+				gp->type = GPARAM_TYPE_INT;
+				gp->v.ival |= DICT_COMP_FLG;
+				break;
 			case PV_MARKER:
 				gp->type = GPARAM_TYPE_PVS;
 				if (fixup_pvar(param)) {
@@ -31,6 +31,7 @@ extern unsigned char* mnd_hdrs_mask;
 #define BODY_COMP_FLG		1 << 1
 #define HDR_COMP_FLG		1 << 2
 #define SEPARATE_COMP_FLG	1 << 3
+#define DICT_COMP_FLG		1 << 4
 
 unsigned char get_compact_form(struct hdr_field*);
 int search_hdr(mc_whitelist_p*, str*);
@@ -26,164 +26,253 @@
 #include "zlib.h"
 
 #include "compression_helpers.h"
+#include "gz_helpers.h"
+#include "sip_dict.h"
 #include "../../ut.h"
 
 /*
+ * The zlib streams are kept per process and reset, instead of being
+ * initialized and destroyed, for each message - the init of a deflate
+ * stream (allocating and clearing ~256K of window and hash tables)
+ * costs far more than compressing a SIP message.
  *
+ * 0 - zlib format (deflate algo), 1 - gzip format
  */
-int gzip_compress(unsigned char* in, unsigned long ilen, str* out, unsigned long* olen, int level)
+#define MC_FMT_ZLIB		0
+#define MC_FMT_GZIP		1
+#define MC_FMT_NO		2
+
+/* base two log of the history buffer; 16 is added for the gzip wrapper */
+static const int mc_wbits[MC_FMT_NO] = {15, 15+16};
+
+/* upper limit for a decompressed message */
+#define MC_MAX_INFLATE	(1<<20)
+
+static z_stream mc_zdef[MC_FMT_NO];
+static int mc_zdef_level[MC_FMT_NO];	/* 0 - not initialized yet */
+static z_stream mc_zinf[MC_FMT_NO];
+static int mc_zinf_init[MC_FMT_NO];
+
+static uLong mc_dict_id;
+
+const str mc_dict_name = str_init(MC_SIP_DICT_NAME);
+
+
+void mc_dict_init(void)
 {
-	z_stream zlibStream;
-	int rc, neededSize;
+	mc_dict_id = adler32(0L, Z_NULL, 0);
+	mc_dict_id = adler32(mc_dict_id, (const Bytef*)mc_sip_dict,
+			MC_SIP_DICT_LEN);
+}
+
+/*
+ *
+ */
+static int mc_deflate(int fmt, unsigned char* in, unsigned long ilen,
+		str* out, unsigned long* olen, int level, int dict)
+{
+	z_stream *zs = &mc_zdef[fmt];
+	int rc;
 
 	if (!in || ilen == 0) {
 		LM_ERR("nothing to compress\n");
 		return -1;
 	}
 
-	zlibStream.zalloc = Z_NULL; //deflateInit2 will set all the funcions
-	zlibStream.zfree = Z_NULL;  //set now with Z_NULL
-	zlibStream.opaque = Z_NULL;
-	zlibStream.total_out = 0;   //Total number of out bytes produced so far
-	zlibStream.next_in = in;
-	zlibStream.avail_in = ilen;
-
-	/*
-		Deflate init parameters:
-			zlibStream - input data
-			level - compression level(1-9)
-			Z_DEFLATED - compression method(only Z_DEFLATED)
-			(15+16) - base two log for the history buffer.
-				For simple deflate should be between
-				8-15.16 is added for gzip compression
-			level - memory allocated for internal compression
-				state. 8 is default, 1 means less mem
-				9 maximum mem for better performance
-			Z_DEFAULT_STRATEGY - tune the algorithm.Also
-					Z_FILTERED(data prduced by a filter),
-					Z_HUFFMAN_ONLY force huffman encoding
-					only
- 	*/
-
-	rc = deflateInit2(&zlibStream, level, Z_DEFLATED,
-				(15+16), level, Z_DEFAULT_STRATEGY);
-
-	if (rc != Z_OK) {
-		return rc;
-	}
+	if (mc_zdef_level[fmt] == 0) {
+		memset(zs, 0, sizeof *zs);
+		/*
+			Deflate init parameters:
+				zs - the stream
+				level - compression level(1-9)
+				Z_DEFLATED - compression method(only Z_DEFLATED)
+				wbits - base two log for the history buffer
+				8 - memory allocated for internal compression state
+				Z_DEFAULT_STRATEGY - tune the algorithm
+		*/
+		rc = deflateInit2(zs, level, Z_DEFLATED, mc_wbits[fmt], 8,
+				Z_DEFAULT_STRATEGY);
+		if (rc != Z_OK)
+			return rc;
+		mc_zdef_level[fmt] = level;
+	} else {
+		rc = deflateReset(zs);
+		if (rc != Z_OK)
+			return rc;
 
-	/* zlib doc states that dest buffer size must be 10% +12 larger than
-		the input buffer */
-	neededSize = (int)((float)ilen * 1.1 + 12);
-
-	if (!out->s) {
-		out->s = pkg_malloc(neededSize);
-		out->len = neededSize;
-		if (!out)
-			goto memerr;
-	} else if (ilen > out->len) {
-		out->s = pkg_realloc(out->s, neededSize);
-		out->len = neededSize;
-		if (!out->s)
-			goto memerr;
+		if (level != mc_zdef_level[fmt]) {
+			rc = deflateParams(zs, level, Z_DEFAULT_STRATEGY);
+			if (rc != Z_OK)
+				return rc;
+			mc_zdef_level[fmt] = level;
+		}
 	}
 
-	do {
-		zlibStream.next_out = (unsigned char*)(out->s + zlibStream.total_out);
-		zlibStream.avail_out = neededSize - zlibStream.total_out;
-
-		rc = deflate(&zlibStream, Z_FINISH);
-	} while (rc == Z_OK);
+	if (dict) {
+		/* zlib has no dictionary support for the gzip wrapper */
+		if (fmt != MC_FMT_ZLIB) {
+			LM_ERR("preset dictionary not supported with gzip\n");
+			return Z_STREAM_ERROR;
+		}
 
-	if (rc != Z_STREAM_END) {
-		deflateEnd(&zlibStream);
-		return rc;
+		rc = deflateSetDictionary(zs, (const Bytef*)mc_sip_dict,
+				MC_SIP_DICT_LEN);
+		if (rc != Z_OK)
+			return rc;
 	}
 
-	*olen = zlibStream.total_out;
-	deflateEnd(&zlibStream);
+	if (wrap_realloc(out, deflateBound(zs, ilen)))
+		return -1;
+
+	zs->next_in = in;
+	zs->avail_in = ilen;
+	zs->next_out = (unsigned char*)out->s;
+	zs->avail_out = out->len;
 
+	rc = deflate(zs, Z_FINISH);
+	if (rc != Z_STREAM_END)
+		return rc == Z_OK ? Z_BUF_ERROR : rc;
+
+	*olen = zs->total_out;
 	return Z_OK;
-memerr:
-	LM_ERR("no more pkg mem\n");
-	return -1;
 }
 
 /*
  *
  */
-int gzip_uncompress(unsigned char* in, unsigned long ilen, str* out, unsigned long* olen)
+static int mc_inflate(int fmt, unsigned char* in, unsigned long ilen,
+		str* out, unsigned long* olen)
 {
-	z_stream zlibStream;
-	int rc, neededSize;
+	z_stream *zs = &mc_zinf[fmt];
+	unsigned long size;
+	char *p;
+	int rc;
 
 	if (!in || !ilen) {
-		LM_ERR("nothing to compress\n");
+		LM_ERR("nothing to decompress\n");
 		return -1;
 	}
 
+	if (!mc_zinf_init[fmt]) {
+		memset(zs, 0, sizeof *zs);
+		rc = inflateInit2(zs, mc_wbits[fmt]);
+		if (rc != Z_OK)
+			return rc;
+		mc_zinf_init[fmt] = 1;
+	} else {
+		rc = inflateReset(zs);
+		if (rc != Z_OK)
+			return rc;
+	}
+
 	/* Gzip holds the length of the original message
-		in the last 4 bytes */
-	*olen = (in[ilen-1] << 24) + (in[ilen-2] << 16) +
+		in the last 4 bytes; for deflate we can only guess */
+	if (fmt == MC_FMT_GZIP && ilen >= 4)
+		size = ((unsigned long)in[ilen-1] << 24) + (in[ilen-2] << 16) +
 				(in[ilen-3] << 8) + in[ilen-4];
-	neededSize = *olen+1; /*'\0'*/
-
-	zlibStream.zalloc = Z_NULL;
-	zlibStream.zfree = Z_NULL;
-	zlibStream.opaque = Z_NULL;
-	zlibStream.avail_in = 0;
-	zlibStream.next_in = Z_NULL;
-	zlibStream.total_out = 0;
-
-	/* zlib doc says that window for inflateInit
-		must be at least equal with the window
-		used for compression */
-	rc = inflateInit2(&zlibStream, (15+16));
-
-	if (rc != Z_OK)
-		return rc;
-
-	if (!out->s) {
-		out->s = pkg_malloc(neededSize);
-		out->len = neededSize;
-		if (!out->s)
-			goto memerr;
-	} else if (*olen > out->len) {
-		out->s = pkg_realloc(out->s, neededSize);
-		out->len = neededSize;
-		if (!out->s)
-			goto memerr;
-	}
+	else
+		size = ilen * 4;
+	if (size > MC_MAX_INFLATE)
+		size = MC_MAX_INFLATE;
+	size++; /*'\0'*/
 
-	zlibStream.avail_in = ilen;
-	zlibStream.next_in = in;
+	if (wrap_realloc(out, size))
+		return -1;
 
-	do {
-		zlibStream.avail_out = neededSize - zlibStream.total_out;
-		zlibStream.next_out = (unsigned char*)out->s +
-							zlibStream.total_out;
+	zs->next_in = in;
+	zs->avail_in = ilen;
+	zs->next_out = (unsigned char*)out->s;
+	zs->avail_out = out->len;
 
-		rc = inflate(&zlibStream, Z_NO_FLUSH);
+	while ((rc = inflate(zs, Z_NO_FLUSH)) != Z_STREAM_END) {
 		switch (rc) {
-			case Z_NEED_DICT:
-				rc = Z_DATA_ERROR;
-		case Z_DATA_ERROR:
-		case Z_MEM_ERROR:
+		case Z_NEED_DICT:
+			if (zs->adler != mc_dict_id) {
+				LM_ERR("message compressed with an unknown dictionary\n");
+				return Z_DATA_ERROR;
+			}
+			rc = inflateSetDictionary(zs, (const Bytef*)mc_sip_dict,
+					MC_SIP_DICT_LEN);
+			if (rc != Z_OK)
+				return rc;
+			break;
+		case Z_OK:
 		case Z_BUF_ERROR:
-			inflateEnd(&zlibStream);
+			if (zs->avail_out != 0)
+				/* no progress possible - truncated input */
+				return Z_DATA_ERROR;
+
+			if (out->len >= MC_MAX_INFLATE) {
+				LM_ERR("decompressed message too big\n");
+				return Z_BUF_ERROR;
+			}
+
+			/* wrap_realloc() does not preserve the content */
+			p = pkg_realloc(out->s, 2 * out->len);
+			if (!p) {
+				LM_ERR("no more pkg mem\n");
+				return -1;
+			}
+			out->s = p;
+			out->len *= 2;
+			zs->next_out = (unsigned char*)out->s + zs->total_out;
+			zs->avail_out = out->len - zs->total_out;
+			break;
+		default:
 			return rc;
 		}
-	} while (rc != Z_STREAM_END);
-
-	if (rc != Z_STREAM_END) {
-		deflateEnd(&zlibStream);
-		return rc;
 	}
 
-	deflateEnd(&zlibStream);
+	*olen = zs->total_out;
 	return Z_OK;
-memerr:
-	inflateEnd(&zlibStream);
-	LM_ERR("no more pkg mem\n");
-	return -1;
+}
+
+/*
+ *
+ */
+int gzip_compress(unsigned char* in, unsigned long ilen, str* out, unsigned long* olen, int level)
+{
+	return mc_deflate(MC_FMT_GZIP, in, ilen, out, olen, level, 0);
+}
+
+/*
+ *
+ */
+int gzip_uncompress(unsigned char* in, unsigned long ilen, str* out, unsigned long* olen)
+{
+	return mc_inflate(MC_FMT_GZIP, in, ilen, out, olen);
+}
+
+/*
+ * zlib format, optionally using the preset SIP dictionary
+ */
+int zlib_compress(unsigned char* in, unsigned long ilen, str* out,
+		unsigned long* olen, int level, int dict)
+{
+	return mc_deflate(MC_FMT_ZLIB, in, ilen, out, olen, level, dict);
+}
+
+/*
+ * the dictionary, if any, is detected from the zlib header
+ */
+int zlib_uncompress(unsigned char* in, unsigned long ilen, str* out,
+		unsigned long* olen)
+{
+	return mc_inflate(MC_FMT_ZLIB, in, ilen, out, olen);
+}
+
+void mc_zstreams_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < MC_FMT_NO; i++) {
+		if (mc_zdef_level[i]) {
+			deflateEnd(&mc_zdef[i]);
+			mc_zdef_level[i] = 0;
+		}
+		if (mc_zinf_init[i]) {
+			inflateEnd(&mc_zinf[i]);
+			mc_zinf_init[i] = 0;
+		}
+	}
 }
@@ -27,4 +27,14 @@
 
 int gzip_compress(unsigned char* in, unsigned long ilen, str* out, unsigned long* olen, int level);
 int gzip_uncompress(unsigned char* in, unsigned long ilen, str* out, unsigned long* olen);
+int zlib_compress(unsigned char* in, unsigned long ilen, str* out,
+		unsigned long* olen, int level, int dict);
+int zlib_uncompress(unsigned char* in, unsigned long ilen, str* out,
+		unsigned long* olen);
+
+/* name of the preset dictionary, as advertised in the ";dict=" param */
+extern const str mc_dict_name;
+
+void mc_dict_init(void);
+void mc_zstreams_destroy(void);
 #endif
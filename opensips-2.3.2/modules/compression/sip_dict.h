@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Preset dictionary for the deflate compression of SIP messages - the
+ * header names, tokens and SDP lines most SIP messages are made of. zlib
+ * finds the matches faster at the end of the dictionary, so the most
+ * frequent strings are the last ones.
+ *
+ * NEVER change the content of an existing dictionary: the receiver must
+ * use the exact same bytes as the sender. Add a new one, with a new name.
+ */
+
+#ifndef _MC_SIP_DICT_H
+#define _MC_SIP_DICT_H
+
+#define MC_SIP_DICT_NAME "sip"
+
+static const char mc_sip_dict[] =
+	"a=rtcp-mux\r\n"
+	"a=ice-ufrag:"
+	"a=ice-pwd:"
+	"a=fingerprint:sha-256 "
+	"a=setup:actpass\r\n"
+	"UDP/TLS/RTP/SAVPF "
+	"a=crypto:1 AES_CM_128_HMAC_SHA1_80 inline:"
+	"RTP/SAVP "
+	"a=rtpmap:18 G729/8000\r\n"
+	"a=fmtp:18 annexb=no\r\n"
+	"a=rtpmap:9 G722/8000\r\n"
+	"a=rtpmap:3 GSM/8000\r\n"
+	"a=silenceSupp:off - - - -\r\n"
+	"a=rtcp:"
+	"a=maxptime:"
+	"a=ptime:20\r\n"
+	"a=sendonly\r\n"
+	"a=recvonly\r\n"
+	"a=inactive\r\n"
+	"a=sendrecv\r\n"
+	"a=fmtp:101 0-16\r\n"
+	"a=fmtp:101 0-15\r\n"
+	"a=rtpmap:101 telephone-event/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"m=audio "
+	" RTP/AVP 0 8 18 101\r\n"
+	"t=0 0\r\n"
+	"c=IN IP4 "
+	"s=-\r\n"
+	"s=SIP Call\r\n"
+	"o=- "
+	"v=0\r\n"
+	"application/sdp\r\n"
+	"Content-Type: "
+	"Content-Disposition: session\r\n"
+	"Accept: application/sdp\r\n"
+	"application/pidf+xml\r\n"
+	"Event: presence\r\n"
+	"Event: message-summary\r\n"
+	"Subscription-State: active;expires="
+	"Refer-To: "
+	"Referred-By: "
+	"Replaces: "
+	"P-Asserted-Identity: "
+	"P-Preferred-Identity: "
+	"Privacy: none\r\n"
+	"Remote-Party-ID: "
+	";party=calling;screen=yes;privacy=off"
+	"Diversion: "
+	";reason=unconditional"
+	"Authorization: Digest username=\""
+	"Proxy-Authorization: Digest username=\""
+	"WWW-Authenticate: Digest realm=\""
+	"Proxy-Authenticate: Digest realm=\""
+	"\", nonce=\""
+	"\", uri=\""
+	"\", response=\""
+	"\", algorithm=MD5"
+	", qop=auth, nc=00000001, cnonce=\""
+	", opaque=\""
+	"Session-Expires: 1800;refresher=uac\r\n"
+	"Min-SE: 90\r\n"
+	"Expires: 3600\r\n"
+	"Expires: 0\r\n"
+	"Date: "
+	" GMT\r\n"
+	"Server: OpenSIPS (2.3.2 (x86_64/linux))\r\n"
+	"User-Agent: "
+	"Supported: replaces, timer, 100rel, path, outbound\r\n"
+	"Require: 100rel\r\n"
+	"RSeq: "
+	"RAck: "
+	"Allow-Events: talk, hold, conference, refer, check-sync\r\n"
+	"Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, NOTIFY, MESSAGE, "
+		"SUBSCRIBE, INFO, PRACK, UPDATE\r\n"
+	"Path: <sip:"
+	";lr>\r\n"
+	"Record-Route: <sip:"
+	"Route: <sip:"
+	";lr;ftag="
+	";did="
+	";expires="
+	";+sip.instance=\"<urn:uuid:"
+	";reg-id=1"
+	";received=sip:"
+	";transport=tcp"
+	";transport=tls"
+	";transport=udp"
+	";user=phone"
+	";ob"
+	"Contact: <sip:"
+	"Contact: \""
+	"Max-Forwards: 70\r\n"
+	"Content-Length: 0\r\n"
+	"Content-Length: "
+	"CSeq: 1 REGISTER\r\n"
+	"CSeq: 1 OPTIONS\r\n"
+	"CSeq: 1 SUBSCRIBE\r\n"
+	"CSeq: 1 NOTIFY\r\n"
+	"CSeq: 1 MESSAGE\r\n"
+	"CSeq: 1 CANCEL\r\n"
+	"CSeq: 2 BYE\r\n"
+	"CSeq: 1 ACK\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Call-ID: "
+	"To: <sip:"
+	"To: \""
+	"From: <sip:"
+	"From: \""
+	">;tag="
+	";rport="
+	";received="
+	";rport;branch=z9hG4bK"
+	";branch=z9hG4bK"
+	"Via: SIP/2.0/TLS "
+	"Via: SIP/2.0/TCP "
+	"Via: SIP/2.0/UDP "
+	"SIP/2.0 100 Giving a try\r\n"
+	"SIP/2.0 100 Trying\r\n"
+	"SIP/2.0 180 Ringing\r\n"
+	"SIP/2.0 183 Session Progress\r\n"
+	"SIP/2.0 401 Unauthorized\r\n"
+	"SIP/2.0 407 Proxy Authentication Required\r\n"
+	"SIP/2.0 487 Request Terminated\r\n"
+	"SIP/2.0 200 OK\r\n"
+	"REGISTER sip:"
+	"OPTIONS sip:"
+	"SUBSCRIBE sip:"
+	"NOTIFY sip:"
+	"MESSAGE sip:"
+	"CANCEL sip:"
+	"BYE sip:"
+	"ACK sip:"
+	"INVITE sip:"
+	" SIP/2.0\r\n";
+
+#define MC_SIP_DICT_LEN (sizeof(mc_sip_dict) - 1)
+
+#endif
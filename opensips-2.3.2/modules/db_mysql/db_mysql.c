@@ -168,6 +168,7 @@ int db_mysql_bind_api(const str* mod, db_func_t *dbb)
 	dbb->async_raw_query   = db_mysql_async_raw_query;
 	dbb->async_resume      = db_mysql_async_resume;
 	dbb->async_free_result = db_mysql_async_free_result;
+	dbb->async_query       = db_mysql_async_query;
 
 	dbb->cap |= DB_CAP_MULTIPLE_INSERT;
 	return 0;
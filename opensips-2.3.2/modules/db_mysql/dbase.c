@@ -1199,6 +1199,14 @@ out:
 	return -2;
 }
 
+int db_mysql_async_query(db_con_t *_h, const db_key_t *_k, const db_op_t *_op,
+		const db_val_t *_v, const db_key_t *_c, const int _n, const int _nc,
+		const db_key_t _o, void **_priv)
+{
+	return db_do_async_query(_h, _k, _op, _v, _c, _n, _nc, _o, _priv,
+		db_mysql_val2str, db_mysql_async_raw_query);
+}
+
 int db_mysql_async_resume(db_con_t *_h, int fd, db_res_t **_r, void *_priv)
 {
 	struct pool_con *con = (struct pool_con *)_priv;
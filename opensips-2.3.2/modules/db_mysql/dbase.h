@@ -113,6 +113,13 @@ int db_last_inserted_id(const db_con_t* _h);
  */
 int db_mysql_async_raw_query(db_con_t *_h, const str *_s, void** _data);
 
+/*
+ * Same as db_mysql_async_raw_query(), for a query with bound values
+ */
+int db_mysql_async_query(db_con_t *_h, const db_key_t *_k, const db_op_t *_op,
+		const db_val_t *_v, const db_key_t *_c, const int _n, const int _nc,
+		const db_key_t _o, void **_data);
+
 /*
  * Reads data from the given connection file descriptor. If the query is fully
  * completed, the global "async_status" will be equal to ASYNC_DONE.
@@ -118,6 +118,10 @@ int db_postgres_bind_api(const str* mod, db_func_t *dbb)
 	dbb->insert           = db_postgres_insert;
 	dbb->delete           = db_postgres_delete;
 	dbb->update           = db_postgres_update;
+	dbb->async_raw_query  = db_postgres_async_raw_query;
+	dbb->async_resume     = db_postgres_async_resume;
+	dbb->async_free_result= db_postgres_async_free_result;
+	dbb->async_query      = db_postgres_async_query;
 
 	dbb->cap |= DB_CAP_MULTIPLE_INSERT;
 	return 0;
@@ -63,6 +63,10 @@
 
 #define MAXCOLUMNS	512
 
+/* limits for the parameters of a prepared statement */
+#define PG_PS_MAX_PARAMS	256
+#define PG_PS_BUF_LEN		65536
+
 #include <string.h>
 #include <stdio.h>
 #include "../../dprint.h"
@@ -71,6 +75,8 @@
 #include "../../db/db_ut.h"
 #include "../../db/db_query.h"
 #include "../../db/db_insertq.h"
+#include "../../db/db_async.h"
+#include "../../async.h"
 #include "dbase.h"
 #include "pg_con.h"
 #include "val.h"
@@ -81,8 +87,23 @@ extern int max_db_queries;
 
 static int submit_func_called;
 
+/* values to be bound to the prepared statement of the ongoing query;
+ * for updates, the SET values come first, followed by the WHERE ones */
+static const db_val_t *ps_vals[2];
+static int ps_nvals[2];
+static char ps_buf[PG_PS_BUF_LEN];
+
 static int free_query(const db_con_t* _con);
 
+static inline void set_ps_values(const db_val_t *v1, int n1,
+		const db_val_t *v2, int n2)
+{
+	ps_vals[0] = v1;
+	ps_nvals[0] = n1;
+	ps_vals[1] = v2;
+	ps_nvals[1] = n2;
+}
+
 
 /*
 ** pg_init	initialize database for future queries
@@ -122,6 +143,237 @@ void db_postgres_close(db_con_t* _h)
 	db_do_close(_h, db_postgres_free_connection);
 }
 
+/*
+ * Resets a broken connection; the statements prepared on it are lost
+ * together with the server side session
+ */
+static void reset_connection(const db_con_t* _con)
+{
+	LM_DBG("connection reset\n");
+	PQreset(CON_CONNECTION(_con));
+	db_postgres_free_ps_list((struct pg_con *)_con->tail);
+}
+
+/*
+ * Makes sure the connection is usable before sending a query over it
+ */
+static int check_connection(const db_con_t* _con, const str* _s)
+{
+	/* this bit of nonsense in case our connection get screwed up */
+	switch(PQstatus(CON_CONNECTION(_con)))
+	{
+		case CONNECTION_OK:
+			break;
+		case CONNECTION_BAD:
+			reset_connection(_con);
+			break;
+		case CONNECTION_STARTED:
+		case CONNECTION_MADE:
+		case CONNECTION_AWAITING_RESPONSE:
+		case CONNECTION_AUTH_OK:
+		case CONNECTION_SETENV:
+		case CONNECTION_SSL_STARTUP:
+		case CONNECTION_NEEDED:
+		default:
+			LM_ERR("%p PQstatus(%s) invalid: %.*s\n", _con,
+				PQerrorMessage(CON_CONNECTION(_con)), _s->len, _s->s);
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads all the results of the last sent query, keeping the last one
+ */
+static ExecStatusType get_results(const db_con_t* _con)
+{
+	PGresult *res;
+
+	while ((res = PQgetResult(CON_CONNECTION(_con)))) {
+		if (CON_RESULT(_con))
+			PQclear(CON_RESULT(_con));
+		CON_RESULT(_con) = res;
+	}
+
+	return PQresultStatus(CON_RESULT(_con));
+}
+
+/*
+ * Looks up the statement prepared on the current connection for the
+ * prepared statement handle of the query, preparing it if not found.
+ * The "?" placeholders of the query are turned into "$n" parameters.
+ */
+static struct pg_ps *get_prepared_stmt(const db_con_t* _con, const str* _s,
+		int nparams)
+{
+	struct pg_con *con = (struct pg_con *)_con->tail;
+	struct pg_ps *ps, **prev;
+	PGresult *res;
+	char *q, *p;
+	int i, n;
+
+	for (prev = &con->ps_list; *prev; prev = &(*prev)->next) {
+		ps = *prev;
+		if (ps->key != (void *)CON_PS_REFERENCE(_con))
+			continue;
+
+		if (ps->query.len == _s->len &&
+		        !memcmp(ps->query.s, _s->s, _s->len))
+			return ps;
+
+		/* same handle, different query - drop the old statement */
+		LM_DBG("%p re-preparing statement %s\n", _con, ps->name);
+		p = pkg_malloc(sizeof("DEALLOCATE ") + sizeof(ps->name));
+		if (p) {
+			sprintf(p, "DEALLOCATE %s", ps->name);
+			PQclear(PQexec(con->con, p));
+			pkg_free(p);
+		}
+		*prev = ps->next;
+		pkg_free(ps);
+		break;
+	}
+
+	/* each "?" grows into at most "$NNN" */
+	ps = pkg_malloc(sizeof *ps + 2 * _s->len + 3 * nparams + 2);
+	if (!ps) {
+		LM_ERR("no more pkg memory\n");
+		return NULL;
+	}
+	memset(ps, 0, sizeof *ps);
+
+	ps->key = (void *)CON_PS_REFERENCE(_con);
+	ps->nparams = nparams;
+	ps->query.s = (char *)(ps + 1);
+	ps->query.len = _s->len;
+	memcpy(ps->query.s, _s->s, _s->len);
+	ps->query.s[_s->len] = '\0';
+	snprintf(ps->name, sizeof ps->name, "opensips_ps_%u", con->ps_no++);
+
+	q = ps->query.s + _s->len + 1;
+	for (i = 0, n = 0, p = q; i < _s->len; i++) {
+		if (_s->s[i] == '?') {
+			if (++n > nparams)
+				break;
+			p += sprintf(p, "$%d", n);
+		} else {
+			*p++ = _s->s[i];
+		}
+	}
+	*p = '\0';
+
+	if (n != nparams) {
+		LM_ERR("query has %d placeholders, but %d values were given: %.*s\n",
+			n, nparams, _s->len, _s->s);
+		pkg_free(ps);
+		return NULL;
+	}
+
+	res = PQprepare(con->con, ps->name, q, nparams, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		LM_ERR("%p failed to prepare [%s]: %s\n", _con, q,
+			PQresultErrorMessage(res));
+		PQclear(res);
+		pkg_free(ps);
+		return NULL;
+	}
+	PQclear(res);
+
+	LM_DBG("%p prepared %s as [%s]\n", _con, ps->name, q);
+
+	ps->next = con->ps_list;
+	con->ps_list = ps;
+	return ps;
+}
+
+/*
+** submit_ps	run a query through a prepared statement
+**
+**	Arguments :
+**		db_con_t *	as previously supplied by pg_init()
+**		char *_s	the text query, with "?" placeholders for the values
+**
+**	Returns :
+**		0 upon success
+**		negative number upon failure
+*/
+
+static int db_postgres_submit_ps(const db_con_t* _con, const str* _s)
+{
+	const char *values[PG_PS_MAX_PARAMS];
+	int lengths[PG_PS_MAX_PARAMS];
+	int formats[PG_PS_MAX_PARAMS];
+	struct pg_ps *ps;
+	struct timeval start;
+	int i, j, k, n, off, len, ret;
+
+	n = ps_nvals[0] + ps_nvals[1];
+	if (n > PG_PS_MAX_PARAMS) {
+		LM_ERR("too many values (%d) for a prepared statement\n", n);
+		return -1;
+	}
+
+	for (i = 0, k = 0, off = 0; i < 2; i++)
+		for (j = 0; j < ps_nvals[i]; j++, k++) {
+			len = PG_PS_BUF_LEN - off;
+			if (db_postgres_val2param(&ps_vals[i][j], ps_buf + off, &len,
+			        &values[k], &lengths[k], &formats[k]) < 0) {
+				LM_ERR("failed to convert value %d of the statement\n", k);
+				return -1;
+			}
+			off += len;
+		}
+
+	submit_func_called = 1;
+
+	if (check_connection(_con, _s) < 0)
+		return -1;
+
+	for (i=0;i<max_db_queries;i++) {
+		if(CON_RESULT(_con)) {
+			free_query(_con);
+		}
+
+		ps = get_prepared_stmt(_con, _s, n);
+		if (!ps) {
+			if (PQstatus(CON_CONNECTION(_con))!=CONNECTION_OK) {
+				reset_connection(_con);
+				continue;
+			}
+			return -1;
+		}
+
+		start_expire_timer(start,db_postgres_exec_query_threshold);
+		ret = PQsendQueryPrepared(CON_CONNECTION(_con), ps->name, n,
+			values, lengths, formats, 0);
+		stop_expire_timer(start,db_postgres_exec_query_threshold,
+			"pgsql prepared query",_s->s,_s->len,0);
+		if (ret) {
+			LM_DBG("%p PQsendQueryPrepared(%s)\n", _con, ps->name);
+
+			if (get_results(_con) != PGRES_FATAL_ERROR)
+				return 0;
+		}
+
+		LM_DBG("%p PQsendQueryPrepared failed: %s Query: %.*s\n", _con,
+			PQerrorMessage(CON_CONNECTION(_con)), _s->len, _s->s);
+		if(PQstatus(CON_CONNECTION(_con))!=CONNECTION_OK) {
+			reset_connection(_con);
+		} else {
+			/* failure not due to connection loss - no point in retrying */
+			if(CON_RESULT(_con)) {
+				free_query(_con);
+			}
+			break;
+		}
+	}
+
+	LM_ERR("%p PQsendQueryPrepared Error: %s Query: %.*s\n", _con,
+	PQerrorMessage(CON_CONNECTION(_con)), _s->len, _s->s);
+	return -1;
+}
+
 /*
 ** submit_query	run a query
 **
@@ -137,8 +389,6 @@ void db_postgres_close(db_con_t* _h)
 static int db_postgres_submit_query(const db_con_t* _con, const str* _s)
 {
 	int i,ret=0;
-	ExecStatusType result;
-	PGresult *res = NULL;
 	struct timeval start;
 
 	if(! _con || !_s || !_s->s)
@@ -147,29 +397,13 @@ static int db_postgres_submit_query(const db_con_t* _con, const str* _s)
 		return(-1);
 	}
 
+	if (CON_HAS_PS(_con))
+		return db_postgres_submit_ps(_con, _s);
+
 	submit_func_called = 1;
 
-	/* this bit of nonsense in case our connection get screwed up */
-	switch(PQstatus(CON_CONNECTION(_con)))
-	{
-		case CONNECTION_OK:
-			break;
-		case CONNECTION_BAD:
-			LM_DBG("connection reset\n");
-			PQreset(CON_CONNECTION(_con));
-			break;
-		case CONNECTION_STARTED:
-		case CONNECTION_MADE:
-		case CONNECTION_AWAITING_RESPONSE:
-		case CONNECTION_AUTH_OK:
-		case CONNECTION_SETENV:
-		case CONNECTION_SSL_STARTUP:
-		case CONNECTION_NEEDED:
-		default:
-			LM_ERR("%p PQstatus(%s) invalid: %.*s\n", _con,
-				PQerrorMessage(CON_CONNECTION(_con)), _s->len, _s->s);
-			return -1;
-	}
+	if (check_connection(_con, _s) < 0)
+		return -1;
 
 	for (i=0;i<max_db_queries;i++) {
 		/* free any previous query that is laying about */
@@ -183,16 +417,7 @@ static int db_postgres_submit_query(const db_con_t* _con, const str* _s)
 		if (ret) {
 			LM_DBG("%p PQsendQuery(%.*s)\n", _con, _s->len, _s->s);
 
-			while (1) {
-				if ((res = PQgetResult(CON_CONNECTION(_con)))) {
-					CON_RESULT(_con) = res;
-				} else {
-					break;
-				}
-			}
-
-			result = PQresultStatus(CON_RESULT(_con));
-			if(result==PGRES_FATAL_ERROR)
+			if(get_results(_con)==PGRES_FATAL_ERROR)
 				goto reconnect;
 			else return 0;
 		} else {
@@ -201,8 +426,7 @@ reconnect:
 			LM_DBG("%p PQsendQuery failed: %s Query: %.*s\n", _con,
 			PQerrorMessage(CON_CONNECTION(_con)), _s->len, _s->s);
 			if(PQstatus(CON_CONNECTION(_con))!=CONNECTION_OK) {
-				LM_DBG("connection reset\n");
-				PQreset(CON_CONNECTION(_con));
+				reset_connection(_con);
 			} else {
 				/* failure not due to connection loss - no point in retrying */
 				if(CON_RESULT(_con)) {
@@ -395,10 +619,14 @@ int db_postgres_query(const db_con_t* _h, const db_key_t* _k,
 	const db_op_t* _op, const db_val_t* _v, const db_key_t* _c, const int _n,
 	const int _nc, const db_key_t _o, db_res_t** _r)
 {
-	CON_RESET_CURR_PS(_h); /* no prepared statements support */
-	return db_do_query(_h, _k, _op, _v, _c, _n, _nc, _o, _r,
+	int ret;
+
+	set_ps_values(_v, _n, NULL, 0);
+	ret = db_do_query(_h, _k, _op, _v, _c, _n, _nc, _o, _r,
 		db_postgres_val2str, db_postgres_submit_query,
 		db_postgres_store_result);
+	CON_RESET_CURR_PS(_h);
+	return ret;
 }
 
 
@@ -412,6 +640,171 @@ int db_postgres_raw_query(const db_con_t* _h, const str* _s, db_res_t** _r)
 		db_postgres_store_result);
 }
 
+static int db_postgres_get_con_fd(void *con)
+{
+	return PQsocket(((struct pg_con *)con)->con);
+}
+
+/*
+ * Begins execution of a raw SQL query on a separate connection and
+ * returns immediately, with the socket of that connection for polling.
+ * If no more async connections may be opened, the query is run in
+ * blocking mode and -1 is returned (same as db_mysql)
+ */
+int db_postgres_async_raw_query(db_con_t *_h, const str *_s, void **_priv)
+{
+	int *fd_ref;
+	int i, ret;
+	struct timeval start;
+	struct pg_con *con;
+
+	if (!_h || !_s || !_s->s) {
+		LM_ERR("invalid parameter value\n");
+		return -1;
+	}
+
+	CON_RESET_CURR_PS(_h); /* no prepared statements support */
+
+	con = (struct pg_con *)db_init_async(_h, db_postgres_get_con_fd,
+	                           &fd_ref, (void *)db_postgres_new_connection);
+	*_priv = con;
+	if (!con) {
+		LM_INFO("Failed to open new connection (current: 1 + %d). Running "
+				"in sync mode!\n", ((struct pool_con *)_h->tail)->no_transfers);
+		if (db_postgres_submit_query(_h, _s) == 0)
+			free_query(_h);
+		submit_func_called = 0;
+		return -1;
+	}
+
+	if (check_connection(_h, _s) < 0)
+		goto out;
+
+	for (i = 0; i < max_db_queries; i++) {
+		if (CON_RESULT(_h))
+			free_query(_h);
+
+		start_expire_timer(start, db_postgres_exec_query_threshold);
+		ret = PQsendQuery(CON_CONNECTION(_h), _s->s);
+		stop_expire_timer(start, db_postgres_exec_query_threshold,
+						  "pgsql async query", _s->s, _s->len, 0);
+		if (ret) {
+			LM_DBG("%p PQsendQuery(%.*s)\n", _h, _s->len, _s->s);
+			/* the connection might have been re-established meanwhile */
+			*fd_ref = db_postgres_get_con_fd(con);
+			db_switch_to_sync(_h);
+			return *fd_ref;
+		}
+
+		LM_DBG("%p PQsendQuery failed: %s Query: %.*s\n", _h,
+			PQerrorMessage(CON_CONNECTION(_h)), _s->len, _s->s);
+		if (PQstatus(CON_CONNECTION(_h)) == CONNECTION_OK)
+			break;
+		reset_connection(_h);
+	}
+
+	LM_ERR("%p PQsendQuery Error: %s Query: %.*s\n", _h,
+		PQerrorMessage(CON_CONNECTION(_h)), _s->len, _s->s);
+
+out:
+	db_switch_to_sync(_h);
+	db_store_async_con(_h, (struct pool_con *)con);
+	return -2;
+}
+
+/*
+ * Asynchronous query with bound values, printed and escaped by val2str
+ */
+int db_postgres_async_query(db_con_t *_h, const db_key_t *_k,
+	const db_op_t *_op, const db_val_t *_v, const db_key_t *_c, const int _n,
+	const int _nc, const db_key_t _o, void **_priv)
+{
+	CON_RESET_CURR_PS(_h); /* values are printed in the query */
+	return db_do_async_query(_h, _k, _op, _v, _c, _n, _nc, _o, _priv,
+		db_postgres_val2str, db_postgres_async_raw_query);
+}
+
+/*
+ * Reads whatever is available on the socket of an async query, without
+ * blocking. Sets ASYNC_CONTINUE until all the results are received.
+ */
+int db_postgres_async_resume(db_con_t *_h, int fd, db_res_t **_r, void *_priv)
+{
+	struct pool_con *con = (struct pool_con *)_priv;
+	PGresult *res;
+
+#ifdef EXTRA_DEBUG
+	if (!db_match_async_con(fd, _h)) {
+		LM_BUG("no conn match for fd %d", fd);
+		abort();
+	}
+#endif
+
+	db_switch_to_async(_h, con);
+
+	if (!PQconsumeInput(CON_CONNECTION(_h))) {
+		LM_ERR("%p failed to read the query result: %s\n", _h,
+			PQerrorMessage(CON_CONNECTION(_h)));
+		free_query(_h);
+		goto error;
+	}
+
+	while (!PQisBusy(CON_CONNECTION(_h))) {
+		res = PQgetResult(CON_CONNECTION(_h));
+		if (!res)
+			goto done;
+
+		if (CON_RESULT(_h))
+			PQclear(CON_RESULT(_h));
+		CON_RESULT(_h) = res;
+	}
+
+	/* more data to come */
+	async_status = ASYNC_CONTINUE;
+	db_switch_to_sync(_h);
+	return 1;
+
+done:
+	if (!CON_RESULT(_h)) {
+		LM_ERR("%p no result received for the async query\n", _h);
+		goto error;
+	}
+
+	if (_r) {
+		if (db_postgres_store_result(_h, _r) != 0) {
+			LM_ERR("failed to store result\n");
+			db_switch_to_sync(_h);
+			db_store_async_con(_h, con);
+			return -2;
+		}
+	}
+
+	db_switch_to_sync(_h);
+	db_store_async_con(_h, con);
+	return 0;
+
+error:
+	db_switch_to_sync(_h);
+	db_store_async_con(_h, con);
+	return -1;
+}
+
+int db_postgres_async_free_result(db_con_t *_h, db_res_t *_r, void *_priv)
+{
+	struct pg_con *con = (struct pg_con *)_priv;
+
+	if (_r && db_free_result(_r) < 0) {
+		LM_ERR("error while freeing result structure\n");
+		return -1;
+	}
+
+	if (con->res) {
+		PQclear(con->res);
+		con->res = NULL;
+	}
+	return 0;
+}
+
 /*
  * Retrieve result set
  *
@@ -516,10 +909,16 @@ int db_postgres_insert(const db_con_t* _h, const db_key_t* _k,
 		const db_val_t* _v, const int _n)
 {
 	db_res_t* _r = NULL;
+	int tmp;
 
-	CON_RESET_CURR_PS(_h); /* no prepared statements support */
-	int tmp = db_do_insert(_h, _k, _v, _n, db_postgres_val2str,
+	/* buffered inserts are sent as multi-row text queries */
+	if (CON_HAS_INSLIST(_h))
+		CON_RESET_CURR_PS(_h);
+
+	set_ps_values(_v, _n, NULL, 0);
+	tmp = db_do_insert(_h, _k, _v, _n, db_postgres_val2str,
 		db_postgres_submit_query);
+	CON_RESET_CURR_PS(_h);
 
 	if (submit_func_called)
 	{
@@ -560,10 +959,12 @@ int db_postgres_delete(const db_con_t* _h, const db_key_t* _k,
 		const db_op_t* _o, const db_val_t* _v, const int _n)
 {
 	db_res_t* _r = NULL;
+	int tmp;
 
-	CON_RESET_CURR_PS(_h); /* no prepared statements support */
-	int tmp = db_do_delete(_h, _k, _o, _v, _n, db_postgres_val2str,
+	set_ps_values(_v, _n, NULL, 0);
+	tmp = db_do_delete(_h, _k, _o, _v, _n, db_postgres_val2str,
 		db_postgres_submit_query);
+	CON_RESET_CURR_PS(_h);
 
 	if (db_postgres_store_result(_h, &_r) != 0)
 		LM_WARN("unexpected result returned");
@@ -591,10 +992,12 @@ int db_postgres_update(const db_con_t* _h, const db_key_t* _k,
 		const db_val_t* _uv, const int _n, const int _un)
 {
 	db_res_t* _r = NULL;
+	int tmp;
 
-	CON_RESET_CURR_PS(_h); /* no prepared statements support */
-	int tmp = db_do_update(_h, _k, _o, _v, _uk, _uv, _n, _un,
+	set_ps_values(_uv, _un, _v, _n);
+	tmp = db_do_update(_h, _k, _o, _v, _uk, _uv, _n, _un,
 		db_postgres_val2str, db_postgres_submit_query);
+	CON_RESET_CURR_PS(_h);
 
 	if (db_postgres_store_result(_h, &_r) != 0)
 		LM_WARN("unexpected result returned");
@@ -74,6 +74,28 @@ int db_postgres_query(const db_con_t* _h, const db_key_t* _k, const db_op_t* _op
  */
 int db_postgres_raw_query(const db_con_t* _h, const str* _s, db_res_t** _r);
 
+/**
+ * Asynchronous raw SQL query, returning the fd to be polled
+ */
+int db_postgres_async_raw_query(db_con_t *_h, const str *_s, void **_priv);
+
+/**
+ * Asynchronous query with bound values, returning the fd to be polled
+ */
+int db_postgres_async_query(db_con_t *_h, const db_key_t *_k,
+	const db_op_t *_op, const db_val_t *_v, const db_key_t *_c, const int _n,
+	const int _nc, const db_key_t _o, void **_priv);
+
+/**
+ * Reads the available results of an asynchronous query
+ */
+int db_postgres_async_resume(db_con_t *_h, int fd, db_res_t **_r, void *_priv);
+
+/**
+ * Frees the results of an asynchronous query
+ */
+int db_postgres_async_free_result(db_con_t *_h, db_res_t *_r, void *_priv);
+
 
 /**
  * Insert a row into table
@@ -105,6 +105,7 @@ void db_postgres_free_connection(struct pool_con* con)
 		PQclear(_c->res);
 		_c->res = 0;
 	}
+	db_postgres_free_ps_list(_c);
 	if (_c->id) free_db_id(_c->id);
 	if (_c->con) {
 		LM_DBG("PQfinish(%p)\n", _c->con);
@@ -114,3 +115,18 @@ void db_postgres_free_connection(struct pool_con* con)
 	LM_DBG("pkg_free(%p)\n", _c);
 	pkg_free(_c);
 }
+
+
+/*
+ * Forget all the prepared statements of the connection
+ */
+void db_postgres_free_ps_list(struct pg_con* con)
+{
+	struct pg_ps *ps;
+
+	while (con->ps_list) {
+		ps = con->ps_list;
+		con->ps_list = ps->next;
+		pkg_free(ps);
+	}
+}
@@ -38,6 +38,18 @@
 #include <time.h>
 #include <libpq-fe.h>
 
+/*
+ * Server side prepared statement, cached per connection and keyed by
+ * the address of the db_ps_t handle owned by the caller
+ */
+struct pg_ps {
+	void *key;           /* CON_PS_REFERENCE() of the owning query */
+	char name[24];       /* name of the statement on the server side */
+	str query;           /* the query the statement was prepared from */
+	int nparams;
+	struct pg_ps *next;
+};
+
 /*
  * Postgres specific connection data
  */
@@ -55,6 +67,8 @@ struct pg_con {
 	PGresult *res;		/* this is the current result */
 	char**  row;		/* Actual row in the result */
 	time_t timestamp;	/* Timestamp of last query */
+	struct pg_ps *ps_list;	/* statements prepared on this connection */
+	unsigned int ps_no;	/* counter used for naming the statements */
 
 };
 
@@ -65,6 +79,7 @@ struct pg_con {
 #define CON_ROW(db_con)	       (((struct pg_con*)((db_con)->tail))->row)
 #define CON_TIMESTAMP(db_con)  (((struct pg_con*)((db_con)->tail))->timestamp)
 #define CON_ID(db_con) 	       (((struct pg_con*)((db_con)->tail))->id)
+#define CON_PS_LIST(db_con)    (((struct pg_con*)((db_con)->tail))->ps_list)
 
 /*
  * Create a new connection structure,
@@ -77,4 +92,10 @@ struct pg_con* db_postgres_new_connection(struct db_id* id);
  */
 void db_postgres_free_connection(struct pool_con* con);
 
+/*
+ * Forget all the prepared statements of the connection; to be called
+ * whenever the server side session is lost (e.g. after PQreset())
+ */
+void db_postgres_free_ps_list(struct pg_con* con);
+
 #endif /* PG_CON_H */
@@ -328,3 +328,94 @@ int db_postgres_val2str(const db_con_t* _con, const db_val_t* _v,
 	}
 }
 
+
+
+/*
+ * Converts a value into a parameter of a prepared statement. Values are
+ * passed unquoted and unescaped, in text format, except for blobs which are
+ * sent in binary format. The "_s" buffer (of "*_len" bytes) is used for
+ * the values which need a conversion; on return, "*_len" holds the number
+ * of bytes consumed from it.
+ */
+int db_postgres_val2param(const db_val_t* _v, char* _s, int* _len,
+		const char** _p, int* _plen, int* _pfmt)
+{
+	int l;
+
+	if (!_v || !_s || !_len || !_p || !_plen || !_pfmt) {
+		LM_ERR("invalid parameter value\n");
+		return -1;
+	}
+
+	*_pfmt = 0;
+	*_plen = 0;
+
+	if (VAL_NULL(_v)) {
+		*_p = NULL;
+		*_len = 0;
+		return 0;
+	}
+
+	l = *_len;
+	switch(VAL_TYPE(_v)) {
+	case DB_INT:
+		if (db_int2str(VAL_INT(_v), _s, &l) < 0)
+			goto too_short;
+		break;
+
+	case DB_BIGINT:
+		if (db_bigint2str(VAL_BIGINT(_v), _s, &l) < 0)
+			goto too_short;
+		break;
+
+	case DB_BITMAP:
+		if (db_int2str(VAL_BITMAP(_v), _s, &l) < 0)
+			goto too_short;
+		break;
+
+	case DB_DOUBLE:
+		if (db_double2str(VAL_DOUBLE(_v), _s, &l) < 0)
+			goto too_short;
+		break;
+
+	case DB_STRING:
+		/* already null terminated, no need to copy it */
+		*_p = VAL_STRING(_v);
+		*_len = 0;
+		return 0;
+
+	case DB_STR:
+		l = VAL_STR(_v).len;
+		if (*_len < l + 1)
+			goto too_short;
+		memcpy(_s, VAL_STR(_v).s, l);
+		break;
+
+	case DB_DATETIME:
+		if (db_time2str_nq(VAL_TIME(_v), _s, &l) < 0)
+			goto too_short;
+		break;
+
+	case DB_BLOB:
+		*_p = VAL_BLOB(_v).s;
+		*_plen = VAL_BLOB(_v).len;
+		*_pfmt = 1;
+		*_len = 0;
+		return 0;
+
+	default:
+		LM_DBG("unknown data type\n");
+		return -2;
+	}
+
+	if (l + 1 > *_len)
+		goto too_short;
+	_s[l] = '\0';
+	*_p = _s;
+	*_len = l + 1;
+	return 0;
+
+too_short:
+	LM_ERR("no more space to convert the value of type %d\n", VAL_TYPE(_v));
+	return -1;
+}
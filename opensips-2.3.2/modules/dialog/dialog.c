@@ -289,7 +289,7 @@ static param_export_t mod_params[]={
 
 
 static stat_export_t mod_stats[] = {
-	{"active_dialogs" ,     STAT_NO_RESET,  &active_dlgs       },
+	{"active_dialogs" ,     STAT_NO_RESET|STAT_PER_PROC,  &active_dlgs },
 	{"early_dialogs",       STAT_NO_RESET,  &early_dlgs        },
 	{"processed_dialogs" ,  0,              &processed_dlgs    },
 	{"expired_dialogs" ,    0,              &expired_dlgs      },
@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <stdlib.h>
 
 #include "event_flatstore.h"
 #include "../../mem/mem.h"
@@ -38,6 +39,7 @@
 #include "../../mem/shm_mem.h"
 #include "../../locking.h"
 #include "../../ut.h"
+#include "../../lib/buf_flush.h"
 
 static int mod_init(void);
 static void destroy(void);
@@ -50,6 +52,8 @@ static evi_reply_sock* flat_parse(str socket);
 static struct mi_root* mi_rotate(struct mi_root* root, void *param);
 static int flat_raise(struct sip_msg *msg, str* ev_name,
 					 evi_reply_sock *sock, evi_params_t * params);
+static int flat_flush(int index);
+static void flat_flush_all(void);
 
 static int *opened_fds;
 static int *rotate_version;
@@ -67,6 +71,13 @@ static int initial_capacity = FLAT_DEFAULT_MAX_FD;
 static str file_permissions;
 static mode_t file_permissions_oct;
 
+/* write buffering */
+static int buffer_size = 0;
+static int flush_interval = 1000;
+static int fsync_policy = FLAT_FSYNC_NONE;
+static struct flat_buffer *flat_buffers;
+static struct buf_flusher flat_flusher;
+
 static mi_export_t mi_cmds[] = {
 	{ "evi_flat_rotate","rotates the files the module dumps events into",mi_rotate,0,0,0},
 	{0,0,0,0,0,0}
@@ -76,6 +87,9 @@ static param_export_t mod_params[] = {
 	{"max_open_sockets",INT_PARAM, &initial_capacity},
 	{"delimiter",STR_PARAM, &delimiter.s},
 	{"file_permissions", STR_PARAM, &file_permissions.s},
+	{"buffer_size", INT_PARAM, &buffer_size},
+	{"flush_interval", INT_PARAM, &flush_interval},
+	{"fsync_policy", INT_PARAM, &fsync_policy},
 	{0,0,0}
 };
 
@@ -185,6 +199,42 @@ static int mod_init(void) {
 	for(i = 0; i < initial_capacity; i++)
 		opened_fds[i] = -1;
 
+	if (fsync_policy < FLAT_FSYNC_NONE || fsync_policy > FLAT_FSYNC_WRITE) {
+		LM_WARN("bad value for fsync_policy (%d), disabling fsync\n",
+			fsync_policy);
+		fsync_policy = FLAT_FSYNC_NONE;
+	}
+
+	if (buffer_size < 0) {
+		LM_WARN("bad value for buffer_size (%d), disabling buffering\n",
+			buffer_size);
+		buffer_size = 0;
+	}
+
+	if (buffer_size) {
+		if (flush_interval <= 0) {
+			LM_WARN("bad value for flush_interval (%d), using 1000 ms\n",
+				flush_interval);
+			flush_interval = 1000;
+		}
+
+		flat_buffers = pkg_malloc(initial_capacity*sizeof(struct flat_buffer));
+		if (!flat_buffers) {
+			LM_ERR("no more pkg memory for the write buffers\n");
+			return -1;
+		}
+		memset(flat_buffers, 0, initial_capacity*sizeof(struct flat_buffer));
+
+		if (buf_flusher_init(&flat_flusher, "evi-flat-flush", flush_interval,
+		flat_flush_all) < 0) {
+			LM_ERR("failed to set up the buffer flushing\n");
+			return -1;
+		}
+
+		LM_DBG("buffering up to %d bytes per file, flushed every %d ms\n",
+			buffer_size, flush_interval);
+	}
+
 	return 0;
 }
 
@@ -219,11 +269,90 @@ static void destroy(void){
 
 }
 
-/* it does not do nothing */
 static int child_init(int rank){
 	return 0;
 }
 
+/* dump the buffered lines of a file index into its current descriptor */
+static int flat_flush(int index)
+{
+	struct flat_buffer *fb;
+	int rc = 0;
+
+	if (!flat_buffers || !flat_buffers[index].len)
+		return 0;
+
+	fb = &flat_buffers[index];
+
+	if (opened_fds[index] < 0 ||
+	buf_write_all(opened_fds[index], fb->buf, fb->len) < 0) {
+		LM_ERR("cannot write %d buffered bytes to socket\n", fb->len);
+		rc = -1;
+	} else if (fsync_policy == FLAT_FSYNC_WRITE)
+		fdatasync(opened_fds[index]);
+
+	fb->len = 0;
+	return rc;
+}
+
+static void flat_flush_all(void)
+{
+	int i;
+
+	if (!flat_buffers)
+		return;
+
+	for (i = 0; i < initial_capacity; i++)
+		flat_flush(i);
+
+	buf_flusher_flushed(&flat_flusher);
+}
+
+/* append a line to the buffer of a file index; returns 1 if the line
+ * does not fit into an empty buffer and must be written directly */
+static int flat_buffer_line(int index, struct iovec *iov, int iovcnt)
+{
+	struct flat_buffer *fb = &flat_buffers[index];
+	char *p;
+	int i, total = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (total > buffer_size) {
+		flat_flush(index);
+		return 1;
+	}
+
+	if (buf_flusher_register_proc(&flat_flusher) < 0)
+		return 1;
+
+	if (!fb->buf) {
+		fb->buf = pkg_malloc(buffer_size);
+		if (!fb->buf) {
+			LM_ERR("no more pkg memory for the write buffer\n");
+			return 1;
+		}
+	}
+
+	if (fb->len + total > buffer_size)
+		flat_flush(index);
+
+	/* the length is only updated once the whole line is in, so an exit
+	 * flush never sees a partial record */
+	p = fb->buf + fb->len;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	fb->len += total;
+
+	if (buf_flusher_touch(&flat_flusher) > 0)
+		flat_flush_all();
+
+	return 0;
+}
+
 /* compare two str values */
 static int str_cmp(str a , str b){
 	if(a.len == b.len && strncmp(a.s,b.s,a.len)==0)
@@ -477,6 +606,11 @@ static void rotating(struct flat_socket *fs){
 		rotate_version[index] = fs->rotate_version;
 		lock_release(global_lock);
 
+		/* whatever was buffered belongs to the old file */
+		flat_flush(index);
+		if (fsync_policy != FLAT_FSYNC_NONE)
+			fdatasync(opened_fds[index]);
+
 		/* rotate */
 		rc = close(opened_fds[index]);
 		if(rc < 0){
@@ -568,10 +702,21 @@ static int flat_raise(struct sip_msg *msg, str* ev_name,
 	io_param[idx].iov_len = 1;
 	idx++;
 
+	if (flat_buffers &&
+	flat_buffer_line(entry->file_index_process, io_param, idx) == 0) {
+		if (ev_name && ev_name->s)
+			LM_DBG("buffered event: %.*s has %d parameters\n",
+				ev_name->len, ev_name->s, nr_params);
+		return 0;
+	}
+
 	do {
 		nwritten = writev(opened_fds[entry->file_index_process], io_param, idx);
 	} while (nwritten < 0 && errno == EINTR);
 
+	if (nwritten >= 0 && fsync_policy == FLAT_FSYNC_WRITE)
+		fdatasync(opened_fds[entry->file_index_process]);
+
 	if (ev_name && ev_name->s)
 		LM_DBG("raised event: %.*s has %d parameters\n", ev_name->len, ev_name->s, nr_params);
 
@@ -632,6 +777,9 @@ static void verify_delete(void) {
 	while (aux != NULL) {
 		if (opened_fds[aux->socket->file_index_process] != -1) {
 			LM_DBG("File %s is closed locally, open_counter is %d\n", aux->socket->path.s, aux->socket->counter_open - 1);
+			flat_flush(aux->socket->file_index_process);
+			if (fsync_policy != FLAT_FSYNC_NONE)
+				fdatasync(opened_fds[aux->socket->file_index_process]);
 			close(opened_fds[aux->socket->file_index_process]);
 			aux->socket->counter_open--;
 			opened_fds[aux->socket->file_index_process] = -1;
@@ -34,6 +34,10 @@
 
 #define FLAT_DEFAULT_MAX_FD 100
 
+#define FLAT_FSYNC_NONE		0
+#define FLAT_FSYNC_ROTATE	1
+#define FLAT_FSYNC_WRITE	2
+
 struct flat_socket {
     str path;
     unsigned int file_index_process;
@@ -49,5 +53,10 @@ struct flat_deleted {
     struct flat_deleted *next;
 };
 
+/* per-process write buffer, one for each file index */
+struct flat_buffer {
+    char *buf;
+    int len;
+};
 
 #endif
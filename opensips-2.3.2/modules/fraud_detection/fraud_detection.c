@@ -62,13 +62,13 @@ DEF_PARAM_STR_NAME(cpm, "calls per minute");
 DEF_PARAM_STR_NAME(total_calls, "total calls");
 DEF_PARAM_STR_NAME(concurrent_calls, "concurrent calls");
 DEF_PARAM_STR_NAME(seq_calls, "sequential calls");
+DEF_PARAM_STR_NAME(cph, "calls per hour");
 #undef DEF_PARAM_STR_NAME
 
 
 dr_head_p *dr_head;
 struct dr_binds drb;
 rw_lock_t *frd_data_lock;
-gen_lock_t *frd_seq_calls_lock;
 
 struct dlg_binds dlgb;
 
@@ -181,15 +181,6 @@ static int mod_init(void)
 		return -1;
 	}
 
-	if ((frd_seq_calls_lock = lock_alloc()) == NULL) {
-		LM_ERR("cannot alloc seq_calls lock\n");
-		return -1;
-	}
-	if (lock_init(frd_seq_calls_lock) == NULL) {
-		LM_ERR ("cannot init seq_calls lock\n");
-		return -1;
-	}
-
 	if (load_dlg_api(&dlgb) != 0) {
 		LM_ERR("failed to load dialog binds\n");
 		return -1;
@@ -313,85 +304,15 @@ static int check_fraud(struct sip_msg *msg, char *_user, char *_number, char *_p
 	prefix.len = matched_len;
 	str shm_user;
 	frd_stats_entry_t *se = get_stats(user, prefix, &shm_user);
-
-	/* Check if we need to reset the stats */
-
-	struct tm now, then;
-	time_t nowt = time(NULL);
-
-	/* We lock all the stats values */
-	lock_get(&se->lock);
-	if (gmtime_r(&se->stats.last_matched_time, &then) == NULL
-			|| gmtime_r(&nowt, &now) == NULL) {
-		LM_ERR ("Cannot use gmtime function. Will exit\n");
-		lock_release(&se->lock);
-		return rc_ok_thr;
-	}
-
-	if (se->stats.last_matched_time == 0 || se->stats.last_matched_rule != rule->id
-			|| then.tm_yday != now.tm_yday || then.tm_year != now.tm_year) {
-		se->stats.cpm = 0;
-		se->stats.total_calls = 0;
-		se->stats.concurrent_calls = 0;
-	}
-
-	/* Update the stats */
-
-	lock_get(frd_seq_calls_lock);
-	if (se->stats.last_called_prefix.len == matched_len &&
-			memcmp(se->stats.last_called_prefix.s, number.s, matched_len) == 0) {
-
-		/* We have called the same number last time */
-		++se->stats.seq_calls;
-	}
-	else {
-		if (shm_str_resize(&se->stats.last_called_prefix, matched_len) != 0) {
-			LM_ERR("oom\n");
-			return rc_error;
-		}
-		memcpy(se->stats.last_called_prefix.s, number.s, matched_len);
-		se->stats.seq_calls = 1;
-	}
-	lock_release(frd_seq_calls_lock);
-
-	se->stats.last_matched_rule = rule->id;
-	++se->stats.total_calls;
-
-	/* Calls per FRD_SECS_PER_WINDOW */
-	if (nowt - se->stats.last_matched_time >= 2 * FRD_SECS_PER_WINDOW) {
-		/* outside the range of t0 + 2*WINDOW_SIZE; we can't use any of the
-		 * data since they are too old */
-		se->stats.cpm = 0;
-		memset(se->stats.calls_window, 0,
-				sizeof(unsigned short) * FRD_SECS_PER_WINDOW);
-		se->stats.calls_window[nowt % FRD_SECS_PER_WINDOW] = 1;
-		se->stats.last_matched_time = nowt;
-	}
-	else if (nowt - se->stats.last_matched_time >= FRD_SECS_PER_WINDOW) {
-		/* more than t0 + WINDOW_SIZE but less than 2 * WINDOW_SIZE
-		 * we can consider calls from t0 + (now - WINDOW_SIZE)
-		 * all cals from t0 to t0 + (now - WINDOW_SIZE) shall be invalidated */
-		unsigned int old_matched_time = se->stats.last_matched_time;
-
-		se->stats.last_matched_time = nowt - FRD_SECS_PER_WINDOW + 1;
-
-		/*interval [old_last_matched_time; current_last_matched_time) shall
-		 * be invalidated */
-		unsigned int i = (se->stats.last_matched_time - 1) % FRD_SECS_PER_WINDOW;
-		unsigned int j = (old_matched_time - 1) % FRD_SECS_PER_WINDOW;
-		for (;i != j; i = (i - 1 + FRD_SECS_PER_WINDOW) % FRD_SECS_PER_WINDOW) {
-			se->stats.cpm -= se->stats.calls_window[i];
-			se->stats.calls_window[i] = 0;
-		}
-		se->stats.calls_window[nowt%FRD_SECS_PER_WINDOW]++;
-	} else {
-		/* less than t0 + WINDOW_SIZE; all we need to do is to increase
-		 * the number of calls for nowt */
-		se->stats.calls_window[nowt%FRD_SECS_PER_WINDOW]++;
+	if (se == NULL) {
+		LM_ERR("cannot get the stats for user <%.*s>\n", user.len, user.s);
+		lock_stop_read(frd_data_lock);
+		return rc_error;
 	}
 
-	++se->stats.cpm;
-	++se->stats.concurrent_calls;
+	/* Update the stats - no locking, all counters are atomic */
+	frd_stats_snap_t cur;
+	update_stats(se, rule->id, time(NULL), &cur);
 
 	/* Check the thresholds */
 	int rc = rc_ok_thr;
@@ -399,8 +320,8 @@ static int check_fraud(struct sip_msg *msg, char *_user, char *_number, char *_p
 	frd_thresholds_t *thr = (frd_thresholds_t*)rule->attrs.s;
 
 #define CHECK_AND_RAISE(pname, type) \
-	(se->stats.pname >= thr->pname ## _thr.type) { \
-		raise_ ## type ## _event(&pname ## _name, &se->stats.pname,\
+	(cur.pname >= thr->pname ## _thr.type) { \
+		raise_ ## type ## _event(&pname ## _name, &cur.pname,\
 				&thr->pname ## _thr.type, &user, &number, &rule->id);\
 		rc = rc_ ## type ## _thr;\
 	}
@@ -416,8 +337,6 @@ static int check_fraud(struct sip_msg *msg, char *_user, char *_number, char *_p
 
 #undef CHECK_AND_RAISE
 
-	lock_release(&se->lock);
-
 	/* Set dialog callback to check call duration */
 	struct dlg_cell *dlgc = dlgb.get_dlg();
 	if (dlgc == NULL) {
@@ -485,7 +404,8 @@ static struct mi_root* mi_show_stats(struct mi_root *cmd_tree, void *param)
 		return init_mi_tree(400, MI_BAD_PARM_S, MI_BAD_PARM_LEN);
 	}
 
-	if (!stats_exist(user, prefix)) {
+	frd_stats_entry_t *se = find_stats(user, prefix);
+	if (se == NULL) {
 		LM_WARN("There is no data for user<%.*s> and prefix=<%.*s>\n",
 				user.len, user.s, prefix.len, prefix.s);
 		return init_mi_tree(400, MI_BAD_PARM_S, MI_BAD_PARM_LEN);
@@ -497,8 +417,9 @@ static struct mi_root* mi_show_stats(struct mi_root *cmd_tree, void *param)
 		return 0;
 	rpl_tree->node.flags |= MI_IS_ARRAY;
 
-	frd_stats_entry_t *se = get_stats(user, prefix, NULL);
-	lock_get(&se->lock);
+	/* a lockless snapshot, not to hold back check_fraud() */
+	frd_stats_snap_t cur;
+	read_stats(se, time(NULL), &cur);
 
 #define ADD_STAT_CHILD(pname, pval) do {\
 	int val_len;\
@@ -508,18 +429,17 @@ static struct mi_root* mi_show_stats(struct mi_root *cmd_tree, void *param)
 		goto add_error;\
 } while (0)
 
-	ADD_STAT_CHILD(cpm, se->stats.cpm);
-	ADD_STAT_CHILD(total_calls, se->stats.total_calls);
-	ADD_STAT_CHILD(concurrent_calls, se->stats.concurrent_calls);
-	ADD_STAT_CHILD(seq_calls, se->stats.seq_calls);
+	ADD_STAT_CHILD(cpm, cur.cpm);
+	ADD_STAT_CHILD(cph, cur.cph);
+	ADD_STAT_CHILD(total_calls, cur.total_calls);
+	ADD_STAT_CHILD(concurrent_calls, cur.concurrent_calls);
+	ADD_STAT_CHILD(seq_calls, cur.seq_calls);
 
 #undef ADD_STAT_CHILD
 
-	lock_release(&se->lock);
 	return rpl_tree;
 
 add_error:
-	lock_release(&se->lock);
 	LM_ERR("failed to add node\n");
 	free_mi_tree(rpl_tree);
 	return 0;
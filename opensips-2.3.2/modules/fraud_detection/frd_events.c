@@ -165,9 +165,7 @@ void dialog_terminate_CB(struct dlg_cell *dlgc, int type,
 					&frdparam->user, &frdparam->number, &frdparam->ruleid);
 	}
 
-	lock_get(&frdparam->stats->lock);
-	--frdparam->stats->stats.concurrent_calls;
-	lock_release(&frdparam->stats->lock);
+	end_call_stats(frdparam->stats);
 
 	shm_free(frdparam->number.s);
 	shm_free(frdparam);
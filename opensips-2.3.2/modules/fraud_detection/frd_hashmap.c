@@ -24,63 +24,174 @@
  *  2014-09-26  initial version (Andrei Datcu)
 */
 
+#include <string.h>
+
 #include "frd_hashmap.h"
 
 #include "../../hash_func.h"
-#include "../../str.h"
-#include "../../locking.h"
+#include "../../mem/shm_mem.h"
+#include "../../dprint.h"
+
+#define shard_of(_hm, _h) (&(_hm)->shards[(_h) & (FRD_HASH_SHARDS - 1)])
+#define slot_of(_sh, _h)  (((_h) / FRD_HASH_SHARDS) & ((_sh)->size - 1))
+
+#define item_match(_s, _h, _user, _prefix) \
+	((_s)->hash == (_h) && \
+	(_s)->item->user.len == (_user)->len && \
+	(_s)->item->prefix.len == (_prefix)->len && \
+	memcmp((_s)->item->user.s, (_user)->s, (_user)->len) == 0 && \
+	memcmp((_s)->item->prefix.s, (_prefix)->s, (_prefix)->len) == 0)
 
 int init_hash_map(hash_map_t *hm)
 {
-	hm->buckets = shm_malloc(hm->size * sizeof(hash_bucket_t));
-	if (hm->buckets == NULL) {
+	unsigned int i;
+
+	hm->mem = shm_malloc(FRD_HASH_SHARDS * sizeof(hash_shard_t) +
+			FRD_CACHE_LINE - 1);
+	if (hm->mem == NULL) {
 		LM_ERR("No more shm memory\n");
 		return -1;
 	}
+	hm->shards = (hash_shard_t *)FRD_ALIGN(hm->mem);
+	memset(hm->shards, 0, FRD_HASH_SHARDS * sizeof(hash_shard_t));
 
-	unsigned int i;
+	for (i = 0; i < FRD_HASH_SHARDS; ++i) {
+		hm->shards[i].size = FRD_HASH_SHARD_SIZE;
+		hm->shards[i].slots =
+			shm_malloc(FRD_HASH_SHARD_SIZE * sizeof(hash_slot_t));
+		if (hm->shards[i].slots == NULL) {
+			LM_ERR("No more shm memory\n");
+			goto error;
+		}
+		memset(hm->shards[i].slots, 0,
+			FRD_HASH_SHARD_SIZE * sizeof(hash_slot_t));
 
-	for (i = 0; i < hm->size; ++i) {
-		hm->buckets[i].items = map_create(AVLMAP_SHARED);
-		hm->buckets[i].lock = lock_init_rw();
-		if (hm->buckets[i].lock == NULL) {
+		if (lock_init(&hm->shards[i].lock) == NULL) {
 			LM_ERR("cannot init lock\n");
-			shm_free(hm->buckets);
-			return -1;
+			goto error;
 		}
 	}
 
 	return 0;
+error:
+	for (i = 0; i < FRD_HASH_SHARDS; ++i)
+		if (hm->shards[i].slots)
+			shm_free(hm->shards[i].slots);
+	shm_free(hm->mem);
+	hm->mem = NULL;
+	return -1;
 }
 
-void** get_item (hash_map_t *hm, str key)
+/* doubles the slot array of a shard; must be called under its lock */
+static int grow_shard(hash_shard_t *sh)
 {
-	unsigned int hash = core_hash(&key, NULL, hm->size);
+	hash_slot_t *old = sh->slots, *slots;
+	unsigned int old_size = sh->size, i, j;
 
-	lock_start_read(hm->buckets[hash].lock);
-	void **find_res = map_find(hm->buckets[hash].items, key);
-	lock_stop_read(hm->buckets[hash].lock);
-	if (find_res) {
-		return find_res;
+	slots = shm_malloc(2 * old_size * sizeof(hash_slot_t));
+	if (slots == NULL) {
+		LM_ERR("No more shm memory\n");
+		return -1;
 	}
-	else {
-		lock_start_write(hm->buckets[hash].lock);
-		find_res = map_get(hm->buckets[hash].items, key);
-		lock_stop_write(hm->buckets[hash].lock);
-		return find_res;
+	memset(slots, 0, 2 * old_size * sizeof(hash_slot_t));
+
+	sh->slots = slots;
+	sh->size = 2 * old_size;
+
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].item == NULL)
+			continue;
+		for (j = slot_of(sh, old[i].hash); slots[j].item;
+		j = (j + 1) & (sh->size - 1));
+		slots[j] = old[i];
 	}
+
+	shm_free(old);
+	return 0;
 }
 
-void free_hash_map(hash_map_t* hm, void (*value_destroy_func)(void *))
+static inline hash_slot_t* probe(hash_shard_t *sh, unsigned int hash,
+		str *user, str *prefix)
 {
+	hash_slot_t *s;
 	unsigned int i;
-	for (i = 0; i < hm->size; ++i) {
-		lock_start_write(hm->buckets[i].lock);
-		map_destroy(hm->buckets[i].items, value_destroy_func);
-		lock_stop_write(hm->buckets[i].lock);
-		lock_destroy_rw(hm->buckets[i].lock);
+
+	for (i = slot_of(sh, hash); (s = &sh->slots[i])->item;
+	i = (i + 1) & (sh->size - 1))
+		if (item_match(s, hash, user, prefix))
+			break;
+
+	return s;
+}
+
+frd_stats_entry_t* find_item(hash_map_t *hm, str *user, str *prefix)
+{
+	unsigned int hash = core_hash(user, prefix, 0);
+	hash_shard_t *sh = shard_of(hm, hash);
+	frd_stats_entry_t *item;
+
+	lock_get(&sh->lock);
+	item = probe(sh, hash, user, prefix)->item;
+	lock_release(&sh->lock);
+
+	return item;
+}
+
+frd_stats_entry_t* get_item(hash_map_t *hm, str *user, str *prefix,
+		hash_item_new_f new_item)
+{
+	unsigned int hash = core_hash(user, prefix, 0);
+	hash_shard_t *sh = shard_of(hm, hash);
+	hash_slot_t *s;
+	frd_stats_entry_t *item;
+
+	lock_get(&sh->lock);
+
+	s = probe(sh, hash, user, prefix);
+	if (s->item) {
+		item = s->item;
+		goto done;
+	}
+
+	/* keep the load factor under 3/4 */
+	if (4 * (sh->used + 1) > 3 * sh->size) {
+		if (grow_shard(sh) != 0) {
+			item = NULL;
+			goto done;
+		}
+		s = probe(sh, hash, user, prefix);
+	}
+
+	item = new_item(user, prefix);
+	if (item) {
+		s->hash = hash;
+		s->item = item;
+		sh->used++;
 	}
-	shm_free(hm->buckets);
+
+done:
+	lock_release(&sh->lock);
+	return item;
 }
 
+void free_hash_map(hash_map_t* hm, void (*value_destroy_func)(void *))
+{
+	unsigned int i, j;
+	hash_shard_t *sh;
+
+	if (hm->mem == NULL)
+		return;
 
+	for (i = 0; i < FRD_HASH_SHARDS; ++i) {
+		sh = &hm->shards[i];
+		if (sh->slots == NULL)
+			continue;
+		for (j = 0; j < sh->size; ++j)
+			if (sh->slots[j].item)
+				value_destroy_func(sh->slots[j].item);
+		shm_free(sh->slots);
+		lock_destroy(&sh->lock);
+	}
+	shm_free(hm->mem);
+	hm->mem = NULL;
+}
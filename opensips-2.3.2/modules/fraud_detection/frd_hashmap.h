@@ -27,23 +27,40 @@
 #ifndef __FRD_HASHMAP_H__
 #define __FRD_HASHMAP_H__
 
-#include "../../map.h"
-#include "../../rw_locking.h"
+#include "../../str.h"
+#include "../../locking.h"
+#include "frd_stats.h"
+
+/* Each (user, prefix) pair is kept in one of FRD_HASH_SHARDS independently
+ * locked open addressing tables (linear probing), picked by the low bits
+ * of the hash. A shard only grows by itself, under its own lock, and the
+ * items never move - only the slot arrays are reallocated. */
+#define FRD_HASH_SHARDS      64
+#define FRD_HASH_SHARD_SIZE  16
 
 typedef struct {
-	map_t items;
-	rw_lock_t   *lock;
-} hash_bucket_t;
+	unsigned int hash;
+	frd_stats_entry_t *item;
+} hash_slot_t;
 
 typedef struct {
-	hash_bucket_t *buckets;
-	size_t size;
-} hash_map_t;
+	gen_lock_t lock;
+	unsigned int size;
+	unsigned int used;
+	hash_slot_t *slots;
+} __attribute__((aligned(FRD_CACHE_LINE))) hash_shard_t;
 
+typedef struct {
+	hash_shard_t *shards;
+	void *mem;
+} hash_map_t;
 
+typedef frd_stats_entry_t* (*hash_item_new_f)(str *user, str *prefix);
 
 int init_hash_map(hash_map_t* hm);
-void** get_item (hash_map_t *hm, str key);
+frd_stats_entry_t* find_item(hash_map_t *hm, str *user, str *prefix);
+frd_stats_entry_t* get_item(hash_map_t *hm, str *user, str *prefix,
+		hash_item_new_f new_item);
 void free_hash_map(hash_map_t* hm, void (*value_destroy_func)(void *));
 
 #endif
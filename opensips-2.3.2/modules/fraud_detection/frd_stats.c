@@ -27,21 +27,13 @@
 #include <string.h>
 #include "frd_stats.h"
 #include "frd_hashmap.h"
+#include "../../mem/shm_mem.h"
 #include "../../ut.h"
 
 
-/* Struct used for the first level of the hashmap
- * the user is kept in shm for two reasons :
- *     a) to keep using core's map
- *     b) to pass it for the dialog_end callback
-*/
-
-typedef struct {
-
-	hash_map_t numbers_hm;
-	str user;
-} frd_users_map_item_t;
-
+/* Entries are keyed by (user, prefix) and are never removed while running,
+ * as the dialog callbacks keep pointers to them. The user is kept in shm
+ * to be passed to the dialog_end callback. */
 static hash_map_t stats_table;
 
 /*
@@ -50,79 +42,157 @@ static hash_map_t stats_table;
 
 int init_stats_table(void)
 {
-	stats_table.size = FRD_USER_HASH_SIZE;
 	return init_hash_map(&stats_table);
 }
 
 
-frd_stats_entry_t* get_stats(str user, str prefix, str *shm_user)
+static frd_stats_entry_t* new_stats_entry(str *user, str *prefix)
 {
-	/* First go one level below using the user key */
-	frd_users_map_item_t **hm =
-		(frd_users_map_item_t **)get_item(&stats_table, user);
-
-	if (*hm == NULL) {
-		/* First time the user is seen, we must create a hashmap */
-		*hm = shm_malloc(sizeof(frd_users_map_item_t));
-		if (*hm == NULL) {
-			LM_ERR("no more shm memory\n");
-			return NULL;
-		}
+	frd_stats_entry_t *se;
+	void *mem;
+
+	/* keep each entry on its own cache lines, the counters are hot */
+	mem = shm_malloc(sizeof(frd_stats_entry_t) + FRD_CACHE_LINE - 1 +
+			user->len + prefix->len);
+	if (mem == NULL) {
+		LM_ERR("no more shm memory\n");
+		return NULL;
+	}
 
-		(*hm)->numbers_hm.size = FRD_PREFIX_HASH_SIZE;
-		if (init_hash_map(&(*hm)->numbers_hm) != 0) {
-			LM_ERR("cannot init hashmap\n");
-			shm_free(*hm);
-			return NULL;
-		}
+	se = (frd_stats_entry_t *)FRD_ALIGN(mem);
+	memset(se, 0, sizeof(frd_stats_entry_t));
+	se->mem = mem;
 
-		if (shm_str_dup(&(*hm)->user, &user) != 0) {
-			shm_free(*hm);
-			return NULL;
-		}
+	if (!lock_init(&se->lock)) {
+		LM_ERR ("cannot init lock\n");
+		shm_free(mem);
+		return NULL;
 	}
 
-	if (shm_user)
-		*shm_user = (*hm)->user;
-
-	frd_stats_entry_t **stats_entry =
-		(frd_stats_entry_t**)get_item(&(*hm)->numbers_hm, prefix);
-	if (*stats_entry == NULL) {
-		/* First time the prefix is seen for this user */
-		*stats_entry = shm_malloc(sizeof(frd_stats_entry_t));
-		if (*stats_entry == NULL) {
-			LM_ERR("no more shm memory\n");
-			return NULL;
-		}
+	se->user.s = (char *)(se + 1);
+	se->user.len = user->len;
+	memcpy(se->user.s, user->s, user->len);
+	se->prefix.s = se->user.s + user->len;
+	se->prefix.len = prefix->len;
+	memcpy(se->prefix.s, prefix->s, prefix->len);
 
-		/* Now init the auxiliary info for a stats structure */
-		if (!lock_init(&(*stats_entry)->lock)) {
-			LM_ERR ("cannot init lock\n");
-			shm_free(*stats_entry);
-			return NULL;
-		}
-		memset(&((*stats_entry)->stats), 0, sizeof(frd_stats_t));
+	return se;
+}
+
+frd_stats_entry_t* get_stats(str user, str prefix, str *shm_user)
+{
+	frd_stats_entry_t *se = get_item(&stats_table, &user, &prefix,
+			new_stats_entry);
+
+	if (se && shm_user)
+		*shm_user = se->user;
+
+	return se;
+}
+
+
+frd_stats_entry_t* find_stats(str user, str prefix)
+{
+	return find_item(&stats_table, &user, &prefix);
+}
+
+
+/*
+ * Sliding windows
+*/
+
+static inline void window_add(frd_window_bucket_t *w, unsigned int n,
+		unsigned int slot)
+{
+	frd_window_bucket_t *b = &w[slot % n];
+	frd_window_bucket_t old, new;
+
+	do {
+		old = *b;
+		if ((unsigned int)(old >> 32) == slot)
+			new = old + 1;
+		else
+			new = ((frd_window_bucket_t)slot << 32) | 1;
+	} while (__sync_val_compare_and_swap(b, old, new) != old);
+}
+
+/* sums the buckets of the last n slots, up to (and including) slot */
+static inline unsigned int window_sum(frd_window_bucket_t *w, unsigned int n,
+		unsigned int slot)
+{
+	frd_window_bucket_t v;
+	unsigned int i, sum = 0;
+
+	for (i = 0; i < n; i++) {
+		v = w[i];
+		if (slot - (unsigned int)(v >> 32) < n)
+			sum += (unsigned int)v;
 	}
 
-	return *stats_entry;
+	return sum;
 }
 
 
-int stats_exist(str user, str prefix)
+/*
+ * Called for each new call matching a rule. The counters are restarted
+ * every day and whenever a different rule matches.
+*/
+
+void update_stats(frd_stats_entry_t *se, unsigned int rule_id, time_t now,
+		frd_stats_snap_t *snap)
 {
-	/* First go one level below using the user key */
-	frd_users_map_item_t **hm =
-		(frd_users_map_item_t **)get_item(&stats_table, user);
+	frd_stats_t *st = &se->stats;
+	unsigned int day = now / 86400;
+
+	if (st->last_matched_day != day || st->last_matched_rule != rule_id) {
+		lock_get(&se->lock);
+		if (st->last_matched_day != day || st->last_matched_rule != rule_id) {
+			st->total_calls = 0;
+			st->concurrent_calls = 0;
+			memset(st->calls_window, 0, sizeof st->calls_window);
+			memset(st->hour_window, 0, sizeof st->hour_window);
+			st->last_matched_rule = rule_id;
+			__sync_synchronize();
+			st->last_matched_day = day;
+		}
+		lock_release(&se->lock);
+	}
+
+	window_add(st->calls_window, FRD_SECS_PER_WINDOW, now);
+	window_add(st->hour_window, FRD_MINS_PER_WINDOW, now / 60);
 
-	if (*hm == NULL)
-		return 0;
+	snap->total_calls = __sync_add_and_fetch(&st->total_calls, 1);
+	snap->concurrent_calls = __sync_add_and_fetch(&st->concurrent_calls, 1);
+	/* the entry is per prefix, so the last called prefix is always the
+	 * same one - every call of the entry is a sequential one */
+	snap->seq_calls = __sync_add_and_fetch(&st->seq_calls, 1);
+	snap->cpm = window_sum(st->calls_window, FRD_SECS_PER_WINDOW, now);
+	snap->cph = window_sum(st->hour_window, FRD_MINS_PER_WINDOW, now / 60);
+}
 
-	frd_stats_entry_t **stats_entry =
-		(frd_stats_entry_t**)get_item(&(*hm)->numbers_hm, prefix);
-	if (*stats_entry == NULL)
-		return 0;
+/* lockless read of the current counters */
+void read_stats(frd_stats_entry_t *se, time_t now, frd_stats_snap_t *snap)
+{
+	frd_stats_t *st = &se->stats;
 
-	return 1;
+	snap->total_calls = st->total_calls;
+	snap->concurrent_calls = st->concurrent_calls;
+	snap->seq_calls = st->seq_calls;
+	snap->cpm = window_sum(st->calls_window, FRD_SECS_PER_WINDOW, now);
+	snap->cph = window_sum(st->hour_window, FRD_MINS_PER_WINDOW, now / 60);
+}
+
+void end_call_stats(frd_stats_entry_t *se)
+{
+	unsigned int old;
+
+	/* the counter may have been restarted meanwhile, do not wrap it */
+	do {
+		old = se->stats.concurrent_calls;
+		if (old == 0)
+			return;
+	} while (__sync_val_compare_and_swap(&se->stats.concurrent_calls,
+	old, old - 1) != old);
 }
 
 /*
@@ -132,18 +202,10 @@ int stats_exist(str user, str prefix)
 static void destroy_stats_entry(void *e)
 {
 	lock_destroy( &((frd_stats_entry_t*)e)->lock );
-	shm_free(e);
-}
-
-static void destroy_users(void *u)
-{
-	frd_users_map_item_t *hm = (frd_users_map_item_t*)u;
-	free_hash_map(&hm->numbers_hm, destroy_stats_entry);
-	shm_free(hm->user.s);
-	shm_free(u);
+	shm_free(((frd_stats_entry_t*)e)->mem);
 }
 
 void free_stats_table(void)
 {
-	free_hash_map(&stats_table, destroy_users);
+	free_hash_map(&stats_table, destroy_stats_entry);
 }
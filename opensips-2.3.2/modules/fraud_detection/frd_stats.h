@@ -27,37 +27,68 @@
 #ifndef __FRD_STATS_H__
 #define __FRD_STATS_H__
 
+#include <time.h>
+
 #include "../../str.h"
 #include "../../locking.h"
-#include "../../rw_locking.h"
 
-#define FRD_USER_HASH_SIZE 1000
-#define FRD_PREFIX_HASH_SIZE 10
 #define FRD_SECS_PER_WINDOW 60
+#define FRD_MINS_PER_WINDOW 60
+
+#define FRD_CACHE_LINE 64
+#define FRD_ALIGN(_p) \
+	((void *)(((unsigned long)(_p) + FRD_CACHE_LINE - 1) & \
+		~(unsigned long)(FRD_CACHE_LINE - 1)))
 
+/* A sliding window of calls, one bucket per time slot. Each bucket packs
+ * the slot it counts for (high 32 bits) and the number of calls (low 32
+ * bits), so it is updated with a single CAS and the stale ones are simply
+ * skipped when summing - no sweeping needed as time passes. */
+typedef unsigned long long frd_window_bucket_t;
+
+/* All counters are updated with atomic operations; the entry lock is only
+ * taken to reset them when the day or the matched rule changes */
 typedef struct {
-	unsigned int cpm;
 	unsigned int total_calls;
 	unsigned int concurrent_calls;
-
-	str last_called_prefix;
 	unsigned int seq_calls;
 
 	unsigned int last_matched_rule;
-	time_t last_matched_time;
-	unsigned short calls_window[FRD_SECS_PER_WINDOW];
+	unsigned int last_matched_day;
+
+	/* calls per minute, in 1 second buckets */
+	frd_window_bucket_t calls_window[FRD_SECS_PER_WINDOW];
+	/* calls per hour, in 1 minute buckets */
+	frd_window_bucket_t hour_window[FRD_MINS_PER_WINDOW];
 } frd_stats_t;
 
 typedef struct _frd_hash_item {
-	gen_lock_t            lock;
 	frd_stats_t           stats;
-} frd_stats_entry_t;
+	gen_lock_t            lock;
+	str                   user;
+	str                   prefix;
+	void                  *mem;
+} __attribute__((aligned(FRD_CACHE_LINE))) frd_stats_entry_t;
+
+/* a point in time copy of the counters, as checked against thresholds */
+typedef struct {
+	unsigned int cpm;
+	unsigned int cph;
+	unsigned int total_calls;
+	unsigned int concurrent_calls;
+	unsigned int seq_calls;
+} frd_stats_snap_t;
 
 int init_stats_table(void);
 frd_stats_entry_t* get_stats(str user, str prefix, str *shm_user);
-int stats_exist(str user, str prefix);
+frd_stats_entry_t* find_stats(str user, str prefix);
 void free_stats_table(void);
 
+void update_stats(frd_stats_entry_t *se, unsigned int rule_id, time_t now,
+		frd_stats_snap_t *snap);
+void read_stats(frd_stats_entry_t *se, time_t now, frd_stats_snap_t *snap);
+void end_call_stats(frd_stats_entry_t *se);
+
 
 typedef struct {
 	unsigned int warning;
@@ -45,6 +45,9 @@
  * 2010-09-23 Remove force-rtp-proxy function
  */
 
+#ifdef __OS_linux
+#define _GNU_SOURCE /* sendmmsg() */
+#endif
 #include <sys/types.h>
 #include <netinet/in.h>
 #ifndef __USE_BSD
@@ -57,6 +60,9 @@
 #endif
 #include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../../data_lump.h"
 #include "../../data_lump_rpl.h"
@@ -67,6 +73,7 @@
 #include "../../msg_translator.h"
 #include "../../socket_info.h"
 #include "../../mod_fix.h"
+#include "../../statistics.h"
 #include "../registrar/sip_msg.h"
 #include "../usrloc/usrloc.h"
 #include "../usrloc/ul_mod.h"
@@ -96,6 +103,9 @@
 #define SKIP_OLDMEDIAIP		(1<<1)
 #define REMOVE_ON_TIMEOUT (sipping_flag && rm_on_to_flag)
 
+/* max number of UDP keepalives pushed to the kernel in one go */
+#define NH_BATCH_SIZE		64
+
 
 static int nat_uac_test_f(struct sip_msg* msg, char* str1, char* str2);
 static int fix_nated_contact_f(struct sip_msg *, char *, char *);
@@ -107,6 +117,8 @@ static int add_rcv_param_f(struct sip_msg *, char *, char *);
 static int get_oldip_fields_value(modparam_t type, void* val);
 
 static void nh_timer(unsigned int, void *);
+static void nh_keepalive_process(int rank);
+static int nh_sipping_rpl_filter(struct sip_msg *rpl);
 static void
 ping_checker_timer(unsigned int ticks, void *timer_idx);
 static int mod_init(void);
@@ -196,6 +208,8 @@ static int rm_on_to_flag = -1;
 static char *rm_on_to_flag_str = 0;
 static int natping_tcp = 0;
 static int natping_partitions = 1;
+static int natping_processes = 0;
+static int natping_slices = 10;
 
 static char* rcv_avp_param = NULL;
 static unsigned short rcv_avp_type = 0;
@@ -210,6 +224,15 @@ int skip_oldip=0;
 /*0-> disabled, 1 ->enabled*/
 unsigned int *natping_state=0;
 
+static stat_var *natping_sent;
+static stat_var *natping_sip_sent;
+static stat_var *natping_batches;
+static stat_var *natping_send_errors;
+static stat_var *natping_replies;
+static stat_var *natping_lost;
+static stat_var *natping_removed;
+static stat_var *natping_late_slices;
+
 
 static cmd_export_t cmds[] = {
 	{"fix_nated_contact",  (cmd_function)fix_nated_contact_f,    0,
@@ -253,6 +276,8 @@ static param_export_t params[] = {
 	{"remove_on_timeout_bflag",  INT_PARAM, &rm_on_to_flag         },
 	{"natping_tcp",              INT_PARAM, &natping_tcp           },
 	{"natping_partitions",       INT_PARAM, &natping_partitions    },
+	{"natping_processes",        INT_PARAM, &natping_processes     },
+	{"natping_slices",           INT_PARAM, &natping_slices        },
 	{"natping_socket",           STR_PARAM, &natping_socket        },
 	{"oldip_skip",			     STR_PARAM|USE_FUNC_PARAM,
 								   (void*)get_oldip_fields_value},
@@ -261,6 +286,24 @@ static param_export_t params[] = {
 	{0, 0, 0}
 };
 
+static stat_export_t mod_stats[] = {
+	{"natping_sent",        0, &natping_sent        },
+	{"natping_sip_sent",    0, &natping_sip_sent    },
+	{"natping_batches",     0, &natping_batches     },
+	{"natping_send_errors", 0, &natping_send_errors },
+	{"natping_replies",     0, &natping_replies     },
+	{"natping_lost",        0, &natping_lost        },
+	{"natping_removed",     0, &natping_removed     },
+	{"natping_late_slices", 0, &natping_late_slices },
+	{0, 0, 0}
+};
+
+static proc_export_t procs[] = {
+	/* the child init of usrloc opens its DB connection (db_mode 3) */
+	{"NAT keepalive",  0,  0, nh_keepalive_process, 0, PROC_FLAG_INITCHILD},
+	{0,0,0,0,0,0}
+};
+
 static mi_export_t mi_cmds[] = {
 	{MI_SET_NATPING_STATE, 0, mi_enable_natping,    0,                0, 0},
 	{ 0, 0, 0, 0, 0, 0}
@@ -293,10 +336,10 @@ struct module_exports exports = {
 	cmds,
 	NULL,
 	params,
-	0,           /* exported statistics */
+	mod_stats,   /* exported statistics */
 	mi_cmds,     /* exported MI functions */
 	0,           /* exported pseudo-variables */
-	0,           /* extra processes */
+	procs,       /* extra processes */
 	mod_init,
 	0,           /* reply processing */
 	mod_destroy, /* destroy function */
@@ -567,7 +610,7 @@ mod_init(void)
 			}
 			sipping_method.len = strlen(sipping_method.s);
 			sipping_from.len = strlen(sipping_from.s);
-			exports.response_f = sipping_rpl_filter;
+			exports.response_f = nh_sipping_rpl_filter;
 			init_sip_ping(rm_on_to_flag);
 		}
 
@@ -593,12 +636,25 @@ mod_init(void)
 			}
 		}
 
-		for( i=0 ; i<natping_partitions ; i++ ) {
-			if (register_timer( "nh-timer", nh_timer,
-			(void*)(unsigned long)i, 1, TIMER_FLAG_DELAY_ON_DELAY)<0) {
-				LM_ERR("failed to register timer routine\n");
+		if (natping_processes > 0) {
+			/* dedicated keepalive processes, driving their own wheel */
+			if (natping_slices <= 0 || natping_slices > 1000) {
+				LM_ERR("invalid natping_slices %d (1..1000)\n",
+					natping_slices);
 				return -1;
 			}
+			if (natping_partitions > 1)
+				LM_WARN("natping_partitions ignored when natping_processes "
+					"is set\n");
+			procs[0].no = natping_processes;
+		} else {
+			for( i=0 ; i<natping_partitions ; i++ ) {
+				if (register_timer( "nh-timer", nh_timer,
+				(void*)(unsigned long)i, 1, TIMER_FLAG_DELAY_ON_DELAY)<0) {
+					LM_ERR("failed to register timer routine\n");
+					return -1;
+				}
+			}
 		}
 	}
 
@@ -1291,8 +1347,99 @@ static int send_raw(const char *buf, int buf_len, union sockaddr_union *to,
 }
 
 
-static void
-nh_timer(unsigned int ticks, void *timer_idx)
+/*
+ * UDP keepalive batching - the 4 bytes pings for the contacts sharing the
+ * same sending socket are queued and pushed to the kernel with a single
+ * sendmmsg() call
+ */
+static struct {
+	struct socket_info *sock;
+	int n;
+#ifdef __OS_linux
+	struct mmsghdr msgs[NH_BATCH_SIZE];
+#endif
+	struct iovec iov[NH_BATCH_SIZE];
+	union sockaddr_union to[NH_BATCH_SIZE];
+} nh_batch;
+
+static void nh_batch_flush(void)
+{
+	int n;
+#ifdef __OS_linux
+	int sent;
+#else
+	int i;
+#endif
+
+	if (nh_batch.n == 0)
+		return;
+
+#ifdef __OS_linux
+	sent = 0;
+	while (sent < nh_batch.n) {
+		n = sendmmsg(nh_batch.sock->socket, nh_batch.msgs + sent,
+			nh_batch.n - sent, 0);
+		if (n < 0) {
+			if (errno==EINTR || errno==EAGAIN)
+				continue;
+			/* the first message of the remaining batch failed - drop it
+			 * and go on with the rest */
+			LM_ERR("sendmmsg failed on %.*s: %s(%d)\n",
+				nh_batch.sock->sock_str.len, nh_batch.sock->sock_str.s,
+				strerror(errno), errno);
+			update_stat(natping_send_errors, 1);
+			sent++;
+			continue;
+		}
+		update_stat(natping_sent, n);
+		sent += n;
+	}
+#else
+	for (i = 0; i < nh_batch.n; i++) {
+		n = sendto(nh_batch.sock->socket, sbuf, sizeof(sbuf), 0,
+			&nh_batch.to[i].s, sockaddru_len(nh_batch.to[i]));
+		if (n < 0) {
+			LM_ERR("sendto failed on %.*s: %s(%d)\n",
+				nh_batch.sock->sock_str.len, nh_batch.sock->sock_str.s,
+				strerror(errno), errno);
+			update_stat(natping_send_errors, 1);
+			continue;
+		}
+		update_stat(natping_sent, 1);
+	}
+#endif
+	update_stat(natping_batches, 1);
+
+	nh_batch.n = 0;
+	nh_batch.sock = NULL;
+}
+
+static void nh_batch_add(struct socket_info *sock, union sockaddr_union *to)
+{
+	int i;
+
+	if (nh_batch.sock != sock || nh_batch.n == NH_BATCH_SIZE)
+		nh_batch_flush();
+
+	i = nh_batch.n++;
+	nh_batch.sock = sock;
+	nh_batch.to[i] = *to;
+	nh_batch.iov[i].iov_base = (void *)sbuf;
+	nh_batch.iov[i].iov_len = sizeof(sbuf);
+#ifdef __OS_linux
+	memset(&nh_batch.msgs[i], 0, sizeof(nh_batch.msgs[i]));
+	nh_batch.msgs[i].msg_hdr.msg_name = &nh_batch.to[i].s;
+	nh_batch.msgs[i].msg_hdr.msg_namelen = sockaddru_len(*to);
+	nh_batch.msgs[i].msg_hdr.msg_iov = &nh_batch.iov[i];
+	nh_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+}
+
+
+/*
+ * pings all the contacts of the given usrloc partition
+ */
+static void nh_ping_contacts(unsigned int part_idx, unsigned int part_max)
 {
 	int rval;
 	void *buf = NULL;
@@ -1322,9 +1469,7 @@ nh_timer(unsigned int ticks, void *timer_idx)
 
 	for ( d=ul.get_next_udomain(NULL); d; d=ul.get_next_udomain(d)) {
 		rval = ul.get_domain_ucontacts(d, buf, cblen, (ping_nated_only?ul.nat_flag:0),
-			((unsigned int)(unsigned long)timer_idx)*natping_interval+
-			(ticks%natping_interval), natping_partitions*natping_interval,
-			REMOVE_ON_TIMEOUT?1:0);
+			part_idx, part_max, REMOVE_ON_TIMEOUT?1:0);
 
 		if (rval<0) {
 			LM_ERR("failed to fetch contacts\n");
@@ -1341,9 +1486,7 @@ nh_timer(unsigned int ticks, void *timer_idx)
 			}
 
 			rval = ul.get_domain_ucontacts(d, buf, cblen, (ping_nated_only?ul.nat_flag:0),
-				((unsigned int)(unsigned long)timer_idx)*natping_interval+
-				(ticks%natping_interval), natping_partitions*natping_interval,
-				REMOVE_ON_TIMEOUT?1:0);
+				part_idx, part_max, REMOVE_ON_TIMEOUT?1:0);
 			if (rval != 0) {
 				goto done;
 			}
@@ -1410,28 +1553,109 @@ nh_timer(unsigned int ticks, void *timer_idx)
 									   contact_id ,flags&rm_on_to_flag))) {
 				if (msg_send(send_sock, next_hop.proto, &to, 0, opt.s, opt.len, NULL) < 0) {
 					LM_ERR("sip msg_send failed\n");
+					update_stat(natping_send_errors, 1);
+				} else {
+					update_stat(natping_sip_sent, 1);
 				}
 			} else if (raw_ip && next_hop.proto == PROTO_UDP) {
 				if (send_raw((char*)sbuf, sizeof(sbuf), &to, raw_ip, raw_port)<0) {
 					LM_ERR("send_raw failed\n");
+					update_stat(natping_send_errors, 1);
+				} else {
+					update_stat(natping_sent, 1);
 				}
+			} else if (next_hop.proto == PROTO_UDP &&
+			send_sock->proto == PROTO_UDP) {
+				nh_batch_add(send_sock, &to);
 			} else {
 				if (msg_send(send_sock, next_hop.proto, &to, 0,
 				             (char *)sbuf, sizeof(sbuf), NULL) < 0) {
 					LM_ERR("sip msg_send failed!\n");
+					update_stat(natping_send_errors, 1);
+				} else {
+					update_stat(natping_sent, 1);
 				}
 			}
 		}
+
+		nh_batch_flush();
 	}
 
 	tcp_no_new_conn = 0;
 
 done:
+	nh_batch_flush();
 	if (buf)
 		pkg_free(buf);
 }
 
 
+static void
+nh_timer(unsigned int ticks, void *timer_idx)
+{
+	nh_ping_contacts(((unsigned int)(unsigned long)timer_idx)*natping_interval+
+		(ticks%natping_interval), natping_partitions*natping_interval);
+}
+
+
+/*
+ * Dedicated keepalive process. Each process owns a timing wheel of
+ * natping_interval*natping_slices slots; every slot maps onto its own
+ * usrloc partition, so the whole contact set is walked once per interval,
+ * in small, evenly spaced chunks instead of once-per-second bursts.
+ */
+static void nh_keepalive_process(int rank)
+{
+	struct timespec next, crt;
+	unsigned int wheel, slot;
+	long long lag;
+
+	wheel = natping_interval * natping_slices;
+	slot = 0;
+
+	LM_DBG("NAT keepalive process %d started, %u slots per wheel\n",
+		rank, wheel);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for( ;; ) {
+		nh_ping_contacts(rank*wheel + slot, natping_processes*wheel);
+		slot = (slot + 1) % wheel;
+
+		next.tv_nsec += 1000000000 / natping_slices;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &crt);
+		lag = (long long)(crt.tv_sec - next.tv_sec) * 1000000 +
+			(crt.tv_nsec - next.tv_nsec) / 1000;
+		if (lag >= 0) {
+			/* we are late for the next slot - do it right away */
+			update_stat(natping_late_slices, 1);
+			/* after a long stall, do not try to catch up in a burst */
+			if (lag > 1000000)
+				next = crt;
+			continue;
+		}
+
+		usleep((useconds_t)-lag);
+	}
+}
+
+
+static int nh_sipping_rpl_filter(struct sip_msg *rpl)
+{
+	int rc;
+
+	rc = sipping_rpl_filter(rpl);
+	if (rc == 0)
+		update_stat(natping_replies, 1);
+
+	return rc;
+}
+
+
 /*
  * Create received SIP uri that will be either
  * passed to registrar in an AVP or apended
@@ -1714,6 +1938,7 @@ ping_checker_timer(unsigned int ticks, void *timer_idx)
 		LM_DBG("cell with cid %llu has %d unresponded pings\n",
 				(long long unsigned int)cell->contact_id, cell->not_responded);
 		cell->not_responded++;
+		update_stat(natping_lost, 1);
 
 		if (cell->not_responded >= max_pings_lost) {
 			LM_DBG("cell with cid %llu exceeded max pings threshold! removing...\n",
@@ -1735,6 +1960,8 @@ ping_checker_timer(unsigned int ticks, void *timer_idx)
 				ul.delete_ucontact_from_id(_d, _contact_id, 0) < 0) {
 				/* we keep going since it might work for other contacts */
 				LM_ERR("failed to remove ucontact from db\n");
+			} else {
+				update_stat(natping_removed, 1);
 			}
 		} else {
 			prev = cell;
@@ -46,6 +46,7 @@
 #include "../../timer.h"
 #include "../../locking.h"
 #include "ip_tree.h"
+#include "pike_sketch.h"
 #include "timer.h"
 #include "pike_mi.h"
 #include "pike_funcs.h"
@@ -65,10 +66,16 @@ static int max_reqs  = 30;
 static char *pike_route_s = NULL;
 int timeout   = 120;
 int pike_log_level = L_WARN;
+static char *backend_s = "tree";
+static int sketch_width = 4096;
+static int sketch_depth = 4;
+static int sketch_slots = 4;
+int pike_use_sketch = 0;
 
 /* global variables */
 gen_lock_t*             timer_lock=0;
 struct list_link*       timer = 0;
+struct clusterer_binds  clusterer_api;
 
 /* event id */
 static str pike_block_event = str_init("E_PIKE_BLOCKED");
@@ -86,6 +93,13 @@ static param_export_t params[]={
 	{"remove_latency",        INT_PARAM,  &timeout},
 	{"pike_log_level",        INT_PARAM,  &pike_log_level},
 	{"check_route",           STR_PARAM,  &pike_route_s},
+	{"detection_backend",     STR_PARAM,  &backend_s},
+	{"sketch_width",          INT_PARAM,  &sketch_width},
+	{"sketch_depth",          INT_PARAM,  &sketch_depth},
+	{"sketch_slots",          INT_PARAM,  &sketch_slots},
+	{"replicate_sketch_to",   INT_PARAM,  &pike_sketch_repl_cluster},
+	{"accept_sketch_from",    INT_PARAM,  &pike_sketch_accept_cluster},
+	{"repl_sketch_auth_check",INT_PARAM,  &pike_sketch_repl_auth_check},
 	{0,0,0}
 };
 
@@ -99,12 +113,34 @@ static mi_export_t mi_cmds [] = {
 };
 
 
+static module_dependency_t *get_deps_clusterer(param_export_t *param)
+{
+	int cluster_id = *(int *)param->param_pointer;
+
+	if (cluster_id <= 0)
+		return NULL;
+
+	return alloc_module_dep(MOD_TYPE_DEFAULT, "clusterer", DEP_ABORT);
+}
+
+static dep_export_t deps = {
+	{ /* OpenSIPS module dependencies */
+		{ MOD_TYPE_NULL, NULL, 0 },
+	},
+	{ /* modparam dependencies */
+		{ "replicate_sketch_to",	get_deps_clusterer	},
+		{ "accept_sketch_from",		get_deps_clusterer	},
+		{ NULL, NULL },
+	},
+};
+
+
 struct module_exports exports= {
 	"pike",
 	MOD_TYPE_DEFAULT,/* class of this module */
 	MODULE_VERSION,
 	DEFAULT_DLFLAGS, /* dlopen flags */
-	NULL,            /* OpenSIPS module dependencies */
+	&deps,           /* OpenSIPS module dependencies */
 	cmds,
 	0,
 	params,
@@ -121,12 +157,58 @@ struct module_exports exports= {
 
 
 
+static int init_sketch_backend(void)
+{
+	if (pike_sketch_repl_cluster < 0 || pike_sketch_accept_cluster < 0) {
+		LM_ERR("invalid cluster id, must be 0 or a positive cluster id\n");
+		return -1;
+	}
+
+	if ((pike_sketch_repl_cluster || pike_sketch_accept_cluster) &&
+	load_clusterer_api(&clusterer_api)!=0) {
+		LM_ERR("failed to find clusterer API - is clusterer module loaded?\n");
+		return -1;
+	}
+
+	if (init_pike_sketch(sketch_width, sketch_depth, sketch_slots,
+	max_reqs)!=0) {
+		LM_ERR("sketch creation failed!\n");
+		return -1;
+	}
+
+	/* the window spans one sampling unit and slides one slot at a time */
+	if (register_utimer("pike-slide", pike_sketch_slide, 0,
+	time_unit*1000000/sketch_slots, TIMER_FLAG_DELAY_ON_DELAY)<0) {
+		LM_ERR("failed to register utimer\n");
+		return -1;
+	}
+
+	if (pike_sketch_repl_init()!=0)
+		return -1;
+
+	return 0;
+}
+
+
 static int pike_init(void)
 {
 	int rt;
 
 	LM_INFO("initializing...\n");
 
+	if (strcasecmp(backend_s, "sketch")==0) {
+		pike_use_sketch = 1;
+	} else if (strcasecmp(backend_s, "tree")!=0) {
+		LM_ERR("unknown detection backend <%s>\n", backend_s);
+		return -1;
+	}
+
+	if (pike_use_sketch) {
+		if (init_sketch_backend()!=0)
+			return -1;
+		goto check_route;
+	}
+
 	/* alloc the timer lock */
 	timer_lock=lock_alloc();
 	if (timer_lock==0) {
@@ -159,24 +241,32 @@ static int pike_init(void)
 	register_timer( "pike-swap", swap_routine , 0, time_unit,
 		TIMER_FLAG_DELAY_ON_DELAY );
 
+check_route:
 	if (pike_route_s && *pike_route_s) {
 		rt = get_script_route_ID_by_name( pike_route_s, rlist, RT_NO);
 		if (rt<1) {
 			LM_ERR("route <%s> does not exist\n",pike_route_s);
-			return -1;
+			goto error4;
 		}
 
 		/* register the script callback to get all requests and replies */
 		if (register_script_cb( run_pike_route ,
 		PARSE_ERR_CB|REQ_TYPE_CB|RPL_TYPE_CB|PRE_SCRIPT_CB, (void*)(long)rt )!=0 ) {
 			LM_ERR("failed to register script callbacks\n");
-			goto error3;
+			goto error4;
 		}
 	}
 	if((pike_event_id = evi_publish_event(pike_block_event)) == EVI_ERROR)
 		LM_ERR("cannot register pike flood start event\n");
 
 	return 0;
+error4:
+	if (pike_use_sketch) {
+		destroy_pike_sketch();
+		return -1;
+	}
+	shm_free(timer);
+	timer = 0;
 error3:
 	destroy_ip_tree();
 error2:
@@ -208,6 +298,8 @@ static int pike_exit(void)
 	/* destroy the IP tree */
 	destroy_ip_tree();
 
+	destroy_pike_sketch();
+
 	return 0;
 }
 
@@ -46,6 +46,7 @@
 #include "../../route.h"
 #include "../../script_cb.h"
 #include "ip_tree.h"
+#include "pike_sketch.h"
 #include "pike_funcs.h"
 #include "timer.h"
 
@@ -59,6 +60,7 @@ extern int               pike_log_level;
 extern int               pike_start_level;
 extern int               pike_stop_level;
 extern event_id_t        pike_event_id;
+extern int               pike_use_sketch;
 
 static inline void pike_raise_event(char *ip)
 {
@@ -96,6 +98,7 @@ int pike_check_req(struct sip_msg *msg)
 	struct ip_node *father;
 	unsigned char flags;
 	struct ip_addr* ip;
+	int ret;
 
 
 #ifdef _test
@@ -112,6 +115,16 @@ int pike_check_req(struct sip_msg *msg)
 	ip = &(msg->rcv.src_ip);
 #endif
 
+	/* the sketch needs no tree locking and no timer list */
+	if (pike_use_sketch) {
+		ret = pike_sketch_check(ip);
+		if (ret==-2) {
+			LM_GEN1( pike_log_level,
+				"PIKE - BLOCKing ip %s (sketch)\n",ip_addr2a(ip));
+			pike_raise_event(ip_addr2a(ip));
+		}
+		return ret;
+	}
 
 	/* first lock the proper tree branch and mark the IP with one more hit*/
 	lock_tree_branch( ip->u.addr[0] );
@@ -29,6 +29,7 @@
 #include "../../resolve.h"
 
 #include "ip_tree.h"
+#include "pike_sketch.h"
 #include "pike_mi.h"
 
 #define IPv6_LEN 16
@@ -38,6 +39,7 @@
 
 static struct 		 ip_node *ip_stack[MAX_IP_LEN];
 extern int    		 pike_log_level;
+extern int    		 pike_use_sketch;
 
 
 static inline void print_ip_stack( int level, struct mi_node *node)
@@ -99,6 +101,9 @@ struct mi_root* mi_pike_rm(struct mi_root *cmd, void *param)
     struct ip_addr   *ip;
     int byte_pos;
 
+    if (pike_use_sketch)
+	return init_mi_tree( 400, MI_SSTR("Not supported by the sketch backend"));
+
     mn = cmd->node.kids;
     if (mn==NULL)
 	return init_mi_tree( 400, MI_MISSING_PARM_S, MI_MISSING_PARM_LEN);
@@ -159,6 +164,9 @@ struct mi_root* mi_pike_list(struct mi_root* cmd_tree, void* param)
 	struct ip_node *ip;
 	int i;
 
+	if (pike_use_sketch)
+		return mi_pike_sketch_list(cmd_tree, param);
+
 	rpl_tree = init_mi_tree( 200, MI_OK_S, MI_OK_LEN);
 	if (rpl_tree==0)
 		return 0;
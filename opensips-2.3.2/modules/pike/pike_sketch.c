@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Project
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ * History:
+ * --------
+ *  2017-10-02  created (fixed memory count-min sketch backend)
+ */
+
+#include <string.h>
+
+#include "../../mem/shm_mem.h"
+#include "../../locking.h"
+#include "../../dprint.h"
+#include "../../ut.h"
+#include "../../bin_interface.h"
+#include "pike_sketch.h"
+
+
+/* how many recently blocked IPs are remembered for pike_list */
+#define SKETCH_RED_RING    64
+/* flush the replication buffer when it gets bigger than this */
+#define SKETCH_REPL_BUF_TH 32768
+
+struct sketch_red_ring {
+	gen_lock_t lock;
+	unsigned int next;
+	struct ip_addr ips[SKETCH_RED_RING];
+};
+
+int pike_sketch_repl_cluster = 0;
+int pike_sketch_accept_cluster = 0;
+int pike_sketch_repl_auth_check = 0;
+
+extern struct clusterer_binds clusterer_api;
+
+static struct pike_sketch *sketch = 0;
+static struct sketch_red_ring *red_ring = 0;
+
+static str module_name = str_init("pike");
+
+
+/* FNV-1a with a murmur3 finalizer - good enough to spread IP bytes */
+static inline unsigned int sketch_hash(unsigned char *b, int len,
+													unsigned int seed)
+{
+	unsigned int h;
+	int i;
+
+	h = 2166136261u ^ seed;
+	for (i = 0; i < len; i++) {
+		h ^= b[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+
+/* computes the start (slot 0) of the IP's cell on each row of the sketch;
+ * the seeds are fixed so all the cluster nodes index the cells the same */
+static inline void sketch_cells(struct ip_addr *ip, unsigned int *idx)
+{
+	unsigned int h1, h2, r;
+
+	h1 = sketch_hash(ip->u.addr, ip->len, 0x9e3779b9u);
+	h2 = sketch_hash(ip->u.addr, ip->len, 0x7f4a7c15u) | 1;
+
+	for (r = 0; r < sketch->depth; r++)
+		idx[r] = (r * sketch->width + ((h1 + r * h2) & sketch->width_mask))
+			* sketch->slots;
+}
+
+
+static inline unsigned int cell_count(unsigned int *cell, unsigned int slots)
+{
+	unsigned int i, sum = 0;
+
+	for (i = 0; i < slots; i++)
+		sum += cell[i];
+	return sum;
+}
+
+
+static inline unsigned int sketch_estimate(unsigned int *idx)
+{
+	unsigned int r, v, est = (unsigned int)-1;
+
+	for (r = 0; r < sketch->depth; r++) {
+		v = cell_count(sketch->cells + idx[r], sketch->slots) +
+			cell_count(sketch->remote + idx[r], sketch->slots);
+		if (v < est)
+			est = v;
+	}
+	return est;
+}
+
+
+int init_pike_sketch(int width, int depth, int slots, int max_hits)
+{
+	unsigned int w, size;
+
+	if (depth <= 0 || depth > SKETCH_MAX_DEPTH) {
+		LM_ERR("sketch depth must be between 1 and %d\n", SKETCH_MAX_DEPTH);
+		return -1;
+	}
+	if (slots <= 0 || slots > SKETCH_MAX_SLOTS) {
+		LM_ERR("sketch slots must be between 1 and %d\n", SKETCH_MAX_SLOTS);
+		return -1;
+	}
+	if (width <= 0) {
+		LM_ERR("invalid sketch width %d\n", width);
+		return -1;
+	}
+	for (w = 1; w < (unsigned int)width; w <<= 1);
+	if (w != (unsigned int)width)
+		LM_WARN("sketch width is not a power of 2 -> rounding from %d to %u\n",
+			width, w);
+
+	sketch = shm_malloc(sizeof *sketch);
+	if (!sketch) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(sketch, 0, sizeof *sketch);
+	sketch->width = w;
+	sketch->width_mask = w - 1;
+	sketch->depth = depth;
+	sketch->slots = slots;
+	sketch->max_hits = max_hits;
+
+	size = w * depth * slots * sizeof(unsigned int);
+	sketch->cells = shm_malloc(2 * size);
+	if (!sketch->cells) {
+		LM_ERR("no more shm memory for a %ux%dx%d sketch\n", w, depth, slots);
+		goto error;
+	}
+	memset(sketch->cells, 0, 2 * size);
+	sketch->remote = sketch->cells + w * depth * slots;
+
+	red_ring = shm_malloc(sizeof *red_ring);
+	if (!red_ring) {
+		LM_ERR("no more shm memory\n");
+		goto error;
+	}
+	memset(red_ring, 0, sizeof *red_ring);
+	if (!lock_init(&red_ring->lock)) {
+		LM_ERR("failed to init lock\n");
+		goto error;
+	}
+
+	LM_DBG("using a %ux%d sketch with %d slots (%u bytes)\n",
+		w, depth, slots, 2 * size);
+	return 0;
+error:
+	destroy_pike_sketch();
+	return -1;
+}
+
+
+void destroy_pike_sketch(void)
+{
+	if (red_ring) {
+		lock_destroy(&red_ring->lock);
+		shm_free(red_ring);
+		red_ring = 0;
+	}
+	if (sketch) {
+		if (sketch->cells)
+			shm_free(sketch->cells);
+		shm_free(sketch);
+		sketch = 0;
+	}
+}
+
+
+int pike_sketch_check(struct ip_addr *ip)
+{
+	unsigned int idx[SKETCH_MAX_DEPTH];
+	unsigned int *cell, curr, r, i, v, old, est;
+
+	sketch_cells(ip, idx);
+
+	/* the estimate right before this hit, out of the values the atomic
+	 * increments replaced - concurrent hits of the same IP each see a
+	 * different count, instead of all reading the sum of them */
+	curr = sketch->curr;
+	old = (unsigned int)-1;
+	for (r = 0; r < sketch->depth; r++) {
+		cell = sketch->cells + idx[r];
+		v = __sync_fetch_and_add(cell + curr, 1);
+		for (i = 0; i < sketch->slots; i++)
+			if (i != curr)
+				v += cell[i];
+		v += cell_count(sketch->remote + idx[r], sketch->slots);
+		if (v < old)
+			old = v;
+	}
+	est = old + 1;
+
+	if (est < sketch->max_hits)
+		return 1;
+
+	if (old < sketch->max_hits) {
+		/* this hit took the IP over the limit in the current window */
+		lock_get(&red_ring->lock);
+		red_ring->ips[red_ring->next] = *ip;
+		red_ring->next = (red_ring->next + 1) % SKETCH_RED_RING;
+		lock_release(&red_ring->lock);
+		return -2;
+	}
+	return -1;
+}
+
+
+static inline void sketch_replicate(bin_packet_t *packet)
+{
+	int rc;
+
+	rc = clusterer_api.send_all(packet, pike_sketch_repl_cluster);
+	switch (rc) {
+	case CLUSTERER_CURR_DISABLED:
+		LM_INFO("Current node is disabled in cluster: %d\n",
+			pike_sketch_repl_cluster);
+		goto error;
+	case CLUSTERER_DEST_DOWN:
+		LM_INFO("All destinations in cluster: %d are down or probing\n",
+			pike_sketch_repl_cluster);
+		goto error;
+	case CLUSTERER_SEND_ERR:
+		LM_ERR("Error sending in cluster: %d\n", pike_sketch_repl_cluster);
+		goto error;
+	}
+
+	return;
+error:
+	LM_ERR("Failed to replicate pike sketch slot\n");
+}
+
+
+static inline int sketch_push_header(bin_packet_t *packet)
+{
+	if (bin_push_int(packet, sketch->width) < 0 ||
+	bin_push_int(packet, sketch->depth) < 0)
+		return -1;
+	return 0;
+}
+
+
+/* sends the non-empty cells of a closed slot to the other nodes */
+static void sketch_replicate_slot(unsigned int slot)
+{
+	bin_packet_t packet;
+	unsigned int i, n, cells;
+	int nr = 0, ret;
+
+	if (bin_init(&packet, &module_name, PIKE_SKETCH_SLOT, BIN_VERSION, 0) < 0) {
+		LM_ERR("cannot initiate bin buffer\n");
+		return;
+	}
+	if (sketch_push_header(&packet) < 0)
+		goto error;
+
+	cells = sketch->width * sketch->depth;
+	for (i = 0; i < cells; i++) {
+		n = sketch->cells[i * sketch->slots + slot];
+		if (n == 0)
+			continue;
+
+		if (bin_push_int(&packet, i) < 0 ||
+		(ret = bin_push_int(&packet, n)) < 0)
+			goto error;
+		nr++;
+
+		if (ret > SKETCH_REPL_BUF_TH) {
+			sketch_replicate(&packet);
+			bin_reset_back_pointer(&packet);
+			if (sketch_push_header(&packet) < 0)
+				goto error;
+			nr = 0;
+		}
+	}
+
+	if (nr)
+		sketch_replicate(&packet);
+	bin_free_packet(&packet);
+	return;
+error:
+	LM_ERR("cannot add sketch cells in buffer\n");
+	if (nr)
+		sketch_replicate(&packet);
+	bin_free_packet(&packet);
+}
+
+
+void pike_sketch_slide(utime_t ticks, void *param)
+{
+	unsigned int closed, next, i, cells;
+
+	closed = sketch->curr;
+	next = (closed + 1) % sketch->slots;
+
+	/* the oldest slot leaves the window -> reset it before reusing it */
+	cells = sketch->width * sketch->depth;
+	for (i = 0; i < cells; i++) {
+		sketch->cells[i * sketch->slots + next] = 0;
+		sketch->remote[i * sketch->slots + next] = 0;
+	}
+	__sync_synchronize();
+	sketch->curr = next;
+
+	if (pike_sketch_repl_cluster)
+		sketch_replicate_slot(closed);
+}
+
+
+static void pike_sketch_rcv_bin(enum clusterer_event ev, bin_packet_t *packet,
+		int packet_type, struct receive_info *ri, int cluster_id, int src_id,
+		int dest_id)
+{
+	unsigned int width, depth, curr, cells;
+	unsigned int cell, n;
+	int rc;
+
+	if (ev == CLUSTER_NODE_DOWN || ev == CLUSTER_NODE_UP)
+		return;
+	else if (ev == CLUSTER_ROUTE_FAILED) {
+		LM_INFO("failed to route replication packet of type %d from node %d to "
+			"node %d in cluster: %d\n", packet_type, src_id, dest_id, cluster_id);
+		return;
+	}
+
+	if (packet_type != PIKE_SKETCH_SLOT) {
+		LM_WARN("Invalid binary packet command: %d (from node: %d in "
+			"cluster: %d)\n", packet_type, src_id, cluster_id);
+		return;
+	}
+
+	if (bin_pop_int(packet, &width) != 0 || bin_pop_int(packet, &depth) != 0) {
+		LM_ERR("cannot pop sketch geometry\n");
+		return;
+	}
+	if (width != sketch->width || depth != sketch->depth) {
+		LM_WARN("node %d uses a %ux%u sketch, ours is %ux%u - ignoring\n",
+			src_id, width, depth, sketch->width, sketch->depth);
+		return;
+	}
+
+	cells = sketch->width * sketch->depth;
+	curr = sketch->curr;
+	for (;;) {
+		rc = bin_pop_int(packet, &cell);
+		if (rc == 1)
+			break; /* pop'ed all cells */
+		if (rc < 0 || bin_pop_int(packet, &n) != 0) {
+			LM_ERR("cannot pop sketch cell\n");
+			return;
+		}
+		if (cell >= cells) {
+			LM_ERR("bogus sketch cell %u received from node %d\n", cell, src_id);
+			return;
+		}
+		__sync_fetch_and_add(sketch->remote + cell * sketch->slots + curr, n);
+	}
+}
+
+
+int pike_sketch_repl_init(void)
+{
+	if (pike_sketch_accept_cluster &&
+	clusterer_api.register_module(module_name.s, pike_sketch_rcv_bin,
+	pike_sketch_repl_auth_check, &pike_sketch_accept_cluster, 1) < 0) {
+		LM_ERR("Cannot register clusterer callback!\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* lists the recently blocked IPs which are still above the limit */
+struct mi_root* mi_pike_sketch_list(struct mi_root* cmd_tree, void* param)
+{
+	struct mi_root* rpl_tree;
+	unsigned int idx[SKETCH_MAX_DEPTH];
+	struct ip_addr ips[SKETCH_RED_RING];
+	int i, j;
+
+	rpl_tree = init_mi_tree( 200, MI_OK_S, MI_OK_LEN);
+	if (rpl_tree==0)
+		return 0;
+	rpl_tree->node.flags |= MI_IS_ARRAY;
+
+	lock_get(&red_ring->lock);
+	memcpy(ips, red_ring->ips, sizeof ips);
+	lock_release(&red_ring->lock);
+
+	for (i = 0; i < SKETCH_RED_RING; i++) {
+		if (ips[i].len == 0)
+			continue;
+		/* skip duplicates (IP blocked again in a later window) */
+		for (j = 0; j < i; j++)
+			if (ip_addr_cmp(&ips[i], &ips[j]))
+				break;
+		if (j < i)
+			continue;
+
+		sketch_cells(&ips[i], idx);
+		if (sketch_estimate(idx) >= sketch->max_hits)
+			addf_mi_node_child(&rpl_tree->node, 0, 0, 0, "%s",
+				ip_addr2a(&ips[i]));
+	}
+
+	return rpl_tree;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Project
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ * History:
+ * --------
+ *  2017-10-02  created (fixed memory count-min sketch backend)
+ */
+
+#ifndef _PIKE_SKETCH_H
+#define _PIKE_SKETCH_H
+
+#include "../../ip_addr.h"
+#include "../../timer.h"
+#include "../../mi/mi.h"
+#include "../clusterer/api.h"
+
+#define SKETCH_MAX_DEPTH   8
+#define SKETCH_MAX_SLOTS   16
+
+#define BIN_VERSION        1
+/* replication packet carrying the counts of one closed time slot */
+#define PIKE_SKETCH_SLOT   1
+
+/*
+ * The sketch is a depth x width matrix of cells; each cell keeps one
+ * counter per time slot, so that all the slots of a cell share the same
+ * cache line. The window of the sketch covers the last "slots" slots,
+ * which together span one sampling_time_unit.
+ */
+struct pike_sketch {
+	unsigned int width;        /* power of 2 */
+	unsigned int width_mask;
+	unsigned int depth;
+	unsigned int slots;
+	volatile unsigned int curr; /* slot currently being filled */
+	unsigned int max_hits;     /* blocking threshold per window */
+	unsigned int *cells;       /* local counters */
+	unsigned int *remote;      /* counters aggregated from other nodes */
+};
+
+extern int pike_sketch_repl_cluster;
+extern int pike_sketch_accept_cluster;
+extern int pike_sketch_repl_auth_check;
+
+int init_pike_sketch(int width, int depth, int slots, int max_hits);
+void destroy_pike_sketch(void);
+
+/* same return codes as pike_check_req() */
+int pike_sketch_check(struct ip_addr *ip);
+
+/* advances the sliding window by one slot */
+void pike_sketch_slide(utime_t ticks, void *param);
+
+int pike_sketch_repl_init(void);
+
+struct mi_root* mi_pike_sketch_list(struct mi_root* cmd_tree, void* param);
+
+#endif
@@ -216,6 +216,7 @@ int add_event(pres_ev_t* event)
 	ev->agg_nbody= event->agg_nbody;
 	ev->apply_auth_nbody= event->apply_auth_nbody;
 	ev->get_auth_status= event->get_auth_status;
+	ev->get_auth_variant= event->get_auth_variant;
 	ev->get_rules_doc= event->get_rules_doc;
 	ev->evs_publ_handl= event->evs_publ_handl;
 	ev->evs_subs_handl= event->evs_subs_handl;
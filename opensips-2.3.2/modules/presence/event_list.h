@@ -62,6 +62,12 @@ typedef str* (aux_body_processing_t)(struct subscription *subs, str* body);
  *           pointer: a pointer to str for the "per watcher" body. gets freed by aux_free_body()
  *	*/
 typedef int (is_allowed_t)(struct subscription* subs);
+typedef int (auth_variant_t)(struct subscription* subs);
+/* return value for auth_variant_t
+ *	< 0  if the body can not be shared with other watchers
+ *	>=0  an id of the body apply_auth_nbody builds for this watcher - the
+ *	     watchers with the same id get the same body
+ *	*/
 typedef int (get_rules_doc_t)(str* user, str* domain, str** rules_doc);
 /* return code rules for is_allowed_t
  *	< 0  if error occurred
@@ -107,6 +113,9 @@ struct pres_ev
 	get_rules_doc_t* get_rules_doc;
 	apply_auth_t*  apply_auth_nbody;
 	is_allowed_t*  get_auth_status;
+	/* optional - lets a NOTIFY fan-out call apply_auth_nbody only once
+	 * for the watchers matching the same authorization rule */
+	auth_variant_t* get_auth_variant;
 
 	/* an agg_body_t function should be registered if the event permits having
 	 * multiple published states and requires an aggregation of the information
@@ -376,11 +376,38 @@ int update_shtable(shtable_t htable,unsigned int hash_code,
 	return 0;
 }
 
+/* records dropped from the hash table while still in database - the next
+ * write-behind run deletes them from database, with the other writes */
+typedef struct pres_dropped
+{
+	pres_entry_t* entries;
+	gen_lock_t lock;
+}pres_dropped_t;
+
+static pres_dropped_t* pres_dropped= NULL;
+
+static void free_phtable_entry(pres_entry_t* p);
+
 phtable_t* new_phtable(void)
 {
 	phtable_t* htable= NULL;
 	int i, j;
 
+	pres_dropped= (pres_dropped_t*)shm_malloc(sizeof(pres_dropped_t));
+	if(pres_dropped== NULL)
+	{
+		LM_ERR("No more %s memory\n", SHARE_MEM);
+		return NULL;
+	}
+	pres_dropped->entries= NULL;
+	if(lock_init(&pres_dropped->lock)== 0)
+	{
+		LM_ERR("initializing lock\n");
+		shm_free(pres_dropped);
+		pres_dropped= NULL;
+		return NULL;
+	}
+
 	i = 0;
 	htable= (phtable_t*)shm_malloc(phtable_size* sizeof(phtable_t));
 	if(htable== NULL)
@@ -429,6 +456,19 @@ void destroy_phtable(void)
 	int i;
 	pres_entry_t* p, *prev_p;
 
+	if(pres_dropped)
+	{
+		lock_destroy(&pres_dropped->lock);
+		while(pres_dropped->entries)
+		{
+			p= pres_dropped->entries;
+			pres_dropped->entries= p->next;
+			free_phtable_entry(p);
+		}
+		shm_free(pres_dropped);
+		pres_dropped= NULL;
+	}
+
 	if(pres_htable== NULL)
 		return;
 
@@ -442,6 +482,8 @@ void destroy_phtable(void)
 			p= p->next;
 			if(prev_p->sphere)
 				shm_free(prev_p->sphere);
+			if(prev_p->data)
+				shm_free(prev_p->data);
 			shm_free(prev_p);
 		}
 	}
@@ -585,12 +627,11 @@ void next_turn_phtable(pres_entry_t* p_p, unsigned int hash_code)
 }
 
 
-int delete_phtable(pres_entry_t* p, unsigned int hash_code)
+/* entry must be locked before calling this function */
+static int unlink_phtable(pres_entry_t* p, unsigned int hash_code)
 {
 	pres_entry_t* prev_p= NULL;
 
-	LM_DBG("Count = 0, delete\n");
-	/* delete record */
 	prev_p= pres_htable[hash_code].entries;
 	while(prev_p->next)
 	{
@@ -604,10 +645,265 @@ int delete_phtable(pres_entry_t* p, unsigned int hash_code)
 		return -1;
 	}
 	prev_p->next= p->next;
+
+	return 0;
+}
+
+static void free_phtable_entry(pres_entry_t* p)
+{
 	if(p->sphere)
 		shm_free(p->sphere);
+	if(p->data)
+		shm_free(p->data);
 	shm_free(p);
+}
+
+int delete_phtable(pres_entry_t* p, unsigned int hash_code)
+{
+	LM_DBG("Count = 0, delete\n");
+	/* delete record */
+	if(unlink_phtable(p, hash_code)< 0)
+		return -1;
+	free_phtable_entry(p);
+
+	return 0;
+}
+
+/* entry must be locked before calling this function (if not in mod_init)
+ * a NULL body or extra_hdrs keeps the already stored one */
+int pres_store_set(pres_entry_t* p, str* event_name, str* body,
+		str* extra_hdrs, str* sender, int expires, int received_time)
+{
+	str new_body, new_hdrs, body_cp, hdrs_cp;
+	char* data;
+	int size= 0;
+
+	new_body= (body && body->s)? *body: p->body;
+	new_hdrs= (extra_hdrs && extra_hdrs->s)? *extra_hdrs: p->extra_hdrs;
+
+	data= (char*)shm_malloc(event_name->len+ new_body.len+ new_hdrs.len+
+			(sender? sender->len: 0)+ 1);
+	if(data== NULL)
+	{
+		ERR_MEM(SHARE_MEM);
+	}
+
+	/* the old values may still be in use as source */
+	CONT_COPY(data, p->event_name, (*event_name));
+	CONT_COPY(data, body_cp, new_body);
+	CONT_COPY(data, hdrs_cp, new_hdrs);
+	if(sender)
+	{
+		CONT_COPY(data, p->sender, (*sender));
+	}
+	else
+	{
+		p->sender.s= data+ size;
+		p->sender.len= 0;
+	}
+	p->body= body_cp;
+	p->extra_hdrs= hdrs_cp;
+
+	if(p->data)
+		shm_free(p->data);
+	p->data= data;
+	p->expires= expires;
+	p->received_time= received_time;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+int pres_store_update(pres_entry_t* p, unsigned int hash_code,
+		presentity_t* presentity, str* body, int insert)
+{
+	pres_entry_t* it;
+
+	lock_get(&pres_htable[hash_code].lock);
+	for(it= pres_htable[hash_code].entries->next; it && it!= p; it= it->next);
+	if(it== NULL)
+	{
+		LM_ERR("record not found in hash table\n");
+		goto error;
+	}
+
+	if(pres_store_set(p, &presentity->event->name, body,
+				presentity->extra_hdrs, presentity->sender,
+				presentity->expires+ (int)time(NULL),
+				presentity->received_time)< 0)
+	{
+		LM_ERR("failed to store published state\n");
+		goto error;
+	}
+
+	if(insert)
+		p->db_flag= INSERTDB_FLAG;
+	else
+	if(p->db_flag!= INSERTDB_FLAG)
+		p->db_flag= UPDATEDB_FLAG;
+
+	lock_release(&pres_htable[hash_code].lock);
+	return 0;
+
+error:
+	lock_release(&pres_htable[hash_code].lock);
+	return -1;
+}
+
+/* copies in a pkg array, ordered by the received time, the records
+ * published for a presentity and an event */
+int pres_store_search(str* pres_uri, int event, unsigned int hash_code,
+		pres_rec_t** recs, int* n)
+{
+	pres_entry_t* p;
+	pres_rec_t* r;
+	char* buf;
+	int size= 0, i, j;
+
+	*recs= NULL;
+	*n= 0;
+
+	lock_get(&pres_htable[hash_code].lock);
+
+	for(p= pres_htable[hash_code].entries->next; p; p= p->next)
+	{
+		if(p->data && p->event== event && p->pres_uri.len== pres_uri->len &&
+				strncmp(p->pres_uri.s, pres_uri->s, pres_uri->len)== 0)
+		{
+			size+= p->body.len+ p->extra_hdrs.len+ p->etag_len;
+			(*n)++;
+		}
+	}
+	if(*n== 0)
+	{
+		lock_release(&pres_htable[hash_code].lock);
+		return 0;
+	}
+
+	r= (pres_rec_t*)pkg_malloc((*n)* sizeof(pres_rec_t)+ size);
+	if(r== NULL)
+	{
+		lock_release(&pres_htable[hash_code].lock);
+		*n= 0;
+		ERR_MEM(PKG_MEM_STR);
+	}
+	buf= (char*)(r+ *n);
+	size= 0;
+
+	for(i= 0, p= pres_htable[hash_code].entries->next; p; p= p->next)
+	{
+		if(!(p->data && p->event== event && p->pres_uri.len== pres_uri->len &&
+				strncmp(p->pres_uri.s, pres_uri->s, pres_uri->len)== 0))
+			continue;
+
+		/* keep the array ordered by received time */
+		for(j= i; j> 0 && r[j-1].received_time> p->received_time; j--)
+			r[j]= r[j-1];
+
+		CONT_COPY(buf, r[j].body, p->body);
+		CONT_COPY(buf, r[j].extra_hdrs, p->extra_hdrs);
+		r[j].etag.s= buf+ size;
+		memcpy(r[j].etag.s, p->etag, p->etag_len);
+		r[j].etag.len= p->etag_len;
+		size+= p->etag_len;
+		r[j].received_time= p->received_time;
+		i++;
+	}
+
+	lock_release(&pres_htable[hash_code].lock);
+
+	*recs= r;
+	return 0;
+
+error:
+	return -1;
+}
+
+/* frees the record, or queues its database delete for the next
+ * write-behind run if it reached the database - must be unlinked */
+static void pres_store_drop(pres_entry_t* p)
+{
+	if(p->data== NULL || p->db_flag== INSERTDB_FLAG)
+	{
+		free_phtable_entry(p);
+		return;
+	}
+
+	lock_get(&pres_dropped->lock);
+	p->next= pres_dropped->entries;
+	pres_dropped->entries= p;
+	lock_release(&pres_dropped->lock);
+}
+
+/* deletes from database the records dropped since the last run; the
+ * ones that fail are kept for the next run */
+void pres_store_flush_dropped(void)
+{
+	pres_entry_t* list, *p, *failed= NULL;
+
+	lock_get(&pres_dropped->lock);
+	list= pres_dropped->entries;
+	pres_dropped->entries= NULL;
+	lock_release(&pres_dropped->lock);
+
+	while(list)
+	{
+		p= list;
+		list= list->next;
+
+		if(pres_db_delete_record(p)< 0)
+		{
+			LM_ERR("failed to delete record from database\n");
+			p->next= failed;
+			failed= p;
+			continue;
+		}
+		free_phtable_entry(p);
+	}
+
+	if(failed== NULL)
+		return;
+
+	for(p= failed; p->next; p= p->next);
+	lock_get(&pres_dropped->lock);
+	p->next= pres_dropped->entries;
+	pres_dropped->entries= failed;
+	lock_release(&pres_dropped->lock);
+}
+
+int pres_store_delete(pres_entry_t* p, unsigned int hash_code)
+{
+	lock_get(&pres_htable[hash_code].lock);
+	if(unlink_phtable(p, hash_code)< 0)
+	{
+		lock_release(&pres_htable[hash_code].lock);
+		return -1;
+	}
+	lock_release(&pres_htable[hash_code].lock);
+
+	pres_store_drop(p);
+	return 0;
+}
+
+int pres_store_delete_query(str* pres_uri, int event, str* etag)
+{
+	pres_entry_t* p;
+	unsigned int hash_code;
+
+	hash_code= core_hash(pres_uri, 0, phtable_size);
+	lock_get(&pres_htable[hash_code].lock);
+	p= search_phtable_etag(pres_uri, event, etag, hash_code);
+	if(p== NULL || unlink_phtable(p, hash_code)< 0)
+	{
+		LM_DBG("record not found [%.*s]\n", etag->len, etag->s);
+		lock_release(&pres_htable[hash_code].lock);
+		return -1;
+	}
+	lock_release(&pres_htable[hash_code].lock);
 
+	pres_store_drop(p);
 	return 0;
 }
 
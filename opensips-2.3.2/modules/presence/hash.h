@@ -128,9 +128,29 @@ typedef struct pres_entry
 	/* ordering */
 	unsigned int current_turn;
 	unsigned int last_turn;
+	/* published state, kept only if presentity_in_memory is set */
+	str event_name;
+	str body;
+	str extra_hdrs;
+	str sender;
+	char* data;			/* shm buffer holding the strings above */
+	int expires;
+	int received_time;
+	int db_flag;
+	char db_etag[ETAG_LEN];	/* etag of the record in database */
+	int db_etag_len;
 	struct pres_entry* next;
 }pres_entry_t;
 
+/* published record, as copied from the hash table or from database */
+typedef struct pres_rec
+{
+	str body;
+	str extra_hdrs;
+	str etag;
+	int received_time;
+}pres_rec_t;
+
 typedef struct pres_htable
 {
 	pres_entry_t* entries;
@@ -156,5 +176,15 @@ int delete_phtable_query(str *pres_uri, int event, str* etag);
 
 void destroy_phtable(void);
 
+int pres_store_set(pres_entry_t* p, str* event_name, str* body,
+		str* extra_hdrs, str* sender, int expires, int received_time);
+int pres_store_update(pres_entry_t* p, unsigned int hash_code,
+		struct presentity* presentity, str* body, int insert);
+int pres_store_search(str* pres_uri, int event, unsigned int hash_code,
+		pres_rec_t** recs, int* n);
+int pres_store_delete(pres_entry_t* p, unsigned int hash_code);
+int pres_store_delete_query(str* pres_uri, int event, str* etag);
+void pres_store_flush_dropped(void);
+
 #endif
 
@@ -37,6 +37,8 @@
 #include "../../db/db.h"
 #include "../../db/db_val.h"
 #include "../../socket_info.h"
+#include "../../ipc.h"
+#include "../../locking.h"
 #include "../tm/tm_load.h"
 #include "../pua/hash.h"
 #include "presentity.h"
@@ -116,10 +118,58 @@ inline void printf_subs(subs_t* subs)
 		subs->contact.s,subs->record_route.len,subs->record_route.s);
 }
 
-int build_str_hdr(subs_t* subs, int is_body, str* hdr, str* extra_hdrs)
+/* the headers common to all the watchers of a NOTIFY fan-out (the extra
+ * headers and the event name) are written once in the template buffer, only
+ * the per watcher part is printed for every NOTIFY */
+int init_hdr_tpl(notify_hdr_tpl_t* tpl, pres_ev_t* event, str* extra_hdrs)
 {
-	int len = 0;
 	int extra_len = 0;
+	char* p;
+
+	memset(tpl, 0, sizeof(notify_hdr_tpl_t));
+	tpl->event= event;
+
+	if(extra_hdrs && extra_hdrs->s && extra_hdrs->len)
+		extra_len = extra_hdrs->len;
+
+	/* the Event header plus room for a usual per watcher part */
+	tpl->size = extra_len + 7 /*Event: */ + event->name.len + 256;
+	tpl->buf = (char*)pkg_malloc(tpl->size);
+	if(tpl->buf== NULL)
+	{
+		LM_ERR("while allocating memory\n");
+		return -1;
+	}
+
+	p = tpl->buf;
+	if (extra_len)
+	{
+		memcpy(p, extra_hdrs->s, extra_len);
+		p+= extra_len;
+	}
+	memcpy(p ,"Event: ", 7);
+	p+= 7;
+	memcpy(p, event->name.s, event->name.len);
+	p+= event->name.len;
+
+	tpl->prefix_len = p - tpl->buf;
+
+	return 0;
+}
+
+void destroy_hdr_tpl(notify_hdr_tpl_t* tpl)
+{
+	if(tpl->buf)
+		pkg_free(tpl->buf);
+	tpl->buf = NULL;
+}
+
+/* builds the headers for a watcher in the template buffer; the result
+ * is valid until the next call */
+int build_str_hdr_tpl(notify_hdr_tpl_t* tpl, subs_t* subs, int is_body,
+		str* hdr)
+{
+	int len = 0;
 	int lexpire_len;
 	char* lexpire_s;
 	char* p;
@@ -141,12 +191,11 @@ int build_str_hdr(subs_t* subs, int is_body, str* hdr, str* extra_hdrs)
 	if(status.s== NULL)
 	{
 		LM_ERR("bad status flag= %d\n", subs->status);
-		pkg_free(hdr->s);
 		return -1;
 	}
 	status.len = strlen(status.s);
 
-	len = 7 /*Event: */ + subs->event->name.len +4 /*;id=*/+ subs->event_id.len+
+	len = tpl->prefix_len + 4 /*;id=*/+ subs->event_id.len+
 		CRLF_LEN + 10 /*Contact: <*/ + subs->local_contact.len + 1/*>*/ +
 		((subs->sockinfo && subs->sockinfo->proto!=PROTO_UDP)?
 		 15/*";transport=xxxx"*/:0) + CRLF_LEN + 20 /*Subscription-State: */ +
@@ -154,28 +203,20 @@ int build_str_hdr(subs_t* subs, int is_body, str* hdr, str* extra_hdrs)
 		subs->reason.len):9/*expires=*/ + lexpire_len) + CRLF_LEN + (is_body?
 		(14 /*Content-Type: */+subs->event->content_type.len + CRLF_LEN):0);
 
-	if(extra_hdrs && extra_hdrs->s && extra_hdrs->len)
-		extra_len = extra_hdrs->len;
-
-	hdr->s = (char*)pkg_malloc(extra_len + len);
-	if(hdr->s== NULL)
+	if(len > tpl->size)
 	{
-		LM_ERR("while allocating memory\n");
-		return -1;
+		p = (char*)pkg_realloc(tpl->buf, len);
+		if(p== NULL)
+		{
+			LM_ERR("while allocating memory\n");
+			return -1;
+		}
+		tpl->buf = p;
+		tpl->size = len;
 	}
 
-	p = hdr->s;
-
-	if (extra_len)
-	{
-		memcpy(p, extra_hdrs->s, extra_len);
-		p+= extra_hdrs->len;
-	}
+	p = tpl->buf + tpl->prefix_len;
 
-	memcpy(p ,"Event: ", 7);
-	p+= 7;
-	memcpy(p, subs->event->name.s, subs->event->name.len);
-	p+= subs->event->name.len;
 	if(subs->event_id.len && subs->event_id.s)
 	{
  		memcpy(p, ";id=", 4);
@@ -199,7 +240,6 @@ int build_str_hdr(subs_t* subs, int is_body, str* hdr, str* extra_hdrs)
 		if (p == NULL)
 		{
 			LM_ERR("invalid proto\n");
-			pkg_free(hdr->s);
 			return -1;
 		}
 	}
@@ -244,7 +284,8 @@ int build_str_hdr(subs_t* subs, int is_body, str* hdr, str* extra_hdrs)
 		p += CRLF_LEN;
 	}
 
-	hdr->len = p - hdr->s;
+	hdr->s = tpl->buf;
+	hdr->len = p - tpl->buf;
 
 	return 0;
 }
@@ -818,15 +859,90 @@ static inline db_res_t* pres_search_db(struct sip_uri* uri,str* ev_name, int* bo
 	return result;
 }
 
+static inline void pres_row_str(db_val_t* v, str* s)
+{
+	s->s= (char*)v->val.string_val;
+	s->len= (VAL_NULL(v) || s->s== NULL)? 0: strlen(s->s);
+}
+
+/* fetches in a pkg array the records published for a presentity, ordered
+ * by the received time, from the hash table or from database */
+static int pres_get_records(str* pres_uri, struct sip_uri* uri,
+		pres_ev_t* event, unsigned int hash_code, pres_rec_t** recs, int* n)
+{
+	int body_col, extra_hdrs_col, expires_col, etag_col;
+	db_res_t *result;
+	db_val_t *row_vals;
+	pres_rec_t* r;
+	char* buf;
+	str body, extra_hdrs, etag;
+	int i, size= 0;
+
+	if(pres_in_memory)
+		return pres_store_search(pres_uri, event->evp->parsed, hash_code,
+				recs, n);
+
+	*recs= NULL;
+	*n= 0;
+
+	result = pres_search_db(uri, &event->name,
+			&body_col, &extra_hdrs_col, &expires_col, &etag_col);
+	if(result== NULL)
+		return -1;
+
+	if(result->n<= 0)
+	{
+		pa_dbf.free_result(pa_db, result);
+		return 0;
+	}
+
+	for(i= 0; i< result->n; i++)
+	{
+		row_vals = ROW_VALUES(&result->rows[i]);
+		pres_row_str(&row_vals[body_col], &body);
+		pres_row_str(&row_vals[extra_hdrs_col], &extra_hdrs);
+		pres_row_str(&row_vals[etag_col], &etag);
+		size+= body.len+ extra_hdrs.len+ etag.len;
+	}
+
+	r= (pres_rec_t*)pkg_malloc(result->n* sizeof(pres_rec_t)+ size);
+	if(r== NULL)
+	{
+		pa_dbf.free_result(pa_db, result);
+		ERR_MEM(PKG_MEM_STR);
+	}
+	buf= (char*)(r+ result->n);
+	size= 0;
+
+	for(i= 0; i< result->n; i++)
+	{
+		row_vals = ROW_VALUES(&result->rows[i]);
+		pres_row_str(&row_vals[body_col], &body);
+		pres_row_str(&row_vals[extra_hdrs_col], &extra_hdrs);
+		pres_row_str(&row_vals[etag_col], &etag);
+
+		CONT_COPY(buf, r[i].body, body);
+		CONT_COPY(buf, r[i].extra_hdrs, extra_hdrs);
+		CONT_COPY(buf, r[i].etag, etag);
+		/* already ordered by the query */
+		r[i].received_time= i;
+	}
+	*n= result->n;
+	*recs= r;
+
+	pa_dbf.free_result(pa_db, result);
+	return 0;
+
+error:
+	return -1;
+}
+
 str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 		unsigned int hash_code)
 {
-	db_res_t *result = NULL;
-	int body_col, extra_hdrs_col, expires_col, etag_col;
-	str body;
+	pres_rec_t* recs= NULL;
+	int n= 0;
 	str* dialog_body;
-	db_row_t *row= NULL ;
-	db_val_t *row_vals;
 	int i;
 	int ringing_index = -1;
 	int ringing_state = 0;
@@ -846,32 +962,26 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 			return NULL;
 	}
 
-	result = pres_search_db(uri, &((*dialog_event_p)->name),
-			&body_col, &extra_hdrs_col, &expires_col, &etag_col);
-	if(result== NULL)
+	if(pres_get_records(pres_uri, uri, *dialog_event_p, hash_code,
+				&recs, &n)< 0)
 		return NULL;
 
-	if (result->n<=0 )
+	if (n<=0 )
 	{
 		LM_DBG("The query returned no result, pres_uri=[%.*s] event=[dialog]\n",
 				pres_uri->len, pres_uri->s);
-		pa_dbf.free_result(pa_db, result);
 		return NULL;
 	}
 
 	/* if there are more records - go through them until you find one with a dialog */
-	for(i = result->n -1; i>=0 ; i--)
+	for(i = n -1; i>=0 ; i--)
 	{
-		row = &result->rows[i];
-		row_vals = ROW_VALUES(row);
-		body.s = (char*)row_vals[body_col].val.string_val;
-		if(body.s == NULL)
+		if(recs[i].body.len == 0)
 		{
 			LM_ERR("NULL notify body record\n");
 			goto error;
 		}
-		body.len= strlen(body.s);
-		if(get_dialog_state(body, &dlg_state) < 0)
+		if(get_dialog_state(recs[i].body, &dlg_state) < 0)
 		{
 			LM_ERR("get dialog state failed\n");
 			goto error;
@@ -887,7 +997,7 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 			ringing_state = dlg_state;
 		}
 	}
-	pa_dbf.free_result(pa_db, result);
+	pkg_free(recs);
 
 	LM_DBG("i = %d, ringing_inde = %d\n", i, ringing_index);
 
@@ -908,30 +1018,42 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 	return dialog_body;
 
 error:
-	if(result)
-		pa_dbf.free_result(pa_db, result);
+	if(recs)
+		pkg_free(recs);
 	return NULL;
 }
 
+/* copies the extra headers of the first record that has them */
+static int pres_copy_extra_hdrs(pres_rec_t* rec, str* extra_hdrs)
+{
+	if (rec->extra_hdrs.len > 0 && extra_hdrs && !extra_hdrs->s)
+	{
+		extra_hdrs->s = (char*)pkg_malloc(rec->extra_hdrs.len);
+		if (extra_hdrs->s == NULL)
+		{
+			ERR_MEM(PKG_MEM_STR);
+		}
+		memcpy(extra_hdrs->s, rec->extra_hdrs.s, rec->extra_hdrs.len);
+		extra_hdrs->len = rec->extra_hdrs.len;
+	}
+	return 0;
+
+error:
+	return -1;
+}
+
 str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body,
 		str* contact, str* dbody, str* extra_hdrs, free_body_t** free_fct, int from_publish)
 {
-	int body_col, extra_hdrs_col, expires_col, etag_col= 0;
-	db_res_t *result = NULL;
-	db_row_t *row= NULL ;
-	db_val_t *row_vals;
+	pres_rec_t* recs= NULL;
 	str** body_array= NULL;
 	str* notify_body= NULL;
 	int i, n= 0, len;
 	int build_off_n= -1;
-	str etags;
-	str* body;
-	int size= 0;
 	struct sip_uri uri;
 	unsigned int hash_code;
 	int body_cnt = 0;
 	str* dialog_body= NULL, *local_dialog_body = NULL;
-	int init_i = 0;
 	pres_entry_t* p;
 
 	if(parse_uri(pres_uri.s, pres_uri.len, &uri)< 0)
@@ -1019,18 +1141,14 @@ str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body
 		}
 	}
 
-	result = pres_search_db(&uri,&event->name,&body_col,&extra_hdrs_col,&expires_col,&etag_col);
-	if(result== NULL)
+	if(pres_get_records(&pres_uri, &uri, event, hash_code, &recs, &n)< 0)
 		return NULL;
-	if (result->n<=0 )
+	if (n<=0 )
 	{
 		LM_DBG("The query returned no result: [username]='%.*s'"
 			" [domain]='%.*s' [event]='%.*s'\n",uri.user.len, uri.user.s,
 			uri.host.len, uri.host.s, event->name.len, event->name.s);
 
-		pa_dbf.free_result(pa_db, result);
-		result= NULL;
-
 		if(event->agg_nbody)
 		{
 			/* broken - it will not work with pidf manipulation */
@@ -1068,35 +1186,14 @@ str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body
 	}
 	else
 	{
-		n= result->n;
 		if(event->agg_nbody== NULL )
 		{
 			LM_DBG("Event does not require aggregation\n");
-			row = &result->rows[n-1];
-			row_vals = ROW_VALUES(row);
 
-			if(row_vals[extra_hdrs_col].val.string_val!= NULL)
-			{
-				len = strlen(row_vals[extra_hdrs_col].val.string_val);
-				if (len > 0 && extra_hdrs && !extra_hdrs->s)
-				{
-					extra_hdrs->s = (char*)pkg_malloc(len);
-					if (extra_hdrs->s == NULL)
-					{
-						ERR_MEM(PKG_MEM_STR);
-					}
-					memcpy(extra_hdrs->s, row_vals[extra_hdrs_col].val.string_val, len);
-					extra_hdrs->len = len;
-				}
-			}
-
-			if(row_vals[body_col].val.string_val== NULL)
-			{
-				if (event->mandatory_body)
-					LM_ERR("NULL notify body record\n");
+			if(pres_copy_extra_hdrs(&recs[n-1], extra_hdrs)< 0)
 				goto error;
-			}
-			len= strlen(row_vals[body_col].val.string_val);
+
+			len= recs[n-1].body.len;
 			if(len== 0)
 			{
 				if (event->mandatory_body)
@@ -1113,11 +1210,12 @@ str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body
 			if(notify_body->s== NULL)
 			{
 				pkg_free(notify_body);
+				notify_body= NULL;
 				ERR_MEM(PKG_MEM_STR);
 			}
-			memcpy(notify_body->s, row_vals[body_col].val.string_val, len);
+			memcpy(notify_body->s, recs[n-1].body.s, len);
 			notify_body->len= len;
-			pa_dbf.free_result(pa_db, result);
+			pkg_free(recs);
 			*free_fct = (free_body_t*)pkg_free_w;
 
 			return notify_body;
@@ -1130,112 +1228,36 @@ str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body
 		}
 		memset(body_array, 0, (n+3) *sizeof(str*));
 
-		init_i = body_cnt;
 		if(etag!= NULL)
 		{
 			LM_DBG("searched etag = %.*s len= %d\n",
 					etag->len, etag->s, etag->len);
-			LM_DBG("etag not NULL\n");
-			for(i= 0; i< n; i++)
-			{
-				row = &result->rows[i];
-				row_vals = ROW_VALUES(row);
-				etags.s = (char*)row_vals[etag_col].val.string_val;
-				etags.len = strlen(etags.s);
-
-				if(row_vals[extra_hdrs_col].val.string_val!= NULL)
-				{
-					len = strlen(row_vals[extra_hdrs_col].val.string_val);
-					if (len > 0 && extra_hdrs && !extra_hdrs->s)
-					{
-						extra_hdrs->s = (char*)pkg_malloc(len);
-						if (extra_hdrs->s == NULL)
-						{
-							ERR_MEM(PKG_MEM_STR);
-						}
-						memcpy(extra_hdrs->s, row_vals[extra_hdrs_col].val.string_val, len);
-						extra_hdrs->len = len;
-					}
-				}
+		}
+		for(i= 0; i< n; i++)
+		{
+			if(pres_copy_extra_hdrs(&recs[i], extra_hdrs)< 0)
+				goto error;
 
-				LM_DBG("etag = %.*s len= %d\n", etags.len, etags.s, etags.len);
-				if( (etags.len == etag->len) && (strncmp(etags.s,
-								etag->s,etags.len)==0 ) )
+			if(etag!= NULL)
+			{
+				LM_DBG("etag = %.*s len= %d\n", recs[i].etag.len,
+						recs[i].etag.s, recs[i].etag.len);
+				if( (recs[i].etag.len == etag->len) && (strncmp(recs[i].etag.s,
+								etag->s,etag->len)==0 ) )
 				{
 					LM_DBG("found etag\n");
 					build_off_n= body_cnt;
 				}
-				len= strlen((char*)row_vals[body_col].val.string_val);
-				if(len== 0)
-				{
-					if (event->mandatory_body)
-						LM_ERR("Empty notify body record\n");
-					goto error;
-				}
-
-				size= sizeof(str)+ len;
-				body= (str*)pkg_malloc(size);
-				if(body== NULL)
-				{
-					ERR_MEM(PKG_MEM_STR);
-				}
-				memset(body, 0, size);
-				size= sizeof(str);
-				body->s= (char*)body+ size;
-				memcpy(body->s, (char*)row_vals[body_col].val.string_val, len);
-				body->len= len;
-
-				body_array[body_cnt++]= body;
 			}
-		}
-		else
-		{
-			for(i=0; i< n; i++)
+			if(recs[i].body.len== 0)
 			{
-				row = &result->rows[i];
-				row_vals = ROW_VALUES(row);
-
-				if(row_vals[extra_hdrs_col].val.string_val!= NULL)
-				{
-					len = strlen(row_vals[extra_hdrs_col].val.string_val);
-					if (len > 0 && extra_hdrs && !extra_hdrs->s)
-					{
-						extra_hdrs->s = (char*)pkg_malloc(len);
-						if (extra_hdrs->s == NULL)
-						{
-							ERR_MEM(PKG_MEM_STR);
-						}
-						memcpy(extra_hdrs->s, row_vals[extra_hdrs_col].val.string_val, len);
-						extra_hdrs->len = len;
-					}
-				}
-
-				len= strlen((char*)row_vals[body_col].val.string_val);
-				if(len== 0)
-				{
-					if (event->mandatory_body)
-						LM_ERR("Empty notify body record\n");
-					goto error;
-				}
-
-				size= sizeof(str)+ len;
-				body= (str*)pkg_malloc(size);
-				if(body== NULL)
-				{
-					ERR_MEM(PKG_MEM_STR);
-				}
-				memset(body, 0, size);
-				size= sizeof(str);
-				body->s= (char*)body+ size;
-				memcpy(body->s, row_vals[body_col].val.string_val, len);
-				body->len= len;
-
-				body_array[body_cnt++]= body;
+				if (event->mandatory_body)
+					LM_ERR("Empty notify body record\n");
+				goto error;
 			}
-		}
 
-		pa_dbf.free_result(pa_db, result);
-		result= NULL;
+			body_array[body_cnt++]= &recs[i].body;
+		}
 
 		/* put the dialog info extracted body if present */
 		if(dialog_body)
@@ -1246,7 +1268,6 @@ str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body
 		/* if the Publish with expires=0 has body -> use this one */
 		if(etag && publ_body && build_off_n>=0)
 		{
-			pkg_free(body_array[build_off_n]);
 			body_array[build_off_n] = publ_body;
 			build_off_n = -1;
 		}
@@ -1279,14 +1300,9 @@ str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag, str* publ_body
 
 done:
 	if(body_array!=NULL && body_array!=&dialog_body)
-	{
-		for(i= init_i; i< init_i + n; i++)
-		{
-			if( body_array[i] && body_array[i] != publ_body )
-				pkg_free(body_array[i]);
-		}
 		pkg_free(body_array);
-	}
+	if(recs)
+		pkg_free(recs);
 
 	if(local_dialog_body && local_dialog_body!=FAKED_BODY
 			&& local_dialog_body->s)
@@ -1299,8 +1315,8 @@ done:
 	return notify_body;
 
 error:
-	if(result!=NULL)
-		pa_dbf.free_result(pa_db, result);
+	if(recs)
+		pkg_free(recs);
 
 	if(local_dialog_body && local_dialog_body!=FAKED_BODY
 			&& local_dialog_body->s)
@@ -1310,16 +1326,7 @@ error:
 	}
 
 	if(body_array!=NULL && body_array!=&dialog_body)
-	{
-		for(i= init_i; i< init_i + n; i++)
-		{
-			if( body_array[i] && body_array[i] != publ_body )
-				pkg_free(body_array[i]);
-			else
-				break;
-		}
 		pkg_free(body_array);
-	}
 	return NULL;
 }
 
@@ -1726,6 +1733,307 @@ error:
 	return NULL;
 }
 
+/* watchers of a NOTIFY fan-out, sent in batches of notify_batch_size;
+ * the batches over the first one are handled by other processes */
+typedef struct notify_batch
+{
+	pres_ev_t* event;
+	str extra_hdrs;
+	int n;
+	subs_t** subs;
+	str* bodies;
+}notify_batch_t;
+
+typedef struct notify_workers
+{
+	gen_lock_t lock;
+	int no;
+	int procs[1];
+}notify_workers_t;
+
+typedef struct notify_target
+{
+	subs_t* subs;
+	str* body;
+	int own;	/* body built only for this watcher */
+}notify_target_t;
+
+/* body after authorization, shared by all the watchers that match
+ * the same rule */
+typedef struct body_variant
+{
+	int id;
+	str* body;
+}body_variant_t;
+
+static int notify_ipc_type= -1;
+static notify_workers_t* notify_workers= NULL;
+static int notify_workers_max= 0;
+
+static void notify_batch_handler(int sender, void *payload);
+static int notify_update_subs(subs_t* subs);
+
+int init_notify_batch(void)
+{
+	notify_workers_max= count_init_children(0);
+
+	notify_workers= (notify_workers_t*)shm_malloc(sizeof(notify_workers_t)+
+			notify_workers_max* sizeof(int));
+	if(notify_workers== NULL)
+	{
+		ERR_MEM(SHARE_MEM);
+	}
+	memset(notify_workers, 0, sizeof(notify_workers_t));
+
+	if(lock_init(&notify_workers->lock)== 0)
+	{
+		LM_ERR("failed to init lock\n");
+		goto error;
+	}
+
+	notify_ipc_type= ipc_register_handler(notify_batch_handler,
+			"Presence NOTIFY batch");
+	if(notify_ipc_type< 0)
+	{
+		LM_ERR("failed to register IPC handler\n");
+		goto error;
+	}
+
+	return 0;
+
+error:
+	if(notify_workers)
+	{
+		shm_free(notify_workers);
+		notify_workers= NULL;
+	}
+	return -1;
+}
+
+/* called by each process that may take NOTIFY batches */
+int register_notify_worker(void)
+{
+	if(notify_workers== NULL)
+		return 0;
+
+	lock_get(&notify_workers->lock);
+	if(notify_workers->no< notify_workers_max)
+		notify_workers->procs[notify_workers->no++]= process_no;
+	lock_release(&notify_workers->lock);
+
+	return 0;
+}
+
+void destroy_notify_batch(void)
+{
+	if(notify_workers== NULL)
+		return;
+
+	lock_destroy(&notify_workers->lock);
+	shm_free(notify_workers);
+	notify_workers= NULL;
+}
+
+/* round robin over the workers, other than the current process */
+static int next_notify_worker(void)
+{
+	static unsigned int rr= 0;
+	int no, proc;
+
+	if(notify_workers== NULL || (no= notify_workers->no)== 0)
+		return -1;
+
+	proc= notify_workers->procs[(rr++ + process_no)% no];
+	if(proc== process_no)
+	{
+		if(no== 1)
+			return -1;
+		proc= notify_workers->procs[(rr++ + process_no)% no];
+	}
+	return proc;
+}
+
+static void free_notify_batch(notify_batch_t* b)
+{
+	int i;
+
+	for(i= 0; i< b->n; i++)
+		if(b->subs[i])
+			shm_free(b->subs[i]);
+	shm_free(b);
+}
+
+static notify_batch_t* build_notify_batch(pres_ev_t* event, str* extra_hdrs,
+		notify_target_t* t, int n)
+{
+	notify_batch_t* b;
+	char* p;
+	int size, i, j;
+
+	size= sizeof(notify_batch_t)+ n* (sizeof(subs_t*)+ sizeof(str));
+	if(extra_hdrs && extra_hdrs->s)
+		size+= extra_hdrs->len;
+	for(i= 0; i< n; i++)
+	{
+		if(t[i].body== NULL)
+			continue;
+		for(j= 0; j< i && t[j].body!= t[i].body; j++);
+		if(j== i)
+			size+= t[i].body->len;
+	}
+
+	b= (notify_batch_t*)shm_malloc(size);
+	if(b== NULL)
+	{
+		ERR_MEM(SHARE_MEM);
+	}
+	memset(b, 0, size);
+
+	b->event= event;
+	b->subs= (subs_t**)(b+ 1);
+	b->bodies= (str*)(b->subs+ n);
+	p= (char*)(b->bodies+ n);
+
+	if(extra_hdrs && extra_hdrs->s)
+	{
+		b->extra_hdrs.s= p;
+		memcpy(p, extra_hdrs->s, extra_hdrs->len);
+		b->extra_hdrs.len= extra_hdrs->len;
+		p+= extra_hdrs->len;
+	}
+
+	for(i= 0; i< n; i++)
+	{
+		b->subs[i]= mem_copy_subs(t[i].subs, SHM_MEM_TYPE);
+		if(b->subs[i]== NULL)
+		{
+			LM_ERR("failed to copy subscription\n");
+			b->n= i;
+			free_notify_batch(b);
+			return NULL;
+		}
+
+		if(t[i].body== NULL)
+			continue;
+		/* the watchers of a variant share the body */
+		for(j= 0; j< i && t[j].body!= t[i].body; j++);
+		if(j< i)
+		{
+			b->bodies[i]= b->bodies[j];
+			continue;
+		}
+		b->bodies[i].s= p;
+		memcpy(p, t[i].body->s, t[i].body->len);
+		b->bodies[i].len= t[i].body->len;
+		p+= t[i].body->len;
+	}
+	b->n= n;
+
+	return b;
+
+error:
+	return NULL;
+}
+
+static void notify_batch_handler(int sender, void *payload)
+{
+	notify_batch_t* b= (notify_batch_t*)payload;
+	notify_hdr_tpl_t tpl;
+	int i;
+
+	LM_DBG("sending %d NOTIFY requests on behalf of process %d\n",
+			b->n, sender);
+
+	if(init_hdr_tpl(&tpl, b->event, &b->extra_hdrs)< 0)
+	{
+		LM_ERR("while building headers template\n");
+		goto done;
+	}
+
+	for(i= 0; i< b->n; i++)
+	{
+		if(send_notify_body(b->subs[i],
+				b->bodies[i].s? &b->bodies[i]: NULL, &tpl)< 0)
+			LM_ERR("Could not send notify for %.*s\n",
+					b->event->name.len, b->event->name.s);
+	}
+
+	destroy_hdr_tpl(&tpl);
+done:
+	free_notify_batch(b);
+}
+
+/* gets the body for a watcher - the authorization rules are applied only
+ * once for all the watchers matching the same rule */
+static int get_watcher_body(pres_ev_t* event, subs_t* s, str* n_body,
+		body_variant_t** vars, int* vars_no, notify_target_t* t)
+{
+	body_variant_t* v;
+	str* final_body= NULL;
+	int id= -1, i;
+
+	t->subs= s;
+	t->body= (n_body && n_body->s)? n_body: NULL;
+	t->own= 0;
+
+	if(t->body== NULL || !event->req_auth || s->auth_rules_doc== NULL ||
+			event->apply_auth_nbody== NULL)
+		return 0;
+
+	if(event->get_auth_variant)
+	{
+		id= event->get_auth_variant(s);
+		for(i= 0; id>= 0 && i< *vars_no; i++)
+		{
+			if((*vars)[i].id== id)
+			{
+				if((*vars)[i].body)
+					t->body= (*vars)[i].body;
+				return 0;
+			}
+		}
+	}
+
+	if(event->apply_auth_nbody(n_body, s, &final_body)< 0)
+	{
+		LM_ERR("in function apply_auth_nbody\n");
+		return -1;
+	}
+
+	if(id>= 0)
+	{
+		/* grow by powers of 2 */
+		if((*vars_no & (*vars_no- 1))== 0)
+		{
+			v= (body_variant_t*)pkg_realloc(*vars,
+					(*vars_no? 2* *vars_no: 1)* sizeof(body_variant_t));
+			if(v== NULL)
+			{
+				if(final_body)
+				{
+					event->free_body(final_body->s);
+					pkg_free(final_body);
+				}
+				ERR_MEM(PKG_MEM_STR);
+			}
+			*vars= v;
+		}
+		(*vars)[*vars_no].id= id;
+		(*vars)[*vars_no].body= final_body;
+		(*vars_no)++;
+	}
+	else
+	if(final_body)
+		t->own= 1;
+
+	if(final_body)
+		t->body= final_body;
+	return 0;
+
+error:
+	return -1;
+}
+
 int publ_notify(presentity_t* p, str pres_uri, str* body, str* offline_etag,
 		str* rules_doc, str* dialog_body, int from_publish)
 {
@@ -1734,6 +2042,13 @@ int publ_notify(presentity_t* p, str pres_uri, str* body, str* offline_etag,
 	subs_t* subs_array= NULL, *s= NULL;
 	int ret_code= -1;
 	free_body_t* free_fct = 0;
+	notify_hdr_tpl_t tpl = {0, 0, 0, 0};
+	notify_target_t* targets= NULL;
+	body_variant_t* vars= NULL;
+	notify_batch_t* b;
+	str* n_body;
+	str* extra_hdrs;
+	int vars_no= 0, n= 0, batch, start, proc, i;
 
 	subs_array= get_subs_dialog(&pres_uri, p->event , p->sender);
 	if(subs_array == NULL)
@@ -1743,31 +2058,142 @@ int publ_notify(presentity_t* p, str pres_uri, str* body, str* offline_etag,
 		goto done;
 	}
 
-	/* if the event does not require aggregation - we have the final body */
-	if(p->event->agg_nbody)
+	extra_hdrs= p->extra_hdrs?p->extra_hdrs:&notify_extra_hdrs;
+
+	/* the body is built once for all the watchers - if the event does not
+	 * require aggregation and no body was published, the last one stored
+	 * is used */
+	if(p->event->agg_nbody || body== NULL || body->s== NULL)
 	{
-		notify_body = get_p_notify_body(pres_uri, p->event , offline_etag, body,
-				NULL, dialog_body,
-				p->extra_hdrs?p->extra_hdrs:&notify_extra_hdrs, &free_fct,
-				from_publish);
+		notify_body = get_p_notify_body(pres_uri, p->event,
+				p->event->agg_nbody? offline_etag: NULL,
+				p->event->agg_nbody? body: NULL, NULL, dialog_body,
+				extra_hdrs, &free_fct, from_publish);
 	}
+	n_body= notify_body?notify_body:body;
 
-	s= subs_array;
-	while(s)
+	for(s= subs_array; s; s= s->next)
+		n++;
+
+	targets= (notify_target_t*)pkg_malloc(n* sizeof(notify_target_t));
+	if(targets== NULL)
+	{
+		LM_ERR("No more %s memory\n", PKG_MEM_STR);
+		n= 0;
+		goto done;
+	}
+
+	for(i= 0, s= subs_array; s; s= s->next)
 	{
 		s->auth_rules_doc= rules_doc;
-		LM_INFO("notify\n");
-		if(notify(s, NULL, notify_body?notify_body:body,
-			0, p->extra_hdrs?p->extra_hdrs:&notify_extra_hdrs, from_publish)< 0 )
+		if(get_watcher_body(p->event, s, n_body, &vars, &vars_no,
+					&targets[i])< 0)
+		{
+			LM_ERR("Could not build notify body for %.*s\n",
+					p->event->name.len, p->event->name.s);
+			continue;
+		}
+		i++;
+	}
+	n= i;
+
+	/* the CSeq and version of each watcher are taken here, in the order
+	 * of the publications, and not by the process sending the NOTIFY -
+	 * a batch sent late can only carry a lower CSeq and version than a
+	 * NOTIFY with a newer body for the same watcher */
+	for(i= 0, start= 0; start< n; start++)
+	{
+		if(notify_update_subs(targets[start].subs)< 0)
+		{
+			LM_ERR("Could not update the subscription for %.*s\n",
+					p->event->name.len, p->event->name.s);
+			if(targets[start].own)
+			{
+				p->event->free_body(targets[start].body->s);
+				pkg_free(targets[start].body);
+			}
+			continue;
+		}
+		targets[i++]= targets[start];
+	}
+	n= i;
+
+	batch= (notify_batch_size> 0)? notify_batch_size: n;
+
+	/* the batches over the first one go to other processes, so that
+	 * a hot presentity does not keep a single process busy */
+	for(start= batch; start< n; start+= batch)
+	{
+		if((proc= next_notify_worker())< 0)
+			break;
+
+		b= build_notify_batch(p->event, extra_hdrs, targets+ start,
+				(n- start< batch)? n- start: batch);
+		if(b== NULL)
+			break;
+
+		if(ipc_send_job(proc, notify_ipc_type, (void*)b)< 0)
+		{
+			LM_ERR("failed to send NOTIFY batch to process %d\n", proc);
+			free_notify_batch(b);
+			break;
+		}
+	}
+	/* whatever could not be dispatched is sent from here */
+	if(start> n)
+		start= n;
+
+	if(init_hdr_tpl(&tpl, p->event, extra_hdrs)< 0)
+	{
+		LM_ERR("while building headers template\n");
+		goto done;
+	}
+
+	for(i= 0; i< n; i++)
+	{
+		/* skip the dispatched batches */
+		if(i== batch && start> batch)
+		{
+			i= start;
+			if(i>= n)
+				break;
+		}
+
+		LM_DBG("notify\n");
+		if(send_notify_body(targets[i].subs, targets[i].body, &tpl)< 0)
 		{
 			LM_ERR("Could not send notify for %.*s\n",
 					p->event->name.len, p->event->name.s);
 		}
-		s= s->next;
 	}
 	ret_code= 0;
 
 done:
+	destroy_hdr_tpl(&tpl);
+
+	if(targets)
+	{
+		for(i= 0; i< n; i++)
+		{
+			if(targets[i].own)
+			{
+				p->event->free_body(targets[i].body->s);
+				pkg_free(targets[i].body);
+			}
+		}
+		pkg_free(targets);
+	}
+	for(i= 0; i< vars_no; i++)
+	{
+		if(vars[i].body)
+		{
+			p->event->free_body(vars[i].body->s);
+			pkg_free(vars[i].body);
+		}
+	}
+	if(vars)
+		pkg_free(vars);
+
 	free_subs_list(subs_array, PKG_MEM_TYPE, 0);
 
 	if (notify_extra_hdrs.s)
@@ -1851,15 +2277,10 @@ done:
 int send_notify_request(subs_t* subs, subs_t * watcher_subs,
 		str* n_body,int force_null_body, str* extra_hdrs, int from_publish)
 {
-	dlg_t* td = NULL;
-	str met = {"NOTIFY", 6};
-	str str_hdr = {NULL, 0};
+	notify_hdr_tpl_t tpl = {0, 0, 0, 0};
 	str notify_extra_hdrs = {NULL, 0};
 	str* notify_body = NULL;
-	int result= 0;
-	c_back_param *cb_param= NULL;
 	str* final_body= NULL;
-	str* aux_body = 0;
 	free_body_t* free_fct = 0;
 
 	LM_DBG("enter: have_body=%d force_null=%d dialog info:\n",
@@ -1949,6 +2370,76 @@ int send_notify_request(subs_t* subs, subs_t * watcher_subs,
 
 jump_over_body:
 
+	if(init_hdr_tpl(&tpl, subs->event,
+				extra_hdrs?extra_hdrs:&notify_extra_hdrs)< 0)
+	{
+		LM_ERR("while building headers template\n");
+		goto error;
+	}
+
+	if(send_notify_body(subs, notify_body, &tpl)< 0)
+		goto error;
+
+	destroy_hdr_tpl(&tpl);
+
+	if (notify_extra_hdrs.s)
+		pkg_free(notify_extra_hdrs.s);
+
+	if((int)(long)n_body!= (int)(long)notify_body)
+	{
+		if(notify_body!=NULL)
+		{
+			if(notify_body->s!=NULL)
+			{
+				if(subs->event->type& WINFO_TYPE )
+					xmlFree(notify_body->s);
+				else
+				if(free_fct)
+					free_fct(notify_body->s);
+				else
+					subs->event->free_body(notify_body->s);
+			}
+			pkg_free(notify_body);
+		}
+	}
+	return 0;
+
+error:
+	destroy_hdr_tpl(&tpl);
+	if (notify_extra_hdrs.s)
+		pkg_free(notify_extra_hdrs.s);
+
+	if((int)(long)n_body!= (int)(long)notify_body)
+	{
+		if(notify_body!=NULL)
+		{
+			if(notify_body->s!=NULL)
+			{
+				if(subs->event->type& WINFO_TYPE)
+					xmlFree(notify_body->s);
+				else
+				if(subs->event->apply_auth_nbody== NULL && subs->event->agg_nbody== NULL)
+					pkg_free(notify_body->s);
+				else
+				subs->event->free_body(notify_body->s);
+			}
+			pkg_free(notify_body);
+		}
+	}
+	return -1;
+}
+
+/* sends the NOTIFY with an already built body, the headers being
+ * printed with the given template */
+int send_notify_body(subs_t* subs, str* notify_body, notify_hdr_tpl_t* tpl)
+{
+	dlg_t* td = NULL;
+	str met = {"NOTIFY", 6};
+	str str_hdr = {NULL, 0};
+	int result= 0;
+	c_back_param *cb_param= NULL;
+	str* aux_body = 0;
+
 	if(subs->expires<= 0)
 	{
         subs->expires= 0;
@@ -1958,8 +2449,7 @@ jump_over_body:
 	}
 
 	/* build extra headers */
-	if( build_str_hdr( subs, notify_body?1:0, &str_hdr,
-				extra_hdrs?extra_hdrs:&notify_extra_hdrs)< 0 )
+	if( build_str_hdr_tpl(tpl, subs, notify_body?1:0, &str_hdr)< 0 )
 	{
 		LM_ERR("while building headers\n");
 		goto error;
@@ -2017,63 +2507,18 @@ jump_over_body:
 		td->id.loc_tag.len, td->id.loc_tag.s, td->loc_seq.value);
 
 	free_tm_dlg(td);
-
-	pkg_free(str_hdr.s);
-
-	if (notify_extra_hdrs.s)
-		pkg_free(notify_extra_hdrs.s);
-
-	if((int)(long)n_body!= (int)(long)notify_body)
-	{
-		if(notify_body!=NULL)
-		{
-			if(notify_body->s!=NULL)
-			{
-				if(subs->event->type& WINFO_TYPE )
-					xmlFree(notify_body->s);
-				else
-				if(free_fct)
-					free_fct(notify_body->s);
-				else
-					subs->event->free_body(notify_body->s);
-			}
-			pkg_free(notify_body);
-		}
-	}
 	return 0;
 
 error:
 	if(td)
 		free_tm_dlg(td);
-	if(str_hdr.s)
-		pkg_free(str_hdr.s);
-	if (notify_extra_hdrs.s)
-		pkg_free(notify_extra_hdrs.s);
-
-	if((int)(long)n_body!= (int)(long)notify_body)
-	{
-		if(notify_body!=NULL)
-		{
-			if(notify_body->s!=NULL)
-			{
-				if(subs->event->type& WINFO_TYPE)
-					xmlFree(notify_body->s);
-				else
-				if(subs->event->apply_auth_nbody== NULL && subs->event->agg_nbody== NULL)
-					pkg_free(notify_body->s);
-				else
-				subs->event->free_body(notify_body->s);
-			}
-			pkg_free(notify_body);
-		}
-	}
 	return -1;
 }
 
-
-int notify(subs_t* subs, subs_t * watcher_subs, str* n_body, int force_null_body, str* extra_hdrs, int from_publish)
+/* updates the local cseq and version of the subscription before sending
+ * a NOTIFY for it */
+static int notify_update_subs(subs_t* subs)
 {
-	/* update first in hash table and the send Notify */
 	if(subs->expires!= 0 && subs->status != TERMINATED_STATUS)
 	{
 		unsigned int hash_code;
@@ -2092,6 +2537,14 @@ int notify(subs_t* subs, subs_t * watcher_subs, str* n_body, int force_null_body
 			}
 		}
 	}
+	return 0;
+}
+
+int notify(subs_t* subs, subs_t * watcher_subs, str* n_body, int force_null_body, str* extra_hdrs, int from_publish)
+{
+	/* update first in hash table and the send Notify */
+	if(notify_update_subs(subs)< 0)
+		return -1;
 
 	if(subs->reason.s && subs->status== ACTIVE_STATUS &&
 		subs->reason.len== 12 && strncmp(subs->reason.s, "polite-block", 12)== 0)
@@ -54,6 +54,16 @@ typedef struct watcher
 	struct watcher* next;
 }watcher_t;
 
+/* NOTIFY headers template - the part common to all the watchers is
+ * written once at the beginning of the buffer */
+typedef struct notify_hdr_tpl
+{
+	pres_ev_t* event;
+	char* buf;
+	int size;
+	int prefix_len;
+}notify_hdr_tpl_t;
+
 typedef struct wid_cback
 {
 	str pres_uri;
@@ -105,6 +115,17 @@ int notify(subs_t* subs, subs_t* watcher_subs, str* n_body,int force_null_body,
 int send_notify_request(subs_t* subs, subs_t * watcher_subs,
 		str* n_body,int force_null_body, str* extra_hdrs, int from_publish);
 
+int send_notify_body(subs_t* subs, str* notify_body, notify_hdr_tpl_t* tpl);
+
+int init_hdr_tpl(notify_hdr_tpl_t* tpl, pres_ev_t* event, str* extra_hdrs);
+int build_str_hdr_tpl(notify_hdr_tpl_t* tpl, subs_t* subs, int is_body,
+		str* hdr);
+void destroy_hdr_tpl(notify_hdr_tpl_t* tpl);
+
+int init_notify_batch(void);
+int register_notify_worker(void);
+void destroy_notify_batch(void);
+
 char* get_status_str(int flag);
 void free_watcher_list(watcher_t* w);
 int add_watcher_list(subs_t* s, watcher_t* watchers);
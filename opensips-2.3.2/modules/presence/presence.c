@@ -112,6 +112,8 @@ int max_expires_publish= 3600;
 int shtable_size= 9;
 shtable_t subs_htable= NULL;
 int fallback2db= 0;
+int pres_in_memory= 0;
+int notify_batch_size= 0;
 int sphere_enable= 0;
 int mix_dialog_presence= 0;
 int notify_offline_body= 0;
@@ -159,6 +161,8 @@ static param_export_t params[]={
 	{ "subs_htable_size",       INT_PARAM, &shtable_size},
 	{ "pres_htable_size",       INT_PARAM, &phtable_size},
 	{ "fallback2db",            INT_PARAM, &fallback2db},
+	{ "presentity_in_memory",   INT_PARAM, &pres_in_memory},
+	{ "notify_batch_size",      INT_PARAM, &notify_batch_size},
 	{ "enable_sphere_check",    INT_PARAM, &sphere_enable},
 	{ "waiting_subs_daysno",    INT_PARAM, &waiting_subs_daysno},
 	{ "mix_dialog_presence",    INT_PARAM, &mix_dialog_presence},
@@ -261,6 +265,19 @@ static int mod_init(void)
 	if(max_expires_publish<= 0)
 		max_expires_publish = 3600;
 
+	if(notify_batch_size> 0 && init_notify_batch()< 0)
+	{
+		LM_ERR("failed to init the NOTIFY batches\n");
+		return -1;
+	}
+
+	if(pres_in_memory && (fallback2db || db_update_period<= 0))
+	{
+		LM_WARN("presentity_in_memory requires fallback2db disabled and"
+			" a positive db_update_period - ignoring it\n");
+		pres_in_memory= 0;
+	}
+
 	if(server_address.s== NULL)
 		LM_DBG("server_address parameter not set in configuration file\n");
 
@@ -363,8 +380,13 @@ static int mod_init(void)
 	}
 
 	if(db_update_period>0)
+	{
 		register_timer("presence-dbupdate", timer_db_update, 0,
 			db_update_period, TIMER_FLAG_SKIP_ON_DELAY);
+		if(pres_in_memory)
+			register_timer("presence-pdbupdate", timer_pres_db_update, 0,
+				db_update_period, TIMER_FLAG_SKIP_ON_DELAY);
+	}
 
 	if (pa_dbf.use_table(pa_db, &watchers_table) < 0)
 	{
@@ -437,6 +459,12 @@ static int child_init(int rank)
 	}
 	LM_DBG("child %d: Database connection opened successfully\n", rank);
 
+	/* the SIP workers and the timer handler process (the only ones with a
+	 * positive rank) read IPC jobs, so they take NOTIFY batches; the timer
+	 * attendant (PROC_TIMER) and the module processes do not */
+	if(rank> PROC_MAIN && register_notify_worker()< 0)
+		return -1;
+
 	return 0;
 }
 
@@ -452,12 +480,17 @@ static void destroy(void)
 	if(subs_htable && pa_db)
 		timer_db_update(0, 0);
 
+	if(pres_in_memory && pres_htable && pa_db)
+		timer_pres_db_update(0, 0);
+
 	if(subs_htable)
 		destroy_shtable(subs_htable, shtable_size);
 
 	if(pres_htable)
 		destroy_phtable();
 
+	destroy_notify_batch();
+
 	if(pa_db && pa_dbf.close)
 		pa_dbf.close(pa_db);
 
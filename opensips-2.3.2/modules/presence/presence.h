@@ -58,6 +58,8 @@ extern str server_address;
 extern int max_expires_publish;
 extern int max_expires_subscribe;
 extern int fallback2db;
+extern int pres_in_memory;
+extern int notify_batch_size;
 extern int sphere_enable;
 extern int shtable_size;
 extern shtable_t subs_htable;
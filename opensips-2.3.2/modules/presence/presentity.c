@@ -38,6 +38,8 @@
 #include "../../usr_avp.h"
 #include "../alias_db/alias_db.h"
 #include "../../data_lump_rpl.h"
+#include "../../parser/parse_uri.h"
+#include "../pua/hash.h"
 #include "presentity.h"
 #include "presence.h"
 #include "notify.h"
@@ -481,6 +483,17 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity, int* sent_r
 			goto error;
 		}
 
+		if(pres_in_memory)
+		{
+			/* the record reaches the database on the next db update */
+			if(pres_store_update(p, hash_code, presentity, &body, 1)< 0)
+			{
+				LM_ERR("storing published state in hash table\n");
+				goto error;
+			}
+			goto send_notify;
+		}
+
 		/* insert new record into database */
 		query_cols[n_query_cols] = &str_expires_col;
 		query_vals[n_query_cols].type = DB_INT;
@@ -563,7 +576,7 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity, int* sent_r
 					&presentity->etag, hash_code);
 			}
 
-		} else {
+		} else if(!pres_in_memory) {
 
 			lock_release(&pres_htable[hash_code].lock);
 			/* search also in db */
@@ -600,16 +613,36 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity, int* sent_r
 					presentity->etag.len, presentity->etag.s);
 		}
 
+		if(p== NULL && pres_in_memory)
+		{
+			/* the hash table holds all the published records */
+			lock_release(&pres_htable[hash_code].lock);
+			LM_ERR("No E_Tag match [%.*s]\n", presentity->etag.len,
+					presentity->etag.s);
+			if (msg && sigb.reply(msg, 412, &pu_412_rpl, 0)==-1 )
+			{
+				LM_ERR("sending '412 Conditional request failed' reply\n");
+				goto error;
+			}
+			*sent_reply= 1;
+			goto done;
+		}
+
 		/* record found */
 		if(presentity->expires == 0)
 		{
-			/* delete from hash table */
-			if(p && delete_phtable(p, hash_code)< 0)
+			/* in memory mode the record is needed by the first
+			 * notify, so it is removed only after it */
+			if(!pres_in_memory)
 			{
-					LM_ERR("deleting record from hash table failed\n");
+				/* delete from hash table */
+				if(p && delete_phtable(p, hash_code)< 0)
+				{
+						LM_ERR("deleting record from hash table failed\n");
+				}
+				/* presentity removed, pointer no longer valid */
+				p = NULL;
 			}
-			/* presentity removed, pointer no longer valid */
-			p = NULL;
 
 			lock_release(&pres_htable[hash_code].lock);
 			if(msg && publ_send200ok(msg,presentity->expires,presentity->etag)<0)
@@ -626,16 +659,27 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity, int* sent_r
 				goto error;
 			}
 
-			if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+			if(pres_in_memory)
 			{
-				LM_ERR("unsuccessful sql use table\n");
-				goto error;
+				if(pres_store_delete(p, hash_code)< 0)
+				{
+					LM_ERR("deleting record from hash table failed\n");
+				}
+				p = NULL;
 			}
-			//CON_PS_REFERENCE(pa_db) = &my_ps_delete;
-			if(pa_dbf.delete(pa_db,query_cols,0,query_vals,n_query_cols)<0)
+			else
 			{
-				LM_ERR("unsuccessful sql delete operation");
-				goto error;
+				if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+				{
+					LM_ERR("unsuccessful sql use table\n");
+					goto error;
+				}
+				//CON_PS_REFERENCE(pa_db) = &my_ps_delete;
+				if(pa_dbf.delete(pa_db,query_cols,0,query_vals,n_query_cols)<0)
+				{
+					LM_ERR("unsuccessful sql delete operation");
+					goto error;
+				}
 			}
 			LM_DBG("Expires=0, deleted from db %.*s\n",
 				presentity->user.len,presentity->user.s);
@@ -764,17 +808,29 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity, int* sent_r
 			//CON_PS_REFERENCE(pa_db) = &my_ps_update_no_body;
 		}
 
-		if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+		if(pres_in_memory)
 		{
-			LM_ERR("unsuccessful sql use table\n");
-			goto error;
+			if(pres_store_update(p, hash_code, presentity,
+						body.s? &body: NULL, 0)< 0)
+			{
+				LM_ERR("updating published info in hash table\n");
+				goto error;
+			}
 		}
-
-		if( pa_dbf.update( pa_db,query_cols, query_ops, query_vals,
-				update_keys, update_vals, n_query_cols, n_update_cols )<0)
+		else
 		{
-			LM_ERR("updating published info in database\n");
-			goto error;
+			if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+			{
+				LM_ERR("unsuccessful sql use table\n");
+				goto error;
+			}
+
+			if( pa_dbf.update( pa_db,query_cols, query_ops, query_vals,
+					update_keys, update_vals, n_query_cols, n_update_cols )<0)
+			{
+				LM_ERR("updating published info in database\n");
+				goto error;
+			}
 		}
 
 		/* send 200OK */
@@ -886,28 +942,38 @@ int pres_htable_restore(void)
 {
 	/* query all records from presentity table and insert records
 	 * in presentity table */
-	db_key_t result_cols[6];
+	db_key_t result_cols[9];
 	db_res_t *result= NULL;
 	db_row_t *rows= NULL ;
 	db_val_t *row_vals;
 	int  i;
 	str user, domain, ev_str, uri, body;
+	str extra_hdrs, sender;
 	int n_result_cols= 0;
 	int user_col, domain_col, event_col, expires_col, body_col = 0, etag_col;
+	int extra_hdrs_col = 0, sender_col = 0, received_time_col = 0;
 	int event;
 	event_t ev;
 	char* sphere= NULL;
 	int nr_rows;
 	str etag;
 	int no_rows = 10;
+	pres_entry_t* p;
 
 	result_cols[user_col= n_result_cols++]= &str_username_col;
 	result_cols[domain_col= n_result_cols++]= &str_domain_col;
 	result_cols[event_col= n_result_cols++]= &str_event_col;
 	result_cols[expires_col= n_result_cols++]= &str_expires_col;
 	result_cols[etag_col= n_result_cols++]= &str_etag_col;
-	if(sphere_enable)
+	if(sphere_enable || pres_in_memory)
 		result_cols[body_col= n_result_cols++]= &str_body_col;
+	if(pres_in_memory)
+	{
+		result_cols[extra_hdrs_col= n_result_cols++]= &str_extra_hdrs_col;
+		result_cols[sender_col= n_result_cols++]= &str_sender_col;
+		result_cols[received_time_col= n_result_cols++]=
+			&str_received_time_col;
+	}
 
 	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
 	{
@@ -1005,7 +1071,7 @@ int pres_htable_restore(void)
 				sphere= extract_sphere(body);
 			}
 
-			if(insert_phtable(&uri, event, &etag, sphere, 0)== NULL)
+			if((p= insert_phtable(&uri, event, &etag, sphere, 0))== NULL)
 			{
 				LM_ERR("inserting record in presentity hash table");
 				pkg_free(uri.s);
@@ -1013,6 +1079,33 @@ int pres_htable_restore(void)
 					pkg_free(sphere);
 				goto error;
 			}
+
+			if(pres_in_memory)
+			{
+				body.s= (char*)row_vals[body_col].val.string_val;
+				body.len= body.s? strlen(body.s): 0;
+				extra_hdrs.s= (char*)row_vals[extra_hdrs_col].val.string_val;
+				extra_hdrs.len= (VAL_NULL(row_vals+ extra_hdrs_col) ||
+						extra_hdrs.s== NULL)? 0: strlen(extra_hdrs.s);
+				sender.s= (char*)row_vals[sender_col].val.string_val;
+				sender.len= (VAL_NULL(row_vals+ sender_col) ||
+						sender.s== NULL)? 0: strlen(sender.s);
+
+				/* the hash table is not yet shared, no locking needed */
+				if(pres_store_set(p, &ev_str, &body, &extra_hdrs, &sender,
+					row_vals[expires_col].val.int_val,
+					row_vals[received_time_col].val.int_val)< 0)
+				{
+					LM_ERR("storing published state in hash table\n");
+					pkg_free(uri.s);
+					if(sphere)
+						pkg_free(sphere);
+					goto error;
+				}
+				memcpy(p->db_etag, etag.s, etag.len);
+				p->db_etag_len= etag.len;
+				p->db_flag= NO_UPDATEDB_FLAG;
+			}
 			if(sphere)
 				pkg_free(sphere);
 			pkg_free(uri.s);
@@ -1042,6 +1135,194 @@ error:
 	return -1;
 }
 
+/* deletes from database the record of an in memory presentity */
+int pres_db_delete_record(pres_entry_t* p)
+{
+	db_key_t query_cols[4];
+	db_val_t query_vals[4];
+	int n_query_cols= 0;
+	struct sip_uri uri;
+
+	if(parse_uri(p->pres_uri.s, p->pres_uri.len, &uri)< 0)
+	{
+		LM_ERR("failed to parse presentity uri\n");
+		return -1;
+	}
+
+	query_cols[n_query_cols] = &str_domain_col;
+	query_vals[n_query_cols].type = DB_STR;
+	query_vals[n_query_cols].nul = 0;
+	query_vals[n_query_cols].val.str_val = uri.host;
+	n_query_cols++;
+
+	query_cols[n_query_cols] = &str_username_col;
+	query_vals[n_query_cols].type = DB_STR;
+	query_vals[n_query_cols].nul = 0;
+	query_vals[n_query_cols].val.str_val = uri.user;
+	n_query_cols++;
+
+	query_cols[n_query_cols] = &str_event_col;
+	query_vals[n_query_cols].type = DB_STR;
+	query_vals[n_query_cols].nul = 0;
+	query_vals[n_query_cols].val.str_val = p->event_name;
+	n_query_cols++;
+
+	query_cols[n_query_cols] = &str_etag_col;
+	query_vals[n_query_cols].type = DB_STR;
+	query_vals[n_query_cols].nul = 0;
+	query_vals[n_query_cols].val.str_val.s = p->db_etag;
+	query_vals[n_query_cols].val.str_val.len = p->db_etag_len;
+	n_query_cols++;
+
+	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+	{
+		LM_ERR("unsuccessful sql use table\n");
+		return -1;
+	}
+
+	if(pa_dbf.delete(pa_db, query_cols, 0, query_vals, n_query_cols)< 0)
+	{
+		LM_ERR("unsuccessful sql delete operation\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* writes to database the presentity records modified or dropped since
+ * the last run, if presentity_in_memory is set */
+void timer_pres_db_update(unsigned int ticks, void *param)
+{
+	db_key_t query_cols[10], update_keys[6];
+	db_val_t query_vals[10], update_vals[6];
+	int n_query_cols, n_update_cols;
+	struct sip_uri uri;
+	pres_entry_t* p;
+	int i;
+
+	pres_store_flush_dropped();
+
+	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+	{
+		LM_ERR("unsuccessful sql use table\n");
+		return;
+	}
+
+	for(i= 0; i< phtable_size; i++)
+	{
+		lock_get(&pres_htable[i].lock);
+
+		for(p= pres_htable[i].entries->next; p; p= p->next)
+		{
+			if(p->data== NULL || p->db_flag== NO_UPDATEDB_FLAG)
+				continue;
+
+			if(parse_uri(p->pres_uri.s, p->pres_uri.len, &uri)< 0)
+			{
+				LM_ERR("failed to parse presentity uri\n");
+				continue;
+			}
+
+			n_query_cols= 0;
+			query_cols[n_query_cols] = &str_domain_col;
+			query_vals[n_query_cols].type = DB_STR;
+			query_vals[n_query_cols].nul = 0;
+			query_vals[n_query_cols].val.str_val = uri.host;
+			n_query_cols++;
+
+			query_cols[n_query_cols] = &str_username_col;
+			query_vals[n_query_cols].type = DB_STR;
+			query_vals[n_query_cols].nul = 0;
+			query_vals[n_query_cols].val.str_val = uri.user;
+			n_query_cols++;
+
+			query_cols[n_query_cols] = &str_event_col;
+			query_vals[n_query_cols].type = DB_STR;
+			query_vals[n_query_cols].nul = 0;
+			query_vals[n_query_cols].val.str_val = p->event_name;
+			n_query_cols++;
+
+			query_cols[n_query_cols] = &str_etag_col;
+			query_vals[n_query_cols].type = DB_STR;
+			query_vals[n_query_cols].nul = 0;
+			n_query_cols++;
+
+			n_update_cols= 0;
+			update_keys[n_update_cols] = &str_etag_col;
+			update_vals[n_update_cols].type = DB_STR;
+			update_vals[n_update_cols].nul = 0;
+			update_vals[n_update_cols].val.str_val.s = p->etag;
+			update_vals[n_update_cols].val.str_val.len = p->etag_len;
+			n_update_cols++;
+
+			update_keys[n_update_cols] = &str_expires_col;
+			update_vals[n_update_cols].type = DB_INT;
+			update_vals[n_update_cols].nul = 0;
+			update_vals[n_update_cols].val.int_val = p->expires;
+			n_update_cols++;
+
+			update_keys[n_update_cols] = &str_received_time_col;
+			update_vals[n_update_cols].type = DB_INT;
+			update_vals[n_update_cols].nul = 0;
+			update_vals[n_update_cols].val.int_val = p->received_time;
+			n_update_cols++;
+
+			update_keys[n_update_cols] = &str_sender_col;
+			update_vals[n_update_cols].type = DB_STR;
+			update_vals[n_update_cols].nul = 0;
+			update_vals[n_update_cols].val.str_val = p->sender;
+			n_update_cols++;
+
+			update_keys[n_update_cols] = &str_body_col;
+			update_vals[n_update_cols].type = DB_BLOB;
+			update_vals[n_update_cols].nul = 0;
+			update_vals[n_update_cols].val.str_val = p->body;
+			n_update_cols++;
+
+			update_keys[n_update_cols] = &str_extra_hdrs_col;
+			update_vals[n_update_cols].type = DB_BLOB;
+			update_vals[n_update_cols].nul = 0;
+			update_vals[n_update_cols].val.str_val = p->extra_hdrs;
+			n_update_cols++;
+
+			if(p->db_flag== INSERTDB_FLAG)
+			{
+				/* etag taken from the update set */
+				query_vals[n_query_cols-1]= update_vals[0];
+				memcpy(query_cols+ n_query_cols, update_keys+ 1,
+						(n_update_cols- 1)* sizeof(db_key_t));
+				memcpy(query_vals+ n_query_cols, update_vals+ 1,
+						(n_update_cols- 1)* sizeof(db_val_t));
+
+				if(pa_dbf.insert(pa_db, query_cols, query_vals,
+						n_query_cols+ n_update_cols- 1)< 0)
+				{
+					LM_ERR("inserting presentity record in database\n");
+					continue;
+				}
+			}
+			else
+			{
+				query_vals[n_query_cols-1].val.str_val.s = p->db_etag;
+				query_vals[n_query_cols-1].val.str_val.len = p->db_etag_len;
+
+				if(pa_dbf.update(pa_db, query_cols, 0, query_vals, update_keys,
+						update_vals, n_query_cols, n_update_cols)< 0)
+				{
+					LM_ERR("updating presentity record in database\n");
+					continue;
+				}
+			}
+
+			memcpy(p->db_etag, p->etag, p->etag_len);
+			p->db_etag_len= p->etag_len;
+			p->db_flag= NO_UPDATEDB_FLAG;
+		}
+
+		lock_release(&pres_htable[i].lock);
+	}
+}
+
 int pres_expose_evi(pres_ev_t *ev, str *filter)
 {
 	int user_col, domain_col, expires_col, body_col, etag_col;
@@ -64,6 +64,11 @@ int generate_ETag(int etag_count, str* etag);
 
 int pres_htable_restore(void);
 
+struct pres_entry;
+int pres_db_delete_record(struct pres_entry* p);
+
+void timer_pres_db_update(unsigned int ticks, void *param);
+
 char* extract_sphere(str body);
 
 char* get_sphere(str* pres_uri);
@@ -52,6 +52,7 @@ struct p_modif
 {
 	presentity_t* p;
 	str uri;
+	int event;
 };
 
 #define MAX_NO_OF_EXTRA_HDRS 4
@@ -167,6 +168,128 @@ static inline void build_extra_hdrs(struct sip_msg* msg, const str* map, str* ex
 	}
 }
 
+static int build_p_modif(struct p_modif* pm, str* user, str* domain,
+		str* etag, str* event)
+{
+	presentity_t* pres;
+	event_t ev;
+	int size;
+
+	size= sizeof(presentity_t) + user->len+ domain->len+ etag->len;
+	pres= (presentity_t*)pkg_malloc(size);
+	if(pres== NULL)
+	{
+		ERR_MEM(PKG_MEM_STR);
+	}
+	memset(pres, 0, size);
+	size= sizeof(presentity_t);
+
+	pres->user.s= (char*)pres+ size;
+	memcpy(pres->user.s, user->s, user->len);
+	pres->user.len= user->len;
+	size+= user->len;
+
+	pres->domain.s= (char*)pres+ size;
+	memcpy(pres->domain.s, domain->s, domain->len);
+	pres->domain.len= domain->len;
+	size+= domain->len;
+
+	pres->etag.s= (char*)pres+ size;
+	memcpy(pres->etag.s, etag->s, etag->len);
+	pres->etag.len= etag->len;
+	size+= etag->len;
+
+	pres->event= contains_event(event, &ev);
+	if(pres->event== NULL)
+	{
+		LM_DBG("event not found\n");
+		pkg_free(pres);
+		pm->p = 0;
+	}
+	else
+	{
+		pm->p= pres;
+		pm->event= ev.parsed;
+	}
+
+	if(uandd_to_uri(*user, *domain, &pm->uri)< 0)
+	{
+		LM_ERR("constructing uri\n");
+		free_event_params(ev.params, PKG_MEM_TYPE);
+		return -1;
+	}
+	free_event_params(ev.params, PKG_MEM_TYPE);
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/* collects the expired records kept in the presentity hash table */
+static int get_expired_phtable(int limit, struct p_modif** p_arr, int* n)
+{
+	pres_entry_t* e;
+	struct p_modif* p;
+	struct sip_uri uri;
+	str etag;
+	int i, j= 0;
+
+	*n= 0;
+	for(i= 0; i< phtable_size; i++)
+	{
+		lock_get(&pres_htable[i].lock);
+		for(e= pres_htable[i].entries->next; e; e= e->next)
+			if(e->data && e->expires< limit)
+				(*n)++;
+		lock_release(&pres_htable[i].lock);
+	}
+	if(*n== 0)
+		return 0;
+
+	p= (struct p_modif*)pkg_malloc((*n)* sizeof(struct p_modif));
+	if(p== NULL)
+	{
+		*n= 0;
+		ERR_MEM(PKG_MEM_STR);
+	}
+	memset(p, 0, (*n)* sizeof(struct p_modif));
+	*p_arr= p;
+
+	for(i= 0; i< phtable_size && j< *n; i++)
+	{
+		lock_get(&pres_htable[i].lock);
+		for(e= pres_htable[i].entries->next; e && j< *n; e= e->next)
+		{
+			if(!(e->data && e->expires< limit))
+				continue;
+
+			if(parse_uri(e->pres_uri.s, e->pres_uri.len, &uri)< 0)
+			{
+				LM_ERR("failed to parse presentity uri\n");
+				continue;
+			}
+			etag.s= e->etag;
+			etag.len= e->etag_len;
+			if(build_p_modif(&p[j], &uri.user, &uri.host, &etag,
+						&e->event_name)< 0)
+			{
+				lock_release(&pres_htable[i].lock);
+				*n= j+ 1;
+				return -1;
+			}
+			j++;
+		}
+		lock_release(&pres_htable[i].lock);
+	}
+	*n= j;
+
+	return 0;
+
+error:
+	return -1;
+}
+
 void msg_presentity_clean(unsigned int ticks,void *param)
 {
 	static db_ps_t my_ps_delete = NULL;
@@ -177,17 +300,27 @@ void msg_presentity_clean(unsigned int ticks,void *param)
 	db_res_t *result = NULL;
 	db_row_t *row ;
 	db_val_t *row_vals ;
-	int i =0, size= 0;
+	int i =0;
 	struct p_modif* p= NULL;
-	presentity_t* pres= NULL;
 	int n= 0;
 	int event_col, etag_col, user_col, domain_col;
-	event_t ev;
 	str user, domain, etag, event;
 	int n_result_cols= 0;
 	str* rules_doc= NULL;
 	static str query_str = str_init("username");
 
+	if(pres_in_memory)
+	{
+		LM_DBG("cleaning expired presentity information\n");
+
+		if(get_expired_phtable((int)time(NULL) -10, &p, &n)< 0)
+			goto error;
+		if(n== 0)
+			goto clean;
+		LM_DBG("found n= %d expires messages\n", n);
+		goto notify;
+	}
+
 	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
 	{
 		LM_ERR("in use_table\n");
@@ -253,52 +386,13 @@ void msg_presentity_clean(unsigned int ticks,void *param)
 		event.s= (char*)row_vals[event_col].val.string_val;
 		event.len= strlen(event.s);
 
-		size= sizeof(presentity_t) + user.len+ domain.len+ etag.len;
-		pres= (presentity_t*)pkg_malloc(size);
-		if(pres== NULL)
-		{
-			ERR_MEM(PKG_MEM_STR);
-		}
-		memset(pres, 0, size);
-		size= sizeof(presentity_t);
-
-		pres->user.s= (char*)pres+ size;
-		memcpy(pres->user.s, user.s, user.len);
-		pres->user.len= user.len;
-		size+= user.len;
-
-		pres->domain.s= (char*)pres+ size;
-		memcpy(pres->domain.s, domain.s, domain.len);
-		pres->domain.len= domain.len;
-		size+= domain.len;
-
-		pres->etag.s= (char*)pres+ size;
-		memcpy(pres->etag.s, etag.s, etag.len);
-		pres->etag.len= etag.len;
-		size+= etag.len;
-
-		pres->event= contains_event(&event, &ev);
-		if(pres->event== NULL)
-		{
-			LM_DBG("event not found\n");
-			p[i].p = 0;
-			goto no_notify;
-		}
-
-		p[i].p= pres;
-
-no_notify:
-		if(uandd_to_uri(user, domain, &p[i].uri)< 0)
-		{
-			LM_ERR("constructing uri\n");
-			free_event_params(ev.params, PKG_MEM_TYPE);
+		if(build_p_modif(&p[i], &user, &domain, &etag, &event)< 0)
 			goto error;
-		}
-		free_event_params(ev.params, PKG_MEM_TYPE);
 	}
 	pa_dbf.free_result(pa_db, result);
 	result= NULL;
 
+notify:
 	for(i= 0; i<n ; i++)
 	{
 		if(p[i].p == 0)
@@ -328,7 +422,14 @@ no_notify:
 		}
 		rules_doc= NULL;
 		/* delete from hash table */
-		if(delete_phtable_query(&p[i].uri, ev.parsed, &p[i].p->etag)< 0)
+		if(pres_in_memory)
+		{
+			if(pres_store_delete_query(&p[i].uri, p[i].event,
+						&p[i].p->etag)< 0)
+				LM_DBG("record already removed from pres hash table\n");
+		}
+		else
+		if(delete_phtable_query(&p[i].uri, p[i].event, &p[i].p->etag)< 0)
 		{
 			LM_ERR("deleting from pres hash table\n");
 		}
@@ -338,6 +439,11 @@ error:
 	if(result)
 		pa_dbf.free_result(pa_db, result);
 
+	/* in memory records are deleted one by one, together with the
+	 * hash table entry */
+	if(pres_in_memory)
+		goto clean;
+
 	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
 	{
 		LM_ERR("in use_table\n");
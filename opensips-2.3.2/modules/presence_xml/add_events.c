@@ -153,6 +153,7 @@ int xml_add_events(void)
 	event.type= PUBL_TYPE;
 	event.req_auth= 1;
 	event.apply_auth_nbody= pres_apply_auth;
+	event.get_auth_variant= pres_auth_variant;
 	event.get_auth_status= pres_watcher_allowed;
 	event.agg_nbody= presence_agg_nbody;
 	event.evs_publ_handl= xml_publ_handl;
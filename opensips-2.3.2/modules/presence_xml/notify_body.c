@@ -882,6 +882,43 @@ str* presence_agg_nbody(str* pres_user, str* pres_domain, str** body_array, int
         return n_body;
 }
 
+/* the watchers of a NOTIFY fan-out share the rules document, so the
+ * last parsed one is kept; the returned doc must not be freed */
+static xmlDocPtr get_rules_xml(str* rules_doc)
+{
+	static str rules_txt= {NULL, 0};
+	static xmlDocPtr rules_xml= NULL;
+	char* p;
+
+	if(rules_xml && rules_txt.len== rules_doc->len &&
+			memcmp(rules_txt.s, rules_doc->s, rules_doc->len)== 0)
+		return rules_xml;
+
+	if(rules_xml)
+	{
+		xmlFreeDoc(rules_xml);
+		rules_xml= NULL;
+	}
+
+	p= (char*)pkg_realloc(rules_txt.s, rules_doc->len);
+	if(p== NULL)
+	{
+		LM_ERR("No more pkg memory\n");
+		return NULL;
+	}
+	rules_txt.s= p;
+	memcpy(rules_txt.s, rules_doc->s, rules_doc->len);
+	rules_txt.len= rules_doc->len;
+
+	rules_xml= xmlParseMemory(rules_doc->s, rules_doc->len);
+	if(rules_xml== NULL)
+	{
+		LM_ERR("parsing xml doc\n");
+		return NULL;
+	}
+	return rules_xml;
+}
+
 int pres_apply_auth(str* notify_body, subs_t* subs, str** final_nbody)
 {
 	xmlDocPtr doc= NULL;
@@ -897,18 +934,14 @@ int pres_apply_auth(str* notify_body, subs_t* subs, str** final_nbody)
 		LM_ERR("NULL rules doc\n");
 		return -1;
 	}
-	doc= xmlParseMemory(subs->auth_rules_doc->s, subs->auth_rules_doc->len);
+	doc= get_rules_xml(subs->auth_rules_doc);
 	if(doc== NULL)
-	{
-		LM_ERR("parsing xml doc\n");
 		return -1;
-	}
 
 	node= get_rule_node(subs, doc);
 	if(node== NULL)
 	{
 		LM_DBG("The subscriber didn't match the conditions\n");
-		xmlFreeDoc(doc);
 		return 0;
 	}
 
@@ -916,17 +949,41 @@ int pres_apply_auth(str* notify_body, subs_t* subs, str** final_nbody)
 	if(n_body== NULL)
 	{
 		LM_ERR("in function get_final_notify_body\n");
-		xmlFreeDoc(doc);
 		return -1;
 	}
 
-	xmlFreeDoc(doc);
-
 	*final_nbody= n_body;
 	return 1;
 
 }
 
+/* the watchers matching the same rule get the same body from
+ * pres_apply_auth, so the rule position is used as body variant */
+int pres_auth_variant(subs_t* subs)
+{
+	xmlDocPtr doc;
+	xmlNodePtr node;
+	int id= 1;
+
+	if(force_active)
+		return 0;
+
+	if(subs->auth_rules_doc== NULL)
+		return -1;
+
+	doc= get_rules_xml(subs->auth_rules_doc);
+	if(doc== NULL)
+		return -1;
+
+	node= get_rule_node(subs, doc);
+	if(node== NULL)
+		return 0;
+
+	for(node= node->prev; node; node= node->prev)
+		id++;
+	return id;
+}
+
 str* get_final_notify_body( subs_t *subs, str* notify_body, xmlNodePtr rule_node)
 {
 	xmlNodePtr transf_node = NULL, node = NULL, dont_provide = NULL;
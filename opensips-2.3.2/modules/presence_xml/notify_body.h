@@ -32,6 +32,7 @@ str* dialog_agg_nbody(str* pres_user, str* pres_domain, str** body_array,
 str* presence_agg_nbody(str* pres_user, str* pres_domain, str** body_array,
 		int n, int off_index);
 int pres_apply_auth(str* notify_body, subs_t* subs, str** final_nbody);
+int pres_auth_variant(subs_t* subs);
 void free_xml_body(char* body);
 
 #endif
@@ -45,7 +45,6 @@
 #include "hep.h"
 #include "../compression/compression_api.h"
 
-#include "../../lib/cJSON.h"
 
 #define GENERIC_VENDOR_ID 0x0000
 #define HEP_PROTO_SIP  0x01
@@ -900,11 +899,100 @@ static trace_message create_hep12_message(union sockaddr_union* from_su, union s
 }
 
 
+/* fixed parts of a HEPv3 packet - chunk headers and the capture id never
+ * change, so they are built once per process and copied for each message */
+static hep_generic_t hep3_hg_tpl;
+static struct ip4_addr hep3_ip4_tpl;
+static struct ip6_addr hep3_ip6_tpl;
+static int hep3_tpl_ready = 0;
+
+#define HEP3_CHUNK_HDR(_c, _type) \
+	do { \
+		(_c).chunk.vendor_id = htons(GENERIC_VENDOR_ID); \
+		(_c).chunk.type_id = htons(_type); \
+		(_c).chunk.length = htons(sizeof(_c)); \
+	} while (0)
+
+static void init_hep3_templates(void)
+{
+	memset(&hep3_hg_tpl, 0, sizeof hep3_hg_tpl);
+	memset(&hep3_ip4_tpl, 0, sizeof hep3_ip4_tpl);
+	memset(&hep3_ip6_tpl, 0, sizeof hep3_ip6_tpl);
+
+	memcpy(hep3_hg_tpl.header.id, HEP_HEADER_ID, HEP_HEADER_ID_LEN);
+
+	HEP3_CHUNK_HDR(hep3_hg_tpl.ip_family, HEP_PROTO_FAMILY);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.ip_proto, HEP_PROTO_ID);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.src_port, HEP_SRC_PORT);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.dst_port, HEP_DST_PORT);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.time_sec, HEP_TIMESTAMP);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.time_usec, HEP_TIMESTAMP_US);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.proto_t, HEP_PROTO_TYPE);
+	HEP3_CHUNK_HDR(hep3_hg_tpl.capt_id, HEP_AGENT_ID);
+	hep3_hg_tpl.capt_id.data = htonl(hep_capture_id);
+
+	HEP3_CHUNK_HDR(hep3_ip4_tpl.src_ip4, HEP_IPV4_SRC);
+	HEP3_CHUNK_HDR(hep3_ip4_tpl.dst_ip4, HEP_IPV4_DST);
+	HEP3_CHUNK_HDR(hep3_ip6_tpl.src_ip6, HEP_IPV6_SRC);
+	HEP3_CHUNK_HDR(hep3_ip6_tpl.dst_ip6, HEP_IPV6_DST);
+
+	hep3_tpl_ready = 1;
+}
+
+#undef HEP3_CHUNK_HDR
+
+/* one released message is kept per process, together with the storage
+ * of its JSON builders, so that tracing does not allocate per packet */
+static struct hep_enc_msg *hep3_free_msg = NULL;
+
+static struct hep_enc_msg* get_hep3_msg(void)
+{
+	struct hep_enc_msg *enc;
+	struct hep_enc_buf corr, pld;
+
+	if (hep3_free_msg) {
+		enc = hep3_free_msg;
+		hep3_free_msg = NULL;
+
+		corr = enc->corr;
+		pld = enc->pld;
+		memset(enc, 0, sizeof *enc);
+		enc->corr.s = corr.s;
+		enc->corr.size = corr.size;
+		enc->pld.s = pld.s;
+		enc->pld.size = pld.size;
+
+		return enc;
+	}
+
+	enc = pkg_malloc(sizeof *enc);
+	if (enc == NULL) {
+		LM_ERR("no more pkg mem!\n");
+		return NULL;
+	}
+	memset(enc, 0, sizeof *enc);
+
+	return enc;
+}
+
+static void put_hep3_msg(struct hep_enc_msg *enc)
+{
+	if (hep3_free_msg == NULL) {
+		hep3_free_msg = enc;
+		return;
+	}
+
+	if (enc->corr.s)
+		pkg_free(enc->corr.s);
+	if (enc->pld.s)
+		pkg_free(enc->pld.s);
+	pkg_free(enc);
+}
+
 static trace_message create_hep3_message(union sockaddr_union* from_su, union sockaddr_union* to_su,
 		int net_proto, str* payload, int proto)
 {
 	int rc;
-	int iplen=0, tlen;
 
 	struct timeval tvb;
 
@@ -912,124 +1000,53 @@ static trace_message create_hep3_message(union sockaddr_union* from_su, union so
 
 	str compressed_payload={NULL, 0};
 
+	struct hep_enc_msg* enc;
 	struct hep_desc* hep_msg;
 
-	hep_msg = pkg_malloc(sizeof(struct hep_desc));
-	if (hep_msg == NULL) {
-		LM_ERR("no more pkg mem!\n");
+	if (!hep3_tpl_ready)
+		init_hep3_templates();
+
+	if ((enc = get_hep3_msg()) == NULL)
 		return NULL;
-	}
 
-	memset(hep_msg, 0, sizeof(struct hep_desc));
+	hep_msg = &enc->h;
 	hep_msg->version = 3;
 
 	gettimeofday(&tvb, NULL);
 
-	/* header set */
-	memcpy(hep_msg->u.hepv3.hg.header.id, HEP_HEADER_ID, HEP_HEADER_ID_LEN);
-
-	/* IP proto */
-	hep_msg->u.hepv3.hg.ip_family.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-	hep_msg->u.hepv3.hg.ip_family.chunk.type_id   = htons(0x0001);
+	hep_msg->u.hepv3.hg = hep3_hg_tpl;
 	hep_msg->u.hepv3.hg.ip_family.data = from_su->s.sa_family;
-	hep_msg->u.hepv3.hg.ip_family.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.ip_family));
-
-	/* Proto ID */
-	hep_msg->u.hepv3.hg.ip_proto.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-	hep_msg->u.hepv3.hg.ip_proto.chunk.type_id   = htons(0x0002);
 	hep_msg->u.hepv3.hg.ip_proto.data = net_proto;
-	hep_msg->u.hepv3.hg.ip_proto.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.ip_proto));
-
 
 	/* IPv4 */
 	if(from_su->s.sa_family == AF_INET) {
-		/* SRC IP */
-		hep_msg->u.hepv3.addr.ip4_addr.src_ip4.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.addr.ip4_addr.src_ip4.chunk.type_id   = htons(0x0003);
+		hep_msg->u.hepv3.addr.ip4_addr = hep3_ip4_tpl;
 		hep_msg->u.hepv3.addr.ip4_addr.src_ip4.data = from_su->sin.sin_addr;
-		hep_msg->u.hepv3.addr.ip4_addr.src_ip4.chunk.length = htons(sizeof(hep_msg->u.hepv3.addr.ip4_addr.src_ip4));
-
-		/* DST IP */
-		hep_msg->u.hepv3.addr.ip4_addr.dst_ip4.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.addr.ip4_addr.dst_ip4.chunk.type_id   = htons(0x0004);
 		hep_msg->u.hepv3.addr.ip4_addr.dst_ip4.data = to_su->sin.sin_addr;
-		hep_msg->u.hepv3.addr.ip4_addr.dst_ip4.chunk.length = htons(sizeof(hep_msg->u.hepv3.addr.ip4_addr.dst_ip4));
 
-		iplen = sizeof(hep_msg->u.hepv3.addr.ip4_addr.dst_ip4) + sizeof(hep_msg->u.hepv3.addr.ip4_addr.src_ip4);
-
-		/* SRC PORT */
-		hep_msg->u.hepv3.hg.src_port.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.hg.src_port.chunk.type_id   = htons(0x0007);
 		hep_msg->u.hepv3.hg.src_port.data = htons(from_su->sin.sin_port);
-		hep_msg->u.hepv3.hg.src_port.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.src_port));
-
-		/* DST PORT */
-		hep_msg->u.hepv3.hg.dst_port.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.hg.dst_port.chunk.type_id   = htons(0x0008);
 		hep_msg->u.hepv3.hg.dst_port.data = htons(to_su->sin.sin_port);
-		hep_msg->u.hepv3.hg.dst_port.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.dst_port));
 	}
 	/* IPv6 */
 	else if(from_su->s.sa_family == AF_INET6) {
-		/* SRC IPv6 */
-		hep_msg->u.hepv3.addr.ip6_addr.src_ip6.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.addr.ip6_addr.src_ip6.chunk.type_id   = htons(0x0005);
+		hep_msg->u.hepv3.addr.ip6_addr = hep3_ip6_tpl;
 		hep_msg->u.hepv3.addr.ip6_addr.src_ip6.data = from_su->sin6.sin6_addr;
-		hep_msg->u.hepv3.addr.ip6_addr.src_ip6.chunk.length = htons(sizeof(hep_msg->u.hepv3.addr.ip6_addr.src_ip6));
-
-		/* DST IPv6 */
-		hep_msg->u.hepv3.addr.ip6_addr.dst_ip6.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.addr.ip6_addr.dst_ip6.chunk.type_id   = htons(0x0006);
-		hep_msg->u.hepv3.addr.ip6_addr.dst_ip6.data = from_su->sin6.sin6_addr;
-		hep_msg->u.hepv3.addr.ip6_addr.dst_ip6.chunk.length = htons(sizeof(hep_msg->u.hepv3.addr.ip6_addr.dst_ip6));
+		hep_msg->u.hepv3.addr.ip6_addr.dst_ip6.data = to_su->sin6.sin6_addr;
 
-		iplen = sizeof(hep_msg->u.hepv3.addr.ip6_addr.dst_ip6) + sizeof(hep_msg->u.hepv3.addr.ip6_addr.src_ip6);
-
-		/* SRC PORT */
-		hep_msg->u.hepv3.hg.src_port.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.hg.src_port.chunk.type_id   = htons(0x0007);
 		hep_msg->u.hepv3.hg.src_port.data = htons(from_su->sin6.sin6_port);
-		hep_msg->u.hepv3.hg.src_port.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.src_port));
-
-		/* DST PORT */
-		hep_msg->u.hepv3.hg.dst_port.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.hg.dst_port.chunk.type_id   = htons(0x0008);
 		hep_msg->u.hepv3.hg.dst_port.data = htons(to_su->sin6.sin6_port);
-		hep_msg->u.hepv3.hg.dst_port.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.dst_port));
 	}
 
-	/* TIMESTAMP SEC */
-	hep_msg->u.hepv3.hg.time_sec.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-	hep_msg->u.hepv3.hg.time_sec.chunk.type_id   = htons(0x0009);
 	hep_msg->u.hepv3.hg.time_sec.data = htonl(tvb.tv_sec);
-	hep_msg->u.hepv3.hg.time_sec.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.time_sec));
-
-
-	/* TIMESTAMP USEC */
-	hep_msg->u.hepv3.hg.time_usec.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-	hep_msg->u.hepv3.hg.time_usec.chunk.type_id   = htons(0x000a);
 	hep_msg->u.hepv3.hg.time_usec.data = htonl(tvb.tv_usec);
-	hep_msg->u.hepv3.hg.time_usec.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.time_usec));
-
-	/* Protocol TYPE */
-	hep_msg->u.hepv3.hg.proto_t.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-	hep_msg->u.hepv3.hg.proto_t.chunk.type_id   = htons(0x000b);
 	hep_msg->u.hepv3.hg.proto_t.data = proto;
-	hep_msg->u.hepv3.hg.proto_t.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.proto_t));
-
-	/* Capture ID */
-	hep_msg->u.hepv3.hg.capt_id.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-	hep_msg->u.hepv3.hg.capt_id.chunk.type_id   = htons(0x000c);
-	/* */
-	hep_msg->u.hepv3.hg.capt_id.data = htonl(hep_capture_id);
-	hep_msg->u.hepv3.hg.capt_id.chunk.length = htons(sizeof(hep_msg->u.hepv3.hg.capt_id));
 
 	hep_msg->u.hepv3.payload_chunk.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
 	hep_msg->u.hepv3.payload_chunk.chunk.type_id   = payload_compression ? htons(0x0010) : htons(0x000f);
 
 	if ( payload ) {
-		/* The payload length shall be transformed to network order later; now we'll still need the length of
-		 * the payload before sending */
+		/* the payload length is kept in host order (header included) until
+		 * the packet is serialized */
 		if (!payload_compression) {
 			hep_msg->u.hepv3.payload_chunk.data = payload->s;
 			hep_msg->u.hepv3.payload_chunk.chunk.length = payload->len + sizeof(hep_chunk_t);
@@ -1053,12 +1070,6 @@ static trace_message create_hep3_message(union sockaddr_union* from_su, union so
 		memset( &hep_msg->u.hepv3.payload_chunk, 0, sizeof( hep_msg->u.hepv3.payload_chunk ) );
 	}
 
-	tlen = sizeof(struct hep_generic) + iplen +
-					(payload ? (sizeof(hep_chunk_t) + payload->len) : 0);
-
-	/* FIXME WARNING this is not htons */
-	hep_msg->u.hepv3.hg.header.length = tlen;
-
 	return hep_msg;
 }
 
@@ -1144,6 +1155,28 @@ static int add_generic_chunk(struct hep_desc* hep_msg, void* data, int len, int
 
 
 
+/* per-process serialization buffer; a packet is only needed until it is
+ * handed to msg_send(), so a single buffer is reused for all of them */
+static char *hep_out_buf = NULL;
+static int hep_out_size = 0;
+
+static char* get_hep_out_buf(int len)
+{
+	char *p;
+
+	if (len > hep_out_size) {
+		p = pkg_realloc(hep_out_buf, len);
+		if (p == NULL) {
+			LM_ERR("no more pkg mem!\n");
+			return NULL;
+		}
+		hep_out_buf = p;
+		hep_out_size = len;
+	}
+
+	return hep_out_buf;
+}
+
 static char* build_hep12_buf(struct hep_desc* hep_msg, int* len)
 {
 	int buflen, p;
@@ -1161,11 +1194,8 @@ static char* build_hep12_buf(struct hep_desc* hep_msg, int* len)
 		buflen += sizeof(struct hep_timehdr);
 	}
 
-	buf = pkg_malloc(buflen);
-	if (buf == NULL) {
-		LM_ERR("no more pkg mem!\n");
+	if ((buf = get_hep_out_buf(buflen)) == NULL)
 		return NULL;
-	}
 
 	memset(buf, 0, buflen);
 
@@ -1196,195 +1226,199 @@ static char* build_hep12_buf(struct hep_desc* hep_msg, int* len)
 
 }
 
-static inline char* JSON_toString(void* root)
-{
-	return cJSON_Print(root);
-}
-
-static inline void JSON_free(void* root)
-{
-	cJSON_Delete(root);
-}
-
-static char* build_hep3_buf(struct hep_desc* hep_msg, int* len)
+/* make room for @len more bytes plus the closing brace */
+static int hep_json_grow(struct hep_enc_buf *b, int len)
 {
-	#define UPDATE_CHECK_REMAINING(__rem, __len, __curr) \
-		do { \
-			if (__rem < __curr) { \
-				LM_BUG("bad packet length inside hep structure!\n"); \
-				return NULL; \
-			} \
-			__rem -= __curr; \
-			__len += __curr; \
-		} while (0);
-
-
-	int rem, hdr_len, pld_len, corr_len=0;
-	char* buf;
-	str* h5_buf;
-
-	generic_chunk_t *it, *corr_chunk, correlation;
-
-	*len = 0;
+	char *p;
+	int size;
 
-	rem = hep_msg->u.hepv3.hg.header.length;
+	if (b->len + len + 1 <= b->size)
+		return 0;
 
-	if ( hep_msg->fPayload ) {
-		/* FIXME no payload compression */
-		hep_msg->u.hepv3.payload_chunk.chunk.vendor_id = htons(GENERIC_VENDOR_ID);
-		hep_msg->u.hepv3.payload_chunk.chunk.type_id   = htons(0x000f);
-		if ( !homer5_on ) {
-			rem -= hep_msg->u.hepv3.payload_chunk.chunk.length;
+	size = b->size ? b->size : 128;
+	while (size < b->len + len + 1)
+		size *= 2;
 
-			hep_msg->u.hepv3.payload_chunk.data = JSON_toString(hep_msg->fPayload);
+	p = pkg_realloc(b->s, size);
+	if (p == NULL) {
+		LM_ERR("no more pkg mem!\n");
+		return -1;
+	}
+	b->s = p;
+	b->size = size;
 
-			hep_msg->u.hepv3.payload_chunk.chunk.length =
-				strlen(hep_msg->u.hepv3.payload_chunk.data) + sizeof(hep_chunk_t);
+	return 0;
+}
 
-			rem += hep_msg->u.hepv3.payload_chunk.chunk.length;
-		} else {
-			rem -= hep_msg->u.hepv3.payload_chunk.chunk.length;
+/* quote and escape a string the same way cJSON prints it */
+static char* hep_json_str(char *p, const char *s, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	int i;
 
-			h5_buf = hep_msg->fPayload;
-			hep_msg->u.hepv3.payload_chunk.data = h5_buf->s;
-			hep_msg->u.hepv3.payload_chunk.chunk.length =
-									h5_buf->len + sizeof(hep_chunk_t);
+	*p++ = '"';
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)s[i];
+		if (c >= 32 && c != '"' && c != '\\') {
+			*p++ = c;
+			continue;
+		}
 
-			rem += hep_msg->u.hepv3.payload_chunk.chunk.length;
+		*p++ = '\\';
+		switch (c) {
+			case '"':  *p++ = '"';  break;
+			case '\\': *p++ = '\\'; break;
+			case '\b': *p++ = 'b';  break;
+			case '\f': *p++ = 'f';  break;
+			case '\n': *p++ = 'n';  break;
+			case '\r': *p++ = 'r';  break;
+			case '\t': *p++ = 't';  break;
+			default:
+				*p++ = 'u'; *p++ = '0'; *p++ = '0';
+				*p++ = hex[c >> 4];
+				*p++ = hex[c & 0xf];
 		}
 	}
+	*p++ = '"';
 
-	if ( hep_msg->correlation ) {
-		if ( !homer5_on ) {
-			memset( &correlation, 0, sizeof(generic_chunk_t));
-			correlation.chunk.vendor_id = htons(0);
-			/* hardcoded but this is the header */
-			correlation.chunk.type_id = htons(HEP_EXTRA_CORRELATION);
-			correlation.chunk.length = sizeof(hep_chunk_t);
-
-			correlation.data = JSON_toString(hep_msg->correlation);
-			corr_len += strlen(correlation.data);
-
-			correlation.chunk.length += corr_len;
-			rem += correlation.chunk.length;
-
-			correlation.chunk.length = htons(correlation.chunk.length);
-		} else {
-			/* search to see whether we already got a correlation header */
-			for ( it=hep_msg->u.hepv3.chunk_list; it; it=it->next ) {
-				if ( it->chunk.type_id == 0x11 ) {
-					break;
-				}
-			}
-
-			h5_buf = hep_msg->correlation;
-			if ( it ) {
-				corr_chunk = it;
-				rem -= it->chunk.length;
-			} else {
-				corr_chunk = pkg_malloc( sizeof(hep_chunk_t) );
-				if ( !corr_chunk ) {
-					LM_ERR("no more pkg memory!\n");
-					return 0;
-				}
-
-				memset( corr_chunk, 0, sizeof(hep_chunk_t) );
-				corr_chunk->chunk.type_id = 0x11;
-			}
-
-			corr_chunk->chunk.length = sizeof(hep_chunk_t) + h5_buf->len;
-			corr_chunk->data = h5_buf->s;
-
-
-			/* if chunk not exists add it to custom chunk list */
-			if ( !it ) {
-				corr_chunk->next = hep_msg->u.hepv3.chunk_list;
-				hep_msg->u.hepv3.chunk_list = corr_chunk;
-			}
+	return p;
+}
 
-			rem += corr_chunk->chunk.length;
-		}
-	}
+/* append a "name":"value" member to a JSON object under construction;
+ * the object is only closed when the packet is serialized */
+static int hep_json_add(struct hep_enc_buf *b, char *name, str *value)
+{
+	int name_len = strlen(name);
+	char *p;
 
+	/* worst case: every char escaped as \u00XX */
+	if (hep_json_grow(b, 1 + 6*name_len + 2 + 1 + 6*value->len + 2) < 0)
+		return -1;
 
-	buf = pkg_malloc(rem);
+	p = b->s + b->len;
+	*p++ = b->len ? ',' : '{';
+	p = hep_json_str(p, name, name_len);
+	*p++ = ':';
+	p = hep_json_str(p, value->s, value->len);
+	b->len = p - b->s;
 
-	hep_msg->u.hepv3.hg.header.length = htons(rem);
+	return 0;
+}
 
-	if (buf == NULL) {
-		LM_ERR("no more pkg mem!\n");
-		return NULL;
-	}
+/* the built object, closed; room for the brace is always reserved */
+static inline void hep_json_get(struct hep_enc_buf *b, str *out)
+{
+	b->s[b->len] = '}';
+	out->s = b->s;
+	out->len = b->len + 1;
+}
 
-	memcpy(buf, &hep_msg->u.hepv3.hg, sizeof(hep_generic_t));
-	UPDATE_CHECK_REMAINING(rem, *len, sizeof(hep_generic_t));
+#define HEP3_PUT_CHUNK(_p, _vendor, _type, _data, _len) \
+	do { \
+		hep_chunk_t _c; \
+		_c.vendor_id = htons(_vendor); \
+		_c.type_id = htons(_type); \
+		_c.length = htons(sizeof(hep_chunk_t) + (_len)); \
+		memcpy(_p, &_c, sizeof(hep_chunk_t)); \
+		memcpy(_p + sizeof(hep_chunk_t), _data, _len); \
+		_p += sizeof(hep_chunk_t) + (_len); \
+	} while (0)
+
+/* serialize a HEPv3 message in a single pass into the per-process output
+ * buffer; the message itself is left untouched, so it may be built again */
+static char* build_hep3_buf(struct hep_desc* hep_msg, int* len)
+{
+	struct hep_enc_msg *enc = (struct hep_enc_msg *)hep_msg;
+	int tlen, iplen, corr_type = 0;
+	unsigned short pld_type;
+	str pld = {NULL, 0}, corr = {NULL, 0};
+	generic_chunk_t *it;
+	char *buf, *p;
 
 	if (hep_msg->u.hepv3.hg.ip_family.data == AF_INET) {
-		memcpy(buf+*len, &hep_msg->u.hepv3.addr.ip4_addr, sizeof(struct ip4_addr));
-		UPDATE_CHECK_REMAINING(rem, *len, sizeof(struct ip4_addr));
-	}
-	/* IPv6 */
-	else if(hep_msg->u.hepv3.hg.ip_family.data == AF_INET6) {
-		memcpy(buf+*len, &hep_msg->u.hepv3.addr.ip6_addr, sizeof(struct ip6_addr));
-		UPDATE_CHECK_REMAINING(rem, *len, sizeof(struct ip6_addr));
+		iplen = sizeof(struct ip4_addr);
+	} else if (hep_msg->u.hepv3.hg.ip_family.data == AF_INET6) {
+		iplen = sizeof(struct ip6_addr);
 	} else {
 		LM_ERR("unknown IP family\n");
 		return NULL;
 	}
 
-	if ( hep_msg->u.hepv3.payload_chunk.data
+	/* payload: the formatted one, if any, replaces the raw one */
+	pld_type = ntohs(hep_msg->u.hepv3.payload_chunk.chunk.type_id);
+	if ( hep_msg->fPayload ) {
+		/* FIXME no payload compression */
+		pld_type = HEP_PAYLOAD;
+		if ( !homer5_on )
+			hep_json_get(&enc->pld, &pld);
+		else
+			pld = *(str *)hep_msg->fPayload;
+	} else if ( hep_msg->u.hepv3.payload_chunk.data
 				&& hep_msg->u.hepv3.payload_chunk.chunk.length ) {
-		pld_len = hep_msg->u.hepv3.payload_chunk.chunk.length - sizeof(hep_chunk_t);
-		/* earlier we didn't do htons on this buffer because we needed the
-		 * length; we'll do it now */
-		hep_msg->u.hepv3.payload_chunk.chunk.length =
-					htons(hep_msg->u.hepv3.payload_chunk.chunk.length);
-
-		memcpy(buf+*len, &hep_msg->u.hepv3.payload_chunk, sizeof(hep_chunk_t));
-		UPDATE_CHECK_REMAINING(rem, *len, sizeof(hep_chunk_t));
-
-		memcpy(buf+*len, hep_msg->u.hepv3.payload_chunk.data, pld_len);
-		UPDATE_CHECK_REMAINING(rem, *len, pld_len);
+		pld.s = hep_msg->u.hepv3.payload_chunk.data;
+		pld.len = hep_msg->u.hepv3.payload_chunk.chunk.length - sizeof(hep_chunk_t);
 	}
 
-	/* copy the correlation if exists */
+	/* correlation: a JSON chunk, or the HEP correlation id for homer5 */
 	if ( hep_msg->correlation ) {
-		/* if on it will be with the rest of the chunks */
 		if ( !homer5_on ) {
-			memcpy( buf + *len, &correlation.chunk, sizeof(hep_chunk_t));
-			UPDATE_CHECK_REMAINING(rem, *len, sizeof(hep_chunk_t));
-
-			/* can't get the correlation length from header since it's in htons form */
-			memcpy(buf + *len, correlation.data, corr_len);
-			UPDATE_CHECK_REMAINING(rem, *len, corr_len);
+			hep_json_get(&enc->corr, &corr);
+			corr_type = HEP_EXTRA_CORRELATION;
+		} else {
+			corr = *(str *)hep_msg->correlation;
+			corr_type = HEP_CORRELATION_ID;
 		}
 	}
 
+	tlen = sizeof(hep_generic_t) + iplen;
+	if (pld.s)
+		tlen += sizeof(hep_chunk_t) + pld.len;
+	if (corr.s)
+		tlen += sizeof(hep_chunk_t) + corr.len;
 	for (it=hep_msg->u.hepv3.chunk_list; it; it=it->next) {
-		hdr_len = it->chunk.length;
-
-		it->chunk.vendor_id = htons(it->chunk.vendor_id);
-		it->chunk.length = htons(it->chunk.length);
-		it->chunk.type_id = htons(it->chunk.type_id);
-
-		memcpy(buf+*len, &it->chunk, sizeof(hep_chunk_t));
-		UPDATE_CHECK_REMAINING(rem, *len, sizeof(hep_chunk_t));
+		if (corr_type == HEP_CORRELATION_ID && it->chunk.vendor_id == 0 &&
+		it->chunk.type_id == HEP_CORRELATION_ID)
+			continue;
+		tlen += it->chunk.length;
+	}
 
-		memcpy(buf+*len, it->data, hdr_len - sizeof(hep_chunk_t));
-		UPDATE_CHECK_REMAINING(rem, *len, hdr_len - sizeof(hep_chunk_t));
+	if (tlen > 0xffff) {
+		LM_ERR("HEP packet too large (%d)\n", tlen);
+		return NULL;
 	}
 
-	if (rem) {
-		LM_ERR("%d bytes not copied!\n", rem);
+	if ((buf = get_hep_out_buf(tlen)) == NULL)
 		return NULL;
+
+	memcpy(buf, &hep_msg->u.hepv3.hg, sizeof(hep_generic_t));
+	((hep_generic_t *)buf)->header.length = htons(tlen);
+	p = buf + sizeof(hep_generic_t);
+
+	memcpy(p, &hep_msg->u.hepv3.addr, iplen);
+	p += iplen;
+
+	if (pld.s)
+		HEP3_PUT_CHUNK(p, GENERIC_VENDOR_ID, pld_type, pld.s, pld.len);
+
+	if (corr.s)
+		HEP3_PUT_CHUNK(p, 0, corr_type, corr.s, corr.len);
+
+	for (it=hep_msg->u.hepv3.chunk_list; it; it=it->next) {
+		if (corr_type == HEP_CORRELATION_ID && it->chunk.vendor_id == 0 &&
+		it->chunk.type_id == HEP_CORRELATION_ID)
+			continue;
+		HEP3_PUT_CHUNK(p, it->chunk.vendor_id, it->chunk.type_id, it->data,
+			it->chunk.length - sizeof(hep_chunk_t));
 	}
 
+	*len = p - buf;
 
 	return buf;
-
-#undef UPDATE_CHECK_REMAINING
 }
 
+#undef HEP3_PUT_CHUNK
+
 /*
  *
  * **********************************
@@ -1501,7 +1535,7 @@ int add_hep_chunk(trace_message message, void* data, int len, int type, int data
 
 int add_hep_correlation(trace_message message, char* corr_name, str* corr_value)
 {
-	cJSON* root;
+	struct hep_enc_msg* enc;
 	struct hep_desc* hep_msg;
 	str* sip_correlation;
 
@@ -1518,19 +1552,13 @@ int add_hep_correlation(trace_message message, char* corr_name, str* corr_value)
 	}
 
 	if ( !homer5_on ) {
-		if ( hep_msg->correlation) {
-			root = (cJSON *) hep_msg->correlation;
-		} else {
-			root = cJSON_CreateObject();
-			if ( !root ) {
-				LM_ERR("failed to create correlation object!\n");
-				return -1;
-			}
-
-			hep_msg->correlation = root;
+		enc = (struct hep_enc_msg *)hep_msg;
+		if ( hep_json_add( &enc->corr, corr_name, corr_value) < 0 ) {
+			LM_ERR("failed to add correlation %s!\n", corr_name);
+			return -1;
 		}
 
-		cJSON_AddStrToObject( root, corr_name, corr_value->s, corr_value->len);
+		hep_msg->correlation = &enc->corr;
 	} else {
 		if ( !memcmp( corr_name, "sip", sizeof("sip") ) ) {
 			/* we'll save sip correlation id as the actual correlation */
@@ -1553,7 +1581,7 @@ int add_hep_correlation(trace_message message, char* corr_name, str* corr_value)
 
 int add_hep_payload(trace_message message, char* pld_name, str* pld_value)
 {
-	cJSON* root;
+	struct hep_enc_msg* enc;
 	struct hep_desc* hep_msg;
 
 	str* homer5_buf;
@@ -1571,18 +1599,13 @@ int add_hep_payload(trace_message message, char* pld_name, str* pld_value)
 	}
 
 	if ( !homer5_on ) {
-		if ( hep_msg->fPayload ) {
-			root = (cJSON *) hep_msg->fPayload;
-		} else {
-			root = cJSON_CreateObject();
-			if ( !root ) {
-				LM_ERR("failed to create correlation object!\n");
-				return -1;
-			}
-			hep_msg->fPayload = root;
+		enc = (struct hep_enc_msg *)hep_msg;
+		if ( hep_json_add( &enc->pld, pld_name, pld_value) < 0 ) {
+			LM_ERR("failed to add payload %s!\n", pld_name);
+			return -1;
 		}
 
-		cJSON_AddStrToObject( root, pld_name, pld_value->s, pld_value->len);
+		hep_msg->fPayload = &enc->pld;
 	} else {
 		if ( hep_msg->fPayload ) {
 			homer5_buf = hep_msg->fPayload;
@@ -1632,7 +1655,7 @@ int send_hep_message(trace_message message, trace_dest dest, struct socket_info*
 	char* buf=0;
 
 	struct proxy_l* p;
-	union sockaddr_union* to;
+	union sockaddr_union to;
 
 	hid_list_p hep_dest = (hid_list_p) dest;
 
@@ -1642,8 +1665,8 @@ int send_hep_message(trace_message message, trace_dest dest, struct socket_info*
 	}
 
 
+	/* the buffer is the per-process output one - not to be freed */
 	if (((struct hep_desc *)message)->version == 3) {
-		/* hep msg will be freed after */
 		if ((buf=build_hep3_buf((struct hep_desc *)message, &len))==NULL) {
 			LM_ERR("failed to build hep buffer!\n");
 			return -1;
@@ -1662,28 +1685,19 @@ int send_hep_message(trace_message message, trace_dest dest, struct socket_info*
 		return -1;
 	}
 
-	to=(union sockaddr_union *)pkg_malloc(sizeof(union sockaddr_union));
-	if (to == 0) {
-		LM_ERR("no more pkg mem!\n");
-		pkg_free(p);
-		return -1;
-	}
-
-	hostent2su(to, &p->host, p->addr_idx, p->port?p->port:HEP_PORT);
+	hostent2su(&to, &p->host, p->addr_idx, p->port?p->port:HEP_PORT);
 
 	do {
-		if (msg_send(send_sock, hep_dest->transport, to, 0, buf, len, NULL) < 0) {
+		if (msg_send(send_sock, hep_dest->transport, &to, 0, buf, len, NULL) < 0) {
 			LM_ERR("Cannot send hep message!\n");
 			continue;
 		}
 		ret=0;
 		break;
-	} while ( get_next_su( p, to, 0)==0);
+	} while ( get_next_su( p, &to, 0)==0);
 
 	free_proxy(p);
 	pkg_free(p);
-	pkg_free(to);
-	pkg_free(buf);
 
 	return ret;
 }
@@ -1705,25 +1719,21 @@ void free_hep_message(trace_message message)
 			pkg_free(foo);
 		}
 
-		/* free JSON payload if there */
-		if ( hep_msg->fPayload ) {
-			if ( !homer5_on ) {
-				JSON_free( hep_msg->fPayload );
-			} else {
+		/* JSON payload and correlation live in the message's own
+		 * builders; only the homer5 buffers are separate */
+		if ( homer5_on ) {
+			if ( hep_msg->fPayload ) {
 				if ( ((str *)hep_msg->fPayload)->s )
 					pkg_free( ((str *)hep_msg->fPayload)->s );
 				pkg_free( hep_msg->fPayload );
 			}
-		}
 
-		/* free JSON correlation if there */
-		if ( hep_msg->correlation ) {
-			if ( !homer5_on ) {
-				JSON_free( hep_msg->correlation );
-			} else {
+			if ( hep_msg->correlation )
 				pkg_free( hep_msg->correlation );
-			}
 		}
+
+		put_hep3_msg((struct hep_enc_msg *)hep_msg);
+		return;
 	}
 
 	pkg_free(hep_msg);
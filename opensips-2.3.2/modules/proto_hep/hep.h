@@ -238,6 +238,22 @@ struct hep_desc {
 	void* fPayload; /* formatted payload */
 };
 
+/* growable buffer holding a JSON object under construction */
+struct hep_enc_buf {
+	char *s;
+	int len;
+	int size;
+};
+
+/* outgoing HEPv3 message; when homer5 is off, correlation and fPayload
+ * point to the builders below */
+struct hep_enc_msg {
+	struct hep_desc h;
+
+	struct hep_enc_buf corr;
+	struct hep_enc_buf pld;
+};
+
 
 struct hep_context {
 	struct hep_desc h;
@@ -61,6 +61,12 @@ int ws_hs_read_tout = 100;
 /* XXX: this information should be dynamically provided */
 static str ws_resource = str_init("/");
 
+/* permessage-deflate: disabled, 15 bits window, context takeover,
+ * messages under 128 bytes are not compressed */
+static struct ws_deflate_cfg ws_deflate_cfg = { 0, 15, 1, 128 };
+
+static struct ws_stats ws_stats;
+
 #define _ws_common_module "ws"
 #define _ws_common_tcp_current_req tcp_current_req
 #define _ws_common_current_req ws_current_req
@@ -70,6 +76,8 @@ static str ws_resource = str_init("/");
 #define _ws_common_read_tout ws_hs_read_tout
 #define _ws_common_write_tout ws_send_timeout
 #define _ws_common_resource ws_resource
+#define _ws_common_deflate_cfg ws_deflate_cfg
+#define _ws_common_stats ws_stats
 #include "ws_handshake_common.h"
 #include "ws_common.h"
 
@@ -116,12 +124,30 @@ static param_export_t params[] = {
 	{ "ws_send_timeout",   INT_PARAM, &ws_send_timeout   },
 	{ "ws_resource",       STR_PARAM, &ws_resource       },
 	{ "ws_handshake_timeout", INT_PARAM, &ws_hs_read_tout },
+	{ "ws_compression",    INT_PARAM, &ws_deflate_cfg.enabled },
+	{ "ws_compression_window_bits", INT_PARAM, &ws_deflate_cfg.window_bits },
+	{ "ws_compression_context_takeover", INT_PARAM,
+		&ws_deflate_cfg.context_takeover },
+	{ "ws_compression_min_size", INT_PARAM, &ws_deflate_cfg.min_size },
 	{ "trace_destination",     STR_PARAM,         &trace_destination_name.s  },
 	{ "trace_on",						 INT_PARAM, &trace_is_on_tmp        },
 	{ "trace_filter_route",				 STR_PARAM, &trace_filter_route     },
 	{0, 0, 0}
 };
 
+static stat_export_t mod_stats[] = {
+	{"ws_frames_sent",        0, &ws_stats.frames_sent },
+	{"ws_frames_received",    0, &ws_stats.frames_rcvd },
+	{"ws_masked_bytes",       0, &ws_stats.masked_bytes },
+	{"ws_deflated_msgs",      0, &ws_stats.deflated_msgs },
+	{"ws_deflate_in_bytes",   0, &ws_stats.deflate_in },
+	{"ws_deflate_out_bytes",  0, &ws_stats.deflate_out },
+	{"ws_inflated_msgs",      0, &ws_stats.inflated_msgs },
+	{"ws_inflate_in_bytes",   0, &ws_stats.inflate_in },
+	{"ws_inflate_out_bytes",  0, &ws_stats.inflate_out },
+	{0, 0, 0}
+};
+
 static dep_export_t deps = {
 	{ /* OpenSIPS module dependencies */
 		{ MOD_TYPE_DEFAULT, "proto_hep", DEP_SILENT },
@@ -147,7 +173,7 @@ struct module_exports exports = {
 	cmds,       /* exported functions */
 	0,          /* exported async functions */
 	params,     /* module parameters */
-	0,          /* exported statistics */
+	mod_stats,  /* exported statistics */
 	mi_cmds,    /* exported MI functions */
 	0,          /* exported pseudo-variables */
 	0,          /* extra processes */
@@ -184,6 +210,9 @@ static int mod_init(void)
 {
 	LM_INFO("initializing WebSocket protocol\n");
 
+	if (ws_deflate_fix_cfg() < 0)
+		return -1;
+
 	if (trace_destination_name.s) {
 		if ( !net_trace_api ) {
 			if ( trace_prot_bind( WS_TRACE_PROTO, &tprot) < 0 ) {
@@ -266,6 +295,8 @@ static void ws_conn_clean(struct tcp_connection* c)
 		}
 	}
 
+	if (d->zip)
+		ws_deflate_free(d->zip);
 	shm_free(d);
 	c->proto_data = NULL;
 }
@@ -38,6 +38,8 @@ enum ws_conn_state { WS_CON_INIT, WS_CON_HANDSHAKE, WS_CON_HANDSHAKE_DONE,
 
 enum ws_conn_type { WS_NONE, WS_CLIENT, WS_SERVER };
 
+struct ws_deflate;
+
 enum ws_close_code {
 	WS_ERR_NONE		= 0,
 	WS_ERR_NORMAL	= 1000,
@@ -71,6 +73,9 @@ struct ws_data {
 
 	/* WebSocket Handshake key */
 	str key;
+
+	/* permessage-deflate state, if negotiated */
+	struct ws_deflate *zip;
 };
 
 #define WS_STATE(_c) \
@@ -81,6 +86,8 @@ struct ws_data {
 	(((struct ws_data *)(_c)->proto_data)->code)
 #define WS_KEY(_c) \
 	(((struct ws_data *)(_c)->proto_data)->key)
+#define WS_ZIP(_c) \
+	(((struct ws_data *)(_c)->proto_data)->zip)
 
 
 #endif /* _PROTO_WS_H_ */
@@ -37,6 +37,17 @@
 #include "proto_ws.h"
 #include "ws_tcp.h"
 #include "ws_common_defs.h"
+#include "ws_deflate.h"
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+	#define WS_MASK_ALIGN		16
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+	#define WS_MASK_ALIGN		16
+#else
+	#define WS_MASK_ALIGN		sizeof(uint64_t)
+#endif
 
 
 /*
@@ -74,6 +85,7 @@
 #define WS_OP_PONG			0xA
 
 #define WS_BIT_FIN			0x80
+#define WS_BIT_RSV1			0x40
 #define WS_BIT_MASK			0x80
 #define WS_MASK_SLEN		0x7F
 #define WS_MASK_OPCODE		0x0F
@@ -130,6 +142,8 @@
 #define WS_USE_ELENC(_r)	(WS_SLEN(_r) == WS_EXTC_LEN)
 #define WS_IS_MASKED(_r)	(WS_BUF(_r)[1] & WS_BIT_MASK)
 #define WS_IS_FIN(_r)		(WS_BUF(_r)[0] & WS_BIT_FIN)
+#define WS_IS_RSV1(_r)		(WS_BUF(_r)[0] & WS_BIT_RSV1)
+#define WS_IS_CONTROL(_op)	((_op) & 0x8)
 #define WS_OPCODE(_r)		(WS_BUF(_r)[0] & WS_MASK_OPCODE)
 #define WS_MASK(_r)			(*((unsigned int *)(WS_BODY(_r)) - 1))
 
@@ -148,6 +162,9 @@
 #ifndef _ws_common_write_tout
 #error "_ws_common_write_tout not defined!"
 #endif
+#ifndef _ws_common_stats
+#error "_ws_common_stats not defined!"
+#endif
 
 static inline void ws_print_masked(char *buf, int len)
 {
@@ -182,20 +199,39 @@ static inline void ws_print_masked(char *buf, int len)
 
 static inline void ws_mask(char *buf, int len, unsigned int mask)
 {
-	char *p = buf;
-	char *end = buf + len;
+	unsigned char *p = (unsigned char *)buf;
+	unsigned char *end = p + len;
+	uint64_t mask64;
+#if defined(__SSE2__)
+	__m128i vmask;
+#elif defined(__ARM_NEON)
+	uint8x16_t vmask;
+#endif
 
 	/* xor first bits, until aligned */
-	for (; p < end && (((unsigned long)p) % sizeof(unsigned long *)); p++,
+	for (; p < end && (((unsigned long)p) % WS_MASK_ALIGN); p++,
 			mask = ROTATE32(mask))
 		*p ^= MASK8(mask);
 
-	/* xor the big chunk, which is aligned */
-	for (; p < end - (sizeof(int) - 1); p += sizeof(int))
-		*((int *)p) ^= mask;
+	/* xor the big chunk, 16 bytes at a time, if the CPU can do it */
+#if defined(__SSE2__)
+	vmask = _mm_set1_epi32((int)mask);
+	for (; end - p >= 16; p += 16)
+		_mm_store_si128((__m128i *)p,
+				_mm_xor_si128(_mm_load_si128((__m128i *)p), vmask));
+#elif defined(__ARM_NEON)
+	vmask = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+	for (; end - p >= 16; p += 16)
+		vst1q_u8(p, veorq_u8(vld1q_u8(p), vmask));
+#endif
+
+	/* what is left of the aligned chunk, a word at a time */
+	mask64 = ((uint64_t)mask << 32) | mask;
+	for (; end - p >= sizeof(uint64_t); p += sizeof(uint64_t))
+		*((uint64_t *)p) ^= mask64;
 
 	/* the last chunk may not be processed */
-	for (; p < end; p++, mask >>= 8)
+	for (; p < end; p++, mask = ROTATE32(mask))
 		*p ^= MASK8(mask);
 	//ws_print_masked(buf, len);
 }
@@ -212,6 +248,9 @@ static inline int ws_send(struct tcp_connection *con, int fd, int op,
 	static unsigned char hdr_buf[WS_MAX_HDR_LEN];
 	static struct iovec v[2] = { {hdr_buf, 0}, {0, 0}};
 	unsigned int mask = rand();
+	struct ws_deflate *zip = WS_ZIP(con);
+	int deflated = 0;
+	int n;
 
 	/* FIN + OPCODE */
 	hdr_buf[0] = WS_BIT_FIN | (op & WS_MASK_OPCODE);
@@ -220,8 +259,29 @@ static inline int ws_send(struct tcp_connection *con, int fd, int op,
 		hdr_buf[1] = 0;
 		/* don't have any data, send only the heeader  */
 		v[0].iov_len = WS_MIN_HDR_LEN;
-		return _ws_common_writev(con, fd, v, 1, _ws_common_write_tout);
-	} else if (len < WS_EXT_LEN) {
+		n = _ws_common_writev(con, fd, v, 1, _ws_common_write_tout);
+		if (n >= 0)
+			update_stat(_ws_common_stats.frames_sent, 1);
+		return n;
+	}
+
+	/* data messages may be compressed; the lock keeps the compressed frames
+	 * on the wire in the same order they went through the compressor */
+	if (zip && !WS_IS_CONTROL(op) && len >= _ws_common_deflate_cfg.min_size) {
+		lock_get(&zip->lock);
+		deflated = ws_deflate_msg(zip, &body, &len);
+		if (deflated < 0) {
+			lock_release(&zip->lock);
+			return -1;
+		} else if (deflated == 0) {
+			lock_release(&zip->lock);
+		} else {
+			/* first frame of a compressed message */
+			hdr_buf[0] |= WS_BIT_RSV1;
+		}
+	}
+
+	if (len < WS_EXT_LEN) {
 		hdr_buf[1] = len;
 		v[0].iov_len = WS_MIN_HDR_LEN;
 	} else if (len < WS_MAX_ELEN) {
@@ -232,7 +292,8 @@ static inline int ws_send(struct tcp_connection *con, int fd, int op,
 		v[0].iov_len = WS_MIN_HDR_LEN + WS_ELENC_SIZE;
 		hdr_buf[1] = WS_EXTC_LEN;
 		/* len can't be larger than 32 bits long */
-		*(uint64_t *)(hdr_buf + WS_MIN_HDR_LEN) = htonl(len);
+		*(uint32_t *)(hdr_buf + WS_MIN_HDR_LEN) = 0;
+		*(uint32_t *)(hdr_buf + WS_MIN_HDR_LEN + sizeof(uint32_t)) = htonl(len);
 	}
 
 	if (WS_TYPE(con) == WS_CLIENT) {
@@ -242,22 +303,35 @@ static inline int ws_send(struct tcp_connection *con, int fd, int op,
 		/* also indicate that the message is masked */
 		hdr_buf[1] |= WS_BIT_MASK;
 
-		body_buf = body_buf ? pkg_realloc(body_buf, len) : pkg_malloc(len);
-		if (!body_buf) {
-			LM_ERR("oom for body buffer\n");
-			return -1;
-		}
-		memcpy(body_buf, body, len);
+		if (deflated) {
+			/* already in our own buffer - mask it in place */
+			ws_mask(body, len, mask);
+			v[1].iov_base = body;
+		} else {
+			body_buf = body_buf ? pkg_realloc(body_buf, len) : pkg_malloc(len);
+			if (!body_buf) {
+				LM_ERR("oom for body buffer\n");
+				return -1;
+			}
+			memcpy(body_buf, body, len);
 
-		ws_mask(body_buf, len, mask);
-		v[1].iov_base = body_buf;
+			ws_mask(body_buf, len, mask);
+			v[1].iov_base = body_buf;
+		}
+		update_stat(_ws_common_stats.masked_bytes, len);
 	} else {
 		v[1].iov_base = body;
 	}
 
 	v[1].iov_len = len;
 
-	return _ws_common_writev(con, fd, v, 2, _ws_common_write_tout);
+	n = _ws_common_writev(con, fd, v, 2, _ws_common_write_tout);
+	if (deflated)
+		lock_release(&zip->lock);
+	if (n >= 0)
+		update_stat(_ws_common_stats.frames_sent, 1);
+
+	return n;
 }
 
 static inline int ws_send_pong(struct tcp_connection *con, struct ws_req *req)
@@ -362,6 +436,8 @@ static enum ws_close_code inline ws_parse(struct ws_req *req)
 			req->tcp.body = (char *)req->tcp.buf + WS_MIN_HDR_LEN;
 		}
 
+		req->deflated = WS_IS_RSV1(req) ? 1 : 0;
+
 		if (WS_IS_MASKED(req)) {
 			req->tcp.body += WS_MASK_SIZE;
 			req->mask = WS_MASK(req);
@@ -377,8 +453,10 @@ static enum ws_close_code inline ws_parse(struct ws_req *req)
 		 * decode only if we have something interesting out there
 		 * even if we have a mask but it is 0, XOR doesn't do anything
 		 */
-		if (req->mask && req->tcp.content_len)
+		if (req->mask && req->tcp.content_len) {
 			ws_mask(req->tcp.body, req->tcp.content_len, req->mask);
+			update_stat(_ws_common_stats.masked_bytes, req->tcp.content_len);
+		}
 
 		req->tcp.complete = 1;
 		req->tcp.parsed = req->tcp.body + req->tcp.content_len;
@@ -396,6 +474,7 @@ update_parsed:
 		(_req)->op = WS_OP_CONT; \
 		(_req)->mask = 0; \
 		(_req)->is_masked = 0; \
+		(_req)->deflated = 0; \
 	} while(0)
 
 static int ws_process(struct tcp_connection *con)
@@ -453,6 +532,14 @@ again:
 			goto error;
 		}
 
+		/* RSV1 is only allowed on data frames, if compression is on */
+		if (req->deflated && (!WS_ZIP(con) || WS_IS_CONTROL(req->op))) {
+			LM_DBG("unexpected compressed WS msg, op %d\n", req->op);
+			ret_code = WS_ERR_PROTO;
+			goto error;
+		}
+		update_stat(_ws_common_stats.frames_rcvd, 1);
+
 		/* update the timeout - we successfully read the request */
 		tcp_conn_set_lifetime(con, _ws_common_write_tout);
 		con->timeout=con->lifetime;
@@ -506,10 +593,15 @@ again:
 		case WS_OP_TEXT:
 		case WS_OP_BIN:
 
-			bk = *req->tcp.parsed;
-			*req->tcp.parsed = 0;
 			msg_buf = req->tcp.body;
 			msg_len = req->tcp.parsed-req->tcp.body;
+			if (req->deflated) {
+				ret_code = ws_inflate_msg(WS_ZIP(con), &msg_buf, &msg_len);
+				if (ret_code != WS_ERR_NONE)
+					goto error;
+			}
+			bk = *req->tcp.parsed;
+			*req->tcp.parsed = 0;
 			local_rcv = con->rcv;
 
 			if (!size) {
@@ -614,6 +706,7 @@ again:
 			newreq->op = req->op;
 			newreq->mask = req->mask;
 			newreq->is_masked = req->is_masked;
+			newreq->deflated = req->deflated;
 
 			con->con_req = (struct tcp_req *)newreq;
 		}
@@ -26,7 +26,10 @@
 #ifndef _WS_COMMON_DEFS_H_
 #define _WS_COMMON_DEFS_H_
 
+#include <zlib.h>
 #include "../../net/net_tcp.h"
+#include "../../locking.h"
+#include "../../statistics.h"
 
 /* wrapper around tcp request to add ws info */
 struct ws_req {
@@ -34,6 +37,46 @@ struct ws_req {
 	unsigned int op;
 	unsigned int mask;
 	unsigned int is_masked;
+	unsigned int deflated;
+};
+
+/* the server/client_max_window_bits have to be echoed in the response */
+#define WS_ZIP_TX_BITS_F	(1 << 0)
+#define WS_ZIP_RX_BITS_F	(1 << 1)
+
+/* negotiated permessage-deflate (RFC 7692) state of a connection, in shm */
+struct ws_deflate {
+	/* serializes the compressor and the writes of compressed frames */
+	gen_lock_t lock;
+	unsigned char tx_bits;
+	unsigned char rx_bits;
+	unsigned char tx_no_takeover;
+	unsigned char rx_no_takeover;
+	unsigned char flags;
+	/* zlib streams - created when first used */
+	z_stream *tx;
+	z_stream *rx;
+};
+
+/* permessage-deflate module settings */
+struct ws_deflate_cfg {
+	int enabled;
+	int window_bits;
+	int context_takeover;
+	int min_size;
+};
+
+/* framing and compression counters */
+struct ws_stats {
+	stat_var *frames_sent;
+	stat_var *frames_rcvd;
+	stat_var *masked_bytes;
+	stat_var *deflated_msgs;
+	stat_var *deflate_in;
+	stat_var *deflate_out;
+	stat_var *inflated_msgs;
+	stat_var *inflate_in;
+	stat_var *inflate_out;
 };
 
 
@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2017 - OpenSIPS Foundation
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ *
+ * History:
+ * -------
+ *  2017-xx-xx  permessage-deflate (RFC 7692) support
+ */
+
+#ifndef _WS_DEFLATE_H_
+#define _WS_DEFLATE_H_
+
+#include <zlib.h>
+
+#include "../../mem/shm_mem.h"
+#include "../../statistics.h"
+#include "../../config.h"
+#include "../../ut.h"
+#include "proto_ws.h"
+#include "ws_common_defs.h"
+
+#ifndef _ws_common_module
+#error "_ws_common_module not defined!"
+#endif
+#ifndef _ws_common_deflate_cfg
+#error "_ws_common_deflate_cfg not defined!"
+#endif
+#ifndef _ws_common_stats
+#error "_ws_common_stats not defined!"
+#endif
+
+#define WS_EXT_DEFLATE		"permessage-deflate"
+#define WS_EXT_DEFLATE_LEN	(sizeof(WS_EXT_DEFLATE) - 1)
+
+#define WS_EXT_HDR			"\r\nSec-WebSocket-Extensions: " WS_EXT_DEFLATE
+#define WS_EXT_HDR_LEN		(sizeof(WS_EXT_HDR) - 1)
+
+/* large enough for the header and all the parameters */
+#define WS_EXT_MAX_LEN		(WS_EXT_HDR_LEN + 128)
+
+/* zlib does not produce raw deflate streams with a 256 bytes window */
+#define WS_DEFLATE_MIN_BITS	9
+#define WS_DEFLATE_MAX_BITS	15
+
+/* the trailer removed from / appended to each compressed message */
+static unsigned char ws_deflate_tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+#define WS_PARAM_IS(_s, _p) \
+	((_s).len == sizeof(_p) - 1 && !strncasecmp((_s).s, _p, (_s).len))
+
+
+static int ws_deflate_fix_cfg(void)
+{
+	if (!_ws_common_deflate_cfg.enabled)
+		return 0;
+
+	if (_ws_common_deflate_cfg.window_bits < WS_DEFLATE_MIN_BITS ||
+			_ws_common_deflate_cfg.window_bits > WS_DEFLATE_MAX_BITS) {
+		LM_ERR("invalid compression window bits %d - must be between "
+				"%d and %d\n", _ws_common_deflate_cfg.window_bits,
+				WS_DEFLATE_MIN_BITS, WS_DEFLATE_MAX_BITS);
+		return -1;
+	}
+
+	if (_ws_common_deflate_cfg.min_size < 0)
+		_ws_common_deflate_cfg.min_size = 0;
+
+	return 0;
+}
+
+
+static voidpf ws_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return shm_malloc(items * size);
+}
+
+static void ws_zfree(voidpf opaque, voidpf address)
+{
+	shm_free(address);
+}
+
+static inline z_stream *ws_zstream_new(void)
+{
+	z_stream *zs;
+
+	zs = shm_malloc(sizeof *zs);
+	if (!zs) {
+		LM_ERR("no more shm for zlib stream\n");
+		return NULL;
+	}
+	memset(zs, 0, sizeof *zs);
+	zs->zalloc = ws_zalloc;
+	zs->zfree = ws_zfree;
+	zs->opaque = Z_NULL;
+
+	return zs;
+}
+
+static void ws_deflate_free(struct ws_deflate *z)
+{
+	if (z->tx) {
+		deflateEnd(z->tx);
+		shm_free(z->tx);
+	}
+	if (z->rx) {
+		inflateEnd(z->rx);
+		shm_free(z->rx);
+	}
+	lock_destroy(&z->lock);
+	shm_free(z);
+}
+
+
+/*
+ * Checks a single extension offer; returns 1 if it is a permessage-deflate
+ * offer that we can accept, filling in the negotiated values, 0 otherwise
+ */
+static int ws_deflate_offer(str offer, struct ws_deflate *z)
+{
+	str tok, name, val;
+	char *p, *eq, *end;
+	unsigned int n;
+	int srv_bits = 0, cli_bits = 0; /* 0 - absent, -1 - no value */
+	int srv_nt = 0, cli_nt = 0;
+
+	end = offer.s + offer.len;
+	p = q_memchr(offer.s, ';', offer.len);
+	tok.s = offer.s;
+	tok.len = (p ? p : end) - offer.s;
+	str_trim_spaces_lr(tok);
+	if (!WS_PARAM_IS(tok, WS_EXT_DEFLATE))
+		return 0;
+
+	while (p && p < end) {
+		tok.s = p + 1;
+		p = q_memchr(tok.s, ';', end - tok.s);
+		tok.len = (p ? p : end) - tok.s;
+
+		name = tok;
+		val.s = NULL;
+		val.len = 0;
+		eq = q_memchr(tok.s, '=', tok.len);
+		if (eq) {
+			name.len = eq - tok.s;
+			val.s = eq + 1;
+			val.len = tok.s + tok.len - val.s;
+			str_trim_spaces_lr(val);
+			if (val.len >= 2 && val.s[0] == '"' && val.s[val.len - 1] == '"') {
+				val.s++;
+				val.len -= 2;
+			}
+		}
+		str_trim_spaces_lr(name);
+		if (name.len == 0)
+			continue;
+
+		if (WS_PARAM_IS(name, "server_no_context_takeover")) {
+			if (val.s || srv_nt)
+				return 0;
+			srv_nt = 1;
+		} else if (WS_PARAM_IS(name, "client_no_context_takeover")) {
+			if (val.s || cli_nt)
+				return 0;
+			cli_nt = 1;
+		} else if (WS_PARAM_IS(name, "server_max_window_bits")) {
+			if (!val.s || srv_bits || str2int(&val, &n) < 0 ||
+					n < 8 || n > WS_DEFLATE_MAX_BITS)
+				return 0;
+			srv_bits = n;
+		} else if (WS_PARAM_IS(name, "client_max_window_bits")) {
+			if (cli_bits)
+				return 0;
+			if (val.s) {
+				if (str2int(&val, &n) < 0 || n < 8 || n > WS_DEFLATE_MAX_BITS)
+					return 0;
+				cli_bits = n;
+			} else {
+				cli_bits = -1;
+			}
+		} else {
+			LM_DBG("unknown permessage-deflate parameter <%.*s>\n",
+					name.len, name.s);
+			return 0;
+		}
+	}
+
+	memset(z, 0, sizeof *z);
+
+	/* our compressor */
+	z->tx_bits = _ws_common_deflate_cfg.window_bits;
+	if (srv_bits) {
+		if (srv_bits < z->tx_bits)
+			z->tx_bits = srv_bits;
+		z->flags |= WS_ZIP_TX_BITS_F;
+	} else if (z->tx_bits < WS_DEFLATE_MAX_BITS) {
+		z->flags |= WS_ZIP_TX_BITS_F;
+	}
+	if (z->tx_bits < WS_DEFLATE_MIN_BITS) {
+		LM_DBG("cannot compress with a %d bits window\n", z->tx_bits);
+		return 0;
+	}
+	z->tx_no_takeover = srv_nt || !_ws_common_deflate_cfg.context_takeover;
+
+	/* the peer's compressor - we can only limit it if it allows us to */
+	z->rx_bits = WS_DEFLATE_MAX_BITS;
+	if (cli_bits) {
+		z->rx_bits = _ws_common_deflate_cfg.window_bits;
+		if (cli_bits > 0 && cli_bits < z->rx_bits)
+			z->rx_bits = cli_bits;
+		if (z->rx_bits < WS_DEFLATE_MAX_BITS)
+			z->flags |= WS_ZIP_RX_BITS_F;
+	}
+	z->rx_no_takeover = cli_nt || !_ws_common_deflate_cfg.context_takeover;
+
+	return 1;
+}
+
+/*
+ * Walks through the offers in a Sec-WebSocket-Extensions header and
+ * attaches the compression state to the connection for the first one
+ * we accept
+ */
+static void ws_deflate_negotiate(struct tcp_connection *c, str *hdr)
+{
+	struct ws_deflate tmp, *z;
+	str offer;
+	char *p, *end;
+
+	end = hdr->s + hdr->len;
+	for (offer.s = hdr->s; offer.s < end; offer.s = p + 1) {
+		p = q_memchr(offer.s, ',', end - offer.s);
+		if (!p)
+			p = end;
+		offer.len = p - offer.s;
+
+		if (!ws_deflate_offer(offer, &tmp))
+			continue;
+
+		z = shm_malloc(sizeof *z);
+		if (!z) {
+			LM_ERR("no more shm for compression state\n");
+			return;
+		}
+		*z = tmp;
+		lock_init(&z->lock);
+		WS_ZIP(c) = z;
+
+		LM_DBG("permessage-deflate negotiated on %p: tx %d bits%s, "
+				"rx %d bits%s\n", c,
+				z->tx_bits, z->tx_no_takeover ? " (no takeover)" : "",
+				z->rx_bits, z->rx_no_takeover ? " (no takeover)" : "");
+		return;
+	}
+}
+
+/* builds the Sec-WebSocket-Extensions header for the handshake reply */
+static int ws_deflate_response(struct ws_deflate *z, char *buf)
+{
+	char *p = buf;
+	char *s;
+	int len;
+
+	memcpy(p, WS_EXT_HDR, WS_EXT_HDR_LEN);
+	p += WS_EXT_HDR_LEN;
+
+#define WS_APPEND(_s) \
+	do { \
+		memcpy(p, _s, sizeof(_s) - 1); \
+		p += sizeof(_s) - 1; \
+	} while (0)
+
+	if (z->tx_no_takeover)
+		WS_APPEND("; server_no_context_takeover");
+	if (z->rx_no_takeover)
+		WS_APPEND("; client_no_context_takeover");
+	if (z->flags & WS_ZIP_TX_BITS_F) {
+		WS_APPEND("; server_max_window_bits=");
+		s = int2str(z->tx_bits, &len);
+		memcpy(p, s, len);
+		p += len;
+	}
+	if (z->flags & WS_ZIP_RX_BITS_F) {
+		WS_APPEND("; client_max_window_bits=");
+		s = int2str(z->rx_bits, &len);
+		memcpy(p, s, len);
+		p += len;
+	}
+
+#undef WS_APPEND
+
+	return p - buf;
+}
+
+
+/*
+ * Compresses a message; must be called with z->lock held, and the frame
+ * must be written before releasing it.
+ * Returns 1 and points buf/len to the compressed payload (in a per-process
+ * buffer), 0 if the message should be sent as it is, -1 on error.
+ */
+static int ws_deflate_msg(struct ws_deflate *z, char **buf, unsigned int *len)
+{
+	static unsigned char *zbuf = NULL;
+	static unsigned int zbuf_len = 0;
+	unsigned char *tmp;
+	unsigned int need, done, out_len;
+	int ret;
+
+	if (!z->tx) {
+		z->tx = ws_zstream_new();
+		if (!z->tx)
+			return -1;
+		if (deflateInit2(z->tx, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				-(int)z->tx_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			LM_ERR("cannot initialize the compressor\n");
+			shm_free(z->tx);
+			z->tx = NULL;
+			return -1;
+		}
+	}
+
+	/* the sync flush marker is not accounted by deflateBound() */
+	need = deflateBound(z->tx, *len) + sizeof(ws_deflate_tail) + 8;
+	if (need > zbuf_len) {
+		tmp = pkg_realloc(zbuf, need);
+		if (!tmp) {
+			LM_ERR("no more pkg for compression buffer\n");
+			return -1;
+		}
+		zbuf = tmp;
+		zbuf_len = need;
+	}
+
+	z->tx->next_in = (Bytef *)*buf;
+	z->tx->avail_in = *len;
+	z->tx->next_out = zbuf;
+	z->tx->avail_out = zbuf_len;
+
+	for (;;) {
+		ret = deflate(z->tx, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			LM_ERR("compression failed: %d\n", ret);
+			return -1;
+		}
+		if (z->tx->avail_out)
+			break;
+
+		/* not enough room to complete the flush */
+		done = zbuf_len;
+		tmp = pkg_realloc(zbuf, zbuf_len * 2);
+		if (!tmp) {
+			LM_ERR("no more pkg for compression buffer\n");
+			return -1;
+		}
+		zbuf = tmp;
+		zbuf_len *= 2;
+		z->tx->next_out = zbuf + done;
+		z->tx->avail_out = zbuf_len - done;
+	}
+
+	out_len = zbuf_len - z->tx->avail_out;
+	if (out_len < sizeof(ws_deflate_tail) ||
+			memcmp(zbuf + out_len - sizeof(ws_deflate_tail), ws_deflate_tail,
+				sizeof(ws_deflate_tail))) {
+		LM_BUG("compressed message does not end with an empty block\n");
+		return -1;
+	}
+	out_len -= sizeof(ws_deflate_tail);
+
+	if (z->tx_no_takeover) {
+		deflateReset(z->tx);
+		/* no history to keep in sync, so we can still change our mind */
+		if (out_len >= *len)
+			return 0;
+	}
+
+	update_stat(_ws_common_stats.deflated_msgs, 1);
+	update_stat(_ws_common_stats.deflate_in, *len);
+	update_stat(_ws_common_stats.deflate_out, out_len);
+
+	*buf = (char *)zbuf;
+	*len = out_len;
+	return 1;
+}
+
+/*
+ * Decompresses a received message into a per-process buffer; on success
+ * buf/len point to the (null terminated) SIP message
+ */
+static enum ws_close_code ws_inflate_msg(struct ws_deflate *z,
+		char **buf, int *len)
+{
+	static char zbuf[BUF_SIZE + 1];
+	int ret, in_len = *len;
+
+	if (!z->rx) {
+		z->rx = ws_zstream_new();
+		if (!z->rx)
+			return WS_ERR_UNEXPECT;
+		if (inflateInit2(z->rx, -(int)z->rx_bits) != Z_OK) {
+			LM_ERR("cannot initialize the decompressor\n");
+			shm_free(z->rx);
+			z->rx = NULL;
+			return WS_ERR_UNEXPECT;
+		}
+	}
+
+	z->rx->next_in = (Bytef *)*buf;
+	z->rx->avail_in = *len;
+	z->rx->next_out = (Bytef *)zbuf;
+	z->rx->avail_out = BUF_SIZE;
+
+	ret = inflate(z->rx, Z_SYNC_FLUSH);
+	if ((ret == Z_OK || ret == Z_BUF_ERROR) && z->rx->avail_in == 0 &&
+			z->rx->avail_out) {
+		z->rx->next_in = ws_deflate_tail;
+		z->rx->avail_in = sizeof(ws_deflate_tail);
+		ret = inflate(z->rx, Z_SYNC_FLUSH);
+	}
+
+	switch (ret) {
+	case Z_OK:
+	case Z_BUF_ERROR:
+		if (z->rx->avail_in == 0 && z->rx->avail_out)
+			break;
+		LM_ERR("decompressed message too large (max %d)\n", BUF_SIZE);
+		inflateReset(z->rx);
+		return WS_ERR_TOO_BIG;
+	case Z_STREAM_END:
+		/* the peer closed the stream with a final block */
+		inflateReset(z->rx);
+		break;
+	default:
+		LM_ERR("invalid compressed data: %s\n",
+				z->rx->msg ? z->rx->msg : "unknown error");
+		return WS_ERR_BADDATA;
+	}
+
+	*len = BUF_SIZE - z->rx->avail_out;
+	zbuf[*len] = 0;
+	*buf = zbuf;
+
+	if (z->rx_no_takeover)
+		inflateReset(z->rx);
+
+	update_stat(_ws_common_stats.inflated_msgs, 1);
+	update_stat(_ws_common_stats.inflate_in, in_len);
+	update_stat(_ws_common_stats.inflate_out, *len);
+
+	return WS_ERR_NONE;
+}
+
+#endif /* _WS_DEFLATE_H_ */
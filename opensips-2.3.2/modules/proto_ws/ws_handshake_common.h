@@ -27,6 +27,7 @@
 #define _WS_HANDSHAKE_H_
 
 #include "../../ip_addr.h"
+#include "ws_deflate.h"
 
 #define HTTP_SEP			"\r\n"
 #define HTTP_SEP_LEN		(sizeof(HTTP_SEP) - 1)
@@ -949,6 +950,11 @@ static int ws_parse_req_handshake(struct tcp_connection *c, char *msg, int len)
 					goto ws_error;
 				}
 				flags |= WS_PROTO_F;
+			} else if (hf->name.len == HDR_LEN("Sec-WebSocket-Extensions") &&
+					!strncasecmp(hf->name.s + 14, "extensions", 10)) {
+
+				if (_ws_common_deflate_cfg.enabled && !WS_ZIP(c))
+					ws_deflate_negotiate(c, &hf->body);
 			}
 			break;
 		}
@@ -1012,9 +1018,11 @@ static int ws_complete_handshake(struct tcp_connection *c)
 {
 	int n;
 	struct timeval get;
+	static char ws_ext_buf[WS_EXT_MAX_LEN];
 	static struct iovec iov[] = {
 		{ (void*)WS_HTTP_ACCEPT, WS_HTTP_ACCEPT_LEN }, /* all mandatory headers */
 		{ (void *)ws_accept_buf, WS_ACCEPT_KEY_LEN }, /* the cookie */
+		{ (void *)ws_ext_buf, 0 }, /* the negotiated extensions */
 		{ (void *)HTTP_END, HTTP_END_LEN }/* message end */
 	};
 
@@ -1027,7 +1035,9 @@ static int ws_complete_handshake(struct tcp_connection *c)
 	/* compute the ws_key in ws_accept_buf */
 	ws_compute_key(&WS_KEY(c));
 
-	n = _ws_common_writev(c, c->fd, iov, 3, _ws_common_write_tout);
+	iov[2].iov_len = WS_ZIP(c) ? ws_deflate_response(WS_ZIP(c), ws_ext_buf) : 0;
+
+	n = _ws_common_writev(c, c->fd, iov, iov_len, _ws_common_write_tout);
 	stop_expire_timer(get, tcpthreshold,
 			_ws_common_module " handshake", "", 0, 1);
 
@@ -64,6 +64,12 @@ int wss_hs_read_tout = 100;
 /* XXX: this information should be dynamically provided */
 static str wss_resource = str_init("/");
 
+/* permessage-deflate: disabled, 15 bits window, context takeover,
+ * messages under 128 bytes are not compressed */
+static struct ws_deflate_cfg wss_deflate_cfg = { 0, 15, 1, 128 };
+
+static struct ws_stats wss_stats;
+
 static int wss_raw_writev(struct tcp_connection *c, int fd,
 		const struct iovec *iov, int iovcnt, int tout);
 
@@ -81,6 +87,8 @@ static int wss_raw_writev(struct tcp_connection *c, int fd,
  */
 #define _ws_common_write_tout 0
 #define _ws_common_resource wss_resource
+#define _ws_common_deflate_cfg wss_deflate_cfg
+#define _ws_common_stats wss_stats
 #include "../proto_ws/ws_handshake_common.h"
 #include "../proto_ws/ws_common.h"
 
@@ -126,12 +134,30 @@ static param_export_t params[] = {
 	{ "wss_max_msg_chunks", INT_PARAM, &wss_max_msg_chunks },
 	{ "wss_resource",       STR_PARAM, &wss_resource       },
 	{ "wss_handshake_timeout", INT_PARAM, &wss_hs_read_tout},
+	{ "wss_compression",    INT_PARAM, &wss_deflate_cfg.enabled },
+	{ "wss_compression_window_bits", INT_PARAM, &wss_deflate_cfg.window_bits },
+	{ "wss_compression_context_takeover", INT_PARAM,
+		&wss_deflate_cfg.context_takeover },
+	{ "wss_compression_min_size", INT_PARAM, &wss_deflate_cfg.min_size },
 	{ "trace_destination",     STR_PARAM,         &trace_destination_name.s  },
 	{ "trace_on",						 INT_PARAM, &trace_is_on_tmp        },
 	{ "trace_filter_route",				 STR_PARAM, &trace_filter_route     },
 	{0, 0, 0}
 };
 
+static stat_export_t mod_stats[] = {
+	{"wss_frames_sent",       0, &wss_stats.frames_sent },
+	{"wss_frames_received",   0, &wss_stats.frames_rcvd },
+	{"wss_masked_bytes",      0, &wss_stats.masked_bytes },
+	{"wss_deflated_msgs",     0, &wss_stats.deflated_msgs },
+	{"wss_deflate_in_bytes",  0, &wss_stats.deflate_in },
+	{"wss_deflate_out_bytes", 0, &wss_stats.deflate_out },
+	{"wss_inflated_msgs",     0, &wss_stats.inflated_msgs },
+	{"wss_inflate_in_bytes",  0, &wss_stats.inflate_in },
+	{"wss_inflate_out_bytes", 0, &wss_stats.inflate_out },
+	{0, 0, 0}
+};
+
 static dep_export_t deps = {
 	{ /* OpenSIPS module dependencies */
 		{ MOD_TYPE_DEFAULT, "proto_hep", DEP_SILENT },
@@ -156,7 +182,7 @@ struct module_exports exports = {
 	cmds,       /* exported functions */
 	0,          /* exported async functions */
 	params,     /* module parameters */
-	0,          /* exported statistics */
+	mod_stats,  /* exported statistics */
 	mi_cmds,    /* exported MI functions */
 	0,          /* exported pseudo-variables */
 	0,          /* extra processes */
@@ -193,6 +219,9 @@ static int mod_init(void)
 {
 	LM_INFO("initializing Secure WebSocket protocol\n");
 
+	if (ws_deflate_fix_cfg() < 0)
+		return -1;
+
 	if(load_tls_mgm_api(&tls_mgm_api) != 0){
 		LM_DBG("failed to find tls API - is tls_mgm module loaded?\n");
 		return -1;
@@ -292,6 +321,8 @@ static void ws_conn_clean(struct tcp_connection* c)
 			}
 		}
 
+		if (d->zip)
+			ws_deflate_free(d->zip);
 		shm_free(d);
 		c->proto_data = NULL;
 
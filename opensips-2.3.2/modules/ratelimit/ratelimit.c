@@ -60,6 +60,9 @@ static int *rl_feedback_limit;
 int * rl_network_load;	/* network load */
 int * rl_network_count;	/* flag for counting network algo users */
 
+unsigned int * rl_share_epoch;	/* bumped when pipes with shares expire */
+rl_pipe_t ** rl_share_dead;		/* expired pipes, freed on the next timer */
+
 /* these only change in the mod_init() process -- no locking needed */
 int rl_timer_interval = RL_TIMER_INTERVAL;
 
@@ -70,6 +73,7 @@ struct clusterer_binds clusterer_api;
 
 int rl_window_size=10;   /* how many seconds the window shall hold*/
 int rl_slot_period=200;  /* how many milisecs a slot from the window has  */
+int rl_share_interval = RL_SHARE_INTERVAL; /* ms between shares rebalancing */
 
 static str db_url = {0,0};
 str db_prefix = str_init("rl_pipe_");
@@ -144,6 +148,7 @@ static param_export_t params[] = {
 	{ "repl_pipes_auth_check",	INT_PARAM,	&repl_pipes_auth_check		},
 	{ "window_size",            INT_PARAM,  &rl_window_size},
 	{ "slot_period",            INT_PARAM,  &rl_slot_period},
+	{ "share_interval",         INT_PARAM,  &rl_share_interval},
 	{ 0, 0, 0}
 };
 
@@ -354,10 +359,20 @@ static int mod_init(void)
 		return -1;
 	}
 
+	if (rl_share_interval < 0) {
+		LM_ERR("invalid share interval\n");
+		return -1;
+	}
+
 	if (db_url.s) {
 		db_url.len = strlen(db_url.s);
 		db_prefix.len = strlen(db_prefix.s);
 		LM_DBG("using CacheDB url: %s\n", db_url.s);
+		if (rl_share_interval) {
+			LM_WARN("share_interval cannot be used with CacheDB - "
+					"disabling per process shares\n");
+			rl_share_interval = 0;
+		}
 	}
 
 	RL_SHM_MALLOC(rl_network_count, sizeof(int));
@@ -369,6 +384,10 @@ static int mod_init(void)
 	RL_SHM_MALLOC(pid_setpoint, sizeof(double));
 	RL_SHM_MALLOC(drop_rate, sizeof(int));
 	RL_SHM_MALLOC(rl_feedback_limit, sizeof(int));
+	if (rl_share_interval) {
+		RL_SHM_MALLOC(rl_share_epoch, sizeof(unsigned int));
+		RL_SHM_MALLOC(rl_share_dead, sizeof(rl_pipe_t *));
+	}
 
 	/* init ki value for feedback algo */
 	*pid_ki = -25.0;
@@ -396,6 +415,12 @@ static int mod_init(void)
 		LM_ERR("failed to register utimer\n");
 		return -1;
 	}
+	if (rl_share_interval &&
+		register_utimer("rl-share-utimer", rl_timer_share, NULL,
+			rl_share_interval * 1000, TIMER_FLAG_SKIP_ON_DELAY) < 0) {
+		LM_ERR("failed to register share utimer\n");
+		return -1;
+	}
 
 	if (rl_hash_size <= 0) {
 		LM_ERR("Hash size must be a positive integer, power of 2!\n");
@@ -468,6 +493,8 @@ void mod_destroy(void)
 	RL_SHM_FREE(pid_setpoint);
 	RL_SHM_FREE(drop_rate);
 	RL_SHM_FREE(rl_feedback_limit);
+	RL_SHM_FREE(rl_share_epoch);
+	RL_SHM_FREE(rl_share_dead);
 
 	if (db_url.s && db_url.len)
 		destroy_cachedb();
@@ -29,6 +29,7 @@
 #define RL_DEFAULT_EXPIRE	3600
 #define RL_HASHSIZE			1024
 #define RL_TIMER_INTERVAL	10
+#define RL_SHARE_INTERVAL	0
 #define RL_PIPE_PENDING		(1<<0)
 #define BIN_VERSION         1
 
@@ -65,6 +66,14 @@ typedef struct rl_window {
 	long int *window;  /* actual array of messages */
 } rl_window_t;
 
+/* share of a TAILDROP pipe's budget, owned by a single process */
+typedef struct rl_share {
+	volatile unsigned int used;		/* admitted by the owner, never reset */
+	volatile unsigned int budget;	/* owner admits while used < budget */
+	unsigned int folded;			/* part of used already in the counter */
+	struct rl_share *next;
+} rl_share_t;
+
 typedef struct rl_pipe {
 	int limit;					/* limit used by algorithm */
 	int counter;				/* countes the accesses */
@@ -76,6 +85,9 @@ typedef struct rl_pipe {
 	unsigned long last_used;	/* timestamp when the pipe was last accessed */
 	rl_repl_counter_t *dsts;	/* counters per destination */
 	rl_window_t rwin;			/* window of requests */
+	rl_share_t *shares;			/* per process shares of the budget */
+	int share_dry;				/* no budget left to share */
+	struct rl_pipe *dead_next;	/* expired pipes waiting to be freed */
 } rl_pipe_t;
 
 typedef struct rl_repl_dst {
@@ -108,6 +120,9 @@ extern int repl_pipes_auth_check;
 extern int rl_repl_cluster;
 extern int rl_window_size;
 extern int rl_slot_period;
+extern int rl_share_interval;
+extern unsigned int *rl_share_epoch;
+extern rl_pipe_t **rl_share_dead;
 
 extern struct clusterer_binds clusterer_api;
 
@@ -132,6 +147,7 @@ void pid_setpoint_limit(int);
 /* timer */
 void rl_timer(unsigned int, void *);
 void rl_timer_repl(utime_t, void *);
+void rl_timer_share(utime_t, void *);
 
 /* cachedb functions */
 int init_cachedb(str*);
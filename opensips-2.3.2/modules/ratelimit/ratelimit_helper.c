@@ -307,6 +307,260 @@ static str * get_rl_algo_name(rl_algo_t algo)
 	return NULL;
 }
 
+static rl_pipe_t *rl_create_pipe(rl_algo_t algo)
+{
+	rl_pipe_t *pipe;
+
+	pipe = shm_malloc(sizeof(rl_pipe_t) +
+			/* memory for the window */
+			(rl_window_size*1000) / rl_slot_period * sizeof(long int));
+	if (!pipe) {
+		LM_ERR("no more shm memory\n");
+		return NULL;
+	}
+	memset(pipe, 0, sizeof(rl_pipe_t));
+	pipe->algo = (algo == PIPE_ALGO_NOP) ? rl_default_algo : algo;
+	pipe->rwin.window = (long int *)(pipe + 1);
+	pipe->rwin.window_size = rl_window_size * 1000 / rl_slot_period;
+	memset(pipe->rwin.window, 0, pipe->rwin.window_size * sizeof(long int));
+
+	return pipe;
+}
+
+static void rl_free_pipe(rl_pipe_t *pipe)
+{
+	rl_share_t *share;
+
+	while (pipe->shares) {
+		share = pipe->shares;
+		pipe->shares = share->next;
+		shm_free(share);
+	}
+	shm_free(pipe);
+}
+
+/*
+ * Per process shares of TAILDROP pipes.
+ *
+ * Each process caches, in its private memory, the pipes it checked along
+ * with a share of their budget. While the share is not consumed, a check
+ * only bumps the process' own counter, without taking any lock. The
+ * rl-share-utimer folds the counters of all the shares into the pipe and
+ * splits the remaining budget between the shares every share_interval ms.
+ * Expired pipes that have shares are only freed by the next rl_timer run,
+ * after their processes have seen the new epoch and dropped them.
+ */
+struct rl_share_entry {
+	str name;
+	int limit;
+	rl_pipe_t *pipe;
+	rl_share_t *share;
+	struct rl_share_entry *next;
+};
+
+static struct rl_share_entry **rl_share_cache;
+static unsigned int rl_share_local_epoch;
+
+#define RL_SHARE_LEFT(_s) ((int)((_s)->budget - (_s)->used))
+
+static void rl_share_flush(void)
+{
+	struct rl_share_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < rl_htable.size; i++) {
+		while (rl_share_cache[i]) {
+			e = rl_share_cache[i];
+			rl_share_cache[i] = e->next;
+			pkg_free(e);
+		}
+	}
+}
+
+/* NOTE: assumes that the pipe has been locked */
+static void rl_share_fold(rl_pipe_t *pipe)
+{
+	rl_share_t *share;
+	unsigned int used;
+
+	for (share = pipe->shares; share; share = share->next) {
+		used = share->used;
+		if (used == share->folded)
+			continue;
+		pipe->counter += used - share->folded;
+		share->folded = used;
+		pipe->last_used = time(0);
+	}
+}
+
+/* NOTE: assumes that the pipe has been locked; the remainder of the
+ * budget goes to the first share, if one is specified */
+static void rl_share_rebalance(rl_pipe_t *pipe, rl_share_t *first)
+{
+	rl_share_t *share;
+	int left, no = 0, quota = 0, extra = 0;
+
+	rl_share_fold(pipe);
+	for (share = pipe->shares; share; share = share->next)
+		no++;
+	if (!no)
+		return;
+
+	left = pipe->limit * rl_timer_interval - rl_get_all_counters(pipe);
+	if (left > 0) {
+		pipe->share_dry = 0;
+		quota = left / no;
+		extra = left % no;
+	} else {
+		pipe->share_dry = 1;
+	}
+
+	if (first) {
+		first->budget = first->folded + quota + (extra ? 1 : 0);
+		if (extra)
+			extra--;
+	}
+	for (share = pipe->shares; share; share = share->next) {
+		if (share == first)
+			continue;
+		share->budget = share->folded + quota + (extra ? 1 : 0);
+		if (extra)
+			extra--;
+	}
+}
+
+/* takes a fresh share for the pipe, creating the pipe if needed
+ * returns 0 if the pipe cannot be checked using shares */
+static int rl_share_refill(str *name, int limit, unsigned int hash_idx,
+		struct rl_share_entry *e)
+{
+	rl_pipe_t **pipe;
+	rl_share_t *share;
+	int ret = 0;
+
+	RL_GET_LOCK(hash_idx);
+
+	if (!e) {
+		pipe = RL_GET_PIPE(hash_idx, *name);
+		if (!pipe) {
+			LM_ERR("cannot get the index\n");
+			goto release;
+		}
+		if (!*pipe) {
+			if (!(*pipe = rl_create_pipe(PIPE_ALGO_TAILDROP)))
+				goto release;
+			LM_DBG("Pipe %.*s doesn't exist, but was created %p\n",
+					name->len, name->s, *pipe);
+		} else if ((*pipe)->algo != PIPE_ALGO_TAILDROP) {
+			/* pipe created with a different algorithm */
+			goto release;
+		}
+
+		e = pkg_malloc(sizeof(struct rl_share_entry) + name->len);
+		if (!e) {
+			LM_ERR("no more pkg memory\n");
+			goto release;
+		}
+		share = shm_malloc(sizeof(rl_share_t));
+		if (!share) {
+			LM_ERR("no more shm memory\n");
+			pkg_free(e);
+			goto release;
+		}
+		memset(share, 0, sizeof(rl_share_t));
+		share->next = (*pipe)->shares;
+		(*pipe)->shares = share;
+
+		e->name.s = (char *)(e + 1);
+		e->name.len = name->len;
+		memcpy(e->name.s, name->s, name->len);
+		e->pipe = *pipe;
+		e->share = share;
+		e->next = rl_share_cache[hash_idx];
+		rl_share_cache[hash_idx] = e;
+	}
+
+	/* set/update the limit */
+	e->pipe->limit = e->limit = limit;
+	e->pipe->last_used = time(0);
+
+	rl_share_rebalance(e->pipe, e->share);
+	if (RL_SHARE_LEFT(e->share) > 0) {
+		e->share->used++;
+		ret = 1;
+	} else {
+		ret = -1;
+	}
+	LM_DBG("Pipe %.*s counter:%d limit:%d share:%d should %sbe blocked\n",
+		name->len, name->s, e->pipe->counter, limit,
+		RL_SHARE_LEFT(e->share), ret == 1 ? "NOT " : "");
+
+release:
+	RL_RELEASE_LOCK(hash_idx);
+	return ret;
+}
+
+/* returns 0 if the pipe should be checked the regular way */
+static int rl_share_check(str *name, int limit, unsigned int hash_idx)
+{
+	struct rl_share_entry *e;
+
+	if (!rl_share_cache) {
+		rl_share_cache = pkg_malloc(rl_htable.size *
+				sizeof(struct rl_share_entry *));
+		if (!rl_share_cache) {
+			LM_ERR("no more pkg memory\n");
+			return 0;
+		}
+		memset(rl_share_cache, 0,
+				rl_htable.size * sizeof(struct rl_share_entry *));
+		rl_share_local_epoch = *rl_share_epoch;
+	} else if (rl_share_local_epoch != *rl_share_epoch) {
+		/* some pipes expired - their shares can no longer be used */
+		rl_share_local_epoch = *rl_share_epoch;
+		rl_share_flush();
+	}
+
+	for (e = rl_share_cache[hash_idx]; e; e = e->next)
+		if (e->name.len == name->len &&
+				memcmp(e->name.s, name->s, name->len) == 0)
+			break;
+
+	if (e && e->limit == limit) {
+		if (RL_SHARE_LEFT(e->share) > 0) {
+			e->share->used++;
+			return 1;
+		}
+		if (e->pipe->share_dry)
+			return -1;
+	}
+
+	return rl_share_refill(name, limit, hash_idx, e);
+}
+
+/* rebalances the shares of all the pipes, invoked every share interval */
+void rl_timer_share(utime_t ticks, void *param)
+{
+	unsigned int i;
+	map_iterator_t it;
+	rl_pipe_t **pipe;
+
+	for (i = 0; i < rl_htable.size; i++) {
+		RL_GET_LOCK(i);
+		if (map_first(rl_htable.maps[i], &it) < 0) {
+			LM_ERR("map doesn't exist\n");
+			goto next_map;
+		}
+		for (; iterator_is_valid(&it); iterator_next(&it)) {
+			pipe = (rl_pipe_t **) iterator_val(&it);
+			if (pipe && *pipe && (*pipe)->shares)
+				rl_share_rebalance(*pipe, NULL);
+		}
+next_map:
+		RL_RELEASE_LOCK(i);
+	}
+}
+
 int w_rl_check_2(struct sip_msg *_m, char *_n, char *_l)
 {
 	return w_rl_check_3(_m, _n, _l, NULL);
@@ -365,6 +619,14 @@ int w_rl_check_3(struct sip_msg *_m, char *_n, char *_l, char *_a)
 	}
 
 	hash_idx = RL_GET_INDEX(name);
+
+	/* TAILDROP pipes may be checked against the process' own share */
+	if (rl_share_interval && !cdbc && (algo == PIPE_ALGO_TAILDROP ||
+			(algo == PIPE_ALGO_NOP && rl_default_algo == PIPE_ALGO_TAILDROP)) &&
+			(ret = rl_share_check(&name, limit, hash_idx)) != 0)
+		goto end;
+	ret = 1;
+
 	RL_GET_LOCK(hash_idx);
 
 	/* try to get the value */
@@ -376,23 +638,12 @@ int w_rl_check_3(struct sip_msg *_m, char *_n, char *_l, char *_a)
 
 	if (!*pipe) {
 		/* allocate new pipe */
-		*pipe = shm_malloc(sizeof(rl_pipe_t) +
-				/* memory for the window */
-				(rl_window_size*1000) / rl_slot_period * sizeof(long int));
-		if (!*pipe) {
-			LM_ERR("no more shm memory\n");
+		if (!(*pipe = rl_create_pipe(algo)))
 			goto release;
-		}
-		memset(*pipe, 0, sizeof(rl_pipe_t));
 		LM_DBG("Pipe %.*s doesn't exist, but was created %p\n",
 				name.len, name.s, *pipe);
 		if (algo == PIPE_ALGO_NETWORK)
 			should_update = 1;
-		(*pipe)->algo = (algo == PIPE_ALGO_NOP) ? rl_default_algo : algo;
-		(*pipe)->rwin.window = (long int *)((*pipe) + 1);
-		(*pipe)->rwin.window_size   = rl_window_size * 1000 / rl_slot_period;
-		memset((*pipe)->rwin.window, 0,
-				(*pipe)->rwin.window_size * sizeof(long int));
 	} else {
 		LM_DBG("Pipe %.*s found: %p - last used %lu\n",
 			name.len, name.s, *pipe, (*pipe)->last_used);
@@ -439,11 +690,24 @@ void rl_timer(unsigned int ticks, void *param)
 {
 	unsigned int i = 0;
 	map_iterator_t it, del;
-	rl_pipe_t **pipe;
+	rl_pipe_t **pipe, *dead;
 	str *key;
 	void *value;
 	unsigned long now = time(0);
 
+	/* free the pipes whose shares expired during the previous run */
+	if (rl_share_interval) {
+		lock_get(rl_lock);
+		dead = *rl_share_dead;
+		*rl_share_dead = NULL;
+		lock_release(rl_lock);
+		while (dead) {
+			value = dead;
+			dead = dead->dead_next;
+			rl_free_pipe(value);
+		}
+	}
+
 	/* get CPU load */
 	if (get_cpuload() < 0) {
 		LM_ERR("cannot update CPU load\n");
@@ -495,8 +759,16 @@ void rl_timer(unsigned int ticks, void *param)
 					key->len, key->s);
 				value = iterator_delete(&del);
 				/* free resources */
-				if (value)
+				if (value && ((rl_pipe_t *)value)->shares) {
+					/* other processes might still use it */
+					lock_get(rl_lock);
+					((rl_pipe_t *)value)->dead_next = *rl_share_dead;
+					*rl_share_dead = value;
+					(*rl_share_epoch)++;
+					lock_release(rl_lock);
+				} else if (value) {
 					shm_free(value);
+				}
 				continue;
 			} else {
 				/* leave the lock if a cachedb query should be done*/
@@ -521,6 +793,8 @@ void rl_timer(unsigned int ticks, void *param)
 				default:
 					break;
 				}
+				if ((*pipe)->shares)
+					rl_share_fold(*pipe);
 				(*pipe)->my_last_counter = (*pipe)->counter;
 				(*pipe)->last_counter = rl_get_all_counters(*pipe);
 				if (RL_USE_CDB(*pipe)) {
@@ -529,6 +803,7 @@ void rl_timer(unsigned int ticks, void *param)
 					}
 				} else {
 					(*pipe)->counter = 0;
+					(*pipe)->share_dry = 0;
 				}
 			}
 next_pipe:
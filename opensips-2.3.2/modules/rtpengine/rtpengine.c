@@ -40,6 +40,7 @@
 #include <sys/un.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <poll.h>
 #include <stdio.h>
@@ -74,6 +75,8 @@
 #include "../../mod_fix.h"
 #include "../../dset.h"
 #include "../../route.h"
+#include "../../async.h"
+#include "../../lib/timerfd.h"
 #include "../../modules/tm/tm_load.h"
 #include "rtpengine.h"
 #include "rtpengine_funcs.h"
@@ -154,6 +157,10 @@ static int rtpengine_offer_f(struct sip_msg *, gparam_p str1,
 		pv_spec_t *spvar, pv_spec_t *bpvar);
 static int rtpengine_answer_f(struct sip_msg *, gparam_p str1,
 		pv_spec_t *spvar, pv_spec_t *bpvar);
+static int rtpengine_offer_async_f(struct sip_msg *, async_ctx *,
+		gparam_p str1, pv_spec_t *spvar, pv_spec_t *bpvar);
+static int rtpengine_answer_async_f(struct sip_msg *, async_ctx *,
+		gparam_p str1, pv_spec_t *spvar, pv_spec_t *bpvar);
 static int rtpengine_manage_f(struct sip_msg *, gparam_p str1,
 		pv_spec_t *spvar, pv_spec_t *bpvar);
 static int rtpengine_delete_f(struct sip_msg *, gparam_p str1,
@@ -163,6 +170,10 @@ static int parse_flags(struct ng_flags_parse *, struct sip_msg *, enum rtpe_oper
 
 static int rtpengine_offer_answer(struct sip_msg *msg, const char *flags,
 		pv_spec_t *spvar, pv_spec_t *bpvar, int op);
+static int rtpengine_offer_answer_async(struct sip_msg *msg, async_ctx *ctx,
+		const char *flags, pv_spec_t *spvar, pv_spec_t *bpvar, int op);
+static int rtpe_update_sdp(bencode_buffer_t *bencbuf, bencode_item_t *dict,
+		struct sip_msg *msg, str *body, pv_spec_t *bpvar);
 static int add_rtpengine_socks(struct rtpe_set * rtpe_list, char * rtpengine);
 static int fixup_set_id(void ** param, int param_no);
 static int set_rtpengine_set_f(struct sip_msg * msg, rtpe_set_link_t *set_param);
@@ -282,6 +293,24 @@ static cmd_export_t cmds[] = {
 	{0, 0, 0, 0, 0, 0}
 };
 
+static acmd_export_t acmds[] = {
+	{"rtpengine_offer",  (acmd_function)rtpengine_offer_async_f,  0, 0 },
+	{"rtpengine_offer",  (acmd_function)rtpengine_offer_async_f,  1,
+		fixup_rtpengine },
+	{"rtpengine_offer",  (acmd_function)rtpengine_offer_async_f,  2,
+		fixup_rtpengine },
+	{"rtpengine_offer",  (acmd_function)rtpengine_offer_async_f,  3,
+		fixup_rtpengine },
+	{"rtpengine_answer", (acmd_function)rtpengine_answer_async_f, 0, 0 },
+	{"rtpengine_answer", (acmd_function)rtpengine_answer_async_f, 1,
+		fixup_rtpengine },
+	{"rtpengine_answer", (acmd_function)rtpengine_answer_async_f, 2,
+		fixup_rtpengine },
+	{"rtpengine_answer", (acmd_function)rtpengine_answer_async_f, 3,
+		fixup_rtpengine },
+	{0, 0, 0, 0}
+};
+
 static pv_export_t mod_pvs[] = {
 	{{"rtpstat", (sizeof("rtpstat")-1)}, /* RTP-Statistics */
 		1000, pv_get_rtpstat_f, 0, 0, 0, 0, 0},
@@ -323,7 +352,7 @@ struct module_exports exports = {
 	DEFAULT_DLFLAGS, /* dlopen flags */
 	&deps,           /* OpenSIPS module dependencies */
 	cmds,
-	0,
+	acmds,
 	params,
 	0,           /* exported statistics */
 	mi_cmds,     /* exported MI functions */
@@ -871,12 +900,65 @@ mod_init(void)
 }
 
 
+/* resolves the address of an UDP/UDP6 proxy and returns a socket
+ * connected to it, or -1 on failure */
+static int rtpe_connect_udp(struct rtpe_node *pnode)
+{
+	int n, fd;
+	char *cp, *hostname;
+	struct addrinfo hints, *res;
+
+	/*
+	 * This is UDP or UDP6. Detect host and port; lookup host;
+	 * do connect() in order to specify peer address
+	 */
+	hostname = (char*)pkg_malloc(sizeof(char) * (strlen(pnode->rn_address) + 1));
+	if (hostname==NULL) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	strcpy(hostname, pnode->rn_address);
+
+	cp = strrchr(hostname, ':');
+	if (cp != NULL) {
+		*cp = '\0';
+		cp++;
+	}
+	if (cp == NULL || *cp == '\0')
+		cp = CPORT;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = 0;
+	hints.ai_family = (pnode->rn_umode == 6) ? AF_INET6 : AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
+		LM_ERR("%s\n", gai_strerror(n));
+		pkg_free(hostname);
+		return -1;
+	}
+	pkg_free(hostname);
+
+	fd = socket((pnode->rn_umode == 6) ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		LM_ERR("can't create socket\n");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		LM_ERR("can't connect to a RTP proxy\n");
+		close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
 static int
 child_init(int rank)
 {
-	int n;
-	char *cp;
-	struct addrinfo hints, *res;
 	struct rtpe_set  *rtpe_list;
 	struct rtpe_node *pnode;
 
@@ -896,59 +978,14 @@ child_init(int rank)
 		rtpe_list = rtpe_list->rset_next){
 
 		for (pnode=rtpe_list->rn_first; pnode!=0; pnode = pnode->rn_next){
-			char *hostname;
-
 			if (pnode->rn_umode == 0) {
 				rtpe_socks[pnode->idx] = -1;
 				goto rptest;
 			}
 
-			/*
-			 * This is UDP or UDP6. Detect host and port; lookup host;
-			 * do connect() in order to specify peer address
-			 */
-			hostname = (char*)pkg_malloc(sizeof(char) * (strlen(pnode->rn_address) + 1));
-			if (hostname==NULL) {
-				LM_ERR("no more pkg memory\n");
-				return -1;
-			}
-			strcpy(hostname, pnode->rn_address);
-
-			cp = strrchr(hostname, ':');
-			if (cp != NULL) {
-				*cp = '\0';
-				cp++;
-			}
-			if (cp == NULL || *cp == '\0')
-				cp = CPORT;
-
-			memset(&hints, 0, sizeof(hints));
-			hints.ai_flags = 0;
-			hints.ai_family = (pnode->rn_umode == 6) ? AF_INET6 : AF_INET;
-			hints.ai_socktype = SOCK_DGRAM;
-			if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
-				LM_ERR("%s\n", gai_strerror(n));
-				pkg_free(hostname);
-				return -1;
-			}
-			pkg_free(hostname);
-
-			rtpe_socks[pnode->idx] = socket((pnode->rn_umode == 6)
-			    ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
-			if ( rtpe_socks[pnode->idx] == -1) {
-				LM_ERR("can't create socket\n");
-				freeaddrinfo(res);
-				return -1;
-			}
-
-			if (connect( rtpe_socks[pnode->idx], res->ai_addr, res->ai_addrlen) == -1) {
-				LM_ERR("can't connect to a RTP proxy\n");
-				close( rtpe_socks[pnode->idx] );
-				rtpe_socks[pnode->idx] = -1;
-				freeaddrinfo(res);
+			rtpe_socks[pnode->idx] = rtpe_connect_udp(pnode);
+			if (rtpe_socks[pnode->idx] == -1)
 				return -1;
-			}
-			freeaddrinfo(res);
 rptest:
 			pnode->rn_disabled = rtpe_test(pnode, 0, 1);
 		}
@@ -1274,18 +1311,16 @@ error:
 }
 #undef BCHECK
 
-static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_msg *msg,
-	enum rtpe_operation op, const char *flags_str, str *body_out, pv_spec_t *spvar)
+/* builds the dictionary of a command; on failure the buffer is released */
+static bencode_item_t *rtpe_function_build(bencode_buffer_t *bencbuf,
+		struct sip_msg *msg, enum rtpe_operation op, const char *flags_str,
+		str *body_out, str *callid_out)
 {
 	struct ng_flags_parse ng_flags;
-	bencode_item_t *item, *resp;
-	str callid, from_tag, to_tag, viabranch, error;
+	bencode_item_t *item;
+	str callid, from_tag, to_tag, viabranch;
 	str body = { 0, 0 };
 	int ret;
-	struct rtpe_node *node;
-	struct rtpe_set *set;
-	char *cp;
-	pv_value_t val;
 
 	/*** get & init basic stuff needed ***/
 
@@ -1384,26 +1419,31 @@ static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_
 
 	bencode_dictionary_add_string(ng_flags.dict, "command", command_strings[op]);
 
-	/*** send it out ***/
-
 	if (bencbuf->error) {
 		LM_ERR("out of memory - bencode failed\n");
 		goto error;
 	}
 
-	if ( (set=ctx_rtpeset_get())==NULL )
-		set = default_rtpe_set;
+	if (body_out)
+		*body_out = body;
+	if (callid_out)
+		*callid_out = callid;
 
-	do {
-		node = select_rtpe_node(callid, 1, set);
-		if (!node) {
-			LM_ERR("no available proxies\n");
-			goto error;
-		}
+	return ng_flags.dict;
 
-		cp = send_rtpe_command(node, ng_flags.dict, &ret);
-	} while (cp == NULL);
-	LM_DBG("proxy reply: %.*s\n", ret, cp);
+error:
+	bencode_buffer_free(bencbuf);
+	return NULL;
+}
+
+/* decodes the reply of a command; on failure the buffer is released */
+static bencode_item_t *rtpe_function_reply(bencode_buffer_t *bencbuf,
+		struct sip_msg *msg, struct rtpe_node *node, char *cp, int ret,
+		pv_spec_t *spvar)
+{
+	bencode_item_t *resp;
+	pv_value_t val;
+	str error;
 
 	/* store the value of the selected node */
 	if (spvar) {
@@ -1429,9 +1469,6 @@ static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_
 		goto error;
 	}
 
-	if (body_out)
-		*body_out = body;
-
 	return resp;
 
 error:
@@ -1439,6 +1476,40 @@ error:
 	return NULL;
 }
 
+static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_msg *msg,
+	enum rtpe_operation op, const char *flags_str, str *body_out, pv_spec_t *spvar)
+{
+	bencode_item_t *dict;
+	struct rtpe_node *node;
+	struct rtpe_set *set;
+	str callid;
+	char *cp;
+	int ret;
+
+	dict = rtpe_function_build(bencbuf, msg, op, flags_str, body_out, &callid);
+	if (!dict)
+		return NULL;
+
+	/*** send it out ***/
+
+	if ( (set=ctx_rtpeset_get())==NULL )
+		set = default_rtpe_set;
+
+	do {
+		node = select_rtpe_node(callid, 1, set);
+		if (!node) {
+			LM_ERR("no available proxies\n");
+			bencode_buffer_free(bencbuf);
+			return NULL;
+		}
+
+		cp = send_rtpe_command(node, dict, &ret);
+	} while (cp == NULL);
+	LM_DBG("proxy reply: %.*s\n", ret, cp);
+
+	return rtpe_function_reply(bencbuf, msg, node, cp, ret, spvar);
+}
+
 static int rtpe_function_call_simple(struct sip_msg *msg, enum rtpe_operation op,
 		const char *flags_str, pv_spec_t *spvar)
 {
@@ -1524,6 +1595,13 @@ error:
 	return 1;
 }
 
+static void rtpe_disable_node(struct rtpe_node *node)
+{
+	LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
+	node->rn_disabled = 1;
+	node->rn_recheck_ticks = get_ticks() + rtpengine_disable_tout;
+}
+
 static char *
 send_rtpe_command(struct rtpe_node *node, bencode_item_t *dict, int *outlen)
 {
@@ -1631,10 +1709,7 @@ out:
 	*outlen = len;
 	return cp;
 badproxy:
-	LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
-	node->rn_disabled = 1;
-	node->rn_recheck_ticks = get_ticks() + rtpengine_disable_tout;
-
+	rtpe_disable_node(node);
 	return NULL;
 }
 
@@ -1929,19 +2004,65 @@ rtpengine_answer_f(struct sip_msg *msg, gparam_p str1, pv_spec_t *spvar, pv_spec
 	return rtpengine_offer_answer(msg, flags.s, spvar, bpvar, OP_ANSWER);
 }
 
+static int
+rtpengine_offer_async_f(struct sip_msg *msg, async_ctx *ctx, gparam_p str1,
+		pv_spec_t *spvar, pv_spec_t *bpvar)
+{
+	str flags;
+
+	if (set_rtpengine_set_from_avp(msg) == -1)
+	    return -1;
+
+	flags.s = NULL;
+	if (str1)
+		fixup_get_svalue(msg, str1, &flags);
+	return rtpengine_offer_answer_async(msg, ctx, flags.s, spvar, bpvar,
+			OP_OFFER);
+}
+
+static int
+rtpengine_answer_async_f(struct sip_msg *msg, async_ctx *ctx, gparam_p str1,
+		pv_spec_t *spvar, pv_spec_t *bpvar)
+{
+	str flags;
+
+	if (set_rtpengine_set_from_avp(msg) == -1)
+	    return -1;
+
+	if (msg->first_line.type == SIP_REQUEST)
+		if (msg->first_line.u.request.method_value != METHOD_ACK)
+			return -1;
+
+	flags.s = NULL;
+	if (str1)
+		fixup_get_svalue(msg, str1, &flags);
+	return rtpengine_offer_answer_async(msg, ctx, flags.s, spvar, bpvar,
+			OP_ANSWER);
+}
+
 static int
 rtpengine_offer_answer(struct sip_msg *msg, const char *flags, pv_spec_t *spvar, pv_spec_t *bpvar, int op)
 {
 	bencode_buffer_t bencbuf;
 	bencode_item_t *dict;
-	str body, newbody;
-	struct lump *anchor;
-	pv_value_t val;
+	str body;
 
 	dict = rtpe_function_call_ok(&bencbuf, msg, op, flags, &body, spvar);
 	if (!dict)
 		return -1;
 
+	return rtpe_update_sdp(&bencbuf, dict, msg, &body, bpvar);
+}
+
+/* applies the SDP returned by the proxy; releases the buffer */
+static int
+rtpe_update_sdp(bencode_buffer_t *bencbuf, bencode_item_t *dict,
+		struct sip_msg *msg, str *body, pv_spec_t *bpvar)
+{
+	str newbody;
+	struct lump *anchor;
+	pv_value_t val;
+
 	if (!bencode_dictionary_get_str_dup(dict, "sdp", &newbody)) {
 		LM_ERR("failed to extract sdp body from proxy reply\n");
 		goto error;
@@ -1957,7 +2078,7 @@ rtpengine_offer_answer(struct sip_msg *msg, const char *flags, pv_spec_t *spvar,
 		pkg_free(newbody.s);
 	} else {
 		/* otherise directly set the body of the message */
-		anchor = del_lump(msg, body.s - msg->buf, body.len, 0);
+		anchor = del_lump(msg, body->s - msg->buf, body->len, 0);
 		if (!anchor) {
 			LM_ERR("del_lump failed\n");
 			goto error_free;
@@ -1968,17 +2089,473 @@ rtpengine_offer_answer(struct sip_msg *msg, const char *flags, pv_spec_t *spvar,
 		}
 	}
 
-	bencode_buffer_free(&bencbuf);
+	bencode_buffer_free(bencbuf);
 	return 1;
 
 error_free:
 	pkg_free(newbody.s);
 error:
-	bencode_buffer_free(&bencbuf);
+	bencode_buffer_free(bencbuf);
 	return -1;
 }
 
 
+/*
+ * Async offer/answer support.
+ *
+ * The bencoded command is sent over a per-process UDP socket watched by
+ * the reactor and the reply is matched back by its cookie. Retransmissions
+ * and timeouts are driven by a per-process timer FD; on timeout the node
+ * is disabled and the command is sent to the next node of the set, so the
+ * script is resumed only once a reply is in (or no node is left).
+ */
+
+enum rtpe_async_state {
+	RTPE_ASYNC_PENDING = 0,
+	RTPE_ASYNC_DONE,
+	RTPE_ASYNC_FAILED,
+	RTPE_ASYNC_SYNC			/* to be done in blocking mode */
+};
+
+struct rtpe_async_op {
+	async_ctx *ctx;
+	enum rtpe_async_state state;
+	int op;
+	char *flags;
+	pv_spec_t *spvar;
+	pv_spec_t *bpvar;
+	struct rtpe_set *set;
+	str callid;
+	str cmd;				/* the bencoded command, without cookie */
+	char cookie[34];
+	int cookie_len;			/* without the trailing space */
+	struct rtpe_node *node;
+	int sock;
+	int retr;
+	utime_t sent;
+	str reply;
+	struct rtpe_async_op *next;
+};
+
+/* ops of this process waiting for replies */
+static struct rtpe_async_op *rtpe_async_ops = NULL;
+static int *rtpe_async_socks = NULL;
+static int rtpe_async_timer = -1;
+
+
+static int rtpe_async_reply(int fd, void *param);
+
+/* returns the async socket of this process for the given node */
+static int rtpe_async_sock(struct rtpe_node *node)
+{
+	unsigned int i;
+	int fd, flags;
+
+	if (rtpe_async_socks == NULL) {
+		rtpe_async_socks = (int*)pkg_malloc(sizeof(int) * rtpe_no);
+		if (rtpe_async_socks == NULL) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		for (i = 0; i < rtpe_no; i++)
+			rtpe_async_socks[i] = -1;
+	}
+
+	if (rtpe_async_socks[node->idx] >= 0)
+		return rtpe_async_socks[node->idx];
+
+	fd = rtpe_connect_udp(node);
+	if (fd < 0)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LM_ERR("failed to set O_NONBLOCK (%d) <%s>\n",
+			errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (register_async_fd(fd, rtpe_async_reply, NULL) < 0) {
+		LM_ERR("failed to add the async socket to reactor\n");
+		close(fd);
+		return -1;
+	}
+
+	rtpe_async_socks[node->idx] = fd;
+	return fd;
+}
+
+static int rtpe_async_xmit(struct rtpe_async_op *op)
+{
+	struct iovec v[2];
+	int len;
+
+	v[0].iov_base = op->cookie;
+	v[0].iov_len = op->cookie_len + 1;
+	v[1].iov_base = op->cmd.s;
+	v[1].iov_len = op->cmd.len;
+
+	do {
+		len = writev(op->sock, v, 2);
+	} while (len == -1 && errno == EINTR);
+	if (len <= 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+	errno != ENOBUFS) {
+		LM_ERR("can't send command to a RTP proxy (%s)\n", strerror(errno));
+		return -1;
+	}
+	/* a full buffer is handled as a lost datagram */
+	op->retr++;
+	op->sent = get_uticks();
+	return 0;
+}
+
+/* sends the command to the next available node of the set */
+static void rtpe_async_send(struct rtpe_async_op *op)
+{
+	struct rtpe_node *node;
+
+	for (;;) {
+		node = select_rtpe_node(op->callid, 1, op->set);
+		if (!node) {
+			LM_ERR("no available proxies\n");
+			op->state = RTPE_ASYNC_FAILED;
+			return;
+		}
+		if (node->rn_umode == 0) {
+			/* stream sockets are served in blocking mode */
+			op->state = RTPE_ASYNC_SYNC;
+			return;
+		}
+
+		op->node = node;
+		op->sock = rtpe_async_sock(node);
+		if (op->sock >= 0) {
+			strcpy(op->cookie, gencookie());
+			op->cookie_len = strlen(op->cookie) - 1;
+			op->retr = 0;
+			if (rtpe_async_xmit(op) == 0) {
+				op->state = RTPE_ASYNC_PENDING;
+				return;
+			}
+		}
+		rtpe_disable_node(node);
+	}
+}
+
+static void rtpe_async_free(struct rtpe_async_op *op)
+{
+	if (op->flags)
+		pkg_free(op->flags);
+	if (op->reply.s)
+		pkg_free(op->reply.s);
+	pkg_free(op);
+}
+
+#ifdef HAVE_TIMER_FD
+static void rtpe_async_arm(int on)
+{
+	struct itimerspec its;
+
+	/* check twice per timeout interval */
+	its.it_value.tv_sec = on ? rtpengine_tout / 2 : 0;
+	its.it_value.tv_nsec = on ? (rtpengine_tout % 2) * 500000000 : 0;
+	if (on && rtpengine_tout <= 0)
+		its.it_value.tv_nsec = 100000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(rtpe_async_timer, 0, &its, NULL) < 0)
+		LM_ERR("failed to set timer FD (%d) <%s>\n", errno, strerror(errno));
+}
+#else
+#define rtpe_async_arm(_on)
+#endif
+
+static void rtpe_async_link(struct rtpe_async_op *op)
+{
+	if (rtpe_async_ops == NULL)
+		rtpe_async_arm(1);
+	op->next = rtpe_async_ops;
+	rtpe_async_ops = op;
+}
+
+static void rtpe_async_unlink(struct rtpe_async_op *op)
+{
+	struct rtpe_async_op **prev;
+
+	for (prev = &rtpe_async_ops; *prev; prev = &(*prev)->next)
+		if (*prev == op) {
+			*prev = op->next;
+			break;
+		}
+	op->next = NULL;
+	if (rtpe_async_ops == NULL)
+		rtpe_async_arm(0);
+}
+
+static int rtpe_async_reply(int fd, void *param)
+{
+	static char buf[0x10000];
+	struct rtpe_async_op *op;
+	char *cp;
+	int len;
+
+	async_status = ASYNC_CONTINUE;
+
+	do {
+		len = recv(fd, buf, sizeof(buf) - 1, 0);
+	} while (len == -1 && errno == EINTR);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			LM_DBG("can't read reply from a RTP proxy (%d) <%s>\n",
+				errno, strerror(errno));
+		return 0;
+	}
+	buf[len] = '\0';
+
+	for (op = rtpe_async_ops; op; op = op->next)
+		if (op->state == RTPE_ASYNC_PENDING && op->sock == fd &&
+		len >= op->cookie_len &&
+		memcmp(buf, op->cookie, op->cookie_len) == 0 &&
+		(len == op->cookie_len || buf[op->cookie_len] == ' '))
+			break;
+	if (op == NULL) {
+		LM_DBG("dropping unexpected reply from RTP proxy\n");
+		return 0;
+	}
+
+	len -= op->cookie_len;
+	cp = buf + op->cookie_len;
+	if (len != 0) {
+		len--;
+		cp++;
+	}
+
+	op->reply.s = pkg_malloc(len + 1);
+	if (op->reply.s == NULL) {
+		LM_ERR("no more pkg memory\n");
+		op->state = RTPE_ASYNC_FAILED;
+	} else {
+		memcpy(op->reply.s, cp, len);
+		op->reply.s[len] = '\0';
+		op->reply.len = len;
+		op->state = RTPE_ASYNC_DONE;
+	}
+
+	rtpe_async_unlink(op);
+	async_script_resume_f(NULL, op->ctx);
+	/* the resume route sets async_status for the transaction it ran,
+	 * but this socket is shared - keep it in the reactor */
+	async_status = ASYNC_CONTINUE;
+	return 0;
+}
+
+#ifdef HAVE_TIMER_FD
+static int rtpe_async_tick(int fd, void *param)
+{
+	struct rtpe_async_op *op, **prev, *ready = NULL;
+	unsigned long long exp;
+	utime_t now;
+
+	async_status = ASYNC_CONTINUE;
+	if (read(fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+		LM_ERR("failed to read from timer FD (%d) <%s>\n",
+			errno, strerror(errno));
+
+	now = get_uticks();
+	for (op = rtpe_async_ops; op; op = op->next) {
+		if (op->state != RTPE_ASYNC_PENDING ||
+		now < op->sent + (utime_t)rtpengine_tout * 1000000)
+			continue;
+		if (op->retr < rtpengine_retr && rtpe_async_xmit(op) == 0)
+			continue;
+		LM_ERR("timeout waiting reply from a RTP proxy\n");
+		rtpe_disable_node(op->node);
+		rtpe_async_send(op);
+	}
+
+	/* detach the completed ops first, as resuming may link new ones */
+	for (prev = &rtpe_async_ops; (op = *prev); ) {
+		if (op->state != RTPE_ASYNC_PENDING) {
+			*prev = op->next;
+			op->next = ready;
+			ready = op;
+		} else {
+			prev = &op->next;
+		}
+	}
+	if (rtpe_async_ops == NULL)
+		rtpe_async_arm(0);
+
+	while (ready) {
+		op = ready;
+		ready = op->next;
+		op->next = NULL;
+		async_script_resume_f(NULL, op->ctx);
+	}
+	/* the timer FD is shared by all the pending ops, keep it */
+	async_status = ASYNC_CONTINUE;
+
+	return 0;
+}
+
+static int rtpe_async_timer_init(void)
+{
+	if (rtpe_async_timer >= 0)
+		return 0;
+
+	rtpe_async_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (rtpe_async_timer < 0) {
+		LM_ERR("failed to create new timer FD (%d) <%s>\n",
+			errno, strerror(errno));
+		return -1;
+	}
+
+	if (register_async_fd(rtpe_async_timer, rtpe_async_tick, NULL) < 0) {
+		LM_ERR("failed to add the timer FD to reactor\n");
+		close(rtpe_async_timer);
+		rtpe_async_timer = -1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+static int rtpe_async_resume(int fd, struct sip_msg *msg, void *param)
+{
+	struct rtpe_async_op *op = (struct rtpe_async_op *)param;
+	bencode_buffer_t bencbuf;
+	bencode_item_t *dict;
+	str body;
+	int ret = -1;
+
+	switch (op->state) {
+		case RTPE_ASYNC_PENDING:
+			/* resumed before the reply came in (the op could not be
+			 * suspended) - redo it in blocking mode */
+			rtpe_async_unlink(op);
+			/* fall through */
+		case RTPE_ASYNC_SYNC:
+			ret = rtpengine_offer_answer(msg, op->flags, op->spvar,
+					op->bpvar, op->op);
+			break;
+		case RTPE_ASYNC_FAILED:
+			break;
+		case RTPE_ASYNC_DONE:
+			LM_DBG("proxy reply: %.*s\n", op->reply.len, op->reply.s);
+			if (bencode_buffer_init(&bencbuf)) {
+				LM_ERR("could not initialize bencode_buffer_t\n");
+				break;
+			}
+			dict = rtpe_function_reply(&bencbuf, msg, op->node,
+					op->reply.s, op->reply.len, op->spvar);
+			if (!dict)
+				break;
+			if (bencode_dictionary_get_strcmp(dict, "result", "ok")) {
+				LM_ERR("proxy didn't return \"ok\" result\n");
+				bencode_buffer_free(&bencbuf);
+				break;
+			}
+			if (extract_body(msg, &body) == -1) {
+				LM_ERR("can't extract body from the message\n");
+				bencode_buffer_free(&bencbuf);
+				break;
+			}
+			ret = rtpe_update_sdp(&bencbuf, dict, msg, &body, op->bpvar);
+			break;
+	}
+
+	rtpe_async_free(op);
+	return ret;
+}
+
+static int rtpengine_offer_answer_async(struct sip_msg *msg, async_ctx *ctx,
+		const char *flags, pv_spec_t *spvar, pv_spec_t *bpvar, int op)
+{
+	bencode_buffer_t bencbuf;
+	bencode_item_t *dict;
+	struct rtpe_async_op *aop;
+	struct iovec *v;
+	str callid;
+	char *p;
+	int vcnt, len, i;
+
+#ifdef HAVE_TIMER_FD
+	/* non-request routes are served in blocking mode */
+	if (route_type != REQUEST_ROUTE || rtpe_async_timer_init() < 0)
+		goto sync;
+#else
+	goto sync;
+#endif
+
+	dict = rtpe_function_build(&bencbuf, msg, op, flags, NULL, &callid);
+	if (!dict)
+		return -1;
+
+	v = bencode_iovec(dict, &vcnt, 1, 0);
+	if (!v) {
+		LM_ERR("error converting bencode to iovec\n");
+		bencode_buffer_free(&bencbuf);
+		return -1;
+	}
+	for (i = 1, len = 0; i <= vcnt; i++)
+		len += v[i].iov_len;
+
+	/* the command refers the message, so it is flattened right away */
+	aop = pkg_malloc(sizeof(*aop) + callid.len + len);
+	if (aop == NULL) {
+		LM_ERR("no more pkg memory\n");
+		bencode_buffer_free(&bencbuf);
+		return -1;
+	}
+	memset(aop, 0, sizeof(*aop));
+	aop->callid.s = (char *)(aop + 1);
+	aop->callid.len = callid.len;
+	memcpy(aop->callid.s, callid.s, callid.len);
+	aop->cmd.s = p = aop->callid.s + callid.len;
+	aop->cmd.len = len;
+	for (i = 1; i <= vcnt; i++) {
+		memcpy(p, v[i].iov_base, v[i].iov_len);
+		p += v[i].iov_len;
+	}
+	bencode_buffer_free(&bencbuf);
+
+	if (flags && (aop->flags = pkg_strdup(flags)) == NULL) {
+		LM_ERR("no more pkg memory\n");
+		rtpe_async_free(aop);
+		return -1;
+	}
+	aop->op = op;
+	aop->spvar = spvar;
+	aop->bpvar = bpvar;
+	aop->ctx = ctx;
+	if ( (aop->set=ctx_rtpeset_get())==NULL )
+		aop->set = default_rtpe_set;
+
+	rtpe_async_send(aop);
+	if (aop->state == RTPE_ASYNC_FAILED) {
+		rtpe_async_free(aop);
+		return -1;
+	} else if (aop->state == RTPE_ASYNC_SYNC) {
+		rtpe_async_free(aop);
+		goto sync;
+	}
+
+	rtpe_async_link(aop);
+
+	ctx->resume_f = rtpe_async_resume;
+	ctx->resume_param = aop;
+	async_status = ASYNC_NO_FD;
+
+	return 1;
+
+sync:
+	async_status = ASYNC_SYNC;
+	return rtpengine_offer_answer(msg, flags, spvar, bpvar, op);
+}
+
+
+
 static int
 start_recording_f(struct sip_msg* msg, pv_spec_t *spvar)
 {
@@ -153,6 +153,7 @@
 #include <poll.h>
 #include <stdlib.h>
 #include <sys/uio.h>
+#include <fcntl.h>
 
 #include "../../dprint.h"
 #include "../../data_lump.h"
@@ -173,6 +174,8 @@
 #include "../../parser/parse_body.h"
 #include "../../msg_callbacks.h"
 #include "../../evi/evi_modules.h"
+#include "../../async.h"
+#include "../../lib/timerfd.h"
 
 #include "../dialog/dlg_load.h"
 #include "../tm/tm_load.h"
@@ -250,6 +253,12 @@ static int force_rtp_proxy(struct sip_msg *, char *, char *, char *, char *, int
 static int start_recording_f(struct sip_msg *, char *, char *, char *);
 static int rtpproxy_answer4_f(struct sip_msg *, char *, char *, char *, char *);
 static int rtpproxy_offer4_f(struct sip_msg *, char *, char *, char *, char *);
+static int rtpproxy_answer_async_f(struct sip_msg *, async_ctx *,
+		char *, char *, char *, char *);
+static int rtpproxy_offer_async_f(struct sip_msg *, async_ctx *,
+		char *, char *, char *, char *);
+static int rtpproxy_offer_answer(struct sip_msg *, async_ctx *,
+		char *, char *, char *, char *, int);
 static int rtpproxy_stats_f(struct sip_msg *, char *, char *, char *, char *,
 		char *, char *);
 static int rtpproxy_all_stats_f(struct sip_msg *, char *, char *, char *);
@@ -348,6 +357,13 @@ static unsigned int *list_version;
 static unsigned int my_version = 0;
 static unsigned int rtpp_number = 0;
 
+/* sockets used for the async commands (per process), indexed as the
+ * ones above, but kept apart so that a blocking command never drains
+ * a reply an async one is waiting for */
+static int *rtpp_async_socks = 0;
+static unsigned int rtpp_async_no = 0;
+static unsigned int rtpp_async_version = 0;
+
 /* DB support for loading proxies */
 static str db_url = {NULL, 0};
 static str table = str_init("rtpproxy_sockets");
@@ -484,6 +500,28 @@ static cmd_export_t cmds[] = {
 	{0, 0, 0, 0, 0, 0}
 };
 
+static acmd_export_t acmds[] = {
+	{"rtpproxy_offer",  (acmd_function)rtpproxy_offer_async_f,  0, 0 },
+	{"rtpproxy_offer",  (acmd_function)rtpproxy_offer_async_f,  1,
+		fixup_spve_null },
+	{"rtpproxy_offer",  (acmd_function)rtpproxy_offer_async_f,  2,
+		fixup_spve_spve },
+	{"rtpproxy_offer",  (acmd_function)rtpproxy_offer_async_f,  3,
+		fixup_offer_answer },
+	{"rtpproxy_offer",  (acmd_function)rtpproxy_offer_async_f,  4,
+		fixup_offer_answer },
+	{"rtpproxy_answer", (acmd_function)rtpproxy_answer_async_f, 0, 0 },
+	{"rtpproxy_answer", (acmd_function)rtpproxy_answer_async_f, 1,
+		fixup_spve_null },
+	{"rtpproxy_answer", (acmd_function)rtpproxy_answer_async_f, 2,
+		fixup_spve_spve },
+	{"rtpproxy_answer", (acmd_function)rtpproxy_answer_async_f, 3,
+		fixup_offer_answer },
+	{"rtpproxy_answer", (acmd_function)rtpproxy_answer_async_f, 4,
+		fixup_offer_answer },
+	{0, 0, 0, 0}
+};
+
 static param_export_t params[] = {
 	{"nortpproxy_str",        STR_PARAM, &nortpproxy_str.s        },
 	{"rtpproxy_sock",         STR_PARAM|USE_FUNC_PARAM,
@@ -534,7 +572,7 @@ struct module_exports exports = {
 	DEFAULT_DLFLAGS, /* dlopen flags */
 	&deps,           /* OpenSIPS module dependencies */
 	cmds,
-	NULL,
+	acmds,
 	params,
 	0,           /* exported statistics */
 	mi_cmds,     /* exported MI functions */
@@ -1501,11 +1539,64 @@ child_init(int rank)
 	return connect_rtpproxies();
 }
 
-int connect_rtpproxies(void)
+/* resolves the address of an UDP/UDP6 proxy and returns a socket
+ * connected to it, or -1 on failure */
+static int rtpp_connect_udp(struct rtpp_node *pnode)
 {
-	int n;
-	char *cp;
+	int n, fd;
+	char *cp, *hostname;
 	struct addrinfo hints, *res;
+
+	/*
+	 * This is UDP or UDP6. Detect host and port; lookup host;
+	 * do connect() in order to specify peer address
+	 */
+	hostname = (char*)pkg_malloc(sizeof(char) * (strlen(pnode->rn_address) + 1));
+	if (hostname==NULL) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	strcpy(hostname, pnode->rn_address);
+
+	cp = strrchr(hostname, ':');
+	if (cp != NULL) {
+		*cp = '\0';
+		cp++;
+	}
+	if (cp == NULL || *cp == '\0')
+		cp = CPORT;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = 0;
+	hints.ai_family = (pnode->rn_umode == 6) ? AF_INET6 : AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
+		LM_ERR("%s\n", gai_strerror(n));
+		pkg_free(hostname);
+		return -1;
+	}
+	pkg_free(hostname);
+
+	fd = socket((pnode->rn_umode == 6) ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		LM_ERR("can't create socket\n");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		LM_ERR("can't connect to a RTP proxy\n");
+		close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+int connect_rtpproxies(void)
+{
 	struct rtpp_set  *rtpp_list;
 	struct rtpp_node *pnode;
 
@@ -1527,59 +1618,14 @@ int connect_rtpproxies(void)
 		rtpp_list = rtpp_list->rset_next){
 
 		for (pnode=rtpp_list->rn_first; pnode!=0; pnode = pnode->rn_next){
-			char *hostname;
-
 			if (pnode->rn_umode == 0) {
 				rtpp_socks[pnode->idx] = -1;
 				goto rptest;
 			}
 
-			/*
-			 * This is UDP or UDP6. Detect host and port; lookup host;
-			 * do connect() in order to specify peer address
-			 */
-			hostname = (char*)pkg_malloc(sizeof(char) * (strlen(pnode->rn_address) + 1));
-			if (hostname==NULL) {
-				LM_ERR("no more pkg memory\n");
-				return -1;
-			}
-			strcpy(hostname, pnode->rn_address);
-
-			cp = strrchr(hostname, ':');
-			if (cp != NULL) {
-				*cp = '\0';
-				cp++;
-			}
-			if (cp == NULL || *cp == '\0')
-				cp = CPORT;
-
-			memset(&hints, 0, sizeof(hints));
-			hints.ai_flags = 0;
-			hints.ai_family = (pnode->rn_umode == 6) ? AF_INET6 : AF_INET;
-			hints.ai_socktype = SOCK_DGRAM;
-			if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
-				LM_ERR("%s\n", gai_strerror(n));
-				pkg_free(hostname);
-				return -1;
-			}
-			pkg_free(hostname);
-
-			rtpp_socks[pnode->idx] = socket((pnode->rn_umode == 6)
-			    ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
-			if ( rtpp_socks[pnode->idx] == -1) {
-				LM_ERR("can't create socket\n");
-				freeaddrinfo(res);
-				return -1;
-			}
-
-			if (connect( rtpp_socks[pnode->idx], res->ai_addr, res->ai_addrlen) == -1) {
-				LM_ERR("can't connect to a RTP proxy\n");
-				close( rtpp_socks[pnode->idx] );
-				rtpp_socks[pnode->idx] = -1;
-				freeaddrinfo(res);
+			rtpp_socks[pnode->idx] = rtpp_connect_udp(pnode);
+			if (rtpp_socks[pnode->idx] == -1)
 				return -1;
-			}
-			freeaddrinfo(res);
 			LM_DBG("connected %s\n", pnode->rn_address);
 rptest:
 			pnode->rn_disabled = rtpp_test(pnode, 0, 1);
@@ -2194,6 +2240,14 @@ error:
 
 
 
+static void rtpp_disable_node(struct rtpp_node *node)
+{
+	LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
+	node->rn_disabled = 1;
+	node->rn_recheck_ticks = get_ticks() + rtpproxy_disable_tout;
+	raise_rtpproxy_event(node, 0);
+}
+
 #define RTPPROXY_BUF_SIZE 256
 
 char *
@@ -2326,10 +2380,7 @@ out:
 	cp[len] = '\0';
 	return cp;
 badproxy:
-	LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
-	node->rn_disabled = 1;
-	node->rn_recheck_ticks = get_ticks() + rtpproxy_disable_tout;
-	raise_rtpproxy_event(node, 0);
+	rtpp_disable_node(node);
 	return NULL;
 }
 
@@ -2615,47 +2666,55 @@ static int rtpp_get_var_svalue(struct sip_msg *msg, gparam_p gp, str *val, int n
 static int
 rtpproxy_offer4_f(struct sip_msg *msg, char *param1, char *param2, char *param3, char *param4)
 {
-	str aux_str;
-
-	if(rtpp_notify_socket.s)
-	{
-		if ( (!msg->to && parse_headers(msg, HDR_TO_F,0)<0) || !msg->to ) {
-			LM_ERR("bad request or missing TO hdr\n");
-			return -1;
-		}
-
-		/* if an initial request - create a new dialog */
-		if(get_to(msg)->tag_value.s == NULL)
-			dlg_api.create_dlg(msg,0);
-	}
+	return rtpproxy_offer_answer(msg, NULL, param1, param2, param3, param4, 1);
+}
 
-	if (param1) {
-		if (rtpp_get_var_svalue(msg, (gparam_p)param1, &aux_str, 0)<0) {
-			LM_ERR("bogus flags parameter\n");
-			return -1;
-		}
-		param1 = aux_str.s;
-	}
+static int
+rtpproxy_answer4_f(struct sip_msg *msg, char *param1, char *param2, char *param3, char *param4)
+{
+	return rtpproxy_offer_answer(msg, NULL, param1, param2, param3, param4, 0);
+}
 
-	if (param2) {
-		if (rtpp_get_var_svalue(msg, (gparam_p)param2, &aux_str, 1)<0) {
-			LM_ERR("bogus IP addr parameter\n");
-			return -1;
-		}
-		param2 = aux_str.s;
-	}
+static int
+rtpproxy_offer_async_f(struct sip_msg *msg, async_ctx *ctx,
+		char *param1, char *param2, char *param3, char *param4)
+{
+	return rtpproxy_offer_answer(msg, ctx, param1, param2, param3, param4, 1);
+}
 
-	return force_rtp_proxy(msg, param1, param2, param3, param4, 1);
+static int
+rtpproxy_answer_async_f(struct sip_msg *msg, async_ctx *ctx,
+		char *param1, char *param2, char *param3, char *param4)
+{
+	return rtpproxy_offer_answer(msg, ctx, param1, param2, param3, param4, 0);
 }
 
+static int rtpp_async_start(struct sip_msg *, async_ctx *,
+		char *, char *, char *, char *, int);
+
 static int
-rtpproxy_answer4_f(struct sip_msg *msg, char *param1, char *param2, char *param3, char *param4)
+rtpproxy_offer_answer(struct sip_msg *msg, async_ctx *ctx, char *param1,
+		char *param2, char *param3, char *param4, int offer)
 {
 	str aux_str;
 
-	if (msg->first_line.type == SIP_REQUEST)
-		if (msg->first_line.u.request.method_value != METHOD_ACK)
-			return -1;
+	if (offer) {
+		if(rtpp_notify_socket.s)
+		{
+			if ( (!msg->to && parse_headers(msg, HDR_TO_F,0)<0) || !msg->to ) {
+				LM_ERR("bad request or missing TO hdr\n");
+				return -1;
+			}
+
+			/* if an initial request - create a new dialog */
+			if(get_to(msg)->tag_value.s == NULL)
+				dlg_api.create_dlg(msg,0);
+		}
+	} else {
+		if (msg->first_line.type == SIP_REQUEST)
+			if (msg->first_line.u.request.method_value != METHOD_ACK)
+				return -1;
+	}
 
 	if (param1) {
 		if (rtpp_get_var_svalue(msg, (gparam_p)param1, &aux_str, 0)<0) {
@@ -2673,7 +2732,11 @@ rtpproxy_answer4_f(struct sip_msg *msg, char *param1, char *param2, char *param3
 		param2 = aux_str.s;
 	}
 
-	return force_rtp_proxy(msg, param1, param2, param3, param4, 0);
+	if (ctx)
+		return rtpp_async_start(msg, ctx, param1, param2, param3, param4,
+				offer);
+
+	return force_rtp_proxy(msg, param1, param2, param3, param4, offer);
 }
 
 static void engage_callback(struct dlg_cell *dlg, int type,
@@ -3417,6 +3480,599 @@ static inline int rtpp_get_error(char *command)
 	return ret;
 }
 
+/*
+ * Async offer/answer support.
+ *
+ * The commands of an async offer/answer are sent over per-process UDP
+ * sockets watched by the reactor and the replies are matched back by their
+ * cookie. As an SDP body may describe several streams (one command each),
+ * force_rtp_proxy_body() is run twice for an op: a "collect" pass which
+ * only sends the commands (all the streams in parallel) and, once all the
+ * replies are in, a "replay" pass which alters the SDP using the stored
+ * replies. Retransmissions and timeouts are driven by a per-process timer
+ * FD; a stream whose proxy times out is sent, by a new collect pass, to
+ * the next proxy of the set.
+ */
+
+#define RTPP_ASYNC_MAX_STREAMS	16
+
+enum rtpp_slot_state {
+	RTPP_SLOT_NEW = 0,
+	RTPP_SLOT_PENDING,
+	RTPP_SLOT_DONE,
+	RTPP_SLOT_FAILED
+};
+
+struct rtpp_async_slot {
+	enum rtpp_slot_state state;
+	struct rtpp_node *node;
+	unsigned int version;	/* list version the node belongs to */
+	int sock;
+	str cmd;				/* cookie + command, as sent */
+	int cookie_len;			/* without the trailing space */
+	int retr;
+	utime_t sent;
+	char reply[RTPPROXY_BUF_SIZE];
+};
+
+struct rtpp_async_op {
+	async_ctx *ctx;
+	char *flags;
+	char *ip;
+	char *setid;
+	char *var;
+	int offer;
+	int collect;		/* collect or replay pass */
+	int slot;			/* current stream during a pass */
+	int slots_no;
+	int pending;
+	int failed;
+	struct rtpp_async_slot slots[RTPP_ASYNC_MAX_STREAMS];
+	struct rtpp_async_op *next;
+};
+
+static char rtpp_async_pending[] = "";
+/* op being run through force_rtp_proxy_body() */
+static struct rtpp_async_op *rtpp_aop = NULL;
+/* ops of this process waiting for replies */
+static struct rtpp_async_op *rtpp_async_ops = NULL;
+static int rtpp_async_timer = -1;
+
+
+static int rtpp_async_reply(int fd, void *param);
+
+/* returns the async socket of this process for the given node */
+static int rtpp_async_sock(struct rtpp_node *node)
+{
+	unsigned int i;
+	int fd, flags;
+
+	if (rtpp_async_version != my_version || rtpp_async_no < rtpp_number) {
+		/* proxies were reloaded - drop the old sockets; being shut down,
+		 * they get reported as readable and closed by the reactor */
+		for (i = 0; i < rtpp_async_no; i++)
+			if (rtpp_async_socks[i] >= 0) {
+				shutdown(rtpp_async_socks[i], SHUT_RDWR);
+				rtpp_async_socks[i] = -1;
+			}
+		if (rtpp_async_no < rtpp_number) {
+			rtpp_async_socks = (int*)pkg_realloc(rtpp_async_socks,
+				rtpp_number * sizeof(int));
+			if (rtpp_async_socks==NULL) {
+				LM_ERR("no more pkg memory\n");
+				rtpp_async_no = 0;
+				return -1;
+			}
+			for (i = rtpp_async_no; i < rtpp_number; i++)
+				rtpp_async_socks[i] = -1;
+			rtpp_async_no = rtpp_number;
+		}
+		rtpp_async_version = my_version;
+	}
+
+	if (node->idx >= rtpp_async_no)
+		return -1;
+	if (rtpp_async_socks[node->idx] >= 0)
+		return rtpp_async_socks[node->idx];
+
+	fd = rtpp_connect_udp(node);
+	if (fd < 0)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LM_ERR("failed to set O_NONBLOCK (%d) <%s>\n",
+			errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (register_async_fd(fd, rtpp_async_reply,
+	(void *)(unsigned long)node->idx) < 0) {
+		LM_ERR("failed to add the async socket to reactor\n");
+		close(fd);
+		return -1;
+	}
+
+	rtpp_async_socks[node->idx] = fd;
+	return fd;
+}
+
+static int rtpp_async_xmit(struct rtpp_async_slot *sl)
+{
+	int len;
+
+	do {
+		len = send(sl->sock, sl->cmd.s, sl->cmd.len, 0);
+	} while (len == -1 && errno == EINTR);
+	if (len <= 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+	errno != ENOBUFS) {
+		LM_ERR("can't send command to a RTP proxy %s\n", strerror(errno));
+		return -1;
+	}
+	/* a full buffer is handled as a lost datagram */
+	sl->retr++;
+	sl->sent = get_uticks();
+	return 0;
+}
+
+/* returns 0 if sent, -1 if the node failed and -2 on internal error */
+static int rtpp_async_send(struct rtpp_async_slot *sl, struct rtpp_node *node,
+		struct iovec *v, int vcnt)
+{
+	char *cookie, *p;
+	int i, len;
+
+	sl->sock = rtpp_async_sock(node);
+	if (sl->sock < 0)
+		return -1;
+
+	cookie = gencookie();
+	len = strlen(cookie);
+	for (i = 1; i < vcnt; i++)
+		len += v[i].iov_len;
+
+	p = pkg_realloc(sl->cmd.s, len);
+	if (p == NULL) {
+		LM_ERR("no more pkg memory\n");
+		return -2;
+	}
+	sl->cmd.s = p;
+	sl->cmd.len = len;
+	sl->cookie_len = strlen(cookie) - 1;
+	memcpy(p, cookie, sl->cookie_len + 1);
+	p += sl->cookie_len + 1;
+	for (i = 1; i < vcnt; i++) {
+		memcpy(p, v[i].iov_base, v[i].iov_len);
+		p += v[i].iov_len;
+	}
+
+	sl->retr = 0;
+	return rtpp_async_xmit(sl);
+}
+
+/* stores a reply; returns -1 for the replies flagging an internal error
+ * of the proxy, which are to be handled as a node failure */
+static int rtpp_async_store(struct rtpp_async_slot *sl, char *reply, int len)
+{
+	int err;
+
+	err = rtpp_get_error(reply);
+	if (err >= 7 && err <= 10)
+		return -1;
+
+	if (len >= RTPPROXY_BUF_SIZE)
+		len = RTPPROXY_BUF_SIZE - 1;
+	memcpy(sl->reply, reply, len);
+	sl->reply[len] = '\0';
+	sl->state = RTPP_SLOT_DONE;
+	return 0;
+}
+
+static void rtpp_async_slot_done(struct rtpp_async_op *op,
+		struct rtpp_async_slot *sl, char *reply, int len)
+{
+	op->pending--;
+	if (reply && rtpp_async_store(sl, reply, len) == 0)
+		return;
+
+	/* the node is touched only if not freed by a reload meanwhile */
+	if (nh_lock)
+		lock_start_read(nh_lock);
+	if (sl->version == *list_version)
+		rtpp_disable_node(sl->node);
+	if (nh_lock)
+		lock_stop_read(nh_lock);
+
+	sl->state = RTPP_SLOT_FAILED;
+	op->failed++;
+}
+
+/*
+ * Replacement of send_rtpp_command() for force_rtp_proxy_body(); for an
+ * async op it sends the command without waiting for the reply (collect
+ * pass) or returns the stored reply (replay pass)
+ */
+static char *rtpp_command(struct rtpp_node *node, struct iovec *v, int vcnt)
+{
+	struct rtpp_async_slot *sl;
+	char *cp;
+	int ret;
+
+	if (rtpp_aop == NULL || rtpp_aop->slot >= RTPP_ASYNC_MAX_STREAMS)
+		return send_rtpp_command(node, v, vcnt);
+
+	sl = &rtpp_aop->slots[rtpp_aop->slot];
+
+	if (!rtpp_aop->collect) {
+		if (sl->state == RTPP_SLOT_DONE)
+			return sl->reply;
+		/* no reply stored (should not happen) - do it the blocking way */
+		return send_rtpp_command(node, v, vcnt);
+	}
+
+	switch (sl->state) {
+		case RTPP_SLOT_PENDING:
+		case RTPP_SLOT_DONE:
+			return rtpp_async_pending;
+		case RTPP_SLOT_FAILED:
+			/* the caller picks another node, if allowed */
+			sl->state = RTPP_SLOT_NEW;
+			return NULL;
+		default:
+			break;
+	}
+
+	sl->node = node;
+	sl->version = my_version;
+
+	if (node->rn_umode != 0) {
+		ret = rtpp_async_send(sl, node, v, vcnt);
+		if (ret == 0) {
+			sl->state = RTPP_SLOT_PENDING;
+			rtpp_aop->pending++;
+			return rtpp_async_pending;
+		}
+		if (ret == -1) {
+			rtpp_disable_node(node);
+			return NULL;
+		}
+	}
+
+	/* stream sockets (or no memory) - go for a blocking command */
+	cp = send_rtpp_command(node, v, vcnt);
+	if (cp == NULL)
+		return NULL;
+	if (rtpp_async_store(sl, cp, strlen(cp)) < 0) {
+		rtpp_disable_node(node);
+		return NULL;
+	}
+	return rtpp_async_pending;
+}
+
+static int rtpp_async_run(struct sip_msg *msg, struct rtpp_async_op *op,
+		int collect)
+{
+	int ret;
+
+	op->collect = collect;
+	op->slot = 0;
+	rtpp_aop = op;
+	ret = force_rtp_proxy(msg, op->flags, op->ip, op->setid, op->var,
+			op->offer);
+	rtpp_aop = NULL;
+	if (collect)
+		op->slots_no = op->slot;
+
+	return ret;
+}
+
+static void rtpp_async_free(struct rtpp_async_op *op)
+{
+	int i;
+
+	for (i = 0; i < RTPP_ASYNC_MAX_STREAMS; i++)
+		if (op->slots[i].cmd.s)
+			pkg_free(op->slots[i].cmd.s);
+	if (op->flags)
+		pkg_free(op->flags);
+	if (op->ip)
+		pkg_free(op->ip);
+	pkg_free(op);
+}
+
+#ifdef HAVE_TIMER_FD
+static void rtpp_async_arm(int on)
+{
+	struct itimerspec its;
+	unsigned int us;
+
+	/* check twice per timeout interval */
+	us = on ? rtpproxy_tout * 500 : 0;
+	if (on && us < 10000)
+		us = 10000;
+
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = (us % 1000000) * 1000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(rtpp_async_timer, 0, &its, NULL) < 0)
+		LM_ERR("failed to set timer FD (%d) <%s>\n", errno, strerror(errno));
+}
+#else
+#define rtpp_async_arm(_on)
+#endif
+
+static void rtpp_async_link(struct rtpp_async_op *op)
+{
+	if (rtpp_async_ops == NULL)
+		rtpp_async_arm(1);
+	op->next = rtpp_async_ops;
+	rtpp_async_ops = op;
+}
+
+static void rtpp_async_unlink(struct rtpp_async_op *op)
+{
+	struct rtpp_async_op **prev;
+
+	for (prev = &rtpp_async_ops; *prev; prev = &(*prev)->next)
+		if (*prev == op) {
+			*prev = op->next;
+			break;
+		}
+	op->next = NULL;
+	if (rtpp_async_ops == NULL)
+		rtpp_async_arm(0);
+}
+
+static int rtpp_async_reply(int fd, void *param)
+{
+	static char buf[RTPPROXY_BUF_SIZE];
+	unsigned int idx = (unsigned int)(unsigned long)param;
+	struct rtpp_async_op *op;
+	struct rtpp_async_slot *sl;
+	char *cp;
+	int len, i;
+
+	if (idx >= rtpp_async_no || rtpp_async_socks[idx] != fd) {
+		/* dropped on proxies reload */
+		async_status = ASYNC_DONE_CLOSE_FD;
+		return 0;
+	}
+	async_status = ASYNC_CONTINUE;
+
+	do {
+		len = recv(fd, buf, sizeof(buf) - 1, 0);
+	} while (len == -1 && errno == EINTR);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			LM_DBG("can't read reply from a RTP proxy (%d) <%s>\n",
+				errno, strerror(errno));
+		return 0;
+	}
+	buf[len] = '\0';
+
+	for (op = rtpp_async_ops; op; op = op->next)
+		for (i = 0; i < op->slots_no; i++) {
+			sl = &op->slots[i];
+			if (sl->state == RTPP_SLOT_PENDING && sl->sock == fd &&
+			len >= sl->cookie_len &&
+			memcmp(buf, sl->cmd.s, sl->cookie_len) == 0 &&
+			(len == sl->cookie_len || buf[sl->cookie_len] == ' '))
+				goto found;
+		}
+
+	LM_DBG("dropping unexpected reply from RTP proxy: %s\n", buf);
+	return 0;
+
+found:
+	len -= sl->cookie_len;
+	cp = buf + sl->cookie_len;
+	if (len != 0) {
+		len--;
+		cp++;
+	}
+	rtpp_async_slot_done(op, sl, cp, len);
+
+	if (op->pending == 0) {
+		rtpp_async_unlink(op);
+		async_script_resume_f(NULL, op->ctx);
+		/* the resume route sets async_status for the transaction it ran,
+		 * but this socket is shared - keep it in the reactor */
+		async_status = ASYNC_CONTINUE;
+	}
+	return 0;
+}
+
+#ifdef HAVE_TIMER_FD
+static int rtpp_async_tick(int fd, void *param)
+{
+	struct rtpp_async_op *op, **prev, *ready = NULL;
+	struct rtpp_async_slot *sl;
+	unsigned long long exp;
+	utime_t now;
+	int i;
+
+	async_status = ASYNC_CONTINUE;
+	if (read(fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+		LM_ERR("failed to read from timer FD (%d) <%s>\n",
+			errno, strerror(errno));
+
+	now = get_uticks();
+	for (op = rtpp_async_ops; op; op = op->next)
+		for (i = 0; i < op->slots_no; i++) {
+			sl = &op->slots[i];
+			if (sl->state != RTPP_SLOT_PENDING)
+				continue;
+			if (sl->version == *list_version) {
+				if (now < sl->sent + (utime_t)rtpproxy_tout * 1000)
+					continue;
+				if (sl->retr < rtpproxy_retr && rtpp_async_xmit(sl) == 0)
+					continue;
+				LM_ERR("timeout waiting reply from a RTP proxy\n");
+			}
+			rtpp_async_slot_done(op, sl, NULL, 0);
+		}
+
+	/* detach the completed ops first, as resuming may link new ones */
+	for (prev = &rtpp_async_ops; (op = *prev); ) {
+		if (op->pending == 0) {
+			*prev = op->next;
+			op->next = ready;
+			ready = op;
+		} else {
+			prev = &op->next;
+		}
+	}
+	if (rtpp_async_ops == NULL)
+		rtpp_async_arm(0);
+
+	while (ready) {
+		op = ready;
+		ready = op->next;
+		op->next = NULL;
+		async_script_resume_f(NULL, op->ctx);
+	}
+	/* the timer FD is shared by all the pending ops, keep it */
+	async_status = ASYNC_CONTINUE;
+
+	return 0;
+}
+
+static int rtpp_async_timer_init(void)
+{
+	if (rtpp_async_timer >= 0)
+		return 0;
+
+	rtpp_async_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (rtpp_async_timer < 0) {
+		LM_ERR("failed to create new timer FD (%d) <%s>\n",
+			errno, strerror(errno));
+		return -1;
+	}
+
+	if (register_async_fd(rtpp_async_timer, rtpp_async_tick, NULL) < 0) {
+		LM_ERR("failed to add the timer FD to reactor\n");
+		close(rtpp_async_timer);
+		rtpp_async_timer = -1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/* counts the media streams of the SDP bodies */
+static int rtpp_async_streams(struct sip_msg *msg)
+{
+	struct body_part *p;
+	char *c, *end;
+	int n = 0;
+
+	if (parse_sip_body(msg)<0 || msg->body==NULL)
+		return 0;
+
+	for (p = &msg->body->first; p != NULL; p = p->next) {
+		if (p->mime != ((TYPE_APPLICATION << 16) + SUBTYPE_SDP))
+			continue;
+		for (c = p->body.s, end = c + p->body.len - 1; c < end; c++)
+			if (c[0] == 'm' && c[1] == '=' &&
+			(c == p->body.s || c[-1] == '\n'))
+				n++;
+	}
+
+	return n;
+}
+
+static int rtpp_async_resume(int fd, struct sip_msg *msg, void *param)
+{
+	struct rtpp_async_op *op = (struct rtpp_async_op *)param;
+	int ret;
+
+	if (op->pending) {
+		/* resumed before all the replies came in (the op could not
+		 * be suspended) - redo it in blocking mode */
+		rtpp_async_unlink(op);
+		ret = force_rtp_proxy(msg, op->flags, op->ip, op->setid, op->var,
+				op->offer);
+		goto done;
+	}
+
+	if (op->failed) {
+		/* resend the failed streams to other nodes */
+		op->failed = 0;
+		ret = rtpp_async_run(msg, op, 1);
+		if (ret < 0)
+			goto done;
+		if (op->pending) {
+			rtpp_async_link(op);
+			async_status = ASYNC_CONTINUE;
+			return 1;
+		}
+	}
+
+	ret = rtpp_async_run(msg, op, 0);
+done:
+	rtpp_async_free(op);
+	return ret;
+}
+
+static int rtpp_async_start(struct sip_msg *msg, async_ctx *ctx, char *flags,
+		char *ip, char *setid, char *var, int offer)
+{
+	struct rtpp_async_op *op;
+	int ret;
+
+#ifdef HAVE_TIMER_FD
+	/* auto-bridging and non-request routes are served in blocking mode */
+	if (rtpproxy_autobridge || route_type != REQUEST_ROUTE ||
+	rtpp_async_streams(msg) > RTPP_ASYNC_MAX_STREAMS ||
+	rtpp_async_timer_init() < 0)
+		goto sync;
+#else
+	goto sync;
+#endif
+
+	op = pkg_malloc(sizeof(*op));
+	if (op == NULL) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memset(op, 0, sizeof(*op));
+	if ((flags && (op->flags = pkg_strdup(flags)) == NULL) ||
+	(ip && (op->ip = pkg_strdup(ip)) == NULL)) {
+		LM_ERR("no more pkg memory\n");
+		rtpp_async_free(op);
+		return -1;
+	}
+	op->setid = setid;
+	op->var = var;
+	op->offer = offer;
+	op->ctx = ctx;
+
+	ret = rtpp_async_run(msg, op, 1);
+	if (ret < 0 || op->pending == 0) {
+		/* failed or all done already, in blocking mode */
+		if (ret >= 0)
+			ret = rtpp_async_run(msg, op, 0);
+		rtpp_async_free(op);
+		async_status = ASYNC_SYNC;
+		return ret;
+	}
+
+	rtpp_async_link(op);
+
+	ctx->resume_f = rtpp_async_resume;
+	ctx->resume_param = op;
+	async_status = ASYNC_NO_FD;
+
+	return 1;
+
+sync:
+	ret = force_rtp_proxy(msg, flags, ip, setid, var, offer);
+	async_status = ASYNC_SYNC;
+	return ret;
+}
+
 int
 force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args, pv_spec_p var)
 {
@@ -3876,7 +4532,7 @@ force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args, pv_spec_
 
 				v[1].iov_base = m_opts.s.s;
 				v[1].iov_len = m_opts.oidx;
-				cp = send_rtpp_command(args->node, v, vcnt);
+				cp = rtpp_command(args->node, v, vcnt);
 				if (!cp && !create) {
 					LM_ERR("cannot lookup a session on a different RTPProxy\n");
 					goto error;
@@ -3900,6 +4556,13 @@ force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args, pv_spec_
 				locked = 0;
 				lock_stop_read(nh_lock);
 			}
+			if (rtpp_aop) {
+				/* async op: move to the next stream; the SDP is only
+				 * altered once all the replies are in */
+				rtpp_aop->slot++;
+				if (rtpp_aop->collect)
+					continue;
+			}
 			LM_DBG("proxy reply: %s\n", cp);
 			/* Parse proxy reply to <argc,argv> */
 			argc = 0;
@@ -4021,6 +4684,9 @@ force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args, pv_spec_
 	} /* Iterate sessions */
 	free_opts(&opts, &rep_opts, &pt_opts);
 
+	if (rtpp_aop && rtpp_aop->collect)
+		return 1;
+
 	if (proxied == 0 && nortpproxy_str.len) {
 		cp = pkg_malloc((nortpproxy_str.len + CRLF_LEN) * sizeof(char));
 		if (cp == NULL) {
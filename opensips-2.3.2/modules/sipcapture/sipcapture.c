@@ -50,6 +50,13 @@
 /* BPF structure */
 #ifdef __OS_linux
 #include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <sys/mman.h>
+#include <poll.h>
+#ifdef TPACKET3_HDRLEN
+#define HAVE_RAW_RING
+#endif
 #endif
 
 #ifndef __USE_BSD
@@ -82,6 +89,7 @@
 #include "../../receive.h"
 #include "../../forward.h"
 #include "../../msg_translator.h"
+#include "../../timer.h"
 
 #include "../../lib/cJSON.h"
 
@@ -475,6 +483,31 @@ int *capture_on_flag = NULL;
 int promisc_on = 0;
 int bpf_on = 0;
 
+/* PACKET_MMAP (TPACKET_V3) receive rings, one per RAW process */
+int raw_ring_on = 0;
+int raw_ring_blocks = 16;
+int raw_ring_block_size = 1<<18;
+
+#ifdef HAVE_RAW_RING
+/* time after which a partially filled block is handed to us (ms) */
+#define RAW_RING_BLOCK_TOV 10
+/* interval for collecting the ring statistics (s) */
+#define RAW_RING_STATS_INTERVAL 1
+
+struct raw_ring {
+	int fd;
+	char *map;
+	unsigned int map_len;
+};
+
+static struct raw_ring *raw_rings = NULL;
+static int raw_rings_no = 0;
+
+static int raw_capture_rings(str* iface, int port_start, int port_end,
+		int rings_no);
+static int raw_capture_ring_loop(struct raw_ring *ring, int port1, int port2);
+#endif
+
 char* hep_route=0;
 str hep_route_s;
 
@@ -633,6 +666,9 @@ static param_export_t params[] = {
 	{"raw_interface",     		STR_PARAM, &raw_interface.s   },
         {"promiscious_on",  		INT_PARAM, &promisc_on   },
         {"raw_moni_bpf_on",  		INT_PARAM, &bpf_on   },
+	{"raw_moni_ring_on",		INT_PARAM, &raw_ring_on },
+	{"raw_ring_blocks",		INT_PARAM, &raw_ring_blocks },
+	{"raw_ring_block_size",		INT_PARAM, &raw_ring_block_size },
 	{"hep_route",		STR_PARAM, &hep_route_name},
 	{0, 0, 0}
 };
@@ -649,10 +685,16 @@ static mi_export_t mi_cmds[] = {
 #ifdef STATISTICS
 stat_var* sipcapture_req;
 stat_var* sipcapture_rpl;
+stat_var* raw_ring_packets;
+stat_var* raw_ring_drops;
+stat_var* raw_ring_freezes;
 
 stat_export_t sipcapture_stats[] = {
 	{"captured_requests" ,  0,  &sipcapture_req  },
 	{"captured_replies"  ,  0,  &sipcapture_rpl  },
+	{"raw_ring_packets"  ,  0,  &raw_ring_packets },
+	{"raw_ring_drops"    ,  0,  &raw_ring_drops   },
+	{"raw_ring_freezes"  ,  0,  &raw_ring_freezes },
 	{0,0,0}
 };
 #endif
@@ -1033,6 +1075,27 @@ static int mod_init(void) {
 				return -1;
 				}
 
+		if (raw_ring_on && ipip_capture_on) {
+			LM_WARN("RAW ring is supported only for monitoring capture, "
+				"using the plain RAW socket\n");
+			raw_ring_on = 0;
+		}
+
+#ifdef HAVE_RAW_RING
+		if (raw_ring_on) {
+			if (raw_capture_rings(raw_interface.len ? &raw_interface : 0,
+			moni_port_start, moni_port_end, raw_sock_children) < 0) {
+				LM_ERR("could not initialize the RAW capture rings\n");
+				return -1;
+			}
+			/* used for the interface settings */
+			raw_sock_desc = raw_rings[0].fd;
+		} else
+#else
+		if (raw_ring_on)
+			LM_WARN("RAW ring not supported on this platform, "
+				"using the plain RAW socket\n");
+#endif
 		raw_sock_desc = raw_capture_socket(raw_socket_listen.len ? ip : 0, raw_interface.len ? &raw_interface : 0,
 										moni_port_start, moni_port_end , ipip_capture_on ? IPPROTO_IPIP : htons(0x0800));
 
@@ -2229,6 +2292,12 @@ static void raw_socket_process(int rank)
 			return;
 		}
 
+#ifdef HAVE_RAW_RING
+	if (raw_rings)
+		raw_capture_ring_loop(&raw_rings[rank], moni_port_start,
+			moni_port_end);
+	else
+#endif
 	raw_capture_rcv_loop(raw_sock_desc, moni_port_start, moni_port_end,
 			moni_capture_on ? 0 : 1);
 
@@ -2262,6 +2331,9 @@ static int do_remaining_queries(str* query_str) {
 static void destroy(void)
 {
 	str query_str;
+#ifdef HAVE_RAW_RING
+	int i;
+#endif
 
 	struct tz_table_list* it=tz_list, *tz_free;
 
@@ -2356,6 +2428,17 @@ static void destroy(void)
                 }
 		close(raw_sock_desc);
 	}
+
+#ifdef HAVE_RAW_RING
+	if (raw_rings) {
+		for (i = 0; i < raw_rings_no; i++) {
+			munmap(raw_rings[i].map, raw_rings[i].map_len);
+			if (raw_rings[i].fd != raw_sock_desc)
+				close(raw_rings[i].fd);
+		}
+		pkg_free(raw_rings);
+	}
+#endif
 }
 
 /**
@@ -5437,25 +5520,106 @@ error:
 
 }
 
-/* Local raw receive loop */
-int raw_capture_rcv_loop(int rsock, int port1, int port2, int ipip) {
-
-
-	static char buf [BUF_SIZE+1];
+/* decodes a raw IP/UDP packet and passes the payload to the SIP core;
+ * buf must have room for one extra byte after the packet */
+static void raw_capture_packet(char *buf, int len, int port1, int port2,
+		int ipip)
+{
 	union sockaddr_union from;
 	union sockaddr_union to;
-        struct receive_info ri;
-	int len;
+	struct receive_info ri;
 	struct ip *iph;
-        struct udphdr *udph;
-        char* udph_start;
-        unsigned short udp_len;
+	struct udphdr *udph;
+	char* udph_start;
+	unsigned short udp_len;
 	int offset = 0;
 	char* end;
 	unsigned short dst_port;
 	unsigned short src_port;
 	struct ip_addr dst_ip, src_ip;
 
+	end=buf+len;
+
+	offset =  ipip ? sizeof(struct ip) : ETHHDR;
+
+	if (len < (sizeof(struct ip)+sizeof(struct udphdr) + offset)) {
+		LM_DBG("received small packet: %d. Ignore it\n",len);
+		return;
+	}
+
+	iph = (struct ip*) (buf + offset);
+
+	offset+=iph->ip_hl*4;
+
+	udph_start = buf+offset;
+
+	udph = (struct udphdr*) udph_start;
+	offset +=sizeof(struct udphdr);
+
+	if ((buf+offset)>end){
+		return;
+	}
+
+	udp_len=ntohs(udph->uh_ulen);
+	if ((udph_start+udp_len)!=end){
+		if ((udph_start+udp_len)>end){
+			return;
+		}else{
+			LM_DBG("udp length too small: %d/%d\n", (int)udp_len, (int)(end-udph_start));
+			return;
+		}
+	}
+	/* cleaup previous values in dst and ri */
+	memset(&dst_ip, 0, sizeof(dst_ip));
+	memset(&ri, 0, sizeof(ri));
+
+	/*FIL IPs*/
+	dst_ip.af=AF_INET;
+	dst_ip.len=4;
+	dst_ip.u.addr32[0]=iph->ip_dst.s_addr;
+	/* fill dst_port */
+	dst_port=ntohs(udph->uh_dport);
+	ip_addr2su(&to, &dst_ip, dst_port);
+	/* fill src_port */
+	src_port=ntohs(udph->uh_sport);
+	src_ip.af=AF_INET;
+	src_ip.len=4;
+	src_ip.u.addr32[0]=iph->ip_src.s_addr;
+	ip_addr2su(&from, &src_ip, src_port);
+	su_setport(&from, src_port);
+
+	ri.src_su=from;
+	su2ip_addr(&ri.src_ip, &from);
+	ri.src_port=src_port;
+	su2ip_addr(&ri.dst_ip, &to);
+	ri.dst_port=dst_port;
+	ri.proto=PROTO_UDP;
+
+	/* cut off the offset */
+	len -= offset;
+
+	if (len<MIN_UDP_PACKET){
+		LM_DBG("probing packet received from\n");
+		return;
+	}
+
+	LM_DBG("PORT: [%d] and [%d]\n", port1, port2);
+
+	if((!port1 && !port2)
+		|| (src_port >= port1 && src_port <= port2) || (dst_port >= port1 && dst_port <= port2)
+		|| (!port2 && (src_port == port1 || dst_port == port1))) {
+		buf[offset+len] = 0;
+		receive_msg(buf+offset, len, &ri, NULL);
+	}
+}
+
+/* Local raw receive loop */
+int raw_capture_rcv_loop(int rsock, int port1, int port2, int ipip) {
+
+
+	static char buf [BUF_SIZE+1];
+	int len;
+
 
 	for(;;) {
 
@@ -5474,85 +5638,265 @@ int raw_capture_rcv_loop(int rsock, int port1, int port2, int ipip) {
                         }
                 }
 
-		end=buf+len;
-
-		offset =  ipip ? sizeof(struct ip) : ETHHDR;
-
-		if (len < (sizeof(struct ip)+sizeof(struct udphdr) + offset)) {
-			LM_DBG("received small packet: %d. Ignore it\n",len);
-                	continue;
-        	}
-
-		iph = (struct ip*) (buf + offset);
-
-		offset+=iph->ip_hl*4;
-
-		udph_start = buf+offset;
-
-		udph = (struct udphdr*) udph_start;
-		offset +=sizeof(struct udphdr);
-
-        	if ((buf+offset)>end){
-                	continue;
-        	}
-
-		udp_len=ntohs(udph->uh_ulen);
-	        if ((udph_start+udp_len)!=end){
-        	        if ((udph_start+udp_len)>end){
-				continue;
-        	        }else{
-                	        LM_DBG("udp length too small: %d/%d\n", (int)udp_len, (int)(end-udph_start));
-	                        continue;
-        	        }
-	        }
-			/* cleaup previous values in dst and ri */
-			memset(&dst_ip, 0, sizeof(dst_ip));
-			memset(&ri, 0, sizeof(ri));
-
-			/*FIL IPs*/
-			dst_ip.af=AF_INET;
-			dst_ip.len=4;
-			dst_ip.u.addr32[0]=iph->ip_dst.s_addr;
-			/* fill dst_port */
-			dst_port=ntohs(udph->uh_dport);
-			ip_addr2su(&to, &dst_ip, dst_port);
-			/* fill src_port */
-			src_port=ntohs(udph->uh_sport);
-			src_ip.af=AF_INET;
-			src_ip.len=4;
-			src_ip.u.addr32[0]=iph->ip_src.s_addr;
-			ip_addr2su(&from, &src_ip, src_port);
-			su_setport(&from, src_port);
-
-			ri.src_su=from;
-			su2ip_addr(&ri.src_ip, &from);
-			ri.src_port=src_port;
-			su2ip_addr(&ri.dst_ip, &to);
-			ri.dst_port=dst_port;
-			ri.proto=PROTO_UDP;
-
-		/* cut off the offset */
-	        len -= offset;
-
-		if (len<MIN_UDP_PACKET){
-                        LM_DBG("probing packet received from\n");
-                        continue;
-                }
+		raw_capture_packet(buf, len, port1, port2, ipip);
+	}
+
+	return 0;
+
+error:
+	return -1;
+
+}
+
+#ifdef HAVE_RAW_RING
+/*
+ * kernel filter for the RAW rings: IPv4, non-fragmented UDP packets with
+ * the source or the destination port in [port_start, port_end]; as for the
+ * plain monitoring socket, the IP of raw_socket_listen is not checked
+ */
+static void raw_ring_bpf(struct sock_filter *code, int port_start,
+		int port_end)
+{
+	struct sock_filter prog[] = {
+		/* 0 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+		/* 1 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, 12),
+		/* 2 */ BPF_STMT(BPF_LD|BPF_B|BPF_ABS, ETHHDR + 9),
+		/* 3 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_UDP, 0, 10),
+		/* 4 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, ETHHDR + 6),
+		/* fragment offset or More Fragments flag set - drop all the
+		 * fragments, the first one included, as we do not reassemble */
+		/* 5 */ BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x3fff, 8, 0),
+		/* 6 */ BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, ETHHDR),
+		/* 7 */ BPF_STMT(BPF_LD|BPF_H|BPF_IND, ETHHDR),
+		/* 8 */ BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, port_start, 0, 1),
+		/* 9 */ BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, port_end, 0, 3),
+		/* 10 */ BPF_STMT(BPF_LD|BPF_H|BPF_IND, ETHHDR + 2),
+		/* 11 */ BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, port_start, 0, 2),
+		/* 12 */ BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, port_end, 1, 0),
+		/* 13 */ BPF_STMT(BPF_RET|BPF_K, 0x0000ffff),
+		/* 14 */ BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+
+	memcpy(code, prog, sizeof prog);
+}
+
+#define RAW_RING_BPF_LEN 15
+
+/* creates and maps one TPACKET_V3 ring; the sockets of the different RAW
+ * processes are joined in a fanout group, hashed by flow */
+static int raw_capture_ring(struct raw_ring *ring, int ifindex,
+		struct sock_fprog *pf, int fanout_id)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll ll;
+	int version = TPACKET_V3;
+	int fanout;
+
+	ring->fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+	if (ring->fd < 0) {
+		LM_ERR("failed to create packet socket: %s (%d)\n",
+			strerror(errno), errno);
+		return -1;
+	}
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION,
+	&version, sizeof version) < 0) {
+		LM_ERR("failed to set TPACKET_V3: %s (%d)\n", strerror(errno), errno);
+		goto error;
+	}
+
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = raw_ring_block_size;
+	req.tp_block_nr = raw_ring_blocks;
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) *
+		req.tp_block_nr;
+	req.tp_retire_blk_tov = RAW_RING_BLOCK_TOV;
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING,
+	&req, sizeof req) < 0) {
+		LM_ERR("failed to set up a %d x %d bytes RX ring: %s (%d)\n",
+			raw_ring_blocks, raw_ring_block_size, strerror(errno), errno);
+		goto error;
+	}
 
-                LM_DBG("PORT: [%d] and [%d]\n", port1, port2);
+	ring->map_len = req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ|PROT_WRITE, MAP_SHARED,
+		ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		LM_ERR("failed to map the RX ring: %s (%d)\n",
+			strerror(errno), errno);
+		ring->map = NULL;
+		goto error;
+	}
+
+	/* the filter goes first, so nothing unwanted lands in the ring */
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	pf, sizeof *pf) < 0) {
+		LM_ERR("failed to attach the port filter: %s (%d)\n",
+			strerror(errno), errno);
+		goto error;
+	}
+
+	memset(&ll, 0, sizeof ll);
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_IP);
+	ll.sll_ifindex = ifindex;
+	if (bind(ring->fd, (struct sockaddr *)&ll, sizeof ll) < 0) {
+		LM_ERR("failed to bind packet socket: %s (%d)\n",
+			strerror(errno), errno);
+		goto error;
+	}
 
-		if((!port1 && !port2)
-		        || (src_port >= port1 && src_port <= port2) || (dst_port >= port1 && dst_port <= port2)
-		        || (!port2 && (src_port == port1 || dst_port == port1)))
-		                          receive_msg(buf+offset, len, &ri, NULL);
+	if (fanout_id >= 0) {
+		fanout = fanout_id | (PACKET_FANOUT_HASH << 16);
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT,
+		&fanout, sizeof fanout) < 0) {
+			LM_ERR("failed to join fanout group %d: %s (%d)\n",
+				fanout_id, strerror(errno), errno);
+			goto error;
+		}
 	}
 
 	return 0;
+error:
+	if (ring->map)
+		munmap(ring->map, ring->map_len);
+	close(ring->fd);
+	return -1;
+}
+
+static int raw_capture_rings(str* iface, int port_start, int port_end,
+		int rings_no)
+{
+	struct sock_filter code[RAW_RING_BPF_LEN];
+	struct sock_fprog pf;
+	char ifname[IFNAMSIZ];
+	int ifindex = 0;
+	int i;
+
+	if (raw_ring_blocks <= 0 || raw_ring_block_size <= 0 ||
+	raw_ring_block_size % getpagesize()) {
+		LM_ERR("bad ring size: %d blocks of %d bytes (must be a multiple "
+			"of the page size)\n", raw_ring_blocks, raw_ring_block_size);
+		return -1;
+	}
+
+	if (iface) {
+		if (iface->len >= IFNAMSIZ) {
+			LM_ERR("bad interface name %.*s\n", iface->len, iface->s);
+			return -1;
+		}
+		memcpy(ifname, iface->s, iface->len);
+		ifname[iface->len] = 0;
+		ifindex = if_nametoindex(ifname);
+		if (!ifindex) {
+			LM_ERR("unknown interface %s\n", ifname);
+			return -1;
+		}
+	}
+
+	raw_ring_bpf(code, port_start, port_end ? port_end : port_start);
+	pf.len = RAW_RING_BPF_LEN;
+	pf.filter = code;
+
+	raw_rings = pkg_malloc(rings_no * sizeof *raw_rings);
+	if (!raw_rings) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
 
+	for (raw_rings_no = 0; raw_rings_no < rings_no; raw_rings_no++)
+		if (raw_capture_ring(&raw_rings[raw_rings_no], ifindex, &pf,
+		rings_no > 1 ? (getpid() & 0xffff) : -1) < 0)
+			goto error;
+
+	LM_DBG("created %d RAW rings of %d x %d bytes\n", raw_rings_no,
+		raw_ring_blocks, raw_ring_block_size);
+	return 0;
 error:
+	for (i = 0; i < raw_rings_no; i++) {
+		munmap(raw_rings[i].map, raw_rings[i].map_len);
+		close(raw_rings[i].fd);
+	}
+	pkg_free(raw_rings);
+	raw_rings = NULL;
+	raw_rings_no = 0;
 	return -1;
+}
+
+static void raw_ring_stats(struct raw_ring *ring)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof st;
+
+	/* the kernel resets the counters on each read */
+	if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+		LM_DBG("failed to get ring statistics: %s (%d)\n",
+			strerror(errno), errno);
+		return;
+	}
+
+#ifdef STATISTICS
+	update_stat(raw_ring_packets, st.tp_packets);
+	update_stat(raw_ring_drops, st.tp_drops);
+	update_stat(raw_ring_freezes, st.tp_freeze_q_cnt);
+#endif
+}
+
+/* RAW receive loop over a TPACKET_V3 ring: whole blocks of packets are
+ * handed over by the kernel, without any per-packet syscall */
+static int raw_capture_ring_loop(struct raw_ring *ring, int port1, int port2)
+{
+	static char buf[BUF_SIZE+1];
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ph;
+	struct pollfd pfd;
+	unsigned int block = 0, i;
+	utime_t last_stats = 0;
+
+	pfd.fd = ring->fd;
+	pfd.events = POLLIN|POLLERR;
+	pfd.revents = 0;
+
+	for (;;) {
+		if (get_ticks() - last_stats >= RAW_RING_STATS_INTERVAL) {
+			raw_ring_stats(ring);
+			last_stats = get_ticks();
+		}
+
+		bd = (struct tpacket_block_desc *)(ring->map +
+			block * raw_ring_block_size);
 
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+			if (poll(&pfd, 1, RAW_RING_STATS_INTERVAL * 1000) < 0 &&
+			errno != EINTR) {
+				LM_ERR("poll: %s [%d]\n", strerror(errno), errno);
+				return -1;
+			}
+			continue;
+		}
+
+		ph = (struct tpacket3_hdr *)((char *)bd +
+			bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			/* the parser needs a writable, 0 terminated buffer */
+			if (ph->tp_snaplen <= BUF_SIZE) {
+				memcpy(buf, (char *)ph + ph->tp_mac, ph->tp_snaplen);
+				raw_capture_packet(buf, ph->tp_snaplen, port1, port2, 0);
+			}
+			ph = (struct tpacket3_hdr *)((char *)ph + ph->tp_next_offset);
+		}
+
+		/* give the block back to the kernel */
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		block = (block + 1) % raw_ring_blocks;
+	}
+
+	return 0;
 }
+#endif
 
 #undef QUERY_BUF
 #undef QUERY_LEN
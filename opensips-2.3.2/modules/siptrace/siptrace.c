@@ -26,6 +26,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include "../../net/net_tcp.h"
 #include "../../sr_module.h"
 #include "../../dprint.h"
@@ -98,6 +101,22 @@ static unsigned short trace_local_port = 0;
 
 tlist_elem_p trace_list=NULL;
 
+/* trace pipeline: when trace processes are configured, the SIP workers
+ * only copy the trace records into a shm ring and the trace processes do
+ * the actual HEP/SIP/DB output */
+static int trace_procs_no = 0;
+static int trace_ring_size = 1024;
+static int trace_ring_slot_size = 4096;
+static int trace_sampling = 100;
+
+static st_ring_t *st_ring = NULL;
+
+/* db_vals[] indexes of the string columns kept in a ring record */
+static const int st_rec_cols[ST_REC_STRS] = {0, 1, 2, 3, 4, 5, 7, 8, 12, 13};
+
+/* max records drained in a burst */
+#define ST_DRAIN_BURST 256
+
 static const char* corr_id_s="correlation_id";
 static int corr_vendor = -1;
 static int corr_id=-1;
@@ -156,6 +175,9 @@ static int parse_trace_id(unsigned int type, void *val);
 void free_trace_info_pkg(void *param);
 void free_trace_info_shm(void *param);
 
+static void trace_process(int rank);
+static int st_ring_init(void);
+
 
 
 
@@ -196,6 +218,10 @@ static param_export_t params[] = {
 	{"direction_column",   STR_PARAM, &direction_column.s   },
 	{"trace_on",           INT_PARAM, &trace_on             },
 	{"trace_local_ip",     STR_PARAM, &trace_local_ip.s     },
+	{"trace_processes",    INT_PARAM, &trace_procs_no       },
+	{"trace_ring_size",    INT_PARAM, &trace_ring_size      },
+	{"trace_ring_slot_size", INT_PARAM, &trace_ring_slot_size },
+	{"trace_sampling",     INT_PARAM, &trace_sampling       },
 	{0, 0, 0}
 };
 
@@ -210,14 +236,21 @@ static mi_export_t mi_cmds[] = {
 
 stat_var* siptrace_req;
 stat_var* siptrace_rpl;
+stat_var* siptrace_dropped;
 
 static stat_export_t siptrace_stats[] = {
 	{"traced_requests" ,  0,  &siptrace_req  },
 	{"traced_replies"  ,  0,  &siptrace_rpl  },
+	{"dropped_traces"  ,  0,  &siptrace_dropped },
 	{0,0,0}
 };
 #endif
 
+static proc_export_t procs[] = {
+	{"SIP trace",  0,  0, trace_process, 0, PROC_FLAG_INITCHILD},
+	{0,0,0,0,0,0}
+};
+
 static module_dependency_t *get_deps_hep(param_export_t *param)
 {
 	tlist_elem_p it;
@@ -259,7 +292,7 @@ struct module_exports exports = {
 #endif
 	mi_cmds,    /* exported MI functions */
 	0,          /* exported pseudo-variables */
-	0,          /* extra processes */
+	procs,      /* extra processes */
 	mod_init,   /* module initialization function */
 	0,          /* response function */
 	destroy,    /* destroy function */
@@ -822,6 +855,18 @@ static int mod_init(void)
 		LM_WARN("No trace id defined! The module is useless!\n");
 	}
 
+	if (trace_sampling < 1 || trace_sampling > 100) {
+		LM_ERR("invalid trace_sampling %d, must be between 1 and 100\n",
+			trace_sampling);
+		return -1;
+	}
+
+	if (trace_procs_no > 0 && st_ring_init() < 0) {
+		LM_ERR("failed to init the trace ring\n");
+		return -1;
+	}
+	procs[0].no = st_ring ? trace_procs_no : 0;
+
 	/* this makes sense only if trace protocol is loaded */
 	if ( tprot.send_message ) {
 		sip_trace_id=register_traced_type(SIP_TRACE_TYPE_STR);
@@ -895,6 +940,13 @@ static void destroy(void)
 
 	if (trace_on_flag)
 		shm_free(trace_on_flag);
+
+	if (st_ring) {
+		close(st_ring->wake_fd[0]);
+		close(st_ring->wake_fd[1]);
+		shm_free(st_ring->slots);
+		shm_free(st_ring);
+	}
 }
 
 
@@ -925,28 +977,18 @@ static inline int insert_siptrace(st_db_struct_t *st_db,
 }
 
 
-static int save_siptrace(struct sip_msg *msg, db_key_t *keys, db_val_t *vals,
-				trace_info_p info)
+/*
+ * does the actual output of a trace record (kept in db_vals[]) to all the
+ * destinations of its trace id; called either inline, by the SIP workers,
+ * or by the trace processes, for the records drained from the ring
+ */
+static int dispatch_siptrace(str *correlation, db_key_t *keys,
+				db_val_t *vals, trace_info_p info)
 {
 	unsigned int hash;
 
 	tlist_elem_p it;
 
-	if (!info || !info->trace_list) {
-		LM_ERR("invalid trace info!\n");
-		return -1;
-	}
-
-	if (!(*trace_on_flag)) {
-		LM_DBG("trace is off!\n");
-		return 0;
-	}
-
-	/* makes sense only if trace protocol loaded */
-	if ( tprot.send_message && !is_id_traced(sip_trace_id, info)) {
-		return 1;
-	}
-
 	hash = info->trace_list->hash;
 	/* check where the hash matches and take the proper action */
 	for (it=info->trace_list; it && (it->hash == hash); it=it->next) {
@@ -955,7 +997,7 @@ static int save_siptrace(struct sip_msg *msg, db_key_t *keys, db_val_t *vals,
 
 		switch (it->type) {
 		case TYPE_HEP:
-			if (send_trace_proto_duplicate( it->el.hep.hep_id, &msg->callid->body, info) < 0) {
+			if (send_trace_proto_duplicate( it->el.hep.hep_id, correlation, info) < 0) {
 				LM_ERR("Failed to duplicate with hep to <%.*s:%u>\n",
 						it->el.hep.hep_id->ip.len, it->el.hep.hep_id->ip.s,
 						it->el.hep.hep_id->port_no);
@@ -992,6 +1034,292 @@ static int save_siptrace(struct sip_msg *msg, db_key_t *keys, db_val_t *vals,
 	return 0;
 }
 
+
+static int st_ring_init(void)
+{
+	unsigned int size, i;
+
+	if (trace_ring_size <= 0 || trace_ring_slot_size <= 0) {
+		LM_ERR("invalid trace ring size %d/%d\n",
+			trace_ring_size, trace_ring_slot_size);
+		return -1;
+	}
+
+	/* round the number of slots up to a power of 2 */
+	for (size = 1; size < trace_ring_size; size <<= 1);
+
+	st_ring = shm_malloc(sizeof *st_ring);
+	if (!st_ring) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(st_ring, 0, sizeof *st_ring);
+
+	st_ring->mask = size - 1;
+	st_ring->stride = (sizeof(st_ring_rec_t) + trace_ring_slot_size +
+		sizeof(long) - 1) & ~(sizeof(long) - 1);
+
+	st_ring->slots = shm_malloc(size * st_ring->stride);
+	if (!st_ring->slots) {
+		LM_ERR("no more shm memory for %u x %u bytes trace ring\n",
+			size, st_ring->stride);
+		shm_free(st_ring);
+		st_ring = NULL;
+		return -1;
+	}
+
+	/* slot i is free for the producer reaching position i */
+	for (i = 0; i < size; i++)
+		ST_RING_SLOT(st_ring, i)->seq = i;
+
+	/* the SIP workers must never block on waking up a trace process */
+	if (pipe(st_ring->wake_fd) < 0 ||
+	fcntl(st_ring->wake_fd[1], F_SETFL, O_NONBLOCK) < 0) {
+		LM_ERR("failed to create the trace wake up pipe: %s\n",
+			strerror(errno));
+		shm_free(st_ring->slots);
+		shm_free(st_ring);
+		st_ring = NULL;
+		return -1;
+	}
+
+	LM_DBG("trace ring of %u slots, %u bytes each\n", size, st_ring->stride);
+	return 0;
+}
+
+/*
+ * wakes up one of the idle trace processes, if any
+ */
+static inline void st_ring_wake(void)
+{
+	char c = 0;
+	int n;
+
+	while ((n = st_ring->sleepers) > 0) {
+		if (__sync_bool_compare_and_swap(&st_ring->sleepers, n, n - 1)) {
+			if (write(st_ring->wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+				LM_ERR("failed to wake up a trace process: %s\n",
+					strerror(errno));
+			return;
+		}
+	}
+}
+
+/*
+ * copies the current trace record (db_vals[] + info) into the ring, without
+ * taking any lock (bounded MPMC queue: a slot is owned by the process which
+ * moved the head / tail over it, its sequence tells when it may be reused)
+ *
+ * returns 0 if queued, 1 if the ring is full and -1 if the record does not
+ * fit into a slot
+ */
+static int st_ring_push(trace_info_p info)
+{
+	st_ring_rec_t *rec;
+	unsigned int pos, len, i;
+	str *col;
+	char *p;
+	int diff;
+
+	len = 0;
+	for (i = 0; i < ST_REC_STRS - 1; i++)
+		len += db_vals[st_rec_cols[i]].val.str_val.len;
+	if (info->trace_attrs)
+		len += info->trace_attrs->len;
+	if (len > trace_ring_slot_size)
+		return -1;
+
+	pos = st_ring->head;
+	for (;;) {
+		rec = ST_RING_SLOT(st_ring, pos);
+		diff = (int)(rec->seq - pos);
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&st_ring->head, pos, pos + 1))
+				break;
+			pos = st_ring->head;
+		} else if (diff < 0) {
+			/* the slot still holds a record from the previous lap */
+			return 1;
+		} else {
+			pos = st_ring->head;
+		}
+	}
+
+	rec->trace_list = info->trace_list;
+	rec->conn_id = info->conn_id;
+	rec->date = db_vals[10].val.time_val;
+	rec->fromport = db_vals[6].val.int_val;
+	rec->toport = db_vals[9].val.int_val;
+	strncpy(rec->direction, db_vals[11].val.string_val,
+		sizeof rec->direction - 1);
+	rec->direction[sizeof rec->direction - 1] = 0;
+	rec->has_attrs = info->trace_attrs ? 1 : 0;
+
+	p = (char *)(rec + 1);
+	for (i = 0; i < ST_REC_STRS; i++) {
+		if (i == ST_REC_STRS - 1)
+			col = info->trace_attrs;
+		else
+			col = &db_vals[st_rec_cols[i]].val.str_val;
+
+		if (!col || col->len <= 0) {
+			rec->lens[i] = 0;
+			continue;
+		}
+
+		memcpy(p, col->s, col->len);
+		rec->lens[i] = col->len;
+		p += col->len;
+	}
+
+	/* publish the record */
+	__sync_synchronize();
+	rec->seq = pos + 1;
+
+	__sync_synchronize();
+	if (st_ring->sleepers > 0)
+		st_ring_wake();
+
+	return 0;
+}
+
+/*
+ * takes one record out of the ring and sends it to its destinations
+ * returns 0 if the ring was empty, 1 otherwise
+ */
+static int st_ring_pop(void)
+{
+	st_ring_rec_t *rec;
+	trace_info_t info;
+	str attrs;
+	unsigned int pos, i;
+	char *p;
+	int diff;
+
+	pos = st_ring->tail;
+	for (;;) {
+		rec = ST_RING_SLOT(st_ring, pos);
+		diff = (int)(rec->seq - (pos + 1));
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&st_ring->tail, pos, pos + 1))
+				break;
+			pos = st_ring->tail;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = st_ring->tail;
+		}
+	}
+	__sync_synchronize();
+
+	/* rebuild the columns, pointing into the slot */
+	p = (char *)(rec + 1);
+	for (i = 0; i < ST_REC_STRS - 1; i++) {
+		db_vals[st_rec_cols[i]].val.str_val.s = p;
+		db_vals[st_rec_cols[i]].val.str_val.len = rec->lens[i];
+		p += rec->lens[i];
+	}
+	attrs.s = p;
+	attrs.len = rec->lens[ST_REC_STRS - 1];
+
+	db_vals[6].val.int_val = rec->fromport;
+	db_vals[9].val.int_val = rec->toport;
+	db_vals[10].val.time_val = rec->date;
+	db_vals[11].val.string_val = rec->direction;
+
+	memset(&info, 0, sizeof info);
+	info.trace_list = rec->trace_list;
+	info.conn_id = rec->conn_id;
+	info.trace_attrs = rec->has_attrs ? &attrs : NULL;
+
+	if (dispatch_siptrace(&db_vals[1].val.str_val, db_keys, db_vals,
+	&info) < 0)
+		LM_ERR("failed to save siptrace\n");
+
+	/* release the slot for the next lap */
+	__sync_synchronize();
+	rec->seq = pos + st_ring->mask + 1;
+
+	return 1;
+}
+
+static void trace_process(int rank)
+{
+	char c;
+	int n;
+
+	LM_DBG("trace process %d started\n", rank);
+
+	for (;;) {
+		for (n = 0; n < ST_DRAIN_BURST && st_ring_pop(); n++);
+		if (n > 0)
+			continue;
+
+		/* the ring is empty - go idle, but look at it once more after
+		 * doing so, as a record pushed meanwhile may have found nobody
+		 * to wake up */
+		__sync_fetch_and_add(&st_ring->sleepers, 1);
+		if (st_ring_pop()) {
+			/* if a producer took our place already, its wake up byte
+			 * is left in the pipe and some later sleep is just shorter */
+			while ((n = st_ring->sleepers) > 0 &&
+			!__sync_bool_compare_and_swap(&st_ring->sleepers, n, n - 1));
+			continue;
+		}
+
+		while (read(st_ring->wake_fd[0], &c, 1) < 0 && errno == EINTR);
+	}
+}
+
+
+static int save_siptrace(struct sip_msg *msg, db_key_t *keys, db_val_t *vals,
+				trace_info_p info)
+{
+	int rc;
+
+	if (!info || !info->trace_list) {
+		LM_ERR("invalid trace info!\n");
+		return -1;
+	}
+
+	if (!(*trace_on_flag)) {
+		LM_DBG("trace is off!\n");
+		return 0;
+	}
+
+	/* makes sense only if trace protocol loaded */
+	if ( tprot.send_message && !is_id_traced(sip_trace_id, info)) {
+		return 1;
+	}
+
+	/* sample whole calls, based on the Call-ID */
+	if (trace_sampling < 100 &&
+	core_hash(&msg->callid->body, NULL, 0) % 100 >= trace_sampling) {
+		LM_DBG("call not sampled for tracing\n");
+		return 1;
+	}
+
+	if (st_ring) {
+		rc = st_ring_push(info);
+		if (rc == 0)
+			return 0;
+
+		if (rc > 0) {
+			LM_DBG("trace ring is full, dropping record\n");
+#ifdef STATISTICS
+			update_stat(siptrace_dropped, 1);
+#endif
+			return 0;
+		}
+
+		/* too large for a ring slot, do it inline */
+		LM_DBG("record of %d bytes does not fit in the trace ring\n",
+			db_vals[0].val.str_val.len);
+	}
+
+	return dispatch_siptrace(&msg->callid->body, keys, vals, info);
+}
+
 static void trace_transaction_dlgcb(struct dlg_cell* dlg, int type,
 		struct dlg_cb_params * params)
 {
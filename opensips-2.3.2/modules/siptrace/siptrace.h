@@ -97,6 +97,41 @@ typedef struct trace_info {
 	unsigned long long conn_id;
 } trace_info_t, *trace_info_p;
 
+/* string columns copied into a trace ring record */
+#define ST_REC_STRS 10
+
+/*
+ * trace record, as queued in the shm ring by the SIP workers and drained
+ * by the trace processes; the variable part (the string columns) follows
+ * the header, in the order given by st_rec_cols[]
+ */
+typedef struct st_ring_rec {
+	volatile unsigned int seq;   /* slot sequence, see st_ring_push() */
+	tlist_elem_p trace_list;
+	unsigned long long conn_id;
+	time_t date;
+	int fromport;
+	int toport;
+	char direction[4];
+	char has_attrs;
+	unsigned int lens[ST_REC_STRS];
+} st_ring_rec_t;
+
+typedef struct st_ring {
+	volatile unsigned int head;  /* next slot to be filled */
+	char pad1[60];
+	volatile unsigned int tail;  /* next slot to be drained */
+	char pad2[60];
+	volatile int sleepers;       /* idle trace processes, not yet woken up */
+	int wake_fd[2];              /* pipe the idle trace processes block on */
+	unsigned int mask;
+	unsigned int stride;         /* size of a slot, header included */
+	char *slots;
+} st_ring_t;
+
+#define ST_RING_SLOT(_r, _pos) \
+	((st_ring_rec_t *)((_r)->slots + ((_pos) & (_r)->mask) * (_r)->stride))
+
 /* maximum 32 types to trace; this way we'll
  * be able to know all types by having set bits into an integer value */
 #define MAX_TRACE_NAMES (sizeof(int) * 8)
@@ -23,6 +23,11 @@
  *  2015-09-xx  initial version (Vlad Patrascu)
 */
 
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
 #include "../../sr_module.h"
 #include "../../dprint.h"
 #include "../../mem/mem.h"
@@ -32,6 +37,11 @@
 #include "../../locking.h"
 #include "../../rw_locking.h"
 #include "../../timer.h"
+#include "../../pt.h"
+#include "../../route.h"
+#include "../../async.h"
+#include "../../ipc.h"
+#include "../../mod_fix.h"
 #include "sql_cacher.h"
 
 static int mod_init(void);
@@ -42,6 +52,9 @@ int pv_parse_name(pv_spec_p sp, str *in);
 int pv_init_param(pv_spec_p sp, int param);
 int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t *res);
 static int parse_cache_entry(unsigned int type, void *val);
+static int w_sql_cacher_load(struct sip_msg *msg, char *id, char *key);
+static int w_async_sql_cacher_load(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *key);
 
 static struct mi_root* mi_reload(struct mi_root *cmd_tree, void *param);
 
@@ -51,9 +64,13 @@ static str columns_delimiter = str_init(DEFAULT_COLUMNS_DELIM);
 static int fetch_nr_rows = DEFAULT_FETCH_NR_ROWS;
 static int full_caching_expire = DEFAULT_FULL_CACHING_EXPIRE;
 static int reload_interval = DEFAULT_RELOAD_INTERVAL;
+static int negative_expire = DEFAULT_NEGATIVE_EXPIRE;
+static int stale_window = 0;
 
 static cache_entry_t **entry_list;
 static struct queried_key **queries_in_progress;
+/* IPC job resuming the async loads parked in a process */
+static int sf_ipc_type = -1;
 
 /* per process db handlers corresponding to cache entries in entry_list */
 static db_handlers_t *db_hdls_list;
@@ -68,10 +85,26 @@ static param_export_t mod_params[] = {
 	{"sql_fetch_nr_rows", INT_PARAM, &fetch_nr_rows},
 	{"full_caching_expire", INT_PARAM, &full_caching_expire},
 	{"reload_interval", INT_PARAM, &reload_interval},
+	{"on_demand_negative_expire", INT_PARAM, &negative_expire},
+	{"on_demand_stale_window", INT_PARAM, &stale_window},
 	{"cache_table", STR_PARAM|USE_FUNC_PARAM, (void *)&parse_cache_entry},
 	{0,0,0}
 };
 
+static cmd_export_t cmds[] = {
+	{"sql_cacher_load", (cmd_function)w_sql_cacher_load, 2,
+		fixup_spve_spve, 0,
+		REQUEST_ROUTE|FAILURE_ROUTE|BRANCH_ROUTE|ONREPLY_ROUTE|LOCAL_ROUTE|
+		STARTUP_ROUTE|TIMER_ROUTE|EVENT_ROUTE},
+	{0,0,0,0,0,0}
+};
+
+static acmd_export_t acmds[] = {
+	{"sql_cacher_load", (acmd_function)w_async_sql_cacher_load, 2,
+		fixup_spve_spve},
+	{0,0,0,0}
+};
+
 static pv_export_t mod_items[] = {
 	{{"sql_cached_value", sizeof("sql_cached_value") - 1}, 1000,
 		pv_get_sql_cached_value, 0, pv_parse_name, 0, 0, 0},
@@ -103,8 +136,8 @@ struct module_exports exports = {
 	MODULE_VERSION,
 	DEFAULT_DLFLAGS,			/* dlopen flags */
 	&deps,						/* OpenSIPS module dependencies */
-	0,							/* exported functions */
-	0,							/* exported async functions */
+	cmds,						/* exported functions */
+	acmds,						/* exported async functions */
 	mod_params,					/* exported parameters */
 	0,							/* exported statistics */
 	mi_cmds,					/* exported MI functions */
@@ -590,7 +623,8 @@ static int insert_in_cachedb(cache_entry_t *c_entry, db_handlers_t *db_hdls, db_
 	memcpy(cdb_key.s, c_entry->id.s, c_entry->id.len);
 	memcpy(cdb_key.s + c_entry->id.len, str_key.s, str_key.len);
 
-	if (db_hdls->cdbf.set(db_hdls->cdbcon, &cdb_key, &cdb_val, c_entry->expire) < 0) {
+	if (db_hdls->cdbf.set(db_hdls->cdbcon, &cdb_key, &cdb_val,
+		c_entry->on_demand ? c_entry->expire + stale_window : c_entry->expire) < 0) {
 		LM_ERR("Failed to insert the values for key: %.*s in cachedb\n",
 			str_key.len, str_key.s);
 		return -1;
@@ -811,21 +845,248 @@ error:
  * -1 - error
  * -2 - not found in sql db
  */
-static int load_key(cache_entry_t *c_entry, db_handlers_t *db_hdls, str key, db_val_t **values, db_res_t **sql_res)
+/* single-flight registry of the on demand loads in progress: only the first
+ * process missing a key queries the SQL DB, the others wait for its result
+ *
+ * returns SF_LOADER or SF_WAITER with @qk set, SF_SELF if the key is being
+ * loaded asynchronously by this very process (which must not wait for
+ * itself) or -1 on error. With @no_wait, SF_WAITER is returned without
+ * @qk, the caller only wants to know that the key is being loaded.
+ *
+ * With @park_fd, the caller is an async load which must not block: if the
+ * key is already being loaded, SF_PARKED is returned with @park_fd set to
+ * a file descriptor which becomes readable once the load is over */
+static int sf_start_load(str *src_key, int no_wait, struct queried_key **qk,
+															int *park_fd)
+{
+	struct queried_key *it;
+	struct sf_parked *p;
+	int fds[2];
+
+	*qk = NULL;
+
+	lock_get(queries_lock);
+
+	for (it = *queries_in_progress; it; it = it->next)
+		if (it->key.len == src_key->len &&
+			!memcmp(it->key.s, src_key->s, src_key->len))
+			break;
+	if (it) {
+		if (park_fd) {
+			p = shm_malloc(sizeof *p);
+			if (!p) {
+				LM_ERR("No more shm memory\n");
+				goto error;
+			}
+			if (pipe(fds) < 0) {
+				LM_ERR("failed to create pipe: %s\n", strerror(errno));
+				shm_free(p);
+				goto error;
+			}
+			p->proc_no = process_no;
+			p->notify_fd = fds[1];
+			p->next = it->parked;
+			it->parked = p;
+			lock_release(queries_lock);
+
+			*park_fd = fds[0];
+			return SF_PARKED;
+		}
+		if (it->async_proc == process_no) {
+			lock_release(queries_lock);
+			return SF_SELF;
+		}
+		if (!no_wait) {
+			it->nr_waiting_procs++;
+			*qk = it;
+		}
+		lock_release(queries_lock);
+		return SF_WAITER;
+	}
+
+	it = shm_malloc(sizeof(struct queried_key) + src_key->len);
+	if (!it) {
+		LM_ERR("No more shm memory\n");
+		goto error;
+	}
+	it->key.s = (char *)(it + 1);
+	it->key.len = src_key->len;
+	memcpy(it->key.s, src_key->s, src_key->len);
+	it->nr_waiting_procs = 0;
+	it->async_proc = park_fd ? process_no : -1;
+	it->parked = NULL;
+
+	it->wait_sql_query = lock_alloc();
+	if (!it->wait_sql_query) {
+		LM_ERR("No more memory for wait_sql_query lock\n");
+		shm_free(it);
+		goto error;
+	}
+	if (!lock_init(it->wait_sql_query)) {
+		LM_ERR("Failed to init wait_sql_query lock\n");
+		lock_dealloc(it->wait_sql_query);
+		shm_free(it);
+		goto error;
+	}
+	lock_get(it->wait_sql_query);
+
+	it->next = *queries_in_progress;
+	*queries_in_progress = it;
+
+	lock_release(queries_lock);
+
+	*qk = it;
+	return SF_LOADER;
+error:
+	lock_release(queries_lock);
+	return -1;
+}
+
+static void sf_free(struct queried_key *qk)
+{
+	lock_destroy(qk->wait_sql_query);
+	lock_dealloc(qk->wait_sql_query);
+	shm_free(qk);
+}
+
+/* runs in the process of the parked async load */
+static void sf_unpark(struct sf_parked *p)
+{
+	char c = 0;
+
+	while (write(p->notify_fd, &c, 1) < 0 && errno == EINTR);
+	close(p->notify_fd);
+	shm_free(p);
+}
+
+static void sf_unpark_ipc(int sender, void *param)
+{
+	sf_unpark((struct sf_parked *)param);
+}
+
+/* called by the loading process, once the result is in cachedb */
+static void sf_end_load(struct queried_key *qk)
+{
+	struct queried_key **it;
+	struct sf_parked *p, *next;
+	int no_waiters;
+
+	lock_get(queries_lock);
+
+	for (it = queries_in_progress; *it; it = &(*it)->next)
+		if (*it == qk) {
+			*it = qk->next;
+			break;
+		}
+	/* unlinked, so nobody else can start waiting for it */
+	no_waiters = (qk->nr_waiting_procs == 0);
+	p = qk->parked;
+	qk->parked = NULL;
+	lock_release(qk->wait_sql_query);
+
+	lock_release(queries_lock);
+
+	if (no_waiters)
+		sf_free(qk);
+
+	/* the pipes of the parked loads are only open in their own process */
+	for (; p; p = next) {
+		next = p->next;
+		if (p->proc_no == process_no) {
+			sf_unpark(p);
+		} else if (ipc_send_job(p->proc_no, sf_ipc_type, p) < 0) {
+			LM_ERR("failed to resume the async load parked in process %d\n",
+				p->proc_no);
+			shm_free(p);
+		}
+	}
+}
+
+static void sf_wait_load(struct queried_key *qk)
+{
+	int last;
+
+	lock_get(qk->wait_sql_query);
+	lock_release(qk->wait_sql_query);
+
+	lock_get(queries_lock);
+	last = (--qk->nr_waiting_procs == 0);
+	lock_release(queries_lock);
+
+	if (last)
+		sf_free(qk);
+}
+
+/*  return:
+ *  0 - succes, the row was cached
+ * -1 - error
+ * -2 - not found in sql db (cached as such if negative caching is enabled)
+ */
+static int cache_key_row(cache_entry_t *c_entry, db_handlers_t *db_hdls, str *key,
+							db_res_t *sql_res, db_val_t **values)
 {
-	db_key_t key_col;
 	db_row_t *row;
 	db_val_t key_val;
 	str src_key, null_val;
+	int rc;
 
-	src_key.len = c_entry->id.len + key.len;
-	src_key.s = pkg_malloc(src_key.len);
-	if (!src_key.s) {
-		LM_ERR("No more shm memory\n");
+	if (RES_ROW_N(sql_res) == 0) {
+		LM_DBG("key %.*s not found in SQL db\n", key->len, key->s);
+		if (negative_expire == 0)
+			return -2;
+
+		src_key.len = c_entry->id.len + key->len;
+		src_key.s = pkg_malloc(src_key.len);
+		if (!src_key.s) {
+			LM_ERR("No more pkg memory\n");
+			return -1;
+		}
+		memcpy(src_key.s, c_entry->id.s, c_entry->id.len);
+		memcpy(src_key.s + c_entry->id.len, key->s, key->len);
+
+		null_val.len = 0;
+		null_val.s = NULL;
+		rc = db_hdls->cdbf.set(db_hdls->cdbcon, &src_key, &null_val,
+			negative_expire > 0 ? negative_expire : c_entry->expire);
+		pkg_free(src_key.s);
+		if (rc < 0) {
+			LM_ERR("Failed to insert null in cachedb\n");
+			return -1;
+		}
+
+		return -2;
+	} else if (RES_ROW_N(sql_res) > 1) {
+		LM_ERR("Too many rows returned\n");
 		return -1;
 	}
-	memcpy(src_key.s, c_entry->id.s, c_entry->id.len);
-	memcpy(src_key.s + c_entry->id.len, key.s, key.len);
+
+	row = RES_ROWS(sql_res);
+	*values = ROW_VALUES(row);
+
+	if (c_entry->nr_ints + c_entry->nr_strs == 0 &&
+		get_column_types(c_entry, *values, ROW_N(row)) < 0) {
+		LM_ERR("SQL column has unsupported type\n");
+		return -1;
+	}
+
+	VAL_NULL(&key_val) = 0;
+	VAL_TYPE(&key_val) = DB_STR;
+	VAL_STR(&key_val) = *key;
+
+	/* for on demand entries, the header keeps the time the value goes stale */
+	if (insert_in_cachedb(c_entry, db_hdls, &key_val, *values,
+		(int)time(NULL) + c_entry->expire, ROW_N(row)) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* on success, the SQL result must be freed by the caller */
+static int load_key(cache_entry_t *c_entry, db_handlers_t *db_hdls, str key, db_val_t **values, db_res_t **sql_res)
+{
+	db_key_t key_col;
+	db_val_t key_val;
+	int rc;
 
 	key_col = &(c_entry->key);
 	VAL_NULL(&key_val) = 0;
@@ -847,42 +1108,19 @@ static int load_key(cache_entry_t *c_entry, db_handlers_t *db_hdls, str key, db_
 		goto sql_error;
 	}
 
-	if (RES_ROW_N(*sql_res) == 0) {
-		LM_DBG("key %.*s not found in SQL db\n", key.len, key.s);
-		null_val.len = 0;
-		null_val.s = NULL;
-		if (db_hdls->cdbf.set(db_hdls->cdbcon, &src_key, &null_val, c_entry->expire) < 0) {
-			LM_ERR("Failed to insert null in cachedb\n");
-			pkg_free(src_key.s);
-			goto sql_error;
-		}
-		pkg_free(src_key.s);
-
+	rc = cache_key_row(c_entry, db_hdls, &key, *sql_res, values);
+	if (rc != 0) {
 		db_hdls->db_funcs.free_result(db_hdls->db_con, *sql_res);
-		return -2;
-
-	} else if (RES_ROW_N(*sql_res) > 1) {
-		LM_ERR("To many columns returned\n");
-		goto sql_error;
+		*sql_res = NULL;
 	}
 
-	row = RES_ROWS(*sql_res);
-	*values = ROW_VALUES(row);
-
-	if (c_entry->nr_ints + c_entry->nr_strs == 0 &&
-		get_column_types(c_entry, *values, ROW_N(row)) < 0) {
-		LM_ERR("SQL column has unsupported type\n");
-		goto sql_error;
-	}
-
-	if (insert_in_cachedb(c_entry, db_hdls, &key_val, *values, 0, ROW_N(row)) < 0)
-		return -1;
-
-	return 0;
+	return rc;
 
 sql_error:
-	if (*sql_res)
+	if (*sql_res) {
 		db_hdls->db_funcs.free_result(db_hdls->db_con, *sql_res);
+		*sql_res = NULL;
+	}
 	return -1;
 }
 
@@ -935,7 +1173,7 @@ static struct mi_root* mi_reload(struct mi_root *root, void *param)
 	struct queried_key *it;
 	str entry_id, key, src_key;
 	str rld_vers_key;
-	int rld_vers = 0, rc;
+	int rld_vers = 0, rc, sf_rc;
 
 	/* cache entry id */
 	node = root->node.kids;
@@ -974,25 +1212,18 @@ static struct mi_root* mi_reload(struct mi_root *root, void *param)
 		memcpy(src_key.s, c_entry->id.s, c_entry->id.len);
 		memcpy(src_key.s + c_entry->id.len, key.s, key.len);
 
-		lock_get(queries_lock);
-
-		for (it = *queries_in_progress; it; it = it->next)
-			if (!memcmp(it->key.s, src_key.s, src_key.len))
-				break;
+		/* let any ongoing load finish first, then reload anyway */
+		sf_rc = sf_start_load(&src_key, 0, &it, NULL);
 		pkg_free(src_key.s);
-		if (it) {	/* key is in list */
-			lock_release(queries_lock);
-			lock_get(it->wait_sql_query);
-		}
+		if (sf_rc == SF_WAITER)
+			sf_wait_load(it);
 
 		rc = load_key(c_entry, db_hdls, key, &values, &sql_res);
 		if (rc == 0)
 			db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
 
-		if (it)
-			lock_release(it->wait_sql_query);
-		else
-			lock_release(queries_lock);
+		if (sf_rc == SF_LOADER)
+			sf_end_load(it);
 
 		if (rc == -1)
 			return init_mi_tree(500, MI_SSTR("ERROR Reloading key from SQL database\n"));
@@ -1071,6 +1302,12 @@ static int mod_init(void)
 		return -1;
 	}
 
+	sf_ipc_type = ipc_register_handler(sf_unpark_ipc, "sql_cacher unpark");
+	if (sf_ipc_type < 0) {
+		LM_ERR("Failed to register the IPC handler\n");
+		return -1;
+	}
+
 	for (c_entry = *entry_list; c_entry; c_entry = c_entry->next) {
 		if ((db_hdls = db_init_test_conn(c_entry)) == NULL)
 			continue;
@@ -1157,7 +1394,10 @@ static int child_init(int rank)
  * -2 - if not found
  * -1 - if error
  */
-static int cdb_fetch(pv_name_fix_t *pv_name, str *cdb_res, int *entry_rld_vers)
+/* the value is borrowed from the cachedb engine, if possible - it
+ * must be handed back with cdb_release() */
+static int cdb_fetch(pv_name_fix_t *pv_name, str *cdb_res, cdb_borrowed_t *cdb_ref,
+															int *entry_rld_vers)
 {
 	str cdb_key;
 	str rld_vers_key;
@@ -1190,7 +1430,8 @@ static int cdb_fetch(pv_name_fix_t *pv_name, str *cdb_res, int *entry_rld_vers)
 	} else
 		*entry_rld_vers = 0;
 
-	rc = pv_name->db_hdls->cdbf.get(pv_name->db_hdls->cdbcon, &cdb_key, cdb_res);
+	rc = cdb_borrow(&pv_name->db_hdls->cdbf, pv_name->db_hdls->cdbcon,
+		&cdb_key, cdb_res, cdb_ref);
 error:
 	pkg_free(cdb_key.s);
 	return rc;
@@ -1305,20 +1546,38 @@ static void optimize_cdb_decode(pv_name_fix_t *pv_name)
 		pv_name->col_offset = -1;
 }
 
+static int cdb_val_is_stale(str *cdb_val)
+{
+	char int_buf[4];
+	int stale_time;
+
+	if (cdb_val->len < INT_B64_ENC_LEN || base64decode((unsigned char *)int_buf,
+		(unsigned char *)cdb_val->s, INT_B64_ENC_LEN) != 4)
+		return 1;
+	memcpy(&stale_time, int_buf, 4);
+
+	return stale_time <= (int)time(NULL);
+}
+
 /*  return:
  *  0 - succes
  *  1 - succes, null value in db
+ *  4 - the stale value from cachedb is to be used
  * -1 - error
  * -2 - not found in sql db
+ *
+ *  If @stale is set, @cdb_res holds the borrowed stale value.
+ *  On success, the SQL result, if any, must be freed by the caller.
  */
-static int on_demand_load(pv_name_fix_t *pv_name, str *cdb_res, str *str_res, int *int_res)
+static int on_demand_load(pv_name_fix_t *pv_name, str *cdb_res,
+						cdb_borrowed_t *cdb_ref, str *str_res, int *int_res,
+						db_res_t **sql_res, int stale)
 {
-	struct queried_key *it, *prev = NULL, *tmp, *new_key;
+	struct queried_key *qk;
 	str src_key;
-	db_res_t *sql_res = NULL;
 	db_val_t *values;
 	db_type_t val_type;
-	int i, rld_vers_dummy, rc;
+	int i, rld_vers_dummy, rc, sf_rc;
 
 	for (i = 0; i < pv_name->c_entry->nr_columns; i++)
 		if (!memcmp((*pv_name->c_entry->columns[i]).s, pv_name->col.s, pv_name->col.len)) {
@@ -1331,142 +1590,88 @@ static int on_demand_load(pv_name_fix_t *pv_name, str *cdb_res, str *str_res, in
 	}
 
 	src_key.len = pv_name->id.len + pv_name->key.len;
-	src_key.s = shm_malloc(src_key.len);
+	src_key.s = pkg_malloc(src_key.len);
 	if (!src_key.s) {
-		LM_ERR("No more shm memory\n");
+		LM_ERR("No more pkg memory\n");
 		return -1;
 	}
 	memcpy(src_key.s, pv_name->id.s, pv_name->id.len);
 	memcpy(src_key.s + pv_name->id.len, pv_name->key.s, pv_name->key.len);
 
-	lock_get(queries_lock);
-
-	it = *queries_in_progress;
-	while (it) {
-		if (!memcmp(it->key.s, src_key.s, src_key.len)) { /* key is in list */
-			it->nr_waiting_procs++;
-			lock_release(queries_lock);
-			/* wait for the query to complete */
-			lock_get(it->wait_sql_query);
-			lock_get(queries_lock);
-			shm_free(src_key.s);
-			if (it->nr_waiting_procs == 1) {
-				lock_release(it->wait_sql_query);
-				lock_destroy(it->wait_sql_query);
-				lock_dealloc(it->wait_sql_query);
-				/* if this is the last process waiting, delete key from list */
-				if (prev)
-					prev->next = it->next;
-				else
-					*queries_in_progress = it->next;
-				tmp = it;
-				it = it->next;
-				shm_free(tmp);
-			} else if (it->nr_waiting_procs > 1) {
-				it->nr_waiting_procs--;
-				lock_release(it->wait_sql_query);
-			}
-			lock_release(queries_lock);
-
-			/* reload key from cachedb */
-			if (cdb_fetch(pv_name, cdb_res, &rld_vers_dummy) < 0) {
-				LM_ERR("Error or missing value on retrying fetch from cachedb\n");
-				return -1;
-			}
+	sf_rc = sf_start_load(&src_key, stale, &qk, NULL);
+	pkg_free(src_key.s);
 
-			if (pv_name->last_str == -1)
-				optimize_cdb_decode(pv_name);
-			return cdb_val_decode(pv_name, cdb_res, 0, str_res, int_res);
-		} else {
-			it = it->next;
-		}
-		prev = it;
+	if (sf_rc < 0) {
+		LM_ERR("failed to register the load of the key\n");
+		return stale ? 4 : -1;
 	}
 
-	if (!it) {	/* if key not found in list */
-		/* insert key in list */
-		new_key = shm_malloc(sizeof(struct queried_key));
-		if (!new_key) {
-			LM_ERR("No more shm memory\n");
-			lock_release(queries_lock);
-			return -1;
-		}
-		new_key->key = src_key;
-		new_key->nr_waiting_procs = 0;
-		new_key->wait_sql_query = lock_alloc();
-		if (!new_key->wait_sql_query) {
-			LM_ERR("No more memory for wait_sql_query lock\n");
-			lock_release(queries_lock);
-			return -1;
-		}
-		if (!lock_init(new_key->wait_sql_query)) {
-			LM_ERR("Failed to init wait_sql_query lock\n");
-			lock_release(queries_lock);
-			return -1;
-		}
-		new_key->next = NULL;
-		if (*queries_in_progress)
-			new_key->next = *queries_in_progress;
-		*queries_in_progress = new_key;
-
-		lock_get(new_key->wait_sql_query);
-
-		lock_release(queries_lock);
+	/* somebody else is already refreshing the key */
+	if (sf_rc != SF_LOADER && stale)
+		return 4;
 
-		rc = load_key(pv_name->c_entry, pv_name->db_hdls, pv_name->key, &values, &sql_res);
+	if (sf_rc == SF_WAITER) {
+		/* wait for the query to complete */
+		sf_wait_load(qk);
 
-		if (rc) {
-			lock_release(new_key->wait_sql_query);
-			return rc;
+		/* reload key from cachedb */
+		rc = cdb_fetch(pv_name, cdb_res, cdb_ref, &rld_vers_dummy);
+		if (rc == -1) {
+			LM_ERR("Error on retrying fetch from cachedb\n");
+			return -1;
 		}
+		if (rc <= -2 || cdb_res->len == 0 || !cdb_res->s)
+			return -2;
 
-		lock_get(queries_lock);
+		if (pv_name->last_str == -1)
+			optimize_cdb_decode(pv_name);
+		return cdb_val_decode(pv_name, cdb_res, 0, str_res, int_res);
+	}
 
-		lock_release(new_key->wait_sql_query);
+	/* SF_SELF: the async query started by this very process cannot be
+	 * waited for, so this read has to go to the SQL DB by itself */
+	rc = load_key(pv_name->c_entry, pv_name->db_hdls, pv_name->key, &values, sql_res);
 
-		/* delete key from list */
-		if (new_key->nr_waiting_procs == 0) {
-			lock_destroy(new_key->wait_sql_query);
-			lock_dealloc(new_key->wait_sql_query);
-			*queries_in_progress = new_key->next;
-			shm_free(new_key->key.s);
-			shm_free(new_key);
-		}
+	if (sf_rc == SF_LOADER)
+		sf_end_load(qk);
 
-		lock_release(queries_lock);
+	if (stale) {
+		/* rather serve the stale value than nothing if the SQL DB fails */
+		if (rc == -1)
+			return 4;
+		cdb_release(cdb_ref, cdb_res);
+	}
 
-		if (VAL_NULL(values + pv_name->col_nr))
-			return 1;
+	if (rc)
+		return rc;
 
-		val_type = VAL_TYPE(values + pv_name->col_nr);
-		switch (val_type) {
-			case DB_STRING:
-				str_res->s = (char *)VAL_STRING(values + pv_name->col_nr);
-				str_res->len = strlen(str_res->s);
-				break;
-			case DB_STR:
-				str_res = &(VAL_STR(values + pv_name->col_nr));
-				break;
-			case DB_INT:
-				*int_res = VAL_INT(values + pv_name->col_nr);
-				break;
-			case DB_BIGINT:
-				*int_res = (int)VAL_BIGINT(values + pv_name->col_nr);
-				break;
-			case DB_DOUBLE:
-				*int_res = (int)VAL_DOUBLE(values + pv_name->col_nr);
-				break;
-			default:
-				LM_ERR("Unsupported type for SQL column\n");
-				return -1;
-		}
-
-		pv_name->db_hdls->db_funcs.free_result(pv_name->db_hdls->db_con, sql_res);
+	if (VAL_NULL(values + pv_name->col_nr))
+		return 1;
 
-		return 0;
+	val_type = VAL_TYPE(values + pv_name->col_nr);
+	switch (val_type) {
+		case DB_STRING:
+			str_res->s = (char *)VAL_STRING(values + pv_name->col_nr);
+			str_res->len = strlen(str_res->s);
+			break;
+		case DB_STR:
+			*str_res = VAL_STR(values + pv_name->col_nr);
+			break;
+		case DB_INT:
+			*int_res = VAL_INT(values + pv_name->col_nr);
+			break;
+		case DB_BIGINT:
+			*int_res = (int)VAL_BIGINT(values + pv_name->col_nr);
+			break;
+		case DB_DOUBLE:
+			*int_res = (int)VAL_DOUBLE(values + pv_name->col_nr);
+			break;
+		default:
+			LM_ERR("Unsupported type for SQL column\n");
+			return -1;
 	}
 
-	return -1;
+	return 0;
 }
 
 static int parse_pv_name_s(pv_name_fix_t *pv_name, str *name_s)
@@ -1573,7 +1778,9 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 	char *ch = NULL;
 	long long one = 1;
 	str str_res = {NULL, 0}, cdb_res = {NULL, 0};
-	int entry_rld_vers;
+	cdb_borrowed_t cdb_ref = {NULL, NULL, NULL};
+	db_res_t *sql_res = NULL;
+	int entry_rld_vers, stale;
 
 	if (!param || param->pvn.type != PV_NAME_PVAR ||
 		!param->pvn.u.dname) {
@@ -1615,7 +1822,7 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 	if (!pv_name->c_entry->on_demand)
 		lock_start_read(pv_name->c_entry->ref_lock);
 
-	rc = cdb_fetch(pv_name, &cdb_res, &entry_rld_vers);
+	rc = cdb_fetch(pv_name, &cdb_res, &cdb_ref, &entry_rld_vers);
 	if (rc == -1) {
 		LM_ERR("Error fetching from cachedb\n");
 		if (!pv_name->c_entry->on_demand)
@@ -1648,20 +1855,26 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 			}
 		}
 	} else {
-		if (rc <= -2) {
-			rc2 = on_demand_load(pv_name, &cdb_res, &str_res, &int_res);
-			if (rc2 == -1 || rc2 == -2)
-				return pv_get_null(msg, param, res);
-			if (rc2 == 2 || rc2 == 3)
+		/* negative entries are never served stale */
+		stale = rc > -2 && stale_window > 0 && cdb_res.len && cdb_res.s &&
+			cdb_val_is_stale(&cdb_res);
+
+		rc2 = 4;
+		if (rc <= -2 || stale) {
+			rc2 = on_demand_load(pv_name, &cdb_res, &cdb_ref, &str_res, &int_res,
+				&sql_res, stale);
+			if (rc2 == -1 || rc2 == -2 || rc2 == 2 || rc2 == 3)
 				goto out_free_null;
 			if (rc2 == 1) {
 				LM_DBG("NULL value in SQL db\n");
 				goto out_free_null;
 			}
-		} else {
+		}
+
+		if (rc2 == 4) {
 			if (cdb_res.len == 0 || !cdb_res.s) {
 				LM_DBG("key %.*s not found in SQL db\n", pv_name->key.len, pv_name->key.s);
-				return pv_get_null(msg, param, res);
+				goto out_free_null;
 			}
 
 			if (pv_name->last_str == -1)
@@ -1697,16 +1910,272 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 		res->flags = PV_VAL_STR|PV_VAL_INT|PV_TYPE_INT;
 	}
 
-	if (cdb_res.s)
-		pkg_free(cdb_res.s);
+	cdb_release(&cdb_ref, &cdb_res);
+	if (sql_res)
+		pv_name->db_hdls->db_funcs.free_result(pv_name->db_hdls->db_con, sql_res);
 	return 0;
 
 out_free_null:
-	if (cdb_res.s)
-		pkg_free(cdb_res.s);
+	cdb_release(&cdb_ref, &cdb_res);
+	if (sql_res)
+		pv_name->db_hdls->db_funcs.free_result(pv_name->db_hdls->db_con, sql_res);
 	return pv_get_null(msg, param, res);
 }
 
+static int get_cache_entry(str *id, cache_entry_t **c_entry, db_handlers_t **db_hdls)
+{
+	cache_entry_t *it_entries;
+	db_handlers_t *it_db;
+
+	for (it_entries = *entry_list, it_db = db_hdls_list; it_entries;
+		it_entries = it_entries->next, it_db = it_db->next)
+		if (it_entries->id.len == id->len &&
+			!memcmp(it_entries->id.s, id->s, id->len)) {
+			*c_entry = it_entries;
+			*db_hdls = it_db;
+			return 0;
+		}
+
+	LM_WARN("Unknown caching id %.*s\n", id->len, id->s);
+	return -1;
+}
+
+/*  return:
+ *  1 - the key is cached and still fresh
+ * -2 - the key is cached as missing from the SQL DB
+ *  0 - the key needs to be loaded
+ */
+static int check_cached_key(cache_entry_t *c_entry, db_handlers_t *db_hdls,
+							str *src_key)
+{
+	cdb_borrowed_t cdb_ref;
+	str cdb_res = {NULL, 0};
+	int rc;
+
+	rc = cdb_borrow(&db_hdls->cdbf, db_hdls->cdbcon, src_key, &cdb_res, &cdb_ref);
+	if (rc < 0)
+		return 0;
+
+	if (cdb_res.len == 0 || !cdb_res.s)
+		rc = -2;
+	else if (stale_window > 0 && cdb_val_is_stale(&cdb_res))
+		rc = 0;
+	else
+		rc = 1;
+
+	cdb_release(&cdb_ref, &cdb_res);
+	return rc;
+}
+
+static int get_load_params(struct sip_msg *msg, char *id, char *key,
+		cache_entry_t **c_entry, db_handlers_t **db_hdls, str *key_s, str *src_key)
+{
+	str id_s;
+
+	if (fixup_get_svalue(msg, (gparam_p)id, &id_s) != 0 ||
+		fixup_get_svalue(msg, (gparam_p)key, key_s) != 0) {
+		LM_ERR("failed to get the function parameters\n");
+		return -1;
+	}
+
+	if (get_cache_entry(&id_s, c_entry, db_hdls) < 0)
+		return -1;
+	if (!(*c_entry)->on_demand) {
+		LM_ERR("Entry %.*s is not loaded on demand\n", id_s.len, id_s.s);
+		return -1;
+	}
+
+	src_key->len = (*c_entry)->id.len + key_s->len;
+	src_key->s = pkg_malloc(src_key->len);
+	if (!src_key->s) {
+		LM_ERR("No more pkg memory\n");
+		return -1;
+	}
+	memcpy(src_key->s, (*c_entry)->id.s, (*c_entry)->id.len);
+	memcpy(src_key->s + (*c_entry)->id.len, key_s->s, key_s->len);
+
+	return 0;
+}
+
+static int sync_load(cache_entry_t *c_entry, db_handlers_t *db_hdls,
+						str *key, str *src_key)
+{
+	struct queried_key *qk;
+	db_val_t *values;
+	db_res_t *sql_res = NULL;
+	int rc, sf_rc;
+
+	sf_rc = sf_start_load(src_key, 0, &qk, NULL);
+	if (sf_rc < 0)
+		return -1;
+	if (sf_rc == SF_WAITER) {
+		sf_wait_load(qk);
+		return 1;
+	}
+
+	rc = load_key(c_entry, db_hdls, *key, &values, &sql_res);
+	if (rc == 0)
+		db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
+
+	if (sf_rc == SF_LOADER)
+		sf_end_load(qk);
+
+	return rc == 0 ? 1 : rc;
+}
+
+static int w_sql_cacher_load(struct sip_msg *msg, char *id, char *key)
+{
+	cache_entry_t *c_entry;
+	db_handlers_t *db_hdls;
+	str key_s, src_key;
+	int rc;
+
+	if (get_load_params(msg, id, key, &c_entry, &db_hdls, &key_s, &src_key) < 0)
+		return -1;
+
+	rc = check_cached_key(c_entry, db_hdls, &src_key);
+	if (rc == 0)
+		rc = sync_load(c_entry, db_hdls, &key_s, &src_key);
+
+	pkg_free(src_key.s);
+	return rc;
+}
+
+static int resume_async_load(int fd, struct sip_msg *msg, void *_param)
+{
+	struct load_async_param *param = (struct load_async_param *)_param;
+	db_handlers_t *db_hdls = param->db_hdls;
+	db_res_t *sql_res = NULL;
+	db_val_t *values;
+	int rc;
+
+	rc = db_hdls->db_funcs.async_resume(db_hdls->db_con, fd, &sql_res,
+		param->db_param);
+	if (async_status == ASYNC_CONTINUE || async_status == ASYNC_CHANGE_FD)
+		return rc;
+
+	if (rc != 0) {
+		LM_ERR("async query returned error\n");
+		rc = -1;
+	} else {
+		rc = cache_key_row(param->c_entry, db_hdls, &param->key, sql_res,
+			&values);
+		async_status = ASYNC_DONE;
+	}
+
+	db_hdls->db_funcs.async_free_result(db_hdls->db_con, sql_res,
+		param->db_param);
+
+	sf_end_load(param->qk);
+	pkg_free(param);
+
+	return rc == 0 ? 1 : rc;
+}
+
+/* the load of the key was done by somebody else, it is now in cachedb */
+static int resume_parked_load(int fd, struct sip_msg *msg, void *_param)
+{
+	char c;
+
+	while (read(fd, &c, 1) < 0 && errno == EINTR);
+	async_status = ASYNC_DONE_CLOSE_FD;
+
+	return 1;
+}
+
+static int w_async_sql_cacher_load(struct sip_msg *msg, async_ctx *ctx,
+		char *id, char *key)
+{
+	struct load_async_param *param;
+	struct queried_key *qk;
+	cache_entry_t *c_entry;
+	db_handlers_t *db_hdls;
+	db_key_t key_col;
+	db_val_t key_val;
+	str key_s, src_key;
+	int rc, read_fd, sf_rc, park_fd;
+
+	if (get_load_params(msg, id, key, &c_entry, &db_hdls, &key_s, &src_key) < 0)
+		return -1;
+
+	ctx->resume_param = NULL;
+	ctx->resume_f = NULL;
+	async_status = ASYNC_NO_IO;
+
+	rc = check_cached_key(c_entry, db_hdls, &src_key);
+	if (rc != 0)
+		goto out;
+
+	/* no async capabilities - just run it in blocking mode; same if tm is
+	 * to run the resume right away, a parked load would never be resumed */
+	if (!DB_CAPABILITY(db_hdls->db_funcs, DB_CAP_ASYNC_QUERY) ||
+	route_type != REQUEST_ROUTE || msg->REQ_METHOD == METHOD_ACK) {
+		rc = sync_load(c_entry, db_hdls, &key_s, &src_key);
+		goto out;
+	}
+
+	sf_rc = sf_start_load(&src_key, 0, &qk, &park_fd);
+	if (sf_rc < 0) {
+		rc = -1;
+		goto out;
+	}
+	if (sf_rc == SF_PARKED) {
+		/* already being loaded, by another process or by an earlier async
+		 * query of this one - resume once that load is over */
+		ctx->resume_f = resume_parked_load;
+		async_status = park_fd;
+
+		pkg_free(src_key.s);
+		return 1;
+	}
+
+	param = pkg_malloc(sizeof *param + key_s.len);
+	if (!param) {
+		LM_ERR("no more pkg mem\n");
+		goto error;
+	}
+	memset(param, 0, sizeof *param);
+	param->c_entry = c_entry;
+	param->db_hdls = db_hdls;
+	param->qk = qk;
+	param->key.s = (char *)(param + 1);
+	param->key.len = key_s.len;
+	memcpy(param->key.s, key_s.s, key_s.len);
+
+	key_col = &(c_entry->key);
+	VAL_NULL(&key_val) = 0;
+	VAL_TYPE(&key_val) = DB_STR;
+	VAL_STR(&key_val) = param->key;
+
+	if (db_hdls->db_funcs.use_table(db_hdls->db_con, &c_entry->table) < 0) {
+		LM_ERR("Invalid table name: %.*s\n", c_entry->table.len, c_entry->table.s);
+		pkg_free(param);
+		goto error;
+	}
+
+	read_fd = db_hdls->db_funcs.async_query(db_hdls->db_con, &key_col, 0,
+		&key_val, c_entry->columns, 1, c_entry->nr_columns, 0,
+		&param->db_param);
+	if (read_fd < 0) {
+		pkg_free(param);
+		goto error;
+	}
+
+	ctx->resume_param = param;
+	ctx->resume_f = resume_async_load;
+	async_status = read_fd;
+
+	pkg_free(src_key.s);
+	return 1;
+
+error:
+	sf_end_load(qk);
+	rc = -1;
+out:
+	pkg_free(src_key.s);
+	return rc;
+}
+
 static void destroy(void)
 {
 	db_handlers_t *db_hdls;
@@ -1725,10 +2194,7 @@ static void destroy(void)
 	while (q_it) {
 		q_tmp = q_it;
 		q_it = q_it->next;
-		lock_destroy(q_tmp->wait_sql_query);
-		lock_dealloc(q_tmp->wait_sql_query);
-		shm_free(q_tmp->key.s);
-		shm_free(q_tmp);
+		sf_free(q_tmp);
 	}
 	shm_free(queries_in_progress);
 
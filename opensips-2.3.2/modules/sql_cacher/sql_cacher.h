@@ -53,12 +53,19 @@
 #define DEFAULT_ON_DEMAND_EXPIRE 3600
 #define DEFAULT_FULL_CACHING_EXPIRE 86400 /* 24h */
 #define DEFAULT_RELOAD_INTERVAL 60
+#define DEFAULT_NEGATIVE_EXPIRE -1 /* same as the expire of the entry */
 #define DEFAULT_FETCH_NR_ROWS 100
 #define TEST_QUERY_STR "sql_cacher_test_query_key"
 #define CDB_TEST_KEY_STR "sql_cacher_cdb_test_key"
 #define CDB_TEST_VAL_STR "sql_cacher_cdb_test_val"
 #define INT_B64_ENC_LEN 8
 
+/* sf_start_load() outcome */
+#define SF_LOADER 1	/* load the key and wake up the waiters */
+#define SF_WAITER 2	/* wait for the loading process */
+#define SF_SELF   3	/* already loaded asynchronously by this process */
+#define SF_PARKED 4	/* async caller, resumed once the ongoing load is over */
+
 typedef struct _cache_entry {
 	str id;
 	str db_url;
@@ -90,13 +97,30 @@ struct parse_entry {
 	struct parse_entry *next;
 };
 
+/* an async load waiting for the ongoing query of the same key */
+struct sf_parked {
+	int proc_no;
+	int notify_fd;	/* write end of the pipe it waits on, in proc_no */
+	struct sf_parked *next;
+};
+
 struct queried_key {
 	str key;
 	int nr_waiting_procs;
+	int async_proc;	/* process running the async query for the key, or -1 */
 	gen_lock_t *wait_sql_query;
+	struct sf_parked *parked;
 	struct queried_key *next;
 };
 
+struct load_async_param {
+	cache_entry_t *c_entry;
+	db_handlers_t *db_hdls;
+	struct queried_key *qk;
+	str key;
+	void *db_param;
+};
+
 typedef struct _pv_name_fix
 {
 	str id;
@@ -228,7 +228,7 @@ static int fixup_stat(void** param, int param_no)
 	struct stat_param *sp;
 	pv_elem_t *format;
 	str s, sname, group;
-	int grp_idx __attribute__((unused));
+	int grp_idx __attribute__((unused)) = -1;
 
 	s.s = (char*)*param;
 	s.len = strlen(s.s);
@@ -364,7 +364,7 @@ static int w_update_stat(struct sip_msg *msg, char *stat_p, char *val)
 	stat_var *stat;
 	int n;
 	str name, group;
-	int grp_idx __attribute__((unused));
+	int grp_idx __attribute__((unused)) = -1;
 
 	/* evaluate the value first */
 	if (fixup_get_ivalue( msg, (gparam_p)val, &n)<0) {
@@ -441,7 +441,7 @@ static int w_reset_stat(struct sip_msg *msg, char* stat_p, char *foo)
 	pv_value_t pv_val;
 	stat_var *stat;
 	str group, name;
-	int grp_idx __attribute__((unused));
+	int grp_idx __attribute__((unused)) = -1;
 
 	if (sp->type==STAT_PARAM_TYPE_STAT) {
 		/* we have the statistic */
@@ -560,7 +560,7 @@ static inline int get_stat_name(struct sip_msg* msg, pv_name_t *name,
 {
 	pv_value_t pv_val;
 	str sname, group;
-	int grp_idx __attribute__((unused));
+	int grp_idx __attribute__((unused)) = -1;
 
 	/* is the statistic found ? */
 	if (name->type==PV_NAME_INTSTR) {
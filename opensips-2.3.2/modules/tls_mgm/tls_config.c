@@ -62,6 +62,8 @@ char           *tls_ciphers_list = 0;
 /* TLS timeouts (in ms); should be low to detect problems fast */
 int             tls_handshake_timeout = 100;
 int             tls_send_timeout      = 100;
+/* kernel TLS offload of established connections, where available */
+int             tls_ktls = 0;
 /* per default, the TLS domains do not have a name */
 int             tls_client_domain_avp = -1;
 
@@ -72,6 +72,7 @@ extern str     eccurve_col;
 
 extern int      tls_handshake_timeout;
 extern int      tls_send_timeout;
+extern int      tls_ktls;
 extern int      tls_client_domain_avp;
 
 #endif
@@ -67,10 +67,18 @@ static int tls_update_fd(struct tcp_connection *c, int fd)
 	* must be run from within a lock
 	*/
 	SSL            *ssl;
+	BIO            *bio;
 
 	ssl = (SSL *) c->extra_data;
 
-	if (!SSL_set_fd(ssl, fd)) {
+	/* reuse the existing socket BIO, if any - this saves a BIO allocation
+	 * on each I/O and keeps the kTLS state attached to it */
+	bio = SSL_get_rbio(ssl);
+	if (bio && bio == SSL_get_wbio(ssl) &&
+	BIO_method_type(bio) == BIO_TYPE_SOCKET) {
+		if (BIO_get_fd(bio, NULL) != fd)
+			BIO_set_fd(bio, fd, BIO_NOCLOSE);
+	} else if (!SSL_set_fd(ssl, fd)) {
 		LM_ERR("failed to assign socket to ssl\n");
 		return -1;
 	}
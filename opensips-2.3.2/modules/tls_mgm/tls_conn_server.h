@@ -11,6 +11,7 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <poll.h>
+#include <sys/socket.h>
 #include "api.h"
 #include "tls_conn.h"
 #include "tls_config_helper.h"
@@ -216,6 +217,24 @@ static void add_certificates( SSL* ssl, struct tls_data* data)
 	tls_append_cert_info(cert, 0/* server */, data->message, data->tprot);
 }
 
+/*
+ * checks whether OpenSSL managed to move the record layer of a freshly
+ * established connection into the kernel
+ */
+static inline void tls_check_ktls(struct tcp_connection *c, SSL *ssl)
+{
+#ifdef TLS_KTLS_SUPPORT
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		c->proto_flags |= F_TLS_KTLS_TX;
+	if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+		c->proto_flags |= F_TLS_KTLS_RX;
+
+	LM_DBG("kTLS for conn %p: tx %s, rx %s\n", c,
+		(c->proto_flags & F_TLS_KTLS_TX) ? "on" : "off",
+		(c->proto_flags & F_TLS_KTLS_RX) ? "on" : "off");
+#endif
+}
+
 /*
  * Wrapper around SSL_accept, returns -1 on error, 0 on success
  */
@@ -256,6 +275,7 @@ static int tls_accept(struct tcp_connection *c, short *poll_events)
 
 		/* TLS accept done, reset the flag */
 		c->proto_flags &= ~F_TLS_DO_ACCEPT;
+		tls_check_ktls(c, ssl);
 
 		LM_DBG("new TLS connection from %s:%d using %s %s %d\n",
 			ip_addr2a(&c->rcv.src_ip), c->rcv.src_port,
@@ -367,6 +387,7 @@ static int tls_connect(struct tcp_connection *c, short *poll_events)
 				TRANS_TRACE_SUCCESS, &CONNECT_FAIL);
 
 		c->proto_flags &= ~F_TLS_DO_CONNECT;
+		tls_check_ktls(c, ssl);
 		LM_DBG("new TLS connection to %s:%d using %s %s %d\n",
 			ip_addr2a(&c->rcv.src_ip), c->rcv.src_port,
 			SSL_get_cipher_version(ssl), SSL_get_cipher_name(ssl),
@@ -485,6 +506,38 @@ static int tls_fix_read_conn(struct tcp_connection *c)
 	return ret;
 }
 
+#ifdef TLS_KTLS_SUPPORT
+/*
+ * Plain send() on a connection whose TX record layer is done by the
+ * kernel; same return values as tls_write()
+ */
+static int tls_ktls_write(struct tcp_connection *c, int fd, const void *buf,
+												size_t len, short *poll_events)
+{
+	int ret;
+
+again:
+	ret = send(fd, buf, len, MSG_NOSIGNAL);
+	if (ret >= 0) {
+		LM_DBG("kTLS write was successful (%d bytes)\n", ret);
+		return ret;
+	}
+
+	if (errno == EINTR)
+		goto again;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (poll_events)
+			*poll_events = POLLOUT;
+		return 0;
+	}
+
+	LM_ERR("TLS connection to %s:%d kTLS write failed: %s(%d)\n",
+		ip_addr2a(&c->rcv.src_ip), c->rcv.src_port, strerror(errno), errno);
+	c->state = S_CONN_BAD;
+	return -1;
+}
+#endif
+
 /*
  * Wrapper around SSL_write, returns number of bytes written on success, *
  * -1 on error, 0 when it would block
@@ -501,6 +554,14 @@ static int tls_write(struct tcp_connection *c, int fd, const void *buf,
 
 	ssl = (SSL *) c->extra_data;
 
+#ifdef TLS_KTLS_SUPPORT
+	/* the kernel builds the records; a pending TLS 1.3 key update still
+	 * has to go through OpenSSL */
+	if ((c->proto_flags & F_TLS_KTLS_TX) &&
+	SSL_get_key_update_type(ssl) == SSL_KEY_UPDATE_NONE)
+		return tls_ktls_write(c, fd, buf, len, poll_events);
+#endif
+
 	ret = SSL_write(ssl, buf, len);
 	if (ret > 0) {
 		LM_DBG("write was successful (%d bytes)\n", ret);
@@ -42,6 +42,16 @@
 #define F_TLS_DO_ACCEPT   (1<<0)
 #define F_TLS_DO_CONNECT  (1<<1)
 #define F_TLS_TRACE_READY (1<<2)
+#define F_TLS_KTLS_TX     (1<<3)
+#define F_TLS_KTLS_RX     (1<<4)
+
+#include <openssl/ssl.h>
+
+/* OpenSSL 3.0+ can hand the record layer over to the kernel (kTLS) */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && \
+	defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	#define TLS_KTLS_SUPPORT
+#endif
 
 #include "tls_config_helper.h"
 #include "../../locking.h"
@@ -66,6 +76,9 @@ struct tls_domain {
 	int             refs;
 	gen_lock_t     *lock;
 	enum tls_method method;
+	/* session id context, telling apart the sessions of the domains */
+	unsigned char   sid_ctx[SSL_MAX_SID_CTX_LENGTH];
+	unsigned int    sid_ctx_len;
 	struct tls_domain *next;
 };
 
@@ -38,6 +38,7 @@
 #include <openssl/ssl.h>
 #include <openssl/opensslv.h>
 #include <openssl/err.h>
+#include <openssl/sha.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -68,6 +69,7 @@
 #include "tls_domain.h"
 #include "tls_params.h"
 #include "tls_select.h"
+#include "tls_session.h"
 #include "tls.h"
 #include "api.h"
 
@@ -146,9 +148,49 @@ static param_export_t params[] = {
 	{ "ec_curve_col",	STR_PARAM,  &eccurve_col.s	},
 	{ "tls_handshake_timeout", INT_PARAM,         &tls_handshake_timeout     },
 	{ "tls_send_timeout",      INT_PARAM,         &tls_send_timeout          },
+	{ "ktls",                  INT_PARAM,         &tls_ktls                  },
+	{ "session_cache",         INT_PARAM,         &tls_session_cache         },
+	{ "session_cache_size",    INT_PARAM,         &tls_session_cache_size    },
+	{ "session_timeout",       INT_PARAM,         &tls_session_timeout       },
+	{ "session_tickets",       INT_PARAM,         &tls_session_tickets       },
+	{ "ticket_key_lifetime",   INT_PARAM,         &tls_ticket_key_lifetime   },
+	{ "replicate_sessions_to", INT_PARAM,         &tls_sess_repl_cluster     },
+	{ "accept_sessions_from",  INT_PARAM,         &tls_sess_accept_cluster   },
+	{ "repl_sessions_auth_check", INT_PARAM,      &tls_sess_repl_auth_check  },
 	{0, 0, 0}
 };
 
+static stat_export_t mod_stats[] = {
+	{"tls_full_handshakes",       0,             &tls_full_handshakes    },
+	{"tls_resumed_handshakes",    0,             &tls_resumed_handshakes },
+	{"tls_session_cache_hits",    0,             &tls_sess_cache_hits    },
+	{"tls_session_cache_misses",  0,             &tls_sess_cache_misses  },
+	{"tls_session_cache_entries", STAT_IS_FUNC,
+		(stat_var**)tls_sess_cache_get_entries                           },
+	{0, 0, 0}
+};
+
+static module_dependency_t *get_deps_clusterer(param_export_t *param)
+{
+	int cluster_id = *(int *)param->param_pointer;
+
+	if (cluster_id <= 0)
+		return NULL;
+
+	return alloc_module_dep(MOD_TYPE_DEFAULT, "clusterer", DEP_ABORT);
+}
+
+static dep_export_t deps = {
+	{ /* OpenSIPS module dependencies */
+		{ MOD_TYPE_NULL, NULL, 0 },
+	},
+	{ /* modparam dependencies */
+		{ "replicate_sessions_to",	get_deps_clusterer	},
+		{ "accept_sessions_from",	get_deps_clusterer	},
+		{ NULL, NULL },
+	},
+};
+
 static cmd_export_t cmds[] = {
 	{"is_peer_verified", (cmd_function)is_peer_verified,   0, 0, 0,
 		REQUEST_ROUTE},
@@ -340,11 +382,11 @@ struct module_exports exports = {
 	MOD_TYPE_DEFAULT,    /* class of this module */
 	MODULE_VERSION,
 	DEFAULT_DLFLAGS, /* dlopen flags */
-	NULL,            /* OpenSIPS module dependencies */
+	&deps,           /* OpenSIPS module dependencies */
 	cmds,       /* exported functions */
 	0,          /* exported async functions */
 	params,     /* module parameters */
-	0,          /* exported statistics */
+	mod_stats,  /* exported statistics */
 	mi_cmds,          /* exported MI functions */
 	mod_items,          /* exported pseudo-variables */
 	0,          /* extra processes */
@@ -701,6 +743,35 @@ int verify_callback(int pre_verify_ok, X509_STORE_CTX *ctx) {
  * Setup default SSL_CTX (and SSL * ) behavior:
  *     verification, cipherlist, acceptable versions, ...
  */
+/*
+ * the session id context of a domain: the OpenSIPS version along with the
+ * type and the name of the domain, hashed to fit SSL_MAX_SID_CTX_LENGTH
+ */
+static int tls_domain_sid_ctx(struct tls_domain *d)
+{
+	unsigned char *buf, *p;
+	int len;
+
+	len = OS_SSL_SESS_ID_LEN + 1 + d->name.len;
+	buf = pkg_malloc(len);
+	if (!buf) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+
+	p = buf;
+	memcpy(p, OS_SSL_SESS_ID, OS_SSL_SESS_ID_LEN);
+	p += OS_SSL_SESS_ID_LEN;
+	*p++ = (unsigned char)(d->type & (TLS_DOMAIN_SRV|TLS_DOMAIN_CLI));
+	memcpy(p, d->name.s, d->name.len);
+
+	SHA256(buf, len, d->sid_ctx);
+	d->sid_ctx_len = SHA256_DIGEST_LENGTH;
+
+	pkg_free(buf);
+	return 0;
+}
+
 static int init_ssl_ctx_behavior(struct tls_domain *d) {
 	int verify_mode;
 	int from_file = 0;
@@ -761,6 +832,14 @@ static int init_ssl_ctx_behavior(struct tls_domain *d) {
 			SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION |
 			SSL_OP_CIPHER_SERVER_PREFERENCE);
 
+#ifdef TLS_KTLS_SUPPORT
+	/* let OpenSSL push the negotiated keys into the kernel TLS ULP;
+	 * renegotiation would take the connection out of the kernel */
+	if (tls_ktls)
+		SSL_CTX_set_options(d->ctx,
+				SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+#endif
+
 	/* Set verification procedure
 	 * The verification can be made null with SSL_VERIFY_NONE, or
 	 * at least easier with SSL_VERIFY_CLIENT_ONCE instead of
@@ -840,8 +919,15 @@ static int init_ssl_ctx_behavior(struct tls_domain *d) {
 	SSL_CTX_set_verify_depth( d->ctx, VERIFY_DEPTH_S);
 
 	SSL_CTX_set_session_cache_mode( d->ctx, SSL_SESS_CACHE_SERVER );
-	SSL_CTX_set_session_id_context( d->ctx, OS_SSL_SESS_ID,
-			OS_SSL_SESS_ID_LEN );
+	/* a session may only be resumed on the domain that created it, as the
+	 * domains may check the client certificates differently */
+	if (tls_domain_sid_ctx(d) < 0)
+		return -1;
+	SSL_CTX_set_session_id_context( d->ctx, d->sid_ctx, d->sid_ctx_len );
+
+	/* shared session cache, ticket keys and handshake statistics */
+	if (d->type & TLS_DOMAIN_SRV && tls_sessions_setup_ctx(d) < 0)
+		return -1;
 
 	return 0;
 }
@@ -1726,6 +1812,19 @@ static int mod_init(void) {
 	}
 #endif
 
+#ifndef TLS_KTLS_SUPPORT
+	if (tls_ktls) {
+		LM_WARN("kTLS not supported by the OpenSSL library, "
+			"all TLS records will be handled in user space\n");
+		tls_ktls = 0;
+	}
+#endif
+
+	if (tls_sessions_init() < 0) {
+		LM_ERR("failed to init the TLS session resumption support\n");
+		return -1;
+	}
+
 	if (tls_db_url.s) {
 		if (load_info(&tls_server_domains_tmp, &tls_client_domains_tmp,
 				&def_srv_tmp, &def_cli_tmp, *tls_server_domains, *tls_client_domains))
@@ -1869,6 +1968,8 @@ static void mod_destroy(void)
 	shm_free(tls_server_domains);
 	shm_free(tls_client_domains);
 
+	tls_sessions_destroy();
+
 	/* TODO - destroy static locks */
 
 	/* library destroy */
@@ -0,0 +1,845 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ *
+ * Server side TLS session resumption shared by all the processes:
+ *  - a session id cache kept in shared memory, optionally replicated
+ *    to the other nodes of a cluster;
+ *  - RFC 5077 session tickets, protected by a ring of rotating keys kept
+ *    in shared memory (and optionally shared with the cluster).
+ */
+
+#include <string.h>
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include "../../dprint.h"
+#include "../../ut.h"
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../timer.h"
+#include "../../bin_interface.h"
+#include "../clusterer/api.h"
+#include "tls_session.h"
+
+#define TLS_REPL_SESS_NEW	1
+#define TLS_REPL_SESS_DEL	2
+#define TLS_REPL_TICKET_KEY	3
+
+#define TLS_SESS_PURGE_INTERVAL	10
+
+int tls_session_cache = 0;
+int tls_session_cache_size = 16384;
+int tls_session_timeout = 300;
+int tls_session_tickets = 0;
+int tls_ticket_key_lifetime = 3600;
+int tls_sess_repl_cluster = 0;
+int tls_sess_accept_cluster = 0;
+int tls_sess_repl_auth_check = 0;
+
+stat_var *tls_full_handshakes;
+stat_var *tls_resumed_handshakes;
+stat_var *tls_sess_cache_hits;
+stat_var *tls_sess_cache_misses;
+
+static struct ttl_hash *sess_cache;
+/* SSL_CTX ex_data slot holding the server domain of the ctx */
+static int sess_dom_idx = -1;
+static struct tls_ticket_ring *ticket_ring;
+
+static struct clusterer_binds clusterer_api;
+static str repl_module_name = str_init("tls_mgm");
+
+
+/*
+ * cluster replication
+ */
+
+static void tls_sess_replicate(bin_packet_t *packet)
+{
+	int rc;
+
+	rc = clusterer_api.send_all(packet, tls_sess_repl_cluster);
+	switch (rc) {
+	case CLUSTERER_CURR_DISABLED:
+		LM_INFO("Current node is disabled in cluster: %d\n",
+			tls_sess_repl_cluster);
+		goto error;
+	case CLUSTERER_DEST_DOWN:
+		LM_INFO("All destinations in cluster: %d are down or probing\n",
+			tls_sess_repl_cluster);
+		goto error;
+	case CLUSTERER_SEND_ERR:
+		LM_ERR("Error sending in cluster: %d\n", tls_sess_repl_cluster);
+		goto error;
+	}
+
+	return;
+error:
+	LM_ERR("Failed to replicate TLS session data\n");
+}
+
+static void tls_sess_repl_new(const unsigned char *id, unsigned int id_len,
+		unsigned char *der, int der_len)
+{
+	bin_packet_t packet;
+	str s;
+
+	if (bin_init(&packet, &repl_module_name, TLS_REPL_SESS_NEW,
+	BIN_VERSION, 0) < 0) {
+		LM_ERR("cannot initiate bin buffer\n");
+		return;
+	}
+
+	s.s = (char *)id;
+	s.len = id_len;
+	if (bin_push_str(&packet, &s) < 0)
+		goto error;
+	s.s = (char *)der;
+	s.len = der_len;
+	if (bin_push_str(&packet, &s) < 0)
+		goto error;
+	if (bin_push_int(&packet, tls_session_timeout) < 0)
+		goto error;
+
+	tls_sess_replicate(&packet);
+	bin_free_packet(&packet);
+	return;
+error:
+	LM_ERR("cannot push TLS session in buffer\n");
+	bin_free_packet(&packet);
+}
+
+static void tls_sess_repl_del(const unsigned char *id, unsigned int id_len)
+{
+	bin_packet_t packet;
+	str s;
+
+	if (bin_init(&packet, &repl_module_name, TLS_REPL_SESS_DEL,
+	BIN_VERSION, 0) < 0) {
+		LM_ERR("cannot initiate bin buffer\n");
+		return;
+	}
+
+	s.s = (char *)id;
+	s.len = id_len;
+	if (bin_push_str(&packet, &s) < 0) {
+		LM_ERR("cannot push TLS session id in buffer\n");
+		bin_free_packet(&packet);
+		return;
+	}
+
+	tls_sess_replicate(&packet);
+	bin_free_packet(&packet);
+}
+
+static void tls_ticket_key_replicate(struct tls_ticket_key *key)
+{
+	bin_packet_t packet;
+	str s;
+
+	if (bin_init(&packet, &repl_module_name, TLS_REPL_TICKET_KEY,
+	BIN_VERSION, 0) < 0) {
+		LM_ERR("cannot initiate bin buffer\n");
+		return;
+	}
+
+	s.s = (char *)key->name;
+	s.len = TLS_TICKET_NAME_LEN;
+	if (bin_push_str(&packet, &s) < 0)
+		goto error;
+	s.s = (char *)key->aes_key;
+	s.len = TLS_TICKET_KEY_LEN;
+	if (bin_push_str(&packet, &s) < 0)
+		goto error;
+	s.s = (char *)key->hmac_key;
+	s.len = TLS_TICKET_KEY_LEN;
+	if (bin_push_str(&packet, &s) < 0)
+		goto error;
+	/* age of the key, so that it expires at the same time everywhere */
+	if (bin_push_int(&packet, get_ticks() - key->created) < 0)
+		goto error;
+
+	tls_sess_replicate(&packet);
+	bin_free_packet(&packet);
+	return;
+error:
+	LM_ERR("cannot push TLS ticket key in buffer\n");
+	bin_free_packet(&packet);
+}
+
+
+/*
+ * shared session cache
+ */
+
+static inline unsigned int tls_sess_hash(const unsigned char *id,
+		unsigned int id_len)
+{
+	unsigned int h = 0, i;
+
+	/* session ids are random - a few bytes of them are enough */
+	for (i = 0; i < id_len && i < 8; i++)
+		h = (h << 5) + h + id[i];
+
+	return ttl_hash_bucket(sess_cache, h);
+}
+
+#define sess_entry(_e) ((struct tls_sess_entry *)(_e))
+
+/* sessions are bucketed by their id only, so that a delete replicated by
+ * id finds them; a NULL @ctx matches any session id context */
+static inline int tls_sess_match(struct tls_sess_entry *e,
+		const unsigned char *id, unsigned int id_len,
+		const unsigned char *ctx, unsigned int ctx_len)
+{
+	return e->id_len == id_len && memcmp(e->id, id, id_len) == 0 &&
+		(!ctx || (e->sid_ctx_len == ctx_len &&
+		memcmp(e->sid_ctx, ctx, ctx_len) == 0));
+}
+
+static inline const unsigned char *tls_sess_ctx(SSL_SESSION *sess,
+		unsigned int *len)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return SSL_SESSION_get0_id_context(sess, len);
+#else
+	*len = sess->sid_ctx_length;
+	return sess->sid_ctx;
+#endif
+}
+
+static int tls_sess_store(const unsigned char *id, unsigned int id_len,
+		const unsigned char *ctx, unsigned int ctx_len,
+		unsigned char *der, int der_len, unsigned int ttl)
+{
+	struct ttl_hash_entry **prev;
+	struct tls_sess_entry *e;
+	unsigned int h, now;
+
+	if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+	ctx_len > SSL_MAX_SID_CTX_LENGTH)
+		return -1;
+
+	e = shm_malloc(sizeof *e + der_len);
+	if (!e) {
+		LM_ERR("no more shm memory for TLS session\n");
+		return -1;
+	}
+	memcpy(e->id, id, id_len);
+	e->id_len = id_len;
+	memcpy(e->sid_ctx, ctx, ctx_len);
+	e->sid_ctx_len = ctx_len;
+	e->der = (unsigned char *)(e + 1);
+	e->der_len = der_len;
+	memcpy(e->der, der, der_len);
+
+	now = get_ticks();
+	e->link.expires = now + ttl;
+
+	h = tls_sess_hash(id, id_len);
+	ttl_hash_lock(sess_cache, h);
+
+	/* drop an older copy of the same session and anything expired */
+	for (prev = &sess_cache->buckets[h]; *prev; ) {
+		if ((*prev)->expires <= now ||
+		tls_sess_match(sess_entry(*prev), id, id_len, ctx, ctx_len))
+			ttl_hash_unlink(sess_cache, prev);
+		else
+			prev = &(*prev)->next;
+	}
+
+	if (sess_cache->entries >= tls_session_cache_size) {
+		ttl_hash_unlock(sess_cache, h);
+		LM_DBG("TLS session cache full (%u entries)\n", sess_cache->entries);
+		shm_free(e);
+		return -1;
+	}
+
+	ttl_hash_link(sess_cache, h, &e->link);
+
+	ttl_hash_unlock(sess_cache, h);
+	return 0;
+}
+
+static void tls_sess_delete(const unsigned char *id, unsigned int id_len,
+		const unsigned char *ctx, unsigned int ctx_len)
+{
+	struct ttl_hash_entry **prev;
+	unsigned int h;
+
+	h = tls_sess_hash(id, id_len);
+	ttl_hash_lock(sess_cache, h);
+
+	for (prev = &sess_cache->buckets[h]; *prev; prev = &(*prev)->next)
+		if (tls_sess_match(sess_entry(*prev), id, id_len, ctx, ctx_len)) {
+			ttl_hash_unlink(sess_cache, prev);
+			break;
+		}
+
+	ttl_hash_unlock(sess_cache, h);
+}
+
+static int tls_sess_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	const unsigned char *id, *ctx;
+	unsigned int id_len, ctx_len;
+	unsigned char *der, *p;
+	int der_len;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	ctx = tls_sess_ctx(sess, &ctx_len);
+
+	der_len = i2d_SSL_SESSION(sess, NULL);
+	if (der_len <= 0) {
+		LM_ERR("failed to serialize TLS session\n");
+		return 0;
+	}
+
+	der = pkg_malloc(der_len);
+	if (!der) {
+		LM_ERR("no more pkg memory\n");
+		return 0;
+	}
+	p = der;
+	i2d_SSL_SESSION(sess, &p);
+
+	if (tls_sess_store(id, id_len, ctx, ctx_len, der, der_len,
+	tls_session_timeout) == 0 &&
+	tls_sess_repl_cluster)
+		tls_sess_repl_new(id, id_len, der, der_len);
+
+	pkg_free(der);
+
+	/* we keep our own copy, OpenSSL may drop its reference */
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *tls_sess_get_cb(SSL *ssl, const unsigned char *id,
+		int id_len, int *copy)
+#else
+static SSL_SESSION *tls_sess_get_cb(SSL *ssl, unsigned char *id,
+		int id_len, int *copy)
+#endif
+{
+	struct ttl_hash_entry *it;
+	struct tls_sess_entry *e;
+	struct tls_domain *d;
+	SSL_SESSION *sess = NULL;
+	const unsigned char *p;
+	unsigned int h, now;
+
+	*copy = 0;
+
+	if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+		return NULL;
+
+	d = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sess_dom_idx);
+	if (!d)
+		return NULL;
+
+	now = get_ticks();
+	h = tls_sess_hash(id, id_len);
+	ttl_hash_lock(sess_cache, h);
+
+	for (it = sess_cache->buckets[h]; it; it = it->next) {
+		e = sess_entry(it);
+		if (tls_sess_match(e, id, id_len, d->sid_ctx, d->sid_ctx_len)) {
+			if (it->expires > now) {
+				p = e->der;
+				sess = d2i_SSL_SESSION(NULL, &p, e->der_len);
+			}
+			break;
+		}
+	}
+
+	ttl_hash_unlock(sess_cache, h);
+
+	if (sess)
+		update_stat(tls_sess_cache_hits, 1);
+	else
+		update_stat(tls_sess_cache_misses, 1);
+
+	return sess;
+}
+
+static void tls_sess_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	const unsigned char *id, *sid_ctx;
+	unsigned int id_len, sid_ctx_len;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	sid_ctx = tls_sess_ctx(sess, &sid_ctx_len);
+	tls_sess_delete(id, id_len, sid_ctx, sid_ctx_len);
+
+	if (tls_sess_repl_cluster)
+		tls_sess_repl_del(id, id_len);
+}
+
+static void tls_sess_purge(unsigned int ticks, void *param)
+{
+	ttl_hash_purge(sess_cache, ticks);
+}
+
+/* exported as a function statistic */
+unsigned long tls_sess_cache_get_entries(void *param)
+{
+	return sess_cache ? sess_cache->entries : 0;
+}
+
+
+/*
+ * session ticket keys
+ */
+
+/* takes the slot of the oldest key; must be called under the ring lock */
+static struct tls_ticket_key *tls_ticket_slot(void)
+{
+	struct tls_ticket_key *key = &ticket_ring->keys[0];
+	int i;
+
+	for (i = 0; i < TLS_TICKET_KEYS; i++) {
+		if (!ticket_ring->keys[i].used)
+			return &ticket_ring->keys[i];
+		if (ticket_ring->keys[i].created < key->created &&
+		i != ticket_ring->curr)
+			key = &ticket_ring->keys[i];
+	}
+
+	return key;
+}
+
+/* @replicate is 0 for the key generated at startup, when the clusterer
+ * is not up yet - the other nodes get it on the CLUSTER_NODE_UP event */
+static int tls_ticket_new_key(int replicate)
+{
+	struct tls_ticket_key key, *slot;
+
+	if (RAND_bytes(key.name, TLS_TICKET_NAME_LEN) != 1 ||
+	RAND_bytes(key.aes_key, TLS_TICKET_KEY_LEN) != 1 ||
+	RAND_bytes(key.hmac_key, TLS_TICKET_KEY_LEN) != 1) {
+		LM_ERR("failed to generate a TLS ticket key\n");
+		return -1;
+	}
+	key.created = get_ticks();
+	key.local = 1;
+	key.used = 1;
+
+	lock_get(&ticket_ring->lock);
+	slot = tls_ticket_slot();
+	*slot = key;
+	ticket_ring->curr = slot - ticket_ring->keys;
+	lock_release(&ticket_ring->lock);
+
+	LM_DBG("new TLS ticket key in slot %d\n", ticket_ring->curr);
+
+	if (replicate && tls_sess_repl_cluster)
+		tls_ticket_key_replicate(&key);
+
+	return 0;
+}
+
+static void tls_ticket_rotate(unsigned int ticks, void *param)
+{
+	tls_ticket_new_key(1);
+}
+
+/* keys older than two lifetimes no longer decrypt anything */
+static inline int tls_ticket_key_valid(struct tls_ticket_key *key,
+		unsigned int now)
+{
+	return key->used && now - key->created < 2 * tls_ticket_key_lifetime;
+}
+
+/* copies the key to use for encryption (@name==NULL) or the one named
+ * @name; returns 1 if it is the current key, 0 if it is an older one
+ * and -1 if none matches */
+static int tls_ticket_get_key(unsigned char *name, struct tls_ticket_key *out)
+{
+	struct tls_ticket_key *key;
+	unsigned int now = get_ticks();
+	int i, rc = -1;
+
+	lock_get(&ticket_ring->lock);
+
+	if (name == NULL) {
+		*out = ticket_ring->keys[ticket_ring->curr];
+		rc = 1;
+	} else {
+		for (i = 0; i < TLS_TICKET_KEYS; i++) {
+			key = &ticket_ring->keys[i];
+			if (tls_ticket_key_valid(key, now) &&
+			memcmp(key->name, name, TLS_TICKET_NAME_LEN) == 0) {
+				*out = *key;
+				rc = (i == ticket_ring->curr);
+				break;
+			}
+		}
+	}
+
+	lock_release(&ticket_ring->lock);
+	return rc;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_set_mac(EVP_MAC_CTX *hctx, struct tls_ticket_key *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+		key->hmac_key, TLS_TICKET_KEY_LEN);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+		"sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+static int tls_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+		EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int tls_ticket_set_mac(HMAC_CTX *hctx, struct tls_ticket_key *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac_key, TLS_TICKET_KEY_LEN,
+		EVP_sha256(), NULL);
+}
+
+static int tls_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+		EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct tls_ticket_key key;
+	int rc;
+
+	if (enc) {
+		if (tls_ticket_get_key(NULL, &key) < 0 ||
+		RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+			return -1;
+
+		memcpy(name, key.name, TLS_TICKET_NAME_LEN);
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		key.aes_key, iv) != 1 || tls_ticket_set_mac(hctx, &key) != 1)
+			return -1;
+
+		return 1;
+	}
+
+	rc = tls_ticket_get_key(name, &key);
+	if (rc < 0)
+		/* unknown or expired key - fall back to a full handshake */
+		return 0;
+
+	if (tls_ticket_set_mac(hctx, &key) != 1 ||
+	EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)
+		return -1;
+
+	/* ask for a fresh ticket if an older key was used */
+	return rc ? 1 : 2;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/* the ticket keys are shared by all the domains, so a decrypted ticket
+ * is only used on the domain that issued it (older versions of OpenSSL
+ * only do the same check themselves, when resuming) */
+static SSL_TICKET_RETURN tls_ticket_dec_cb(SSL *ssl, SSL_SESSION *sess,
+		const unsigned char *keyname, size_t keyname_len,
+		SSL_TICKET_STATUS status, void *arg)
+{
+	struct tls_domain *d = (struct tls_domain *)arg;
+	const unsigned char *ctx;
+	unsigned int ctx_len;
+
+	switch (status) {
+	case SSL_TICKET_SUCCESS:
+	case SSL_TICKET_SUCCESS_RENEW:
+		ctx = tls_sess_ctx(sess, &ctx_len);
+		if (ctx_len != d->sid_ctx_len || memcmp(ctx, d->sid_ctx, ctx_len)) {
+			LM_DBG("ticket issued by another TLS domain than '%.*s'\n",
+				d->name.len, d->name.s);
+			return SSL_TICKET_RETURN_IGNORE_RENEW;
+		}
+		return status == SSL_TICKET_SUCCESS ?
+			SSL_TICKET_RETURN_USE : SSL_TICKET_RETURN_USE_RENEW;
+	case SSL_TICKET_FATAL_ERR_MALLOC:
+	case SSL_TICKET_FATAL_ERR_OTHER:
+		return SSL_TICKET_RETURN_ABORT;
+	default:
+		/* no ticket, or one we cannot decrypt - full handshake */
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+}
+#endif
+
+
+/*
+ * handshake accounting
+ */
+
+static void tls_sess_info_cb(const SSL *ssl, int where, int ret)
+{
+	if (!(where & SSL_CB_HANDSHAKE_DONE))
+		return;
+
+	if (SSL_session_reused((SSL *)ssl))
+		update_stat(tls_resumed_handshakes, 1);
+	else
+		update_stat(tls_full_handshakes, 1);
+}
+
+
+static void tls_sess_rcv_bin(enum clusterer_event ev, bin_packet_t *packet,
+		int packet_type, struct receive_info *ri, int cluster_id, int src_id,
+		int dest_id)
+{
+	struct tls_ticket_key key, *slot;
+	str id, der, name, aes, hmac;
+	const unsigned char *p, *ctx;
+	unsigned int ctx_len;
+	SSL_SESSION *sess;
+	int ttl, age;
+
+	if (ev == CLUSTER_NODE_DOWN)
+		return;
+	else if (ev == CLUSTER_NODE_UP) {
+		/* let the new node decrypt the tickets we are issuing */
+		if (ticket_ring && tls_sess_repl_cluster &&
+		tls_ticket_get_key(NULL, &key) > 0)
+			tls_ticket_key_replicate(&key);
+		return;
+	} else if (ev == CLUSTER_ROUTE_FAILED) {
+		LM_INFO("failed to route replication packet of type %d from node %d to "
+			"node %d in cluster: %d\n", packet_type, src_id, dest_id, cluster_id);
+		return;
+	}
+
+	switch (packet_type) {
+	case TLS_REPL_SESS_NEW:
+		if (bin_pop_str(packet, &id) != 0 || bin_pop_str(packet, &der) != 0 ||
+		bin_pop_int(packet, &ttl) != 0)
+			goto error;
+		if (!sess_cache)
+			break;
+		/* the session id context comes from the session itself */
+		p = (unsigned char *)der.s;
+		sess = d2i_SSL_SESSION(NULL, &p, der.len);
+		if (!sess) {
+			LM_ERR("bogus TLS session received from node %d\n", src_id);
+			break;
+		}
+		ctx = tls_sess_ctx(sess, &ctx_len);
+		tls_sess_store((unsigned char *)id.s, id.len, ctx, ctx_len,
+			(unsigned char *)der.s, der.len, ttl);
+		SSL_SESSION_free(sess);
+		break;
+	case TLS_REPL_SESS_DEL:
+		if (bin_pop_str(packet, &id) != 0)
+			goto error;
+		if (sess_cache)
+			tls_sess_delete((unsigned char *)id.s, id.len, NULL, 0);
+		break;
+	case TLS_REPL_TICKET_KEY:
+		if (bin_pop_str(packet, &name) != 0 || bin_pop_str(packet, &aes) != 0 ||
+		bin_pop_str(packet, &hmac) != 0 || bin_pop_int(packet, &age) != 0)
+			goto error;
+		if (!ticket_ring)
+			break;
+		if (name.len != TLS_TICKET_NAME_LEN || aes.len != TLS_TICKET_KEY_LEN ||
+		hmac.len != TLS_TICKET_KEY_LEN) {
+			LM_ERR("bogus ticket key received from node %d\n", src_id);
+			return;
+		}
+
+		memcpy(key.name, name.s, TLS_TICKET_NAME_LEN);
+		memcpy(key.aes_key, aes.s, TLS_TICKET_KEY_LEN);
+		memcpy(key.hmac_key, hmac.s, TLS_TICKET_KEY_LEN);
+		key.created = get_ticks() - age;
+		key.local = 0;
+		key.used = 1;
+
+		lock_get(&ticket_ring->lock);
+		slot = tls_ticket_slot();
+		*slot = key;
+		lock_release(&ticket_ring->lock);
+		break;
+	default:
+		LM_WARN("Invalid binary packet command: %d (from node: %d in "
+			"cluster: %d)\n", packet_type, src_id, cluster_id);
+	}
+
+	return;
+error:
+	LM_ERR("failed to pop TLS replication data (type %d)\n", packet_type);
+}
+
+
+int tls_sessions_init(void)
+{
+	if (tls_sess_repl_cluster < 0 || tls_sess_accept_cluster < 0) {
+		LM_ERR("invalid cluster id, must be 0 or a positive cluster id\n");
+		return -1;
+	}
+
+	if (!tls_session_cache && !tls_session_tickets) {
+		if (tls_sess_repl_cluster || tls_sess_accept_cluster)
+			LM_WARN("session replication configured, but neither the "
+				"session cache nor the session tickets are enabled\n");
+		tls_sess_repl_cluster = tls_sess_accept_cluster = 0;
+		return 0;
+	}
+
+	if (tls_session_timeout <= 0) {
+		LM_WARN("bad session timeout (%d), using 300\n", tls_session_timeout);
+		tls_session_timeout = 300;
+	}
+
+	if ((tls_sess_repl_cluster || tls_sess_accept_cluster) &&
+	load_clusterer_api(&clusterer_api) != 0) {
+		LM_ERR("failed to find clusterer API - is clusterer module loaded?\n");
+		return -1;
+	}
+
+	if (tls_session_cache) {
+		if (tls_session_cache_size <= 0) {
+			LM_ERR("bad session cache size (%d)\n", tls_session_cache_size);
+			return -1;
+		}
+
+		sess_cache = ttl_hash_new(tls_session_cache_size, TLS_SESS_LOCKS);
+		if (!sess_cache) {
+			LM_ERR("failed to create the session cache\n");
+			return -1;
+		}
+
+		if (register_timer("tls-sess-purge", tls_sess_purge, NULL,
+		TLS_SESS_PURGE_INTERVAL, TIMER_FLAG_SKIP_ON_DELAY) < 0) {
+			LM_ERR("failed to register the session purge timer\n");
+			return -1;
+		}
+	}
+
+	if (tls_session_tickets) {
+		if (tls_ticket_key_lifetime <= 0) {
+			LM_WARN("bad ticket key lifetime (%d), using 3600\n",
+				tls_ticket_key_lifetime);
+			tls_ticket_key_lifetime = 3600;
+		}
+
+		ticket_ring = shm_malloc(sizeof *ticket_ring);
+		if (!ticket_ring) {
+			LM_ERR("no more shm memory\n");
+			return -1;
+		}
+		memset(ticket_ring, 0, sizeof *ticket_ring);
+		lock_init(&ticket_ring->lock);
+
+		if (tls_ticket_new_key(0) < 0)
+			return -1;
+
+		if (register_timer("tls-ticket-keys", tls_ticket_rotate, NULL,
+		tls_ticket_key_lifetime, TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+			LM_ERR("failed to register the ticket key rotation timer\n");
+			return -1;
+		}
+	}
+
+	if (tls_sess_accept_cluster &&
+	clusterer_api.register_module(repl_module_name.s, tls_sess_rcv_bin,
+	tls_sess_repl_auth_check, &tls_sess_accept_cluster, 1) < 0) {
+		LM_ERR("Cannot register clusterer callback!\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int tls_sessions_setup_ctx(struct tls_domain *d)
+{
+	SSL_CTX *ctx = d->ctx;
+
+	SSL_CTX_set_info_callback(ctx, tls_sess_info_cb);
+
+	if (sess_cache) {
+		if (sess_dom_idx < 0) {
+			sess_dom_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+			if (sess_dom_idx < 0) {
+				LM_ERR("failed to get an SSL_CTX ex_data index\n");
+				return -1;
+			}
+		}
+		if (!SSL_CTX_set_ex_data(ctx, sess_dom_idx, d)) {
+			LM_ERR("failed to attach the domain to its SSL_CTX\n");
+			return -1;
+		}
+
+		SSL_CTX_set_session_cache_mode(ctx,
+			SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_set_timeout(ctx, tls_session_timeout);
+		SSL_CTX_sess_set_new_cb(ctx, tls_sess_new_cb);
+		SSL_CTX_sess_set_get_cb(ctx, tls_sess_get_cb);
+		SSL_CTX_sess_set_remove_cb(ctx, tls_sess_remove_cb);
+	}
+
+	if (ticket_ring) {
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_cb);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		SSL_CTX_set_session_ticket_cb(ctx, NULL, tls_ticket_dec_cb, d);
+#endif
+	}
+
+	return 0;
+}
+
+void tls_sessions_destroy(void)
+{
+	if (sess_cache) {
+		ttl_hash_free(sess_cache);
+		sess_cache = NULL;
+	}
+
+	if (ticket_ring) {
+		lock_destroy(&ticket_ring->lock);
+		shm_free(ticket_ring);
+		ticket_ring = NULL;
+	}
+}
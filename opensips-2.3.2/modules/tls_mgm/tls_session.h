@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+#include <openssl/ssl.h>
+
+#include "../../locking.h"
+#include "../../statistics.h"
+#include "../../lib/ttl_hash.h"
+#include "tls_helper.h"
+
+/* number of ticket keys kept in the ring; the newest local one encrypts,
+ * all of them (including keys learned from the cluster) decrypt */
+#define TLS_TICKET_KEYS		8
+#define TLS_TICKET_NAME_LEN	16
+#define TLS_TICKET_KEY_LEN	32
+
+#define TLS_SESS_LOCKS		32
+
+#define BIN_VERSION		1
+
+/* a cached server session, in its DER form; it is looked up by its id
+ * and the session id context of the domain that created it */
+struct tls_sess_entry {
+	struct ttl_hash_entry link;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned int id_len;
+	unsigned char sid_ctx[SSL_MAX_SID_CTX_LENGTH];
+	unsigned int sid_ctx_len;
+	int der_len;
+	unsigned char *der;
+};
+
+struct tls_ticket_key {
+	unsigned char name[TLS_TICKET_NAME_LEN];
+	unsigned char aes_key[TLS_TICKET_KEY_LEN];
+	unsigned char hmac_key[TLS_TICKET_KEY_LEN];
+	unsigned int created;
+	int local;
+	int used;
+};
+
+struct tls_ticket_ring {
+	gen_lock_t lock;
+	int curr;
+	struct tls_ticket_key keys[TLS_TICKET_KEYS];
+};
+
+extern int tls_session_cache;
+extern int tls_session_cache_size;
+extern int tls_session_timeout;
+extern int tls_session_tickets;
+extern int tls_ticket_key_lifetime;
+extern int tls_sess_repl_cluster;
+extern int tls_sess_accept_cluster;
+extern int tls_sess_repl_auth_check;
+
+extern stat_var *tls_full_handshakes;
+extern stat_var *tls_resumed_handshakes;
+extern stat_var *tls_sess_cache_hits;
+extern stat_var *tls_sess_cache_misses;
+
+int tls_sessions_init(void);
+void tls_sessions_destroy(void);
+
+unsigned long tls_sess_cache_get_entries(void *param);
+
+/* installs the cache, ticket and statistics callbacks on the ctx of a
+ * server domain */
+int tls_sessions_setup_ctx(struct tls_domain *d);
+
+#endif
@@ -297,7 +297,7 @@ static stat_export_t mod_stats[] = {
 	{"received_replies" ,    0,              &tm_rcv_rpls    },
 	{"relayed_replies" ,     0,              &tm_rld_rpls    },
 	{"local_replies" ,       0,              &tm_loc_rpls    },
-	{"UAS_transactions" ,    0,              &tm_uas_trans   },
+	{"UAS_transactions" ,    STAT_PER_PROC,  &tm_uas_trans   },
 	{"UAC_transactions" ,    0,              &tm_uac_trans   },
 	{"2xx_transactions" ,    0,              &tm_trans_2xx   },
 	{"3xx_transactions" ,    0,              &tm_trans_3xx   },
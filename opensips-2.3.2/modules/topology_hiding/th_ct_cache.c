@@ -0,0 +1,248 @@
+/**
+ * Topology Hiding Module - encoded contact cache
+ *
+ * Copyright (C) 2017 OpenSIPS Foundation
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Per node cache of the encoded contact info (route set, contact and
+ * socket of a leg). Instead of the whole info, the Contact carries only
+ * a short token: the hash of the info plus a random nonce. Identical
+ * info (i.e. the same leg of the same dialog) always maps to the same
+ * entry, so re-INVITEs and UPDATEs only refresh it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../mem/mem.h"
+#include "../../timer.h"
+#include "../../hash_func.h"
+#include "../../dprint.h"
+#include "../../ut.h"
+#include "../../lib/ttl_hash.h"
+#include "th_ct_cache.h"
+
+#define TH_CT_LOCKS				32
+#define TH_CT_PURGE_INTERVAL	10
+
+struct th_ct_entry {
+	struct ttl_hash_entry link;
+	unsigned int hash;
+	unsigned int nonce;
+	int len;
+	char *info;
+};
+
+int th_ct_cache_size = 0;
+int th_ct_cache_timeout = 3600;
+
+stat_var *th_ct_cache_hits;
+stat_var *th_ct_cache_misses;
+
+static struct ttl_hash *ct_cache;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+
+static inline void th_ct_print_token(unsigned int hash, unsigned int nonce,
+		char *token)
+{
+	int i;
+
+	token[0] = TH_CT_TOKEN_MARK;
+	for (i = 0; i < 8; i++) {
+		token[8 - i] = hex_digits[hash & 0xf];
+		token[16 - i] = hex_digits[nonce & 0xf];
+		hash >>= 4;
+		nonce >>= 4;
+	}
+}
+
+static inline int th_ct_parse_token(str *token, unsigned int *hash,
+		unsigned int *nonce)
+{
+	unsigned int v[2] = {0, 0};
+	int i, d;
+	char c;
+
+	if (token->len != TH_CT_TOKEN_LEN || token->s[0] != TH_CT_TOKEN_MARK)
+		return -1;
+
+	for (i = 1; i < TH_CT_TOKEN_LEN; i++) {
+		c = token->s[i];
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			d = c - 'A' + 10;
+		else
+			return -1;
+		v[(i - 1) / 8] = (v[(i - 1) / 8] << 4) | d;
+	}
+
+	*hash = v[0];
+	*nonce = v[1];
+	return 0;
+}
+
+int th_ct_cache_store(char *info, int len, char *token)
+{
+	struct ttl_hash_entry **prev;
+	struct th_ct_entry *e;
+	unsigned int h, b, now;
+	str s;
+
+	s.s = info;
+	s.len = len;
+	h = core_hash(&s, NULL, 0);
+	b = ttl_hash_bucket(ct_cache, h);
+	now = get_ticks();
+
+	ttl_hash_lock(ct_cache, b);
+
+	/* same leg as an already cached one? also drop the expired ones */
+	for (prev = &ct_cache->buckets[b]; *prev; ) {
+		e = (struct th_ct_entry *)*prev;
+		if (e->hash == h && e->len == len && memcmp(e->info, info, len) == 0) {
+			e->link.expires = now + th_ct_cache_timeout;
+			th_ct_print_token(h, e->nonce, token);
+			ttl_hash_unlock(ct_cache, b);
+			return 0;
+		}
+		if (e->link.expires <= now)
+			ttl_hash_unlink(ct_cache, prev);
+		else
+			prev = &e->link.next;
+	}
+
+	if (ct_cache->entries >= th_ct_cache_size) {
+		ttl_hash_unlock(ct_cache, b);
+		LM_DBG("contact cache full (%u entries), encoding inline\n",
+			ct_cache->entries);
+		return -1;
+	}
+
+	e = shm_malloc(sizeof *e + len);
+	if (!e) {
+		ttl_hash_unlock(ct_cache, b);
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	e->hash = h;
+	e->nonce = (unsigned int)rand();
+	e->link.expires = now + th_ct_cache_timeout;
+	e->len = len;
+	e->info = (char *)(e + 1);
+	memcpy(e->info, info, len);
+
+	ttl_hash_link(ct_cache, b, &e->link);
+
+	ttl_hash_unlock(ct_cache, b);
+
+	th_ct_print_token(h, e->nonce, token);
+	return 0;
+}
+
+char *th_ct_cache_fetch(str *token, int *len)
+{
+	struct ttl_hash_entry *it;
+	struct th_ct_entry *e = NULL;
+	unsigned int h, b, nonce;
+	char *info = NULL;
+
+	if (th_ct_parse_token(token, &h, &nonce) < 0) {
+		LM_ERR("bad contact token <%.*s>\n", token->len, token->s);
+		return NULL;
+	}
+	b = ttl_hash_bucket(ct_cache, h);
+
+	ttl_hash_lock(ct_cache, b);
+
+	for (it = ct_cache->buckets[b]; it; it = it->next) {
+		e = (struct th_ct_entry *)it;
+		if (e->hash == h && e->nonce == nonce) {
+			info = pkg_malloc(e->len);
+			if (!info) {
+				LM_ERR("no more pkg memory\n");
+				break;
+			}
+			memcpy(info, e->info, e->len);
+			*len = e->len;
+			e->link.expires = get_ticks() + th_ct_cache_timeout;
+			break;
+		}
+	}
+
+	ttl_hash_unlock(ct_cache, b);
+
+	if (it)
+		update_stat(th_ct_cache_hits, 1);
+	else {
+		update_stat(th_ct_cache_misses, 1);
+		LM_DBG("contact token <%.*s> not found\n", token->len, token->s);
+	}
+
+	return info;
+}
+
+static void th_ct_cache_purge(unsigned int ticks, void *param)
+{
+	ttl_hash_purge(ct_cache, ticks);
+}
+
+unsigned long th_ct_cache_get_entries(void *param)
+{
+	return ct_cache ? ct_cache->entries : 0;
+}
+
+int th_ct_cache_init(void)
+{
+	if (th_ct_cache_size <= 0) {
+		th_ct_cache_size = 0;
+		return 0;
+	}
+
+	if (th_ct_cache_timeout <= 0) {
+		LM_ERR("th_contact_cache_timeout must be a positive number of "
+			"seconds, got %d\n", th_ct_cache_timeout);
+		return -1;
+	}
+
+	ct_cache = ttl_hash_new(th_ct_cache_size, TH_CT_LOCKS);
+	if (!ct_cache) {
+		LM_ERR("failed to create the contact cache\n");
+		return -1;
+	}
+
+	if (register_timer("th-ct-purge", th_ct_cache_purge, NULL,
+	TH_CT_PURGE_INTERVAL, TIMER_FLAG_SKIP_ON_DELAY) < 0) {
+		LM_ERR("failed to register the contact cache purge timer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void th_ct_cache_destroy(void)
+{
+	ttl_hash_free(ct_cache);
+	ct_cache = NULL;
+}
@@ -0,0 +1,51 @@
+/**
+ * Topology Hiding Module - encoded contact cache
+ *
+ * Copyright (C) 2017 OpenSIPS Foundation
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef _TOPOH_CT_CACHE_H
+#define _TOPOH_CT_CACHE_H
+
+#include "../../str.h"
+#include "../../statistics.h"
+
+/* the token starts with this mark, followed by 16 hex digits */
+#define TH_CT_TOKEN_MARK	'.'
+#define TH_CT_TOKEN_LEN		17
+
+extern int th_ct_cache_size;
+extern int th_ct_cache_timeout;
+
+extern stat_var *th_ct_cache_hits;
+extern stat_var *th_ct_cache_misses;
+
+int th_ct_cache_init(void);
+void th_ct_cache_destroy(void);
+
+/* stores the encoded contact info (or refreshes an identical one already
+ * stored) and returns the token identifying it */
+int th_ct_cache_store(char *info, int len, char *token);
+
+/* returns a pkg copy of the info identified by the token */
+char *th_ct_cache_fetch(str *token, int *len);
+
+unsigned long th_ct_cache_get_entries(void *param);
+
+#endif
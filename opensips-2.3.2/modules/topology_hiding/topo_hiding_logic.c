@@ -25,6 +25,7 @@
 */
 
 #include "topo_hiding_logic.h"
+#include "th_ct_cache.h"
 
 extern int force_dialog;
 extern struct tm_binds tm_api;
@@ -1498,22 +1499,258 @@ error:
 	return -1;
 }
 
+/* Compact binary form of the info carried by the encoded Contact:
+ *   flags | rr_len | rr | head_len | head_uri_off | head_uri_len |
+ *   ct_len | ct | bind_len | bind
+ * The first route of the set (where the sequential request goes next)
+ * is described upfront, so the decoder does not have to parse the route
+ * set again. It travels either inline (base64 of the XOR-ed blob, marked
+ * with TH_CT_INLINE_MARK) or, if the contact cache is enabled, stays on
+ * this node and only its token is sent. Values with no mark are decoded
+ * as the old (route set, contact, socket) encoding. */
+#define TH_CT_VERSION		2
+#define TH_CT_STRICT		(1<<0)
+#define TH_CT_MULTI			(1<<1)
+#define TH_CT_INLINE_MARK	'-'
+
+struct th_ct_info {
+	unsigned char flags;
+	str rr;
+	int head_len;
+	str head_uri;
+	str ct;
+	str bind;
+};
+
+#define th_put_short(_p,_v) \
+	do { \
+		unsigned short _s = (unsigned short)(_v); \
+		memcpy(_p, &_s, sizeof _s); \
+		_p += sizeof _s; \
+	} while (0)
+
+#define th_put_str(_p,_s) \
+	do { \
+		th_put_short(_p, (_s).len); \
+		memcpy(_p, (_s).s, (_s).len); \
+		_p += (_s).len; \
+	} while (0)
+
+static inline int th_get_short(char **p, char *end, unsigned short *v)
+{
+	if (end - *p < (int)sizeof *v)
+		return -1;
+	memcpy(v, *p, sizeof *v);
+	*p += sizeof *v;
+	return 0;
+}
+
+static inline int th_get_str(char **p, char *end, str *s)
+{
+	unsigned short len;
+
+	if (th_get_short(p, end, &len) < 0 || end - *p < len)
+		return -1;
+	s->s = *p;
+	s->len = len;
+	*p += len;
+	return 0;
+}
+
+static inline int th_ct_info_len(struct th_ct_info *ci)
+{
+	return 1 + 6 * sizeof(unsigned short) +
+		ci->rr.len + ci->ct.len + ci->bind.len;
+}
+
+static char *th_ct_info_pack(struct th_ct_info *ci, char *p)
+{
+	*p++ = (TH_CT_VERSION << 4) | ci->flags;
+	th_put_str(p, ci->rr);
+	th_put_short(p, ci->head_len);
+	th_put_short(p, ci->head_uri.len ? ci->head_uri.s - ci->rr.s : 0);
+	th_put_short(p, ci->head_uri.len);
+	th_put_str(p, ci->ct);
+	th_put_str(p, ci->bind);
+	return p;
+}
+
+static int th_ct_info_unpack(char *buf, int len, struct th_ct_info *ci)
+{
+	char *p = buf, *end = buf + len;
+	unsigned short head_len, off, uri_len;
+
+	if (len < 1 || ((unsigned char)*p >> 4) != TH_CT_VERSION)
+		return -1;
+	ci->flags = *p++ & 0x0f;
+
+	if (th_get_str(&p, end, &ci->rr) < 0 ||
+	th_get_short(&p, end, &head_len) < 0 ||
+	th_get_short(&p, end, &off) < 0 ||
+	th_get_short(&p, end, &uri_len) < 0 ||
+	th_get_str(&p, end, &ci->ct) < 0 ||
+	th_get_str(&p, end, &ci->bind) < 0)
+		return -1;
+
+	if (head_len > ci->rr.len || off + uri_len > head_len ||
+	(ci->rr.len && !uri_len))
+		return -1;
+
+	/* more routes follow the head, past its separator */
+	if ((ci->flags & TH_CT_MULTI) && head_len + 1 >= ci->rr.len)
+		return -1;
+
+	ci->head_len = head_len;
+	ci->head_uri.s = ci->rr.s + off;
+	ci->head_uri.len = uri_len;
+	return 0;
+}
+
+/* the encoding used before the compact one - the first route has to be
+ * looked up by parsing the whole route set */
+static int th_ct_info_unpack_legacy(char *buf, int len, struct th_ct_info *ci)
+{
+	char *p = buf, *end = buf + len;
+	rr_t *head = NULL;
+	struct sip_uri fru;
+
+	memset(ci, 0, sizeof *ci);
+	if (th_get_str(&p, end, &ci->rr) < 0 ||
+	th_get_str(&p, end, &ci->ct) < 0 ||
+	th_get_str(&p, end, &ci->bind) < 0)
+		return -1;
+
+	if (!ci->rr.len)
+		return 0;
+
+	if (parse_rr_body(ci->rr.s, ci->rr.len, &head) != 0) {
+		LM_ERR("failed parsing route set\n");
+		return -1;
+	}
+	if (parse_uri(head->nameaddr.uri.s, head->nameaddr.uri.len, &fru) < 0) {
+		LM_ERR("Failed to parse SIP uri\n");
+		free_rr(&head);
+		return -1;
+	}
+
+	ci->head_len = head->len;
+	ci->head_uri = head->nameaddr.uri;
+	if (head->next)
+		ci->flags |= TH_CT_MULTI;
+	if (is_strict(&fru.params))
+		ci->flags |= TH_CT_STRICT;
+
+	free_rr(&head);
+	return 0;
+}
+
+/* fills in the first route of the set built by print_rr_body() (the last
+ * RR for replies), reusing the RR headers it has already parsed */
+static int th_ct_info_set_head(struct hdr_field *rr_hdr, int reverse,
+		struct th_ct_info *ci)
+{
+	rr_t *head = NULL, *rr;
+	struct sip_uri fru;
+	int n = 0;
+
+	for (; rr_hdr; rr_hdr = rr_hdr->sibling)
+		for (rr = (rr_t *)rr_hdr->parsed; rr; rr = rr->next) {
+			if (!head || reverse)
+				head = rr;
+			n++;
+		}
+
+	if (!head)
+		return 0;
+
+	/* the head is the very first one in the printed set */
+	ci->head_len = head->len;
+	ci->head_uri.s = ci->rr.s + (head->nameaddr.uri.s - head->nameaddr.name.s);
+	ci->head_uri.len = head->nameaddr.uri.len;
+	if (n > 1)
+		ci->flags |= TH_CT_MULTI;
+
+	if (parse_uri(head->nameaddr.uri.s, head->nameaddr.uri.len, &fru) < 0) {
+		LM_ERR("Failed to parse SIP uri\n");
+		return -1;
+	}
+	if (is_strict(&fru.params))
+		ci->flags |= TH_CT_STRICT;
+
+	return 0;
+}
+
+/* returns a pkg buffer holding the info the strs in @ci point to */
+static char *th_ct_decode(str *info, struct th_ct_info *ci)
+{
+	str val = *info;
+	char *buf;
+	int len, i, inline_v2;
+
+	if (val.len >= 2 && val.s[0] == '"' && val.s[val.len - 1] == '"') {
+		val.s++;
+		val.len -= 2;
+	}
+	if (val.len == 0)
+		return NULL;
+
+	if (val.s[0] == TH_CT_TOKEN_MARK) {
+		if (!th_ct_cache_size) {
+			LM_ERR("got contact token <%.*s>, but th_contact_cache_size "
+				"is not set\n", val.len, val.s);
+			return NULL;
+		}
+		if (!(buf = th_ct_cache_fetch(&val, &len)))
+			return NULL;
+		if (th_ct_info_unpack(buf, len, ci) < 0)
+			goto bad;
+		return buf;
+	}
+
+	inline_v2 = (val.s[0] == TH_CT_INLINE_MARK);
+	if (inline_v2) {
+		val.s++;
+		val.len--;
+	}
+
+	buf = pkg_malloc(calc_max_base64_decode_len(val.len));
+	if (!buf) {
+		LM_ERR("No more pkg\n");
+		return NULL;
+	}
+
+	len = base64decode((unsigned char *)buf, (unsigned char *)val.s, val.len);
+	for (i = 0; i < len; i++)
+		buf[i] ^= topo_hiding_ct_encode_pw.s[i%topo_hiding_ct_encode_pw.len];
+
+	if ((inline_v2 ? th_ct_info_unpack(buf, len, ci) :
+	th_ct_info_unpack_legacy(buf, len, ci)) < 0)
+		goto bad;
+
+	return buf;
+bad:
+	LM_ERR("bad encoded contact info <%.*s>\n", info->len, info->s);
+	pkg_free(buf);
+	return NULL;
+}
+
 /* We encode the RR headers, the actual Contact and the socket str for this leg */
 /* Via headers will be restored using the TM module, no need to save anything for them */
 static char* build_encoded_contact_suffix(struct sip_msg* msg,int *suffix_len)
 {
-	short rr_len,ct_len,addr_len,enc_len;
-	char *suffix_plain,*suffix_enc,*p,*s;
+	struct th_ct_info ci;
+	char *suffix_plain=NULL,*suffix_enc=NULL,*p,*s;
+	char token[TH_CT_TOKEN_LEN];
 	str rr_set = {NULL, 0};
 	str contact;
-	int i,total_len;
+	int i,total_len,plain_len,enc_len,val_len;
+	int use_token = 0;
 	struct sip_uri ctu;
 	struct th_ct_params* el;
 	param_t *it;
 	int is_req = (msg->first_line.type==SIP_REQUEST)?1:0;
-	int local_len = sizeof(short) /* RR length */ +
-			sizeof(short) /* Contact length */ +
-			sizeof(short) /* bind addr */;
+
+	memset(&ci, 0, sizeof ci);
 
 	/* parse all headers as we can have multiple
 	   RR headers in the same message */
@@ -1528,9 +1765,9 @@ static char* build_encoded_contact_suffix(struct sip_msg* msg,int *suffix_len)
 			LM_ERR("failed to print route records \n");
 			return NULL;
 		}
-		rr_len = (short)rr_set.len;
-	} else {
-		rr_len = 0;
+		ci.rr = rr_set;
+		if (th_ct_info_set_head(msg->record_route, !is_req, &ci) < 0)
+			goto error;
 	}
 
 	if ( parse_contact(msg->contact)<0 ||
@@ -1540,19 +1777,36 @@ static char* build_encoded_contact_suffix(struct sip_msg* msg,int *suffix_len)
 		goto error;
 	} else {
 		contact = ((contact_body_t *)msg->contact->parsed)->contacts->uri;
-		ct_len = (short)contact.len;
+		ci.ct = contact;
+	}
+
+	ci.bind = msg->rcv.bind_address->sock_str;
+
+	plain_len = th_ct_info_len(&ci);
+	suffix_plain = pkg_malloc(plain_len);
+	if (!suffix_plain) {
+		LM_ERR("no more pkg\n");
+		goto error;
 	}
+	p = th_ct_info_pack(&ci, suffix_plain);
 
-	addr_len = (short)msg->rcv.bind_address->sock_str.len;
-	local_len += rr_len + ct_len + addr_len; 
-	enc_len = calc_base64_encode_len(local_len);
-	total_len = enc_len +  
-		1 /* ; */ + 
-		th_contact_encode_param.len + 
-		1 /* = */  + 
-		1 /* " */ +
-		1 /* " */ +
-		1 /* > */;	 
+	if (th_ct_cache_size && th_ct_cache_store(suffix_plain, p - suffix_plain,
+	token) == 0)
+		use_token = 1;
+
+	if (use_token) {
+		enc_len = 0;
+		val_len = TH_CT_TOKEN_LEN;
+	} else {
+		enc_len = calc_base64_encode_len(p - suffix_plain);
+		val_len = 1 /* " */ + 1 /* mark */ + enc_len + 1 /* " */;
+	}
+
+	total_len = 1 /* ; */ +
+		th_contact_encode_param.len +
+		1 /* = */ +
+		val_len +
+		1 /* > */;
 
 	if (th_param_list) {
 		if ( parse_contact(msg->contact)<0 ||
@@ -1609,42 +1863,27 @@ static char* build_encoded_contact_suffix(struct sip_msg* msg,int *suffix_len)
 		LM_ERR("no more pkg\n");
 		goto error;
 	}
-	suffix_plain = pkg_malloc(local_len+1);
-	if (!suffix_plain) {
-		LM_ERR("no more pkg\n");
-		goto error;
-	}
-
-	p = suffix_plain;
-	memcpy(p,&rr_len,sizeof(short));
-	p+= sizeof(short);
-	if (rr_len) {
-		memcpy(p,rr_set.s,rr_set.len);
-		p+= rr_set.len;
-	}
-	memcpy(p,&ct_len,sizeof(short));
-	p+= sizeof(short);
-	if (ct_len) {
-		memcpy(p,contact.s,contact.len);
-		p+= contact.len;
-	}
-	memcpy(p,&addr_len,sizeof(short));
-	p+= sizeof(short);
-	memcpy(p,msg->rcv.bind_address->sock_str.s,msg->rcv.bind_address->sock_str.len);
-	p+= msg->rcv.bind_address->sock_str.len;
-	for (i=0;i<(int)(p-suffix_plain);i++)
-		suffix_plain[i] ^= topo_hiding_ct_encode_pw.s[i%topo_hiding_ct_encode_pw.len];
 
 	s = suffix_enc;
 	*s++ = ';';
 	memcpy(s,th_contact_encode_param.s,th_contact_encode_param.len);
 	s+= th_contact_encode_param.len;
 	*s++ = '=';
-	*s++ = '"';	
-	base64encode((unsigned char*)s,(unsigned char *)suffix_plain,p-suffix_plain);
-	s = s+enc_len;
-	*s++ = '"';
-	
+	if (use_token) {
+		/* hex digits only, no need for quoting */
+		memcpy(s,token,TH_CT_TOKEN_LEN);
+		s+= TH_CT_TOKEN_LEN;
+	} else {
+		for (i=0;i<(int)(p-suffix_plain);i++)
+			suffix_plain[i] ^= topo_hiding_ct_encode_pw.s[i%topo_hiding_ct_encode_pw.len];
+
+		*s++ = '"';
+		*s++ = TH_CT_INLINE_MARK;
+		base64encode((unsigned char*)s,(unsigned char *)suffix_plain,p-suffix_plain);
+		s = s+enc_len;
+		*s++ = '"';
+	}
+
 	if (th_param_list) {
 		for (el=th_param_list;el;el=el->next) {
 			/* we just iterate over the unknown params */
@@ -1692,11 +1931,13 @@ static char* build_encoded_contact_suffix(struct sip_msg* msg,int *suffix_len)
 	if (rr_set.s)
 		pkg_free(rr_set.s);
 	pkg_free(suffix_plain);
-	*suffix_len = total_len;
+	*suffix_len = s - suffix_enc;
 	return suffix_enc;
 error:
 	if (rr_set.s)
 		pkg_free(rr_set.s);
+	if (suffix_plain)
+		pkg_free(suffix_plain);
 	return NULL;
 }
 
@@ -1794,13 +2035,10 @@ error:
 
 static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 {
-	int max_size,dec_len,i,size;
-	char *dec_buf,*p,*route=NULL,*hdrs,*remote_contact;
+	int size;
+	char *dec_buf,*route=NULL,*hdrs,*remote_contact;
 	struct hdr_field *it;
-	str rr_buf,ct_buf,bind_buf;
-	rr_t *head = NULL, *rrp;
-	int next_strict=0;
-	struct sip_uri fru;
+	struct th_ct_info ci;
 	char* buf = msg->buf;
 	struct lump* lmp = NULL;
 	str host;
@@ -1827,42 +2065,13 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 		}
 	}
 
-	max_size = calc_max_base64_decode_len(info->len);
-	dec_buf = pkg_malloc(max_size);
-	if (dec_buf==NULL) {
-		LM_ERR("No more pkg\n");
+	if (!(dec_buf = th_ct_decode(info, &ci))) {
+		LM_ERR("failed to decode contact info\n");
 		return -1;
 	}
 
-	dec_len = base64decode((unsigned char *)dec_buf,(unsigned char *)info->s,info->len);
-	for (i=0;i<dec_len;i++)
-		dec_buf[i] ^= topo_hiding_ct_encode_pw.s[i%topo_hiding_ct_encode_pw.len]; 
-
-	rr_buf.len=*(short *)dec_buf;
-	rr_buf.s = dec_buf + sizeof(short);
-	p = rr_buf.s + rr_buf.len;
-	ct_buf.len = *(short *)p;
-	ct_buf.s = p + sizeof(short);
-	p = ct_buf.s + ct_buf.len;
-	bind_buf.len = *(short *)p;
-	bind_buf.s = p + sizeof(short);
-
 	LM_DBG("extracted routes [%.*s] , ct [%.*s] and bind [%.*s]\n",
-		rr_buf.len,rr_buf.s,ct_buf.len,ct_buf.s,bind_buf.len,bind_buf.s);
-
-	if (rr_buf.len) {
-		if (parse_rr_body(rr_buf.s,rr_buf.len,&head) != 0) {
-			LM_ERR("failed parsing route set\n");
-			goto err_free_buf;
-		}
-
-		if(parse_uri(head->nameaddr.uri.s, head->nameaddr.uri.len, &fru) < 0) {
-			LM_ERR("Failed to parse SIP uri\n");
-			goto err_free_head;
-		}
-		if(is_strict(&fru.params))
-			next_strict = 1;
-	}
+		ci.rr.len,ci.rr.s,ci.ct.len,ci.ct.s,ci.bind.len,ci.bind.s);
 
 	if (msg->dst_uri.s && msg->dst_uri.len) {
 		/* reset dst_uri if previously set
@@ -1872,20 +2081,20 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 		msg->dst_uri.len = 0;
 	}
 
-	if (!next_strict) {
+	if (!(ci.flags & TH_CT_STRICT)) {
 		LM_DBG("Fixing message. Next hop is Loose router\n");
-		if (ct_buf.len && ct_buf.s) {
-			LM_DBG("Setting new URI to  <%.*s> \n",ct_buf.len,
-					ct_buf.s);
+		if (ci.ct.len && ci.ct.s) {
+			LM_DBG("Setting new URI to  <%.*s> \n",ci.ct.len,
+					ci.ct.s);
 
-			if (set_ruri(msg,&ct_buf) != 0) {
+			if (set_ruri(msg,&ci.ct) != 0) {
 				LM_ERR("failed setting ruri\n");
-				goto err_free_head;
+				goto err_free_buf;
 			}
 		}
 		if( parse_headers( msg, HDR_EOH_F, 0)<0 ) {
 			LM_ERR("failed to parse headers when looking after ROUTEs\n");
-			goto err_free_head;
+			goto err_free_buf;
 		}
 
 		if (msg->route) {
@@ -1894,29 +2103,29 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 					continue;
 				if ((lmp = del_lump(msg,it->name.s - buf,it->len,HDR_ROUTE_T)) == 0) {
 					LM_ERR("del_lump failed \n");
-					goto err_free_head;
+					goto err_free_buf;
 				}
 			}
 		}
 
-		if ( rr_buf.len !=0 && rr_buf.s) {
+		if ( ci.rr.len !=0 && ci.rr.s) {
 
 			lmp = anchor_lump(msg,msg->headers->name.s - buf,0);
 			if (lmp == 0) {
 				LM_ERR("failed anchoring new lump\n");
-				goto err_free_head;
+				goto err_free_buf;
 			}
 
-			size = rr_buf.len + ROUTE_LEN + CRLF_LEN;
+			size = ci.rr.len + ROUTE_LEN + CRLF_LEN;
 			route = pkg_malloc(size+1);
 			if (route == 0) {
 				LM_ERR("no more pkg memory\n");
-				goto err_free_head;
+				goto err_free_buf;
 			}
 
 			memcpy(route,ROUTE_STR,ROUTE_LEN);
-			memcpy(route+ROUTE_LEN,rr_buf.s,rr_buf.len);
-			memcpy(route+ROUTE_LEN+rr_buf.len,CRLF,CRLF_LEN);
+			memcpy(route+ROUTE_LEN,ci.rr.s,ci.rr.len);
+			memcpy(route+ROUTE_LEN+ci.rr.len,CRLF,CRLF_LEN);
 
 			route[size] = 0;
 
@@ -1926,11 +2135,11 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 			}
 
 			LM_DBG("Setting route  header to <%s> \n",route);
-			LM_DBG("setting dst_uri to <%.*s> \n",head->nameaddr.uri.len,
-					head->nameaddr.uri.s);
+			LM_DBG("setting dst_uri to <%.*s> \n",ci.head_uri.len,
+					ci.head_uri.s);
 
-			if (set_dst_uri(msg,&head->nameaddr.uri) !=0 ) {
-				goto err_free_head;
+			if (set_dst_uri(msg,&ci.head_uri) !=0 ) {
+				goto err_free_buf;
 			}
 		}
 	} else {
@@ -1941,43 +2150,42 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 					continue;
 				if ((lmp = del_lump(msg,it->name.s - buf,it->len,HDR_ROUTE_T)) == 0) {
 					LM_ERR("del_lump failed \n");
-					goto err_free_head;
+					goto err_free_buf;
 				}
 			}
 		}
 
-		if ( rr_buf.len !=0 && rr_buf.s) {
-			if (set_ruri(msg,&head->nameaddr.uri) !=0 ) {
+		if ( ci.rr.len !=0 && ci.rr.s) {
+			if (set_ruri(msg,&ci.head_uri) !=0 ) {
 				LM_ERR("failed setting new dst uri\n");
-				goto err_free_head;
+				goto err_free_buf;
 			}
-			i=0;
-			rrp = head;
-			while (rrp) {
-				i++;
-				rrp=rrp->next;
-			}	
 
 			/* If there are more routes other than the first, add them */
-			if (i > 1) {
+			if (ci.flags & TH_CT_MULTI) {
+				if (ci.rr.len - ci.head_len - 1 <= 0) {
+					LM_ERR("bad route set in the contact info\n");
+					goto err_free_buf;
+				}
+
 				lmp = anchor_lump(msg,msg->headers->name.s - buf,0);
 				if (lmp == 0) {
 					LM_ERR("failed anchoring new lump\n");
-					goto err_free_head;
+					goto err_free_buf;
 				}
 
-				hdrs = rr_buf.s + head->len + 1;
+				hdrs = ci.rr.s + ci.head_len + 1;
 
-				size = rr_buf.len - head->len - 1 + ROUTE_LEN + CRLF_LEN;
+				size = ci.rr.len - ci.head_len - 1 + ROUTE_LEN + CRLF_LEN;
 				route = pkg_malloc(size);
 				if (route == 0) {
 					LM_ERR("no more pkg memory\n");
-					goto err_free_head;
+					goto err_free_buf;
 				}
 
 				memcpy(route,ROUTE_STR,ROUTE_LEN);
-				memcpy(route+ROUTE_LEN,hdrs,rr_buf.len - head->len-1);
-				memcpy(route+ROUTE_LEN+rr_buf.len - head->len-1,CRLF,CRLF_LEN);
+				memcpy(route+ROUTE_LEN,hdrs,ci.rr.len - ci.head_len-1);
+				memcpy(route+ROUTE_LEN+ci.rr.len - ci.head_len-1,CRLF,CRLF_LEN);
 
 				LM_DBG("Adding Route header : [%.*s] \n",size,route);
 
@@ -1992,21 +2200,21 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 				if (lmp == 0)
 				{
 					LM_ERR("failed anchoring new lump\n");
-					return -1;
+					goto err_free_buf;
 				}
 			}
 
-			if (ct_buf.len && ct_buf.s) {
-				size = ct_buf.len + ROUTE_PREF_LEN + ROUTE_SUFF_LEN;
+			if (ci.ct.len && ci.ct.s) {
+				size = ci.ct.len + ROUTE_PREF_LEN + ROUTE_SUFF_LEN;
 				remote_contact = pkg_malloc(size);
 				if (remote_contact == NULL) {
 					LM_ERR("no more pkg \n");
-					goto err_free_head;
+					goto err_free_buf;
 				}
 
 				memcpy(remote_contact,ROUTE_PREF,ROUTE_PREF_LEN);
-				memcpy(remote_contact+ROUTE_PREF_LEN,ct_buf.s,ct_buf.len);
-				memcpy(remote_contact+ROUTE_PREF_LEN+ct_buf.len,
+				memcpy(remote_contact+ROUTE_PREF_LEN,ci.ct.s,ci.ct.len);
+				memcpy(remote_contact+ROUTE_PREF_LEN+ci.ct.len,
 						ROUTE_SUFF,ROUTE_SUFF_LEN);
 
 				LM_DBG("Adding remote contact route header : [%.*s]\n",
@@ -2015,7 +2223,7 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 				if (insert_new_lump_after(lmp,remote_contact,size,HDR_ROUTE_T) == 0) {
 					LM_ERR("failed inserting remote contact route\n");
 					pkg_free(remote_contact);
-					goto err_free_head;
+					goto err_free_buf;
 				}
 			}
 		}
@@ -2027,22 +2235,20 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 		LM_ERR("failed to register TMCB\n");
 	}
 
-	if (bind_buf.len && bind_buf.s) {
-		LM_DBG("forcing send socket for req to [%.*s]\n",bind_buf.len,bind_buf.s);
-		if (parse_phostport( bind_buf.s, bind_buf.len, &host.s, &host.len,
+	if (ci.bind.len && ci.bind.s) {
+		LM_DBG("forcing send socket for req to [%.*s]\n",ci.bind.len,ci.bind.s);
+		if (parse_phostport( ci.bind.s, ci.bind.len, &host.s, &host.len,
 		&port, &proto)!=0) {
-			LM_ERR("bad socket <%.*s>\n", bind_buf.len, bind_buf.s);
+			LM_ERR("bad socket <%.*s>\n", ci.bind.len, ci.bind.s);
 		} else {
 			sock = grep_sock_info( &host, (unsigned short)port, proto);
 			if (!sock) {
-				LM_WARN("non-local socket <%.*s>...ignoring\n", bind_buf.len, bind_buf.s);
+				LM_WARN("non-local socket <%.*s>...ignoring\n", ci.bind.len, ci.bind.s);
 			}
 			msg->force_send_socket = sock;
 		}
 	}
 
-	if (rr_buf.len)
-		free_rr(&head);
 	pkg_free(dec_buf);
 
 	if (topo_no_dlg_encode_contact(msg,0) < 0) {
@@ -2055,9 +2261,6 @@ static int topo_no_dlg_seq_handling(struct sip_msg *msg,str *info)
 err_free_route:
 	if (route)
 		pkg_free(route);
-err_free_head:
-	if (rr_buf.len)
-		free_rr(&head);
 err_free_buf:
 	pkg_free(dec_buf);
 	return -1;
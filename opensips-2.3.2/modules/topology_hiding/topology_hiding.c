@@ -29,6 +29,7 @@
 
 
 #include "topo_hiding_logic.h"
+#include "th_ct_cache.h"
 
 struct tm_binds tm_api;
 struct dlg_binds dlg_api;
@@ -69,6 +70,16 @@ static param_export_t params[] = {
 	{ "th_callid_prefix",            STR_PARAM, &topo_hiding_prefix.s        },
 	{ "th_contact_encode_passwd",    STR_PARAM, &topo_hiding_ct_encode_pw.s  },
 	{ "th_contact_encode_param",     STR_PARAM, &th_contact_encode_param.s   },
+	{ "th_contact_cache_size",       INT_PARAM, &th_ct_cache_size            },
+	{ "th_contact_cache_timeout",    INT_PARAM, &th_ct_cache_timeout         },
+	{0, 0, 0}
+};
+
+static stat_export_t mod_stats[] = {
+	{"th_contact_cache_entries", STAT_IS_FUNC,
+		(stat_var**)th_ct_cache_get_entries },
+	{"th_contact_cache_hits",    0, &th_ct_cache_hits   },
+	{"th_contact_cache_misses",  0, &th_ct_cache_misses },
 	{0, 0, 0}
 };
 
@@ -108,7 +119,7 @@ struct module_exports exports= {
 	cmds,             /* exported functions */
 	0,                /* exported async functions */
 	params,           /* param exports */
-	0,                /* exported statistics */
+	mod_stats,        /* exported statistics */
 	0,                /* exported MI functions */
 	pvars,            /* exported pseudo-variables */
 	0,                /* extra processes */
@@ -166,6 +177,10 @@ static int mod_init(void)
 					"hiding signalling for ongoing calls will be lost after "
 					"restart\n");
 
+	if (th_ct_cache_init() < 0) {
+		LM_ERR("failed to init the contact cache\n");
+		goto error;
+	}
 
 
 	return 0;
@@ -175,7 +190,7 @@ error:
 
 static void mod_destroy(void)
 {
-	return;
+	th_ct_cache_destroy();
 }
 
 static int fixup_topo_hiding(void **param, int param_no)
@@ -429,6 +429,11 @@ static int child_init(int _rank)
 		case NO_DB:
 			return 0;
 		case DB_ONLY:
+			/* module processes (e.g. the nathelper keepalive ones) may
+			 * read the contacts too, and only the DB has them */
+			if (_rank == PROC_MODULE)
+				break;
+			/* fall through */
 		case WRITE_THROUGH:
 		case WRITE_BACK:
 			/* we need connection from SIP workers, BIN and MAIN procs */
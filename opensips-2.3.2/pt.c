@@ -33,6 +33,7 @@
 #include "dprint.h"
 #include "pt.h"
 #include "bin_interface.h"
+#include "db/db_insertq.h"
 
 
 /* array with children pids, 0= main proc,
@@ -62,6 +63,12 @@ int init_multi_proc_support(void)
 	/* timer processes */
 	proc_no += 3 /* timer keeper + timer trigger + dedicated */;
 
+	/* dedicated SQL insert writers */
+	proc_no += ql_writers_count();
+
+	/* asynchronous logger */
+	proc_no += log_writers_count();
+
 	/* count the processes requested by modules */
 	proc_no += count_module_procs();
 
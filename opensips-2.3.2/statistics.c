@@ -54,6 +54,12 @@
 static stats_collector *collector = NULL;
 static int stats_ready;
 
+/* per process counters - one cache aligned block for each process */
+long *stat_proc_slots = NULL;
+unsigned int stat_proc_stride = 0;
+static unsigned int stat_proc_no = 0;
+static void *stat_proc_mem = NULL;
+
 static struct mi_root *mi_get_stats(struct mi_root *cmd, void *param);
 static struct mi_root *mi_list_stats(struct mi_root *cmd, void *param);
 static struct mi_root *mi_reset_stats(struct mi_root *cmd, void *param);
@@ -354,6 +360,74 @@ error:
 }
 
 
+int init_stats_proc_slots(int procs)
+{
+	unsigned int size;
+
+	if (collector->proc_stats_no==0)
+		return 0;
+
+	/* round each process block up to a full cache line */
+	stat_proc_stride = (collector->proc_stats_no * sizeof(long) +
+		STAT_CACHE_LINE - 1) / STAT_CACHE_LINE * STAT_CACHE_LINE / sizeof(long);
+	size = procs * stat_proc_stride * sizeof(long);
+
+	stat_proc_mem = shm_malloc(size + STAT_CACHE_LINE);
+	if (stat_proc_mem==NULL) {
+		LM_ERR("no more shm mem for %d per process stats\n",
+			collector->proc_stats_no);
+		return -1;
+	}
+	memset(stat_proc_mem, 0, size + STAT_CACHE_LINE);
+
+	stat_proc_no = procs;
+	stat_proc_slots = (long *)(((unsigned long)stat_proc_mem +
+		STAT_CACHE_LINE - 1) & ~((unsigned long)STAT_CACHE_LINE - 1));
+
+	LM_DBG("%d stats counted per process, for %d processes\n",
+		collector->proc_stats_no, procs);
+	return 0;
+}
+
+/* the base value of a per process stat is the one counted before the slots
+ * got allocated, minus what was counted in the slots up to the last reset */
+#ifdef NO_ATOMIC_OPS
+#define stat_base(_var) ((long)(int)*((_var)->u.val))
+#else
+#define stat_base(_var) ((sizeof((_var)->u.val->counter)==sizeof(int)) ? \
+	(long)(int)(_var)->u.val->counter : (long)(_var)->u.val->counter)
+#endif
+
+static inline long sum_proc_stat(stat_var *var)
+{
+	unsigned int i;
+	long val = 0;
+
+	if (stat_proc_slots)
+		for( i=0 ; i<stat_proc_no ; i++ )
+			val += stat_proc_slots[i * stat_proc_stride + var->proc_idx];
+
+	return val;
+}
+
+unsigned long get_proc_stat_val(stat_var *var)
+{
+	return (unsigned long)(stat_base(var) + sum_proc_stat(var));
+}
+
+void reset_proc_stat(stat_var *var)
+{
+	/* the slots are only written by their owners, so move the
+	 * base instead of clearing them */
+#ifdef NO_ATOMIC_OPS
+	lock_get(stat_lock);
+	*(var->u.val) = -sum_proc_stat(var);
+	lock_release(stat_lock);
+#else
+	atomic_set(var->u.val, -sum_proc_stat(var));
+#endif
+}
+
 void destroy_stats_collector(void)
 {
 	stat_var *stat;
@@ -405,6 +479,10 @@ void destroy_stats_collector(void)
 		if (collector->rwl)
 			lock_destroy_rw( (rw_lock_t *)collector->rwl);
 
+		/* destroy the per process counters */
+		if (stat_proc_mem)
+			shm_free(stat_proc_mem);
+
 		/* destroy the collector */
 		shm_free(collector);
 	}
@@ -507,6 +585,16 @@ do_register:
 	stat->flags = flags;
 	stat->context = ctx;
 
+	/* per process counters can only be set up before forking */
+	if (flags&STAT_PER_PROC) {
+		if ((flags&STAT_IS_FUNC) || mods->is_dyn || stat_proc_slots) {
+			LM_DBG("stat %s cannot be counted per process\n", name);
+			stat->flags &= ~STAT_PER_PROC;
+		} else {
+			stat->proc_idx = collector->proc_stats_no++;
+		}
+	}
+
 	/* compute the hash by name */
 	hash = stat_hash( &stat->name );
 
@@ -37,6 +37,9 @@
 #include "hash_func.h"
 #include "atomic.h"
 
+/* pt.h is not included, it pulls in too much for all the stats users */
+extern int process_no;
+
 #define STATS_HASH_POWER   8
 #define STATS_HASH_SIZE    (1<<(STATS_HASH_POWER))
 
@@ -47,6 +50,11 @@
 #define STAT_SHM_NAME  (1<<2)
 #define STAT_IS_FUNC   (1<<3)
 #define STAT_NO_ALLOC  (1<<4)
+#define STAT_PER_PROC  (1<<5)
+
+/* size of the per process block of counters, so that no two processes
+ * write into the same cache line */
+#define STAT_CACHE_LINE  64
 
 #ifdef NO_ATOMIC_OPS
 typedef unsigned int stat_val;
@@ -62,6 +70,7 @@ typedef struct stat_var_{
 	unsigned int mod_idx; /* backreference */
 	str name;
 	unsigned short flags;
+	unsigned int proc_idx; /* slot in the per process counters */
 	void * context;
 	union{
 		stat_val *val;
@@ -87,6 +96,7 @@ typedef struct stats_collector_ {
 	stat_var* dy_hstats[STATS_HASH_SIZE];   /* hash with dynamic statistics */
 	void *rwl;      /* lock for protecting dynamic stats/modules */
 	module_stats *amodules;
+	unsigned int proc_stats_no; /* stats counted per process */
 }stats_collector;
 
 typedef struct stat_export_ {
@@ -103,6 +113,7 @@ char *build_stat_name( str* prefix, char *var_name);
 
 int init_stats_collector();
 int stats_are_ready(); /* for code which is statistics-dependent */
+int init_stats_proc_slots(int procs);
 
 int register_udp_load_stat(str *name, stat_var **ctx, int children);
 int register_tcp_load_stat(stat_var **ctx);
@@ -149,6 +160,20 @@ unsigned int get_stat_val( stat_var *var );
  */
 stat_var *get_stat_var_from_num_code(unsigned int numerical_code, int in_codes);
 
+/*! \brief
+ * Statistics registered with STAT_PER_PROC (before forking) are updated
+ * by each process into its own slot, without any atomic operation or
+ * lock; the slots are summed up when the statistic is read.
+ */
+extern long *stat_proc_slots;
+extern unsigned int stat_proc_stride;
+
+#define stat_proc_slot(_var) \
+	stat_proc_slots[process_no * stat_proc_stride + (_var)->proc_idx]
+
+unsigned long get_proc_stat_val(stat_var *var);
+void reset_proc_stat(stat_var *var);
+
 
 #ifdef NO_ATOMIC_OPS
 #include "locking.h"
@@ -157,6 +182,7 @@ extern gen_lock_t *stat_lock;
 
 #else
 	#define init_stats_collector()  0
+	#define init_stats_proc_slots(_procs)  0
 	#define destroy_stats_collector()
 	#define register_module_stats(_mod,_stats) 0
 	#define __register_module_stats(_mod,_stats, unsafe) 0
@@ -181,7 +207,9 @@ extern gen_lock_t *stat_lock;
 		#define update_stat( _var, _n) \
 			do { \
 				if ( !((_var)->flags&STAT_IS_FUNC) ) {\
-					if ((_var)->flags&STAT_NO_SYNC) {\
+					if (((_var)->flags&STAT_PER_PROC) && stat_proc_slots) {\
+						stat_proc_slot(_var) += _n;\
+					} else if ((_var)->flags&STAT_NO_SYNC) {\
 						*((_var)->u.val) += _n;\
 					} else {\
 						lock_get(stat_lock);\
@@ -193,7 +221,9 @@ extern gen_lock_t *stat_lock;
 		#define reset_stat( _var) \
 			do { \
 				if ( ((_var)->flags&(STAT_NO_RESET|STAT_IS_FUNC))==0 ) {\
-					if ((_var)->flags&STAT_NO_SYNC) {\
+					if ((_var)->flags&STAT_PER_PROC) {\
+						reset_proc_stat(_var);\
+					} else if ((_var)->flags&STAT_NO_SYNC) {\
 						*((_var)->u.val) = 0;\
 					} else {\
 						lock_get(stat_lock);\
@@ -203,12 +233,16 @@ extern gen_lock_t *stat_lock;
 				}\
 			}while(0)
 		#define get_stat_val( _var ) ((unsigned long)\
-			((_var)->flags&STAT_IS_FUNC)?(_var)->u.f((_var)->context):*((_var)->u.val))
+			((_var)->flags&STAT_IS_FUNC)?(_var)->u.f((_var)->context):\
+			((_var)->flags&STAT_PER_PROC)?get_proc_stat_val(_var):\
+			*((_var)->u.val))
 	#else
 		#define update_stat( _var, _n) \
 			do { \
 				if ( !((_var)->flags&STAT_IS_FUNC) ) {\
-					if (_n>=0) \
+					if (((_var)->flags&STAT_PER_PROC) && stat_proc_slots) \
+						stat_proc_slot(_var) += _n;\
+					else if (_n>=0) \
 						atomic_add( _n, (_var)->u.val);\
 					else \
 						atomic_sub( -(_n), (_var)->u.val);\
@@ -217,11 +251,16 @@ extern gen_lock_t *stat_lock;
 		#define reset_stat( _var) \
 			do { \
 				if ( ((_var)->flags&(STAT_NO_RESET|STAT_IS_FUNC))==0 ) {\
-					atomic_set( (_var)->u.val, 0);\
+					if ((_var)->flags&STAT_PER_PROC) \
+						reset_proc_stat(_var);\
+					else \
+						atomic_set( (_var)->u.val, 0);\
 				}\
 			}while(0)
 		#define get_stat_val( _var ) ((unsigned long)\
-			((_var)->flags&STAT_IS_FUNC)?(_var)->u.f((_var)->context):(_var)->u.val->counter)
+			((_var)->flags&STAT_IS_FUNC)?(_var)->u.f((_var)->context):\
+			((_var)->flags&STAT_PER_PROC)?get_proc_stat_val(_var):\
+			(_var)->u.val->counter)
 	#endif /* NO_ATOMIC_OPS */
 
 	#define if_update_stat(_c, _var, _n) \
@@ -0,0 +1,64 @@
+#!/bin/bash
+# async rtpengine offers with several commands in flight on the same socket
+
+# Copyright (C) 2017 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/require
+
+if ! (check_sipp && check_python && check_opensips && check_module "tm" && check_module "rtpengine"); then
+	exit 0
+fi ;
+
+CFG=37.cfg
+SRV=5060
+UAS=5070
+UAC=5080
+STATS=/tmp/opensips_test_rtpengine.stats
+
+# the fake proxy holds its answers until 4 offers are pending, so the single
+# worker has to keep them all in flight on its rtpengine socket
+python3 fake_rtpproxy.py rtpengine 22222 4 $STATS &> /dev/null &
+sleep 1
+
+../opensips -w . -f $CFG &> /dev/null
+ret=$?
+sleep 1
+
+if [ "$ret" -eq 0 ] ; then
+	sipp -sn uas -bg -i 127.0.0.1 -m 20 -p $UAS &> /dev/null
+	sipp -sn uac -s foo 127.0.0.1:$SRV -i 127.0.0.1 -m 20 -r 20 -l 20 \
+		-p $UAC -timeout 20 &> /dev/null
+	ret=$?
+fi ;
+
+# replies and timeouts arriving after the first resume must still be
+# handled, so all the calls complete and offers overlapped
+if [ "$ret" -eq 0 ] ; then
+	if [ "`cat $STATS`" -lt 2 ] ; then
+		ret=1
+	fi ;
+fi ;
+
+# cleanup
+killall -9 sipp > /dev/null 2>&1
+killall -9 opensips > /dev/null 2>&1
+pkill -f fake_rtpproxy.py > /dev/null 2>&1
+rm -f $STATS
+
+exit $ret;
@@ -0,0 +1,66 @@
+#!/bin/bash
+# concurrent on demand loads of the same key with sql_cacher on mysql
+
+# Copyright (C) 2017 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/require
+
+if ! (check_sipp && check_opensips && check_module "db_mysql" && check_module "sql_cacher" && check_module "cachedb_local"); then
+	exit 0
+fi ;
+
+CFG=38.cfg
+SRV=5060
+UAC=5080
+
+MYSQL="mysql opensips -u opensips --password=opensipsrw -e"
+MYSQL_STAT="mysql -N -B -u opensips --password=opensipsrw -e"
+
+$MYSQL "create table sc_test_data (k varchar(64) primary key, val varchar(64));"
+$MYSQL "insert into sc_test_data (k, val) values ('foo', 'ok');"
+# each query takes a second, so all the calls ask for the key meanwhile
+$MYSQL "create view sc_test as select k, val from sc_test_data where sleep(1) = 0;"
+
+../opensips -w . -f $CFG &> /dev/null
+ret=$?
+sleep 3
+
+if [ "$ret" -eq 0 ] ; then
+	before=`$MYSQL_STAT "show global status like 'Com_select'" | cut -f 2`
+	sipp -sn uac -s foo 127.0.0.1:$SRV -i 127.0.0.1 -m 20 -r 20 -l 20 \
+		-p $UAC -timeout 20 &> /dev/null
+	ret=$?
+	after=`$MYSQL_STAT "show global status like 'Com_select'" | cut -f 2`
+fi ;
+
+# only one of the workers queried the SQL DB, the others waited for it
+if [ "$ret" -eq 0 ] ; then
+	if [ $(($after - $before)) -ne 1 ] ; then
+		ret=1
+	fi ;
+fi ;
+
+# cleanup
+killall -9 sipp > /dev/null 2>&1
+killall -9 opensips > /dev/null 2>&1
+
+$MYSQL "drop view sc_test;"
+$MYSQL "drop table sc_test_data;"
+
+exit $ret;
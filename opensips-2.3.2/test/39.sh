@@ -0,0 +1,77 @@
+#!/bin/bash
+# async queries and prepared statements with db_postgres
+
+# Copyright (C) 2017 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/require
+
+if ! (check_netcat && check_opensips && check_module "db_postgres" && check_module "avpops"); then
+	exit 0
+fi ;
+
+CFG=39.cfg
+PSQL="psql -A -t -n -q -h localhost -U opensipsro opensips -c"
+# the text of the queries run by opensips is only shown to the same user
+PSQL_RW="env PGPASSWORD=opensipsrw psql -A -t -n -q -h localhost -U opensips opensips -c"
+export PGPASSWORD='opensipsro'
+
+../opensips -w . -f $CFG > /dev/null
+ret=$?
+
+sleep 1
+
+# the insert and the update of the contact go through prepared statements
+cat register.sip | nc -q 1 -u localhost 5060 > /dev/null
+sed -e "s/CSeq: 479/CSeq: 480/" register.sip | nc -q 1 -u localhost 5060 > /dev/null
+
+if [ "$ret" -eq 0 ] ; then
+	TMP=`$PSQL "select cseq from location where username='1000';" | tail -n 1`
+	if [ "$TMP" != "480" ] ; then
+		ret=1
+	fi ;
+fi ;
+
+# the last query of the usrloc connection is the prepared one, with
+# "$n" parameters in place of the contact values
+if [ "$ret" -eq 0 ] ; then
+	TMP=`$PSQL_RW "select count(*) from pg_stat_activity where usename='opensips' and pid <> pg_backend_pid() and query like '%location%\$1%';" | tail -n 1`
+	if [ -z "$TMP" ] || [ "$TMP" -lt 1 ] ; then
+		ret=1
+	fi ;
+fi ;
+
+# the contact is looked up by an async query
+if [ "$ret" -eq 0 ] ; then
+	cat options.sip | nc -q 1 -u localhost 5060 | grep "^SIP/2.0 200 Found" > /dev/null
+	ret=$?
+fi ;
+
+# unregister the user
+cat unregister.sip | nc -q 1 -u localhost 5060 > /dev/null
+
+if [ "$ret" -eq 0 ] ; then
+	TMP=`$PSQL "select COUNT(*) from location where username='1000';" | tail -n 1`
+	if [ "$TMP" -ne 0 ] ; then
+		ret=1
+	fi ;
+fi ;
+
+killall -9 opensips
+
+exit $ret
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# minimal RTP proxy stand-in (rtpproxy and rtpengine ng protocols) that
+# holds its replies so that several commands are in flight at once
+
+# Copyright (C) 2017 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#
+# usage: fake_rtpproxy.py rtpproxy|rtpengine <port> <hold> <stats file>
+#
+# Offer/answer replies are delayed until <hold> of them are pending or
+# the oldest one waited for 300ms. The largest number of commands seen in
+# flight at once from a single source socket is written to <stats file>.
+
+import select
+import socket
+import sys
+import time
+
+HOLD_TIMEOUT = 0.3
+
+
+def bdecode(data, i=0):
+	c = data[i:i + 1]
+	if c == b'i':
+		end = data.index(b'e', i)
+		return int(data[i + 1:end]), end + 1
+	if c == b'l':
+		i += 1
+		res = []
+		while data[i:i + 1] != b'e':
+			v, i = bdecode(data, i)
+			res.append(v)
+		return res, i + 1
+	if c == b'd':
+		i += 1
+		res = {}
+		while data[i:i + 1] != b'e':
+			k, i = bdecode(data, i)
+			v, i = bdecode(data, i)
+			res[k] = v
+		return res, i + 1
+	colon = data.index(b':', i)
+	n = int(data[i:colon])
+	return data[colon + 1:colon + 1 + n], colon + 1 + n
+
+
+def bencode(v):
+	if isinstance(v, int):
+		return b'i%de' % v
+	if isinstance(v, bytes):
+		return b'%d:%s' % (len(v), v)
+	if isinstance(v, list):
+		return b'l' + b''.join(bencode(x) for x in v) + b'e'
+	return b'd' + b''.join(bencode(k) + bencode(v[k])
+		for k in sorted(v)) + b'e'
+
+
+def rtpproxy_reply(cmd):
+	"""returns (reply, hold)"""
+	op = cmd[:1].upper()
+	if cmd == b'V':
+		return b'20040107', False
+	if op == b'V':
+		return b'1', False
+	if op in (b'U', b'L'):
+		return b'35000 127.0.0.1', True
+	return b'0', False
+
+
+def rtpengine_reply(cmd):
+	req, _ = bdecode(cmd)
+	command = req.get(b'command', b'')
+	if command == b'ping':
+		return bencode({b'result': b'pong'}), False
+	if command in (b'offer', b'answer'):
+		return bencode({b'result': b'ok', b'sdp': req.get(b'sdp', b'')}), True
+	return bencode({b'result': b'ok'}), False
+
+
+def main():
+	mode, port, hold, stats = sys.argv[1], int(sys.argv[2]), \
+		int(sys.argv[3]), sys.argv[4]
+	handler = rtpproxy_reply if mode == 'rtpproxy' else rtpengine_reply
+
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	sock.bind(('127.0.0.1', port))
+
+	pending = []
+	max_inflight = 0
+	with open(stats, 'w') as f:
+		f.write('0\n')
+
+	while True:
+		tout = None
+		if pending:
+			tout = max(0, pending[0][0] + HOLD_TIMEOUT - time.time())
+		r, _, _ = select.select([sock], [], [], tout)
+		if r:
+			data, addr = sock.recvfrom(65536)
+			cookie, _, cmd = data.partition(b' ')
+			reply, held = handler(cmd.strip())
+			reply = cookie + b' ' + reply
+			if not held:
+				sock.sendto(reply, addr)
+				continue
+			pending.append((time.time(), addr, reply))
+			inflight = len([p for p in pending if p[1] == addr])
+			if inflight > max_inflight:
+				max_inflight = inflight
+				with open(stats, 'w') as f:
+					f.write('%d\n' % max_inflight)
+		if pending and (len(pending) >= hold or
+				pending[0][0] + HOLD_TIMEOUT <= time.time()):
+			# answer in reverse order, so the cookies must be matched
+			for _, addr, reply in reversed(pending):
+				sock.sendto(reply, addr)
+			pending = []
+
+
+if __name__ == '__main__':
+	main()
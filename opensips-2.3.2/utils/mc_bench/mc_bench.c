@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmark for the compression module: compares, on a corpus of SIP
+ * messages, the compression ratio and throughput of
+ *   - a fresh zlib stream per message (compress2/uncompress),
+ *   - a reused stream, reset between messages,
+ *   - a reused stream with the preset SIP dictionary.
+ *
+ *   mc_bench [-l level] [-n rounds] [message_file ...]
+ *
+ * Each file holds one SIP message; without files, a built-in corpus of
+ * typical messages is used.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "../../modules/compression/sip_dict.h"
+
+#define DEFAULT_ROUNDS	20000
+#define MAX_MSG			65536
+
+static const char *builtin_corpus[] = {
+	"INVITE sip:bob@biloxi.example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 192.0.2.10:5060;branch=z9hG4bK74bf9a1c;rport\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: \"Alice\" <sip:alice@atlanta.example.com>;tag=9fxced76sl\r\n"
+	"To: <sip:bob@biloxi.example.com>\r\n"
+	"Call-ID: 3848276298220188511@atlanta.example.com\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Contact: <sip:alice@192.0.2.10:5060;transport=udp>\r\n"
+	"Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, NOTIFY, MESSAGE, "
+		"SUBSCRIBE, INFO, PRACK, UPDATE\r\n"
+	"Supported: replaces, timer\r\n"
+	"User-Agent: Example UA 1.0\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: 237\r\n"
+	"\r\n"
+	"v=0\r\n"
+	"o=- 2890844526 2890844526 IN IP4 192.0.2.10\r\n"
+	"s=-\r\n"
+	"c=IN IP4 192.0.2.10\r\n"
+	"t=0 0\r\n"
+	"m=audio 49170 RTP/AVP 0 8 18 101\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n"
+	"a=rtpmap:18 G729/8000\r\n"
+	"a=rtpmap:101 telephone-event/8000\r\n"
+	"a=fmtp:101 0-15\r\n"
+	"a=ptime:20\r\n"
+	"a=sendrecv\r\n",
+
+	"SIP/2.0 100 Trying\r\n"
+	"Via: SIP/2.0/UDP 192.0.2.10:5060;branch=z9hG4bK74bf9a1c;rport=5060\r\n"
+	"From: \"Alice\" <sip:alice@atlanta.example.com>;tag=9fxced76sl\r\n"
+	"To: <sip:bob@biloxi.example.com>\r\n"
+	"Call-ID: 3848276298220188511@atlanta.example.com\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Server: OpenSIPS (2.3.2 (x86_64/linux))\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n",
+
+	"SIP/2.0 200 OK\r\n"
+	"Via: SIP/2.0/UDP 192.0.2.10:5060;branch=z9hG4bK74bf9a1c;rport=5060\r\n"
+	"Record-Route: <sip:198.51.100.1;lr;ftag=9fxced76sl;did=a1b.c2d>\r\n"
+	"From: \"Alice\" <sip:alice@atlanta.example.com>;tag=9fxced76sl\r\n"
+	"To: <sip:bob@biloxi.example.com>;tag=8321234356\r\n"
+	"Call-ID: 3848276298220188511@atlanta.example.com\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Contact: <sip:bob@203.0.113.7:5060>\r\n"
+	"Session-Expires: 1800;refresher=uac\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: 166\r\n"
+	"\r\n"
+	"v=0\r\n"
+	"o=- 1234 1234 IN IP4 203.0.113.7\r\n"
+	"s=-\r\n"
+	"c=IN IP4 203.0.113.7\r\n"
+	"t=0 0\r\n"
+	"m=audio 3456 RTP/AVP 0 101\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:101 telephone-event/8000\r\n",
+
+	"REGISTER sip:atlanta.example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 192.0.2.10:5060;rport;branch=z9hG4bKnashds7\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: <sip:alice@atlanta.example.com>;tag=a73kszlfl\r\n"
+	"To: <sip:alice@atlanta.example.com>\r\n"
+	"Call-ID: 1j9FpLxk3uxtm8tn@192.0.2.10\r\n"
+	"CSeq: 1 REGISTER\r\n"
+	"Contact: <sip:alice@192.0.2.10:5060>;expires=3600\r\n"
+	"Authorization: Digest username=\"alice\", realm=\"atlanta.example.com\", "
+		"nonce=\"ea9c8e88df84f1cec4341ae6cbe5a359\", "
+		"uri=\"sip:atlanta.example.com\", "
+		"response=\"dfe56131d1958046689d83306477ecc\", algorithm=MD5\r\n"
+	"User-Agent: Example UA 1.0\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n",
+
+	"OPTIONS sip:203.0.113.7:5060 SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 198.51.100.1:5060;branch=z9hG4bK2b4d.1\r\n"
+	"From: <sip:pinger@198.51.100.1>;tag=30d5b1a4\r\n"
+	"To: <sip:203.0.113.7:5060>\r\n"
+	"Call-ID: 5c8e5b6e-1f3a@198.51.100.1\r\n"
+	"CSeq: 1 OPTIONS\r\n"
+	"Max-Forwards: 70\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n",
+
+	"BYE sip:bob@203.0.113.7:5060 SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 192.0.2.10:5060;branch=z9hG4bK74bf9a2d;rport\r\n"
+	"Route: <sip:198.51.100.1;lr;ftag=9fxced76sl;did=a1b.c2d>\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: \"Alice\" <sip:alice@atlanta.example.com>;tag=9fxced76sl\r\n"
+	"To: <sip:bob@biloxi.example.com>;tag=8321234356\r\n"
+	"Call-ID: 3848276298220188511@atlanta.example.com\r\n"
+	"CSeq: 2 BYE\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n",
+};
+
+struct corpus_msg {
+	unsigned char *buf;
+	unsigned long len;
+};
+
+static struct corpus_msg *corpus;
+static int corpus_no;
+static unsigned long corpus_bytes;
+
+static unsigned char out[MAX_MSG + 1024];
+static unsigned char back[MAX_MSG];
+
+static double now_sec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int load_file(const char *path, struct corpus_msg *m)
+{
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	m->buf = malloc(MAX_MSG);
+	if (!m->buf) {
+		fclose(f);
+		return -1;
+	}
+	m->len = fread(m->buf, 1, MAX_MSG, f);
+	fclose(f);
+
+	if (m->len == 0) {
+		fprintf(stderr, "%s: empty file\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* mode: 0 - fresh stream per message, 1 - reused stream,
+ *       2 - reused stream + dictionary */
+static int run(int mode, int level, long rounds, double *ratio,
+		double *c_rate, double *d_rate)
+{
+	z_stream def, inf;
+	unsigned long clen, dlen, total_out;
+	double start, c_time, d_time;
+	unsigned char *cbuf;
+	unsigned long *clens;
+	long r;
+	int i, rc;
+
+	memset(&def, 0, sizeof def);
+	memset(&inf, 0, sizeof inf);
+	if (mode && (deflateInit2(&def, level, Z_DEFLATED, 15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK || inflateInit(&inf) != Z_OK)) {
+		fprintf(stderr, "failed to init zlib streams\n");
+		return -1;
+	}
+
+	/* keep the compressed corpus around for the decompression run */
+	cbuf = malloc(corpus_no * (MAX_MSG + 1024));
+	clens = malloc(corpus_no * sizeof *clens);
+	if (!cbuf || !clens) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	total_out = 0;
+	start = now_sec();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < corpus_no; i++) {
+			clen = MAX_MSG + 1024;
+			if (mode == 0) {
+				rc = compress2(out, &clen, corpus[i].buf, corpus[i].len,
+						level);
+			} else {
+				deflateReset(&def);
+				if (mode == 2)
+					deflateSetDictionary(&def, (const Bytef*)mc_sip_dict,
+							MC_SIP_DICT_LEN);
+				def.next_in = corpus[i].buf;
+				def.avail_in = corpus[i].len;
+				def.next_out = out;
+				def.avail_out = clen;
+				rc = deflate(&def, Z_FINISH);
+				rc = (rc == Z_STREAM_END) ? Z_OK : Z_BUF_ERROR;
+				clen = def.total_out;
+			}
+			if (rc != Z_OK) {
+				fprintf(stderr, "compression failed (%d)\n", rc);
+				return -1;
+			}
+			if (r == 0) {
+				memcpy(cbuf + i * (MAX_MSG + 1024), out, clen);
+				clens[i] = clen;
+				total_out += clen;
+			}
+		}
+	}
+	c_time = now_sec() - start;
+
+	start = now_sec();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < corpus_no; i++) {
+			dlen = MAX_MSG;
+			if (mode == 0) {
+				rc = uncompress(back, &dlen, cbuf + i * (MAX_MSG + 1024),
+						clens[i]);
+			} else {
+				inflateReset(&inf);
+				inf.next_in = cbuf + i * (MAX_MSG + 1024);
+				inf.avail_in = clens[i];
+				inf.next_out = back;
+				inf.avail_out = dlen;
+				rc = inflate(&inf, Z_FINISH);
+				if (rc == Z_NEED_DICT) {
+					inflateSetDictionary(&inf, (const Bytef*)mc_sip_dict,
+							MC_SIP_DICT_LEN);
+					rc = inflate(&inf, Z_FINISH);
+				}
+				rc = (rc == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
+				dlen = inf.total_out;
+			}
+			if (rc != Z_OK || dlen != corpus[i].len ||
+					memcmp(back, corpus[i].buf, dlen)) {
+				fprintf(stderr, "decompression failed (%d)\n", rc);
+				return -1;
+			}
+		}
+	}
+	d_time = now_sec() - start;
+
+	if (mode) {
+		deflateEnd(&def);
+		inflateEnd(&inf);
+	}
+	free(cbuf);
+	free(clens);
+
+	*ratio = (double)total_out / corpus_bytes;
+	*c_rate = rounds * corpus_no / c_time;
+	*d_rate = rounds * corpus_no / d_time;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *modes[] = {"fresh stream", "reused stream",
+		"reused + dictionary"};
+	double ratio, c_rate, d_rate;
+	long rounds = DEFAULT_ROUNDS;
+	int level = 6;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "l:n:h")) != -1) {
+		switch (c) {
+			case 'l':
+				level = atoi(optarg);
+				break;
+			case 'n':
+				rounds = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-l level] [-n rounds] "
+					"[message_file ...]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (level < 1 || level > 9 || rounds <= 0) {
+		fprintf(stderr, "invalid level or number of rounds\n");
+		return 1;
+	}
+
+	if (optind < argc) {
+		corpus_no = argc - optind;
+		corpus = calloc(corpus_no, sizeof *corpus);
+		if (!corpus)
+			return 1;
+		for (i = 0; i < corpus_no; i++)
+			if (load_file(argv[optind + i], &corpus[i]) < 0)
+				return 1;
+	} else {
+		corpus_no = sizeof(builtin_corpus) / sizeof(builtin_corpus[0]);
+		corpus = calloc(corpus_no, sizeof *corpus);
+		if (!corpus)
+			return 1;
+		for (i = 0; i < corpus_no; i++) {
+			corpus[i].buf = (unsigned char *)builtin_corpus[i];
+			corpus[i].len = strlen(builtin_corpus[i]);
+		}
+	}
+
+	for (i = 0; i < corpus_no; i++)
+		corpus_bytes += corpus[i].len;
+
+	printf("messages: %d, bytes: %lu, rounds: %ld, level: %d, "
+		"dictionary: %lu bytes\n", corpus_no, corpus_bytes, rounds, level,
+		(unsigned long)MC_SIP_DICT_LEN);
+	printf("%-20s %8s %16s %16s\n", "mode", "ratio", "compress msg/s",
+		"decompress msg/s");
+
+	for (i = 0; i < 3; i++) {
+		if (run(i, level, rounds, &ratio, &c_rate, &d_rate) < 0)
+			return 1;
+		printf("%-20s %8.3f %16.0f %16.0f\n", modes[i], ratio, c_rate,
+			d_rate);
+	}
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2017 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ *
+ */
+
+/*
+ * Micro-benchmark comparing the two ways of updating a statistic from
+ * many processes: a shared atomic counter (the default) and the per
+ * process counters used by the STAT_PER_PROC statistics.
+ *
+ *   stats_bench [-p processes] [-n updates_per_process]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../atomic.h"
+#include "../../statistics.h"
+
+#define DEFAULT_PROCS   32
+#define DEFAULT_UPDATES 10000000
+
+/* the core's process_no, used by the per process mode */
+int process_no;
+
+struct bench_shm {
+	volatile int ready;
+	volatile int go;
+#ifdef NO_ATOMIC_OPS
+	volatile unsigned long counter;
+#else
+	atomic_t counter;
+#endif
+};
+
+static struct bench_shm *shm;
+static long *slots;
+static unsigned int stride;
+
+static void run_shared(long updates)
+{
+	long i;
+
+	for (i = 0; i < updates; i++)
+#ifdef NO_ATOMIC_OPS
+		__sync_fetch_and_add(&shm->counter, 1);
+#else
+		atomic_inc(&shm->counter);
+#endif
+}
+
+static void run_per_proc(long updates)
+{
+	volatile long *slot = &slots[process_no * stride];
+	long i;
+
+	for (i = 0; i < updates; i++)
+		(*slot)++;
+}
+
+static double run(int procs, long updates, void (*f)(long), unsigned long *sum)
+{
+	struct timeval start, end;
+	pid_t pid;
+	int i;
+
+	memset(shm, 0, sizeof *shm);
+	memset(slots, 0, procs * stride * sizeof(long));
+
+	for (i = 0; i < procs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			process_no = i;
+			__sync_fetch_and_add(&shm->ready, 1);
+			while (!shm->go);
+			f(updates);
+			exit(0);
+		}
+	}
+
+	while (shm->ready != procs);
+	gettimeofday(&start, NULL);
+	shm->go = 1;
+	for (i = 0; i < procs; i++)
+		wait(NULL);
+	gettimeofday(&end, NULL);
+
+	if (f == run_shared) {
+#ifdef NO_ATOMIC_OPS
+		*sum = shm->counter;
+#else
+		*sum = shm->counter.counter;
+#endif
+	} else {
+		*sum = 0;
+		for (i = 0; i < procs; i++)
+			*sum += slots[i * stride];
+	}
+
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int procs = DEFAULT_PROCS;
+	long updates = DEFAULT_UPDATES;
+	unsigned long sum_shared, sum_proc;
+	double t_shared, t_proc;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:n:h")) != -1) {
+		switch (c) {
+			case 'p':
+				procs = atoi(optarg);
+				break;
+			case 'n':
+				updates = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-p processes] "
+					"[-n updates_per_process]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (procs <= 0 || updates <= 0) {
+		fprintf(stderr, "invalid number of processes or updates\n");
+		return 1;
+	}
+
+	stride = STAT_CACHE_LINE / sizeof(long);
+	shm = mmap(NULL, sizeof *shm + procs * STAT_CACHE_LINE,
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	/* mmap returns page aligned memory, keep the slots on their own lines */
+	slots = (long *)((char *)shm + STAT_CACHE_LINE);
+
+	t_shared = run(procs, updates, run_shared, &sum_shared);
+	t_proc = run(procs, updates, run_per_proc, &sum_proc);
+
+	printf("processes: %d, updates per process: %ld\n", procs, updates);
+	printf("shared atomic counter: %8.3f s, %8.2f Mupdates/s (total %lu)\n",
+		t_shared, procs * updates / t_shared / 1000000, sum_shared);
+	printf("per process counters:  %8.3f s, %8.2f Mupdates/s (total %lu)\n",
+		t_proc, procs * updates / t_proc / 1000000, sum_proc);
+	printf("speedup: %.2fx\n", t_shared / t_proc);
+
+	return 0;
+}